@@ -18,6 +18,9 @@ type context struct {
 	n      int
 	model  *model
 	params whisper.Params
+
+	// Segments of the last Process call, when the model has a state pool
+	segments []Segment
 }
 
 // Make sure context adheres to the interface
@@ -153,6 +156,9 @@ func (context *context) SystemInfo() string {
 // Make sure to call whisper_pcm_to_mel() or whisper_set_mel() first.
 // Returns the probabilities of all languages.
 func (context *context) WhisperLangAutoDetect(offset_ms int, n_threads int) ([]float32, error) {
+	if context.model.pool != nil {
+		return nil, ErrInternalAppError
+	}
 	langProbs, err := context.model.ctx.Whisper_lang_auto_detect(offset_ms, n_threads)
 	if err != nil {
 		return nil, err
@@ -174,6 +180,11 @@ func (context *context) Process(
 		context.params.SetSingleSegment(true)
 	}
 
+	// Process on a state from the pool of the model
+	if context.model.pool != nil {
+		return context.processWithState(data, callNewSegment, callProgress)
+	}
+
 	// We don't do parallel processing at the moment
 	processors := 0
 	if processors > 1 {
@@ -213,6 +224,13 @@ func (context *context) NextSegment() (Segment, error) {
 	if context.model.ctx == nil {
 		return Segment{}, ErrInternalAppError
 	}
+	if context.model.pool != nil {
+		if context.n >= len(context.segments) {
+			return Segment{}, io.EOF
+		}
+		context.n++
+		return context.segments[context.n-1], nil
+	}
 	if context.n >= context.model.ctx.Whisper_full_n_segments() {
 		return Segment{}, io.EOF
 	}
@@ -289,6 +307,45 @@ func (context *context) IsLANG(t Token, lang string) bool {
 ///////////////////////////////////////////////////////////////////////////////
 // PRIVATE METHODS
 
+// Process the samples on a state from the pool, blocking until one is free.
+// The segments are copied out of the state before it is returned to the pool.
+func (context *context) processWithState(
+	data []float32,
+	callNewSegment SegmentCallback,
+	callProgress ProgressCallback,
+) error {
+	state := <-context.model.pool
+	defer func() {
+		context.model.pool <- state
+	}()
+
+	if err := context.model.ctx.Whisper_full_with_state(state, context.params, data, nil, func(new int) {
+		if callNewSegment != nil {
+			num_segments := state.Whisper_full_n_segments()
+			s0 := num_segments - new
+			for i := s0; i < num_segments; i++ {
+				callNewSegment(toSegmentFromState(context.model.ctx, state, i))
+			}
+		}
+	}, func(progress int) {
+		if callProgress != nil {
+			callProgress(progress)
+		}
+	}); err != nil {
+		return err
+	}
+
+	// Reset the segment iterator
+	context.n = 0
+	context.segments = make([]Segment, state.Whisper_full_n_segments())
+	for i := range context.segments {
+		context.segments[i] = toSegmentFromState(context.model.ctx, state, i)
+	}
+
+	// Return success
+	return nil
+}
+
 func toSegment(ctx *whisper.Context, n int) Segment {
 	return Segment{
 		Num:    n,
@@ -314,3 +371,29 @@ func toTokens(ctx *whisper.Context, n int) []Token {
 	}
 	return result
 }
+
+func toSegmentFromState(ctx *whisper.Context, state *whisper.State, n int) Segment {
+	return Segment{
+		Num:    n,
+		Text:   strings.TrimSpace(state.Whisper_full_get_segment_text(n)),
+		Start:  time.Duration(state.Whisper_full_get_segment_t0(n)) * time.Millisecond * 10,
+		End:    time.Duration(state.Whisper_full_get_segment_t1(n)) * time.Millisecond * 10,
+		Tokens: toTokensFromState(ctx, state, n),
+	}
+}
+
+func toTokensFromState(ctx *whisper.Context, state *whisper.State, n int) []Token {
+	result := make([]Token, state.Whisper_full_n_tokens(n))
+	for i := 0; i < len(result); i++ {
+		data := state.Whisper_full_get_token_data(n, i)
+
+		result[i] = Token{
+			Id:    int(state.Whisper_full_get_token_id(n, i)),
+			Text:  state.Whisper_full_get_token_text(ctx, n, i),
+			P:     state.Whisper_full_get_token_p(n, i),
+			Start: time.Duration(data.T0()) * time.Millisecond * 10,
+			End:   time.Duration(data.T1()) * time.Millisecond * 10,
+		}
+	}
+	return result
+}
@@ -2,6 +2,7 @@ package whisper_test
 
 import (
 	"os"
+	"sync"
 	"testing"
 
 	// Packages
@@ -53,3 +54,30 @@ func Test_Whisper_001(t *testing.T) {
 	assert.NotNil(ctx)
 
 }
+
+func Test_Whisper_002(t *testing.T) {
+	assert := assert.New(t)
+	if _, err := os.Stat(ModelPath); os.IsNotExist(err) {
+		t.Skip("Skipping test, model not found:", ModelPath)
+	}
+
+	// Load model with a pool of two states
+	model, err := whisper.NewWithStates(ModelPath, 2)
+	assert.NoError(err)
+	assert.NotNil(model)
+	defer model.Close()
+
+	// Process silence from more goroutines than there are states
+	samples := make([]float32, whisper.SampleRate)
+	var wg sync.WaitGroup
+	for i := 0; i < 4; i++ {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			ctx, err := model.NewContext()
+			assert.NoError(err)
+			assert.NoError(ctx.Process(samples, nil, nil))
+		}()
+	}
+	wg.Wait()
+}
@@ -15,6 +15,10 @@ import (
 type model struct {
 	path string
 	ctx  *whisper.Context
+
+	// Pool of states, only used by models created with NewWithStates
+	states []*whisper.State
+	pool   chan *whisper.State
 }
 
 // Make sure model adheres to the interface
@@ -38,7 +42,48 @@ func New(path string) (Model, error) {
 	return model, nil
 }
 
+// NewWithStates loads a model which can be used from several goroutines.
+// It owns a pool of n states: up to n contexts can call Process at the same
+// time, any further calls block until a state is returned to the pool.
+func NewWithStates(path string, n int) (Model, error) {
+	model := new(model)
+	if n < 1 {
+		return nil, ErrInternalAppError
+	} else if _, err := os.Stat(path); err != nil {
+		return nil, err
+	} else if ctx := whisper.Whisper_init_no_state(path); ctx == nil {
+		return nil, ErrUnableToLoadModel
+	} else {
+		model.ctx = ctx
+		model.path = path
+	}
+
+	// Allocate the states
+	model.pool = make(chan *whisper.State, n)
+	for i := 0; i < n; i++ {
+		state, err := model.ctx.Whisper_init_state()
+		if err != nil {
+			model.Close()
+			return nil, err
+		}
+		model.states = append(model.states, state)
+		model.pool <- state
+	}
+
+	// Return success
+	return model, nil
+}
+
 func (model *model) Close() error {
+	// Wait for the states in use to be returned to the pool
+	for range model.states {
+		<-model.pool
+	}
+	for _, state := range model.states {
+		state.Whisper_free_state()
+	}
+	model.states = nil
+
 	if model.ctx != nil {
 		model.ctx.Whisper_free()
 	}
@@ -58,6 +103,9 @@ func (model *model) String() string {
 	if model.ctx != nil {
 		str += fmt.Sprintf(" model=%q", model.path)
 	}
+	if len(model.states) > 0 {
+		str += fmt.Sprintf(" states=%d", len(model.states))
+	}
 	return str + ">"
 }
 
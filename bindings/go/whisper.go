@@ -2,6 +2,7 @@ package whisper
 
 import (
 	"errors"
+	"sync"
 	"unsafe"
 )
 
@@ -46,17 +47,21 @@ static bool whisper_encoder_begin_cb(struct whisper_context* ctx, struct whisper
     return false;
 }
 
-// Get default parameters and set callbacks
-static struct whisper_full_params whisper_full_default_params_cb(struct whisper_context* ctx, enum whisper_sampling_strategy strategy) {
-	struct whisper_full_params params = whisper_full_default_params(strategy);
+// Set callbacks, which are dispatched using the user_data pointer
+static struct whisper_full_params whisper_full_params_cb(struct whisper_full_params params, void* user_data) {
 	params.new_segment_callback = whisper_new_segment_cb;
-	params.new_segment_callback_user_data = (void*)(ctx);
+	params.new_segment_callback_user_data = user_data;
 	params.encoder_begin_callback = whisper_encoder_begin_cb;
-	params.encoder_begin_callback_user_data = (void*)(ctx);
+	params.encoder_begin_callback_user_data = user_data;
 	params.progress_callback = whisper_progress_cb;
-	params.progress_callback_user_data = (void*)(ctx);
+	params.progress_callback_user_data = user_data;
 	return params;
 }
+
+// Get default parameters and set callbacks
+static struct whisper_full_params whisper_full_default_params_cb(struct whisper_context* ctx, enum whisper_sampling_strategy strategy) {
+	return whisper_full_params_cb(whisper_full_default_params(strategy), (void*)(ctx));
+}
 */
 import "C"
 
@@ -65,6 +70,7 @@ import "C"
 
 type (
 	Context          C.struct_whisper_context
+	State            C.struct_whisper_state
 	Token            C.whisper_token
 	TokenData        C.struct_whisper_token_data
 	SamplingStrategy C.enum_whisper_sampling_strategy
@@ -92,6 +98,8 @@ var (
 	ErrAutoDetectFailed = errors.New("whisper_lang_auto_detect failed")
 	ErrConversionFailed = errors.New("whisper_convert failed")
 	ErrInvalidLanguage  = errors.New("invalid language")
+	ErrNoSamples        = errors.New("no samples")
+	ErrStateInitFailed  = errors.New("whisper_init_state failed")
 )
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -109,6 +117,34 @@ func Whisper_init(path string) *Context {
 	}
 }
 
+// Loads the model from the given file without allocating the default state.
+// Use Whisper_init_state() to allocate states and the _with_state / _from_state
+// functions to use them. Returns NULL on failure.
+func Whisper_init_no_state(path string) *Context {
+	cPath := C.CString(path)
+	defer C.free(unsafe.Pointer(cPath))
+	if ctx := C.whisper_init_from_file_with_params_no_state(cPath, C.whisper_context_default_params()); ctx != nil {
+		return (*Context)(ctx)
+	} else {
+		return nil
+	}
+}
+
+// Allocates a new state for the model. Each state can be used by one
+// transcription at a time, so separate states can be processed concurrently.
+func (ctx *Context) Whisper_init_state() (*State, error) {
+	if state := C.whisper_init_state((*C.struct_whisper_context)(ctx)); state != nil {
+		return (*State)(state), nil
+	} else {
+		return nil, ErrStateInitFailed
+	}
+}
+
+// Frees all memory allocated by the state.
+func (state *State) Whisper_free_state() {
+	C.whisper_free_state((*C.struct_whisper_state)(state))
+}
+
 // Frees all memory allocated by the model.
 func (ctx *Context) Whisper_free() {
 	C.whisper_free((*C.struct_whisper_context)(ctx))
@@ -308,12 +344,15 @@ func (ctx *Context) Whisper_full(
 	newSegmentCallback func(int),
 	progressCallback func(int),
 ) error {
-	registerEncoderBeginCallback(ctx, encoderBeginCallback)
-	registerNewSegmentCallback(ctx, newSegmentCallback)
-	registerProgressCallback(ctx, progressCallback)
-	defer registerEncoderBeginCallback(ctx, nil)
-	defer registerNewSegmentCallback(ctx, nil)
-	defer registerProgressCallback(ctx, nil)
+	registerEncoderBeginCallback(unsafe.Pointer(ctx), encoderBeginCallback)
+	registerNewSegmentCallback(unsafe.Pointer(ctx), newSegmentCallback)
+	registerProgressCallback(unsafe.Pointer(ctx), progressCallback)
+	defer registerEncoderBeginCallback(unsafe.Pointer(ctx), nil)
+	defer registerNewSegmentCallback(unsafe.Pointer(ctx), nil)
+	defer registerProgressCallback(unsafe.Pointer(ctx), nil)
+	if len(samples) == 0 {
+		return ErrNoSamples
+	}
 	if C.whisper_full((*C.struct_whisper_context)(ctx), (C.struct_whisper_full_params)(params), (*C.float)(&samples[0]), C.int(len(samples))) == 0 {
 		return nil
 	} else {
@@ -325,11 +364,14 @@ func (ctx *Context) Whisper_full(
 // It seems this approach can offer some speedup in some cases.
 // However, the transcription accuracy can be worse at the beginning and end of each chunk.
 func (ctx *Context) Whisper_full_parallel(params Params, samples []float32, processors int, encoderBeginCallback func() bool, newSegmentCallback func(int)) error {
-	registerEncoderBeginCallback(ctx, encoderBeginCallback)
-	registerNewSegmentCallback(ctx, newSegmentCallback)
-	defer registerEncoderBeginCallback(ctx, nil)
-	defer registerNewSegmentCallback(ctx, nil)
+	registerEncoderBeginCallback(unsafe.Pointer(ctx), encoderBeginCallback)
+	registerNewSegmentCallback(unsafe.Pointer(ctx), newSegmentCallback)
+	defer registerEncoderBeginCallback(unsafe.Pointer(ctx), nil)
+	defer registerNewSegmentCallback(unsafe.Pointer(ctx), nil)
 
+	if len(samples) == 0 {
+		return ErrNoSamples
+	}
 	if C.whisper_full_parallel((*C.struct_whisper_context)(ctx), (C.struct_whisper_full_params)(params), (*C.float)(&samples[0]), C.int(len(samples)), C.int(processors)) == 0 {
 		return nil
 	} else {
@@ -337,6 +379,34 @@ func (ctx *Context) Whisper_full_parallel(params Params, samples []float32, proc
 	}
 }
 
+// Run the entire model on the given state. Different states of the same model
+// can be processed concurrently. The samples are passed to C without copying.
+// The callbacks are called with the results stored in the state.
+func (ctx *Context) Whisper_full_with_state(
+	state *State,
+	params Params,
+	samples []float32,
+	encoderBeginCallback func() bool,
+	newSegmentCallback func(int),
+	progressCallback func(int),
+) error {
+	registerEncoderBeginCallback(unsafe.Pointer(state), encoderBeginCallback)
+	registerNewSegmentCallback(unsafe.Pointer(state), newSegmentCallback)
+	registerProgressCallback(unsafe.Pointer(state), progressCallback)
+	defer registerEncoderBeginCallback(unsafe.Pointer(state), nil)
+	defer registerNewSegmentCallback(unsafe.Pointer(state), nil)
+	defer registerProgressCallback(unsafe.Pointer(state), nil)
+	if len(samples) == 0 {
+		return ErrNoSamples
+	}
+	cparams := C.whisper_full_params_cb((C.struct_whisper_full_params)(params), unsafe.Pointer(state))
+	if C.whisper_full_with_state((*C.struct_whisper_context)(ctx), (*C.struct_whisper_state)(state), cparams, (*C.float)(&samples[0]), C.int(len(samples))) == 0 {
+		return nil
+	} else {
+		return ErrConversionFailed
+	}
+}
+
 // Return the id of the autodetected language, returns -1 if not found
 // Added to whisper.cpp in
 // https://github.com/ggerganov/whisper.cpp/commit/a1c1583cc7cd8b75222857afc936f0638c5683d6
@@ -396,56 +466,117 @@ func (ctx *Context) Whisper_full_get_token_p(segment int, token int) float32 {
 	return float32(C.whisper_full_get_token_p((*C.struct_whisper_context)(ctx), C.int(segment), C.int(token)))
 }
 
+// Results stored in a state, see Whisper_full_with_state()
+
+func (state *State) Whisper_full_lang_id() int {
+	return int(C.whisper_full_lang_id_from_state((*C.struct_whisper_state)(state)))
+}
+
+func (state *State) Whisper_full_n_segments() int {
+	return int(C.whisper_full_n_segments_from_state((*C.struct_whisper_state)(state)))
+}
+
+func (state *State) Whisper_full_get_segment_t0(segment int) int64 {
+	return int64(C.whisper_full_get_segment_t0_from_state((*C.struct_whisper_state)(state), C.int(segment)))
+}
+
+func (state *State) Whisper_full_get_segment_t1(segment int) int64 {
+	return int64(C.whisper_full_get_segment_t1_from_state((*C.struct_whisper_state)(state), C.int(segment)))
+}
+
+func (state *State) Whisper_full_get_segment_text(segment int) string {
+	return C.GoString(C.whisper_full_get_segment_text_from_state((*C.struct_whisper_state)(state), C.int(segment)))
+}
+
+func (state *State) Whisper_full_n_tokens(segment int) int {
+	return int(C.whisper_full_n_tokens_from_state((*C.struct_whisper_state)(state), C.int(segment)))
+}
+
+// The token text needs the vocabulary of the model the state belongs to.
+func (state *State) Whisper_full_get_token_text(ctx *Context, segment int, token int) string {
+	return C.GoString(C.whisper_full_get_token_text_from_state((*C.struct_whisper_context)(ctx), (*C.struct_whisper_state)(state), C.int(segment), C.int(token)))
+}
+
+func (state *State) Whisper_full_get_token_id(segment int, token int) Token {
+	return Token(C.whisper_full_get_token_id_from_state((*C.struct_whisper_state)(state), C.int(segment), C.int(token)))
+}
+
+func (state *State) Whisper_full_get_token_data(segment int, token int) TokenData {
+	return TokenData(C.whisper_full_get_token_data_from_state((*C.struct_whisper_state)(state), C.int(segment), C.int(token)))
+}
+
+func (state *State) Whisper_full_get_token_p(segment int, token int) float32 {
+	return float32(C.whisper_full_get_token_p_from_state((*C.struct_whisper_state)(state), C.int(segment), C.int(token)))
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // CALLBACKS
 
+// Callbacks are keyed by the user_data pointer, which is either the context or
+// the state. The maps are guarded as states can be processed concurrently.
 var (
+	cbMutex        sync.Mutex
 	cbNewSegment   = make(map[unsafe.Pointer]func(int))
 	cbProgress     = make(map[unsafe.Pointer]func(int))
 	cbEncoderBegin = make(map[unsafe.Pointer]func() bool)
 )
 
-func registerNewSegmentCallback(ctx *Context, fn func(int)) {
+func registerNewSegmentCallback(key unsafe.Pointer, fn func(int)) {
+	cbMutex.Lock()
+	defer cbMutex.Unlock()
 	if fn == nil {
-		delete(cbNewSegment, unsafe.Pointer(ctx))
+		delete(cbNewSegment, key)
 	} else {
-		cbNewSegment[unsafe.Pointer(ctx)] = fn
+		cbNewSegment[key] = fn
 	}
 }
 
-func registerProgressCallback(ctx *Context, fn func(int)) {
+func registerProgressCallback(key unsafe.Pointer, fn func(int)) {
+	cbMutex.Lock()
+	defer cbMutex.Unlock()
 	if fn == nil {
-		delete(cbProgress, unsafe.Pointer(ctx))
+		delete(cbProgress, key)
 	} else {
-		cbProgress[unsafe.Pointer(ctx)] = fn
+		cbProgress[key] = fn
 	}
 }
 
-func registerEncoderBeginCallback(ctx *Context, fn func() bool) {
+func registerEncoderBeginCallback(key unsafe.Pointer, fn func() bool) {
+	cbMutex.Lock()
+	defer cbMutex.Unlock()
 	if fn == nil {
-		delete(cbEncoderBegin, unsafe.Pointer(ctx))
+		delete(cbEncoderBegin, key)
 	} else {
-		cbEncoderBegin[unsafe.Pointer(ctx)] = fn
+		cbEncoderBegin[key] = fn
 	}
 }
 
 //export callNewSegment
 func callNewSegment(user_data unsafe.Pointer, new C.int) {
-	if fn, ok := cbNewSegment[user_data]; ok {
+	cbMutex.Lock()
+	fn, ok := cbNewSegment[user_data]
+	cbMutex.Unlock()
+	if ok {
 		fn(int(new))
 	}
 }
 
 //export callProgress
 func callProgress(user_data unsafe.Pointer, progress C.int) {
-	if fn, ok := cbProgress[user_data]; ok {
+	cbMutex.Lock()
+	fn, ok := cbProgress[user_data]
+	cbMutex.Unlock()
+	if ok {
 		fn(int(progress))
 	}
 }
 
 //export callEncoderBegin
 func callEncoderBegin(user_data unsafe.Pointer) C.bool {
-	if fn, ok := cbEncoderBegin[user_data]; ok {
+	cbMutex.Lock()
+	fn, ok := cbEncoderBegin[user_data]
+	cbMutex.Unlock()
+	if ok {
 		if fn() {
 			return C.bool(true)
 		} else {
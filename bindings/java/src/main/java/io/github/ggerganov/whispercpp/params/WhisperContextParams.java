@@ -24,8 +24,14 @@ public class WhisperContextParams extends Structure {
         use_gpu = enable ? CBool.TRUE : CBool.FALSE;
     }
 
+    /** [EXPERIMENTAL] NUMA placement of the weights, see whisper_numa_strategy (default = 0, disabled) */
+    public int numa;
+
+    /** [EXPERIMENTAL] NUMA node of the weights (default = 0) */
+    public int numa_node;
+
     @Override
     protected List<String> getFieldOrder() {
-        return Arrays.asList("use_gpu");
+        return Arrays.asList("use_gpu", "numa", "numa_node");
     }
 }
@@ -28,6 +28,11 @@ public class WhisperFullParams extends Structure {
     /** Number of threads. (default = 4) */
     public int n_threads;
 
+    /** Threads for the encoder, the decoder and the mel spectrogram. (default = 0, same as n_threads) */
+    public int n_threads_encode;
+    public int n_threads_decode;
+    public int n_threads_mel;
+
     /** Maximum tokens to use from past text as a prompt for the decoder. (default = 16384) */
     public int n_max_text_ctx;
 
@@ -140,6 +145,17 @@ public class WhisperFullParams extends Structure {
     /** Overwrite the audio context size (0 = use default). */
     public int audio_ctx;
 
+    /** Size the audio context to the remaining audio of each window (default = false). */
+    public CBool audio_ctx_auto;
+
+    /** Size the audio context to the remaining audio of each window (default = false). */
+    public void audioCtxAuto(boolean enable) {
+        audio_ctx_auto = enable ? CBool.TRUE : CBool.FALSE;
+    }
+
+    /** [EXPERIMENTAL] Threads encoding the next window while the current one is decoded (CPU only, 0 = disabled). */
+    public int n_threads_encode_next;
+
     /** Enable tinydiarize (default = false) */
     public CBool tdrz_enable;
 
@@ -148,6 +164,15 @@ public class WhisperFullParams extends Structure {
         tdrz_enable = enable ? CBool.TRUE : CBool.FALSE;
     }
 
+    /** Draft model context for speculative decoding (whisper_context*, null = disabled). */
+    public Pointer draft_ctx;
+
+    /** Number of tokens to draft per verification pass (default = 4). */
+    public int draft_n_tokens;
+
+    /** Longest n-gram to look up in the context for draft tokens (0 = disabled). */
+    public int draft_ngram;
+
     /** Tokens to provide to the whisper decoder as an initial prompt.
      * These are prepended to any existing text context from a previous call. */
     public String initial_prompt;
@@ -176,6 +201,9 @@ public class WhisperFullParams extends Structure {
         detect_language = enable ? CBool.TRUE : CBool.FALSE;
     }
 
+    /** Audio context for the language detection (0 = same as the first window). */
+    public int detect_audio_ctx;
+
     // Common decoding parameters.
 
     /** Flag to suppress blank tokens. */
@@ -216,6 +244,20 @@ public class WhisperFullParams extends Structure {
     /** No speech threshold. */
     public float no_speech_thold;
 
+    /** [EXPERIMENTAL] Fallback temperatures decoded concurrently with the current one (CPU only, 0 = disabled). */
+    public int n_fallback_parallel;
+
+    /** [EXPERIMENTAL] Threads per concurrent fallback decode. */
+    public int n_threads_fallback;
+
+    /** [EXPERIMENTAL] Fail a decoder as soon as it is stuck in a repetition loop (default = false). */
+    public CBool loop_detect;
+
+    /** [EXPERIMENTAL] Fail a decoder as soon as it is stuck in a repetition loop (default = false). */
+    public void loopDetect(boolean enable) {
+        loop_detect = enable ? CBool.TRUE : CBool.FALSE;
+    }
+
     /** Greedy decoding parameters. */
     public GreedyParams greedy;
 
@@ -313,19 +355,24 @@ public class WhisperFullParams extends Structure {
     public long i_start_rule;
     public float grammar_penalty;
 
+    /** [EXPERIMENTAL] Compute the logits only for these tokens (plus end of text and timestamp tokens). */
+    public Pointer vocab_tokens;
+    public int vocab_n_tokens;
+
     @Override
     protected List<String> getFieldOrder() {
-        return Arrays.asList("strategy", "n_threads", "n_max_text_ctx", "offset_ms", "duration_ms", "translate",
+        return Arrays.asList("strategy", "n_threads", "n_threads_encode", "n_threads_decode", "n_threads_mel", "n_max_text_ctx", "offset_ms", "duration_ms", "translate",
                 "no_context", "single_segment", "no_timestamps",
                 "print_special", "print_progress", "print_realtime", "print_timestamps",  "token_timestamps",
-                "thold_pt", "thold_ptsum", "max_len", "split_on_word", "max_tokens", "speed_up", "audio_ctx",
-                "tdrz_enable", "initial_prompt", "prompt_tokens", "prompt_n_tokens", "language", "detect_language",
+                "thold_pt", "thold_ptsum", "max_len", "split_on_word", "max_tokens", "speed_up", "audio_ctx", "audio_ctx_auto", "n_threads_encode_next",
+                "tdrz_enable", "draft_ctx", "draft_n_tokens", "draft_ngram", "initial_prompt", "prompt_tokens", "prompt_n_tokens", "language", "detect_language", "detect_audio_ctx",
                 "suppress_blank", "suppress_non_speech_tokens", "temperature", "max_initial_ts", "length_penalty",
-                "temperature_inc", "entropy_thold", "logprob_thold", "no_speech_thold", "greedy", "beam_search",
+                "temperature_inc", "entropy_thold", "logprob_thold", "no_speech_thold", "n_fallback_parallel", "n_threads_fallback", "loop_detect", "greedy", "beam_search",
                 "new_segment_callback", "new_segment_callback_user_data",
                 "progress_callback", "progress_callback_user_data",
                 "encoder_begin_callback", "encoder_begin_callback_user_data",
                 "logits_filter_callback", "logits_filter_callback_user_data",
-                "grammar_rules", "n_grammar_rules", "i_start_rule", "grammar_penalty");
+                "grammar_rules", "n_grammar_rules", "i_start_rule", "grammar_penalty",
+                "vocab_tokens", "vocab_n_tokens");
     }
 }
@@ -1,5 +1,5 @@
 const path = require("path");
-const { whisper } = require(path.join(
+const { whisper, Model } = require(path.join(
   __dirname,
   "../../../build/Release/whisper-addon"
 ));
@@ -22,3 +22,29 @@ describe("Run whisper.node", () => {
     }, 10000);
 });
 
+
+describe("Run whisper.node with a persistent model", () => {
+    test("it should stream segments and reuse the model", async () => {
+        const model = new Model({ model: whisperParamsMock.model, use_gpu: whisperParamsMock.use_gpu, n_states: 2 });
+
+        const transcribe = (params) => new Promise((resolve, reject) => {
+            const segments = [];
+            model.transcribe(params, (err, result) => {
+                if (err) {
+                    reject(err);
+                } else {
+                    resolve({ segments, result });
+                }
+            }, (segment) => segments.push(segment));
+        });
+
+        const runs = await Promise.all([1, 2, 3].map(() => transcribe({ fname_inp: whisperParamsMock.fname_inp })));
+
+        for (const { segments, result } of runs) {
+            expect(result.length).toBeGreaterThan(0);
+            expect(segments).toEqual(result);
+        }
+
+        model.free();
+    }, 30000);
+});
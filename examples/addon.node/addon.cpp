@@ -3,6 +3,7 @@
 
 #include "whisper.h"
 
+#include <deque>
 #include <string>
 #include <thread>
 #include <vector>
@@ -141,6 +142,39 @@ void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper
     }
 }
 
+// note: the returned params reference the strings in 'params'
+whisper_full_params to_full_params(const whisper_params & params) {
+    whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+
+    wparams.strategy = params.beam_size > 1 ? WHISPER_SAMPLING_BEAM_SEARCH : WHISPER_SAMPLING_GREEDY;
+
+    wparams.print_realtime   = false;
+    wparams.print_progress   = params.print_progress;
+    wparams.print_timestamps = !params.no_timestamps;
+    wparams.print_special    = params.print_special;
+    wparams.translate        = params.translate;
+    wparams.language         = params.language.c_str();
+    wparams.n_threads        = params.n_threads;
+    wparams.n_max_text_ctx   = params.max_context >= 0 ? params.max_context : wparams.n_max_text_ctx;
+    wparams.offset_ms        = params.offset_t_ms;
+    wparams.duration_ms      = params.duration_ms;
+
+    wparams.token_timestamps = params.output_wts || params.max_len > 0;
+    wparams.thold_pt         = params.word_thold;
+    wparams.entropy_thold    = params.entropy_thold;
+    wparams.logprob_thold    = params.logprob_thold;
+    wparams.max_len          = params.output_wts && params.max_len == 0 ? 60 : params.max_len;
+
+    wparams.speed_up         = params.speed_up;
+
+    wparams.greedy.best_of        = params.best_of;
+    wparams.beam_search.beam_size = params.beam_size;
+
+    wparams.initial_prompt   = params.prompt.c_str();
+
+    return wparams;
+}
+
 int run(whisper_params &params, std::vector<std::vector<std::string>> &result) {
     if (params.fname_inp.empty()) {
         fprintf(stderr, "error: no input files specified\n");
@@ -154,7 +188,7 @@ int run(whisper_params &params, std::vector<std::vector<std::string>> &result) {
 
     // whisper init
 
-    struct whisper_context_params cparams;
+    struct whisper_context_params cparams = whisper_context_default_params();
     cparams.use_gpu = params.use_gpu;
     struct whisper_context * ctx = whisper_init_from_file_with_params(params.model.c_str(), cparams);
 
@@ -204,33 +238,7 @@ int run(whisper_params &params, std::vector<std::vector<std::string>> &result) {
 
         // run the inference
         {
-            whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
-
-            wparams.strategy = params.beam_size > 1 ? WHISPER_SAMPLING_BEAM_SEARCH : WHISPER_SAMPLING_GREEDY;
-
-            wparams.print_realtime   = false;
-            wparams.print_progress   = params.print_progress;
-            wparams.print_timestamps = !params.no_timestamps;
-            wparams.print_special    = params.print_special;
-            wparams.translate        = params.translate;
-            wparams.language         = params.language.c_str();
-            wparams.n_threads        = params.n_threads;
-            wparams.n_max_text_ctx   = params.max_context >= 0 ? params.max_context : wparams.n_max_text_ctx;
-            wparams.offset_ms        = params.offset_t_ms;
-            wparams.duration_ms      = params.duration_ms;
-
-            wparams.token_timestamps = params.output_wts || params.max_len > 0;
-            wparams.thold_pt         = params.word_thold;
-            wparams.entropy_thold    = params.entropy_thold;
-            wparams.logprob_thold    = params.logprob_thold;
-            wparams.max_len          = params.output_wts && params.max_len == 0 ? 60 : params.max_len;
-
-            wparams.speed_up         = params.speed_up;
-
-            wparams.greedy.best_of        = params.best_of;
-            wparams.beam_search.beam_size = params.beam_size;
-
-            wparams.initial_prompt   = params.prompt.c_str();
+            whisper_full_params wparams = to_full_params(params);
 
             whisper_print_user_data user_data = { &params, &pcmf32s };
 
@@ -307,6 +315,337 @@ class Worker : public Napi::AsyncWorker {
 
 
 
+//
+// persistent model
+//
+// the model is loaded once and a pool of whisper_state objects serves the transcriptions. each transcription runs in
+// its own AsyncWorker on a free state - if all states are busy, it waits until one is released. new segments are
+// streamed back through a thread-safe function:
+//
+//   const model = new Model({ model: 'ggml-base.en.bin', use_gpu: true, n_states: 2 });
+//
+//   model.transcribe({ fname_inp: 'jfk.wav' }, (err, result) => { ... }, (segment) => { ... });
+//
+//   model.free();
+//
+
+// read the optional transcription params from a JS object
+void parse_params(const Napi::Object & obj, whisper_params & params) {
+  Napi::Value v;
+
+  if ((v = obj.Get("language")).IsString())       params.language      = v.As<Napi::String>();
+  if ((v = obj.Get("prompt")).IsString())         params.prompt        = v.As<Napi::String>();
+  if ((v = obj.Get("n_threads")).IsNumber())      params.n_threads     = v.As<Napi::Number>().Int32Value();
+  if ((v = obj.Get("max_context")).IsNumber())    params.max_context   = v.As<Napi::Number>().Int32Value();
+  if ((v = obj.Get("max_len")).IsNumber())        params.max_len       = v.As<Napi::Number>().Int32Value();
+  if ((v = obj.Get("best_of")).IsNumber())        params.best_of       = v.As<Napi::Number>().Int32Value();
+  if ((v = obj.Get("beam_size")).IsNumber())      params.beam_size     = v.As<Napi::Number>().Int32Value();
+  if ((v = obj.Get("translate")).IsBoolean())     params.translate     = v.As<Napi::Boolean>();
+  if ((v = obj.Get("no_timestamps")).IsBoolean()) params.no_timestamps = v.As<Napi::Boolean>();
+}
+
+// shared by a worker and its thread-safe function - it outlives the worker and is freed by the finalizer
+struct transcribe_context {
+  Napi::FunctionReference callback;
+  Napi::FunctionReference on_segment;
+
+  bool stream = false;
+
+  std::vector<std::vector<std::string>> result;
+  std::string error;
+};
+
+Napi::Array to_array(Napi::Env env, const std::vector<std::vector<std::string>> & segments) {
+  Napi::Array res = Napi::Array::New(env, segments.size());
+  for (uint64_t i = 0; i < segments.size(); ++i) {
+    Napi::Array tmp = Napi::Array::New(env, segments[i].size());
+    for (uint64_t j = 0; j < segments[i].size(); ++j) {
+      tmp[j] = Napi::String::New(env, segments[i][j]);
+    }
+    res[i] = tmp;
+  }
+  return res;
+}
+
+class TranscribeWorker;
+
+class Model : public Napi::ObjectWrap<Model> {
+ public:
+  static Napi::Function Define(Napi::Env env) {
+    return DefineClass(env, "Model", {
+      InstanceMethod("transcribe", &Model::Transcribe),
+      InstanceMethod("free",       &Model::Free),
+    });
+  }
+
+  Model(const Napi::CallbackInfo& info);
+  ~Model() override { release(); }
+
+  whisper_context * ctx() const { return ctx_; }
+
+  // called on the main thread when a worker is done with its state
+  void Done(whisper_state * state);
+
+ private:
+  Napi::Value Transcribe(const Napi::CallbackInfo& info);
+  Napi::Value Free(const Napi::CallbackInfo& info);
+
+  void release();
+
+  whisper_context * ctx_ = nullptr;
+
+  std::vector<whisper_state *> states;      // all states of the pool
+  std::vector<whisper_state *> states_free; // states that are not used by a worker
+
+  std::deque<TranscribeWorker *> pending;   // workers waiting for a free state
+};
+
+class TranscribeWorker : public Napi::AsyncWorker {
+ public:
+  TranscribeWorker(Napi::Env env, Model * model, whisper_params params, Napi::Function& callback, Napi::Function on_segment)
+      : Napi::AsyncWorker(env), model(model), params(params) {
+    // keep the model alive until the worker is done
+    model_ref = Napi::Persistent(model->Value());
+
+    context = new transcribe_context();
+    context->callback = Napi::Persistent(callback);
+    if (!on_segment.IsEmpty()) {
+      context->on_segment = Napi::Persistent(on_segment);
+      context->stream = true;
+    }
+
+    // the final callback is called by the finalizer, so it always comes after the streamed segments
+    tsfn = Napi::ThreadSafeFunction::New(env, callback, "whisper-transcribe", 0, 1, context,
+        [](Napi::Env env, transcribe_context * context) {
+          Napi::HandleScope scope(env);
+          if (context->error.empty()) {
+            context->callback.Call({ env.Null(), to_array(env, context->result) });
+          } else {
+            context->callback.Call({ Napi::Error::New(env, context->error).Value() });
+          }
+          delete context;
+        });
+  }
+
+  // start processing on the given state
+  void Start(whisper_state * state) {
+    this->state = state;
+    Queue();
+  }
+
+  void Execute() override {
+    std::vector<float> pcmf32; // mono-channel F32 PCM
+    std::vector<std::vector<float>> pcmf32s; // stereo-channel F32 PCM
+
+    if (!::read_wav(params.fname_inp[0], pcmf32, pcmf32s, false)) {
+      SetError("failed to read WAV file '" + params.fname_inp[0] + "'");
+      return;
+    }
+
+    whisper_full_params wparams = to_full_params(params);
+
+    if (context->stream) {
+      wparams.new_segment_callback = [](struct whisper_context * /*ctx*/, struct whisper_state * state, int n_new, void * user_data) {
+        ((TranscribeWorker *) user_data)->Stream(state, n_new);
+      };
+      wparams.new_segment_callback_user_data = this;
+    }
+
+    if (whisper_full_with_state(model->ctx(), state, wparams, pcmf32.data(), pcmf32.size()) != 0) {
+      SetError("failed to process audio");
+      return;
+    }
+
+    const int n_segments = whisper_full_n_segments_from_state(state);
+
+    context->result.resize(n_segments);
+    for (int i = 0; i < n_segments; ++i) {
+      context->result[i] = segment(state, i);
+    }
+  }
+
+  void OnOK() override {
+    model->Done(state);
+    tsfn.Release();
+  }
+
+  void OnError(const Napi::Error& e) override {
+    context->error = e.Message();
+    model->Done(state);
+    tsfn.Release();
+  }
+
+ private:
+  static std::vector<std::string> segment(whisper_state * state, int i) {
+    return {
+      to_timestamp(whisper_full_get_segment_t0_from_state(state, i), true),
+      to_timestamp(whisper_full_get_segment_t1_from_state(state, i), true),
+      whisper_full_get_segment_text_from_state(state, i),
+    };
+  }
+
+  // called from the worker thread for each batch of new segments
+  void Stream(whisper_state * state, int n_new) {
+    const int n_segments = whisper_full_n_segments_from_state(state);
+
+    auto * segments = new std::vector<std::vector<std::string>>();
+    for (int i = n_segments - n_new; i < n_segments; ++i) {
+      segments->push_back(segment(state, i));
+    }
+
+    transcribe_context * context = this->context;
+
+    tsfn.BlockingCall(segments, [context](Napi::Env env, Napi::Function /*callback*/, std::vector<std::vector<std::string>> * segments) {
+      if (env != nullptr) {
+        Napi::Array res = to_array(env, *segments);
+        for (uint32_t i = 0; i < res.Length(); ++i) {
+          context->on_segment.Call({ res.Get(i) });
+        }
+      }
+      delete segments;
+    });
+  }
+
+  Model * model;
+  Napi::ObjectReference model_ref;
+
+  whisper_params params;
+  whisper_state * state = nullptr;
+
+  transcribe_context * context;
+  Napi::ThreadSafeFunction tsfn;
+};
+
+Model::Model(const Napi::CallbackInfo& info) : Napi::ObjectWrap<Model>(info) {
+  Napi::Env env = info.Env();
+  if (info.Length() <= 0 || !info[0].IsObject()) {
+    Napi::TypeError::New(env, "object expected").ThrowAsJavaScriptException();
+    return;
+  }
+
+  Napi::Object obj = info[0].As<Napi::Object>();
+  if (!obj.Get("model").IsString()) {
+    Napi::TypeError::New(env, "model path expected").ThrowAsJavaScriptException();
+    return;
+  }
+
+  std::string model = obj.Get("model").As<Napi::String>();
+
+  struct whisper_context_params cparams = whisper_context_default_params();
+  if (obj.Get("use_gpu").IsBoolean()) {
+    cparams.use_gpu = obj.Get("use_gpu").As<Napi::Boolean>();
+  }
+
+  int n_states = 1;
+  if (obj.Get("n_states").IsNumber()) {
+    n_states = std::max(1, obj.Get("n_states").As<Napi::Number>().Int32Value());
+  }
+
+  ctx_ = whisper_init_from_file_with_params_no_state(model.c_str(), cparams);
+  if (ctx_ == nullptr) {
+    Napi::Error::New(env, "failed to initialize whisper context").ThrowAsJavaScriptException();
+    return;
+  }
+
+  for (int i = 0; i < n_states; ++i) {
+    whisper_state * state = whisper_init_state(ctx_);
+    if (state == nullptr) {
+      release();
+      Napi::Error::New(env, "failed to initialize whisper state").ThrowAsJavaScriptException();
+      return;
+    }
+    states.push_back(state);
+  }
+
+  states_free = states;
+}
+
+void Model::Done(whisper_state * state) {
+  if (!pending.empty()) {
+    TranscribeWorker * worker = pending.front();
+    pending.pop_front();
+    worker->Start(state);
+    return;
+  }
+
+  states_free.push_back(state);
+}
+
+Napi::Value Model::Transcribe(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  if (info.Length() < 2 || !info[0].IsObject() || !info[1].IsFunction()) {
+    Napi::TypeError::New(env, "object and callback expected").ThrowAsJavaScriptException();
+    return env.Undefined();
+  }
+
+  if (ctx_ == nullptr) {
+    Napi::Error::New(env, "model has been freed").ThrowAsJavaScriptException();
+    return env.Undefined();
+  }
+
+  Napi::Object obj = info[0].As<Napi::Object>();
+  if (!obj.Get("fname_inp").IsString()) {
+    Napi::TypeError::New(env, "fname_inp expected").ThrowAsJavaScriptException();
+    return env.Undefined();
+  }
+
+  std::string input = obj.Get("fname_inp").As<Napi::String>();
+
+  whisper_params params;
+  params.fname_inp.emplace_back(input);
+  parse_params(obj, params);
+
+  if (params.language != "auto" && whisper_lang_id(params.language.c_str()) == -1) {
+    Napi::Error::New(env, "unknown language '" + params.language + "'").ThrowAsJavaScriptException();
+    return env.Undefined();
+  }
+
+  if (!whisper_is_multilingual(ctx_)) {
+    params.language  = "en";
+    params.translate = false;
+  }
+
+  Napi::Function callback   = info[1].As<Napi::Function>();
+  Napi::Function on_segment = info.Length() > 2 && info[2].IsFunction() ? info[2].As<Napi::Function>() : Napi::Function();
+
+  TranscribeWorker * worker = new TranscribeWorker(env, this, params, callback, on_segment);
+
+  if (states_free.empty()) {
+    pending.push_back(worker);
+  } else {
+    whisper_state * state = states_free.back();
+    states_free.pop_back();
+    worker->Start(state);
+  }
+
+  return env.Undefined();
+}
+
+Napi::Value Model::Free(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  if (states_free.size() != states.size() || !pending.empty()) {
+    Napi::Error::New(env, "model is busy").ThrowAsJavaScriptException();
+    return env.Undefined();
+  }
+
+  release();
+
+  return env.Undefined();
+}
+
+void Model::release() {
+  for (auto * state : states) {
+    whisper_free_state(state);
+  }
+  states.clear();
+  states_free.clear();
+
+  if (ctx_ != nullptr) {
+    whisper_free(ctx_);
+    ctx_ = nullptr;
+  }
+}
+
 Napi::Value whisper(const Napi::CallbackInfo& info) {
   Napi::Env env = info.Env();
   if (info.Length() <= 0 || !info[0].IsObject()) {
@@ -337,6 +676,10 @@ Napi::Object Init(Napi::Env env, Napi::Object exports) {
       Napi::String::New(env, "whisper"),
       Napi::Function::New(env, whisper)
   );
+  exports.Set(
+      Napi::String::New(env, "Model"),
+      Model::Define(env)
+  );
   return exports;
 }
 
@@ -1,14 +1,34 @@
+#include "common.h"
+
 #include "whisper.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
 #include <cstdio>
 #include <cstring>
 #include <string>
 #include <thread>
+#include <vector>
 
 // command-line parameters
 struct whisper_params {
     int32_t n_threads = std::min(4, (int32_t) std::thread::hardware_concurrency());
-    int32_t what = 0; // what to benchmark: 0 - whisper ecoder, 1 - memcpy, 2 - ggml_mul_mat
+    int32_t what = 0; // what to benchmark: 0 - whisper ecoder, 1 - memcpy, 2 - ggml_mul_mat, 3 - whisper_full on files
+
+    // what = 3
+    int32_t n_states  = 1;
+    int32_t n_repeat  = 1;
+    int32_t best_of   = 2;
+    int32_t beam_size = -1;
+
+    bool no_fallback = false;
+
+    std::string language = "en";
+    std::string fname_json;
+
+    std::vector<std::string> fname_inp;
 
     std::string model = "models/ggml-base.en.bin";
 
@@ -29,6 +49,14 @@ bool whisper_params_parse(int argc, char ** argv, whisper_params & params) {
         else if (arg == "-m"  || arg == "--model")   { params.model     = argv[++i]; }
         else if (arg == "-w"  || arg == "--what")    { params.what      = atoi(argv[++i]); }
         else if (arg == "-ng" || arg == "--no-gpu")  { params.use_gpu   = false; }
+        else if (arg == "-f"  || arg == "--file")    { params.fname_inp.emplace_back(argv[++i]); }
+        else if (arg == "-ns" || arg == "--states")  { params.n_states  = std::max(1, std::stoi(argv[++i])); }
+        else if (arg == "-r"  || arg == "--repeat")  { params.n_repeat  = std::max(1, std::stoi(argv[++i])); }
+        else if (arg == "-bo" || arg == "--best-of") { params.best_of   = std::stoi(argv[++i]); }
+        else if (arg == "-bs" || arg == "--beam-size") { params.beam_size = std::stoi(argv[++i]); }
+        else if (arg == "-nf" || arg == "--no-fallback") { params.no_fallback = true; }
+        else if (arg == "-l"  || arg == "--language") { params.language = argv[++i]; }
+        else if (arg == "-oj" || arg == "--output-json") { params.fname_json = argv[++i]; }
         else {
             fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
             whisper_print_usage(argc, argv, params);
@@ -52,13 +80,24 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "                           %-7s  0 - whisper\n",                                 "");
     fprintf(stderr, "                           %-7s  1 - memcpy\n",                                  "");
     fprintf(stderr, "                           %-7s  2 - ggml_mul_mat\n",                            "");
+    fprintf(stderr, "                           %-7s  3 - whisper_full on the input files\n",         "");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options for -w 3:\n");
+    fprintf(stderr, "  -f FNAME, --file FNAME  [%-7s] input WAV file (can be repeated)\n",           "");
+    fprintf(stderr, "  -ns N,    --states N    [%-7d] number of states processing files concurrently\n", params.n_states);
+    fprintf(stderr, "  -r N,     --repeat N    [%-7d] number of times each file is processed\n",     params.n_repeat);
+    fprintf(stderr, "  -bo N,    --best-of N   [%-7d] number of best candidates to keep\n",          params.best_of);
+    fprintf(stderr, "  -bs N,    --beam-size N [%-7d] beam size for beam search\n",                  params.beam_size);
+    fprintf(stderr, "  -nf,      --no-fallback [%-7s] do not use temperature fallback\n",            params.no_fallback ? "true" : "false");
+    fprintf(stderr, "  -l LANG,  --language LANG [%-5s] spoken language\n",                          params.language.c_str());
+    fprintf(stderr, "  -oj FNAME, --output-json FNAME [%s] write the results to a JSON file\n",       params.fname_json.c_str());
     fprintf(stderr, "\n");
 }
 
 int whisper_bench_full(const whisper_params & params) {
     // whisper init
 
-    struct whisper_context_params cparams;
+    struct whisper_context_params cparams = whisper_context_default_params();
     cparams.use_gpu = params.use_gpu;
 
     struct whisper_context * ctx = whisper_init_from_file_with_params(params.model.c_str(), cparams);
@@ -140,6 +179,325 @@ int whisper_bench_full(const whisper_params & params) {
     return 0;
 }
 
+struct bench_run {
+    int   f         = 0;    // index of the input file
+    bool  ok        = false;
+    float t_audio_s = 0.0f; // duration of the audio
+    float t_wall_ms = 0.0f; // latency of whisper_full_with_state()
+    int   n_tokens  = 0;    // generated tokens
+
+    whisper_timings timings; // spent in this run
+};
+
+// a + sign*b
+static whisper_timings bench_timings_add(const whisper_timings & a, const whisper_timings & b, int sign) {
+    whisper_timings res;
+
+    res.t_mel_us    = a.t_mel_us    + sign*b.t_mel_us;
+    res.t_encode_us = a.t_encode_us + sign*b.t_encode_us;
+    res.t_cross_us  = a.t_cross_us  + sign*b.t_cross_us;
+    res.t_prompt_us = a.t_prompt_us + sign*b.t_prompt_us;
+    res.t_decode_us = a.t_decode_us + sign*b.t_decode_us;
+    res.t_sample_us = a.t_sample_us + sign*b.t_sample_us;
+
+    res.n_encode = a.n_encode + sign*b.n_encode;
+    res.n_prompt = a.n_prompt + sign*b.n_prompt;
+    res.n_decode = a.n_decode + sign*b.n_decode;
+    res.n_sample = a.n_sample + sign*b.n_sample;
+    res.n_fail_p = a.n_fail_p + sign*b.n_fail_p;
+    res.n_fail_h = a.n_fail_h + sign*b.n_fail_h;
+
+    res.n_enc_hit       = a.n_enc_hit       + sign*b.n_enc_hit;
+    res.n_window        = a.n_window        + sign*b.n_window;
+    res.n_window_tokens = a.n_window_tokens + sign*b.n_window_tokens;
+
+    for (int i = 0; i < WHISPER_TIMINGS_HIST_SIZE; ++i) {
+        res.hist_encode_us[i] = a.hist_encode_us[i] + sign*b.hist_encode_us[i];
+        res.hist_prompt_us[i] = a.hist_prompt_us[i] + sign*b.hist_prompt_us[i];
+        res.hist_decode_us[i] = a.hist_decode_us[i] + sign*b.hist_decode_us[i];
+        res.hist_window_us[i] = a.hist_window_us[i] + sign*b.hist_window_us[i];
+    }
+
+    return res;
+}
+
+// total allocated bytes, the model weights are counted once
+template <typename T>
+static size_t bench_memory_size(int (*usage)(T *, whisper_memory_entry *, int), T * obj) {
+    std::vector<whisper_memory_entry> entries(usage(obj, nullptr, 0));
+    usage(obj, entries.data(), entries.size());
+
+    size_t res = 0;
+    for (const auto & entry : entries) {
+        if (strcmp(entry.name, "weights") != 0 || entry.id < 0) {
+            res += entry.size;
+        }
+    }
+
+    return res;
+}
+
+static float bench_elapsed_ms(const std::chrono::high_resolution_clock::time_point & t_start) {
+    return std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - t_start).count();
+}
+
+// nearest-rank percentile of sorted values
+static float bench_percentile(const std::vector<float> & v, float p) {
+    if (v.empty()) {
+        return 0.0f;
+    }
+    const int i = std::min((int) v.size() - 1, std::max(0, (int) std::ceil(p/100.0f*v.size()) - 1));
+    return v[i];
+}
+
+static std::string bench_json_escape(const std::string & s) {
+    std::string res;
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            res += '\\';
+        }
+        res += c;
+    }
+    return res;
+}
+
+// run the input files through whisper_full_with_state() on n_states concurrent states
+int whisper_bench_files(const whisper_params & params) {
+    if (params.fname_inp.empty()) {
+        fprintf(stderr, "error: no input files specified\n");
+        return 2;
+    }
+
+    // whisper init
+
+    struct whisper_context_params cparams = whisper_context_default_params();
+    cparams.use_gpu = params.use_gpu;
+
+    struct whisper_context * ctx = whisper_init_from_file_with_params_no_state(params.model.c_str(), cparams);
+
+    {
+        fprintf(stderr, "\n");
+        fprintf(stderr, "system_info: n_threads = %d / %d | %s\n", params.n_threads*params.n_states, std::thread::hardware_concurrency(), whisper_print_system_info());
+    }
+
+    if (ctx == nullptr) {
+        fprintf(stderr, "error: failed to initialize whisper context\n");
+        return 2;
+    }
+
+    // read all audio upfront, so that file I/O is not measured
+    const int n_files = params.fname_inp.size();
+
+    std::vector<std::vector<float>> pcmf32(n_files);
+    for (int f = 0; f < n_files; ++f) {
+        std::vector<std::vector<float>> pcmf32s;
+        if (!::read_wav(params.fname_inp[f], pcmf32[f], pcmf32s, false)) {
+            fprintf(stderr, "error: failed to read WAV file '%s'\n", params.fname_inp[f].c_str());
+            return 5;
+        }
+    }
+
+    std::vector<struct whisper_state *> states;
+    for (int i = 0; i < params.n_states; ++i) {
+        struct whisper_state * state = whisper_init_state(ctx);
+        if (state == nullptr) {
+            fprintf(stderr, "error: failed to initialize whisper state\n");
+            return 3;
+        }
+        states.push_back(state);
+    }
+
+    whisper_full_params wparams = whisper_full_default_params(params.beam_size > 1 ? WHISPER_SAMPLING_BEAM_SEARCH : WHISPER_SAMPLING_GREEDY);
+
+    wparams.print_progress   = false;
+    wparams.print_realtime   = false;
+    wparams.print_timestamps = false;
+    wparams.print_special    = false;
+    wparams.language         = params.language.c_str();
+    wparams.n_threads        = params.n_threads;
+
+    wparams.greedy.best_of        = params.best_of;
+    wparams.beam_search.beam_size = params.beam_size;
+
+    wparams.temperature_inc  = params.no_fallback ? 0.0f : wparams.temperature_inc;
+
+    fprintf(stderr, "%s: %d files x %d repeats, %d states x %d threads, %s, fallback = %d\n", __func__,
+            n_files, params.n_repeat, params.n_states, params.n_threads,
+            params.beam_size > 1 ? "beam search" : "greedy", params.no_fallback ? 0 : 1);
+
+    // warm-up: one run of the first file on each state
+    {
+        std::vector<std::thread> workers;
+        for (auto * state : states) {
+            workers.emplace_back([&, state]() {
+                whisper_full_with_state(ctx, state, wparams, pcmf32[0].data(), pcmf32[0].size());
+            });
+        }
+        for (auto & worker : workers) {
+            worker.join();
+        }
+    }
+
+    const int n_runs = n_files*params.n_repeat;
+
+    std::vector<bench_run> runs(n_runs);
+    std::atomic<int> i_next(0);
+
+    const auto t_start = std::chrono::high_resolution_clock::now();
+
+    {
+        std::vector<std::thread> workers;
+        for (auto * state : states) {
+            workers.emplace_back([&, state]() {
+                for (int i = i_next++; i < n_runs; i = i_next++) {
+                    auto & run = runs[i];
+
+                    run.f         = i % n_files;
+                    run.t_audio_s = float(pcmf32[run.f].size())/WHISPER_SAMPLE_RATE;
+
+                    const auto timings0 = whisper_get_timings_from_state(state);
+                    const auto t_run    = std::chrono::high_resolution_clock::now();
+
+                    run.ok = whisper_full_with_state(ctx, state, wparams, pcmf32[run.f].data(), pcmf32[run.f].size()) == 0;
+
+                    run.t_wall_ms = bench_elapsed_ms(t_run);
+                    run.timings   = bench_timings_add(whisper_get_timings_from_state(state), timings0, -1);
+
+                    const int n_segments = whisper_full_n_segments_from_state(state);
+                    for (int s = 0; s < n_segments; ++s) {
+                        run.n_tokens += whisper_full_n_tokens_from_state(state, s);
+                    }
+                }
+            });
+        }
+        for (auto & worker : workers) {
+            worker.join();
+        }
+    }
+
+    const float t_wall_s = bench_elapsed_ms(t_start)/1000.0f;
+
+    // aggregate
+    int   n_failed  = 0;
+    int   n_tokens  = 0;
+    float t_audio_s = 0.0f;
+
+    whisper_timings total = {};
+
+    std::vector<float> latency;
+    std::vector<float> rtf;
+
+    for (const auto & run : runs) {
+        if (!run.ok) {
+            n_failed++;
+            continue;
+        }
+
+        n_tokens  += run.n_tokens;
+        t_audio_s += run.t_audio_s;
+
+        total = bench_timings_add(total, run.timings, 1);
+
+        latency.push_back(run.t_wall_ms);
+        rtf.push_back(run.t_wall_ms/1000.0f/std::max(run.t_audio_s, 1e-3f));
+    }
+
+    std::sort(latency.begin(), latency.end());
+    std::sort(rtf.begin(), rtf.end());
+
+    const float rtf_total = t_wall_s/std::max(t_audio_s, 1e-3f);
+
+    fprintf(stderr, "\n");
+    fprintf(stderr, "%s:      runs = %5d (%d failed), %.1f sec of audio in %.2f sec\n", __func__, n_runs, n_failed, t_audio_s, t_wall_s);
+    fprintf(stderr, "%s:       rtf = %8.4f (%.1fx real time)\n", __func__, rtf_total, 1.0f/std::max(rtf_total, 1e-6f));
+    fprintf(stderr, "%s:  tokens/s = %8.2f (%d tokens)\n", __func__, n_tokens/std::max(t_wall_s, 1e-6f), n_tokens);
+    fprintf(stderr, "%s:   latency = p50 %8.2f ms, p95 %8.2f ms, p99 %8.2f ms\n", __func__,
+            bench_percentile(latency, 50), bench_percentile(latency, 95), bench_percentile(latency, 99));
+    fprintf(stderr, "%s:   run rtf = p50 %8.4f, p95 %8.4f, p99 %8.4f\n", __func__,
+            bench_percentile(rtf, 50), bench_percentile(rtf, 95), bench_percentile(rtf, 99));
+    fprintf(stderr, "%s: fallbacks = %3d p / %3d h\n", __func__, total.n_fail_p, total.n_fail_h);
+    fprintf(stderr, "%s:       mel = %10.2f ms\n",                       __func__, total.t_mel_us/1000.0f);
+    fprintf(stderr, "%s:    encode = %10.2f ms / %5d runs\n",            __func__, total.t_encode_us/1000.0f, total.n_encode);
+    fprintf(stderr, "%s:     cross = %10.2f ms / %5d runs\n",            __func__, total.t_cross_us/1000.0f,  total.n_encode);
+    fprintf(stderr, "%s:    prompt = %10.2f ms / %5d runs\n",            __func__, total.t_prompt_us/1000.0f, total.n_prompt);
+    fprintf(stderr, "%s:    decode = %10.2f ms / %5d runs\n",            __func__, total.t_decode_us/1000.0f, total.n_decode);
+    fprintf(stderr, "%s:    sample = %10.2f ms / %5d runs\n",            __func__, total.t_sample_us/1000.0f, total.n_sample);
+
+    // memory of the model and of the largest state - a stream needs one state
+    const size_t mem_model = bench_memory_size(whisper_model_memory_usage, ctx);
+
+    size_t mem_state = 0;
+    for (auto * state : states) {
+        mem_state = std::max(mem_state, bench_memory_size(whisper_state_memory_usage, state));
+    }
+
+    whisper_print_memory_usage(ctx, states[0]);
+
+    fprintf(stderr, "\n");
+    fprintf(stderr, "%s:    memory = %8.2f MB model + %8.2f MB per state\n", __func__, mem_model/1024.0/1024.0, mem_state/1024.0/1024.0);
+    fprintf(stderr, "\n");
+
+    if (!params.fname_json.empty()) {
+        FILE * fout = fopen(params.fname_json.c_str(), "w");
+        if (fout == nullptr) {
+            fprintf(stderr, "error: failed to open '%s' for writing\n", params.fname_json.c_str());
+            return 6;
+        }
+
+        const auto stages = [&](const whisper_timings & t) {
+            fprintf(fout, "\"mel_ms\": %.3f, \"encode_ms\": %.3f, \"cross_ms\": %.3f, \"prompt_ms\": %.3f, \"decode_ms\": %.3f, \"sample_ms\": %.3f, "
+                          "\"n_encode\": %d, \"n_prompt\": %d, \"n_decode\": %d, \"n_sample\": %d, \"n_fail_p\": %d, \"n_fail_h\": %d, "
+                          "\"n_enc_hit\": %d, \"n_window\": %d, \"n_window_tokens\": %d",
+                    t.t_mel_us/1000.0, t.t_encode_us/1000.0, t.t_cross_us/1000.0, t.t_prompt_us/1000.0, t.t_decode_us/1000.0, t.t_sample_us/1000.0,
+                    t.n_encode, t.n_prompt, t.n_decode, t.n_sample, t.n_fail_p, t.n_fail_h,
+                    t.n_enc_hit, t.n_window, t.n_window_tokens);
+        };
+
+        fprintf(fout, "{\n");
+        fprintf(fout, "  \"system_info\": \"%s\",\n", bench_json_escape(whisper_print_system_info()).c_str());
+        fprintf(fout, "  \"model\": \"%s\",\n", bench_json_escape(params.model).c_str());
+        fprintf(fout, "  \"params\": { \"n_threads\": %d, \"n_states\": %d, \"n_repeat\": %d, \"strategy\": \"%s\", \"beam_size\": %d, \"best_of\": %d, \"fallback\": %s, \"language\": \"%s\" },\n",
+                params.n_threads, params.n_states, params.n_repeat, params.beam_size > 1 ? "beam_search" : "greedy",
+                params.beam_size, params.best_of, params.no_fallback ? "false" : "true", bench_json_escape(params.language).c_str());
+        fprintf(fout, "  \"n_runs\": %d,\n", n_runs);
+        fprintf(fout, "  \"n_failed\": %d,\n", n_failed);
+        fprintf(fout, "  \"audio_s\": %.3f,\n", t_audio_s);
+        fprintf(fout, "  \"wall_s\": %.3f,\n", t_wall_s);
+        fprintf(fout, "  \"rtf\": %.5f,\n", rtf_total);
+        fprintf(fout, "  \"tokens\": %d,\n", n_tokens);
+        fprintf(fout, "  \"tokens_per_s\": %.3f,\n", n_tokens/std::max(t_wall_s, 1e-6f));
+        fprintf(fout, "  \"latency_ms\": { \"p50\": %.3f, \"p95\": %.3f, \"p99\": %.3f },\n",
+                bench_percentile(latency, 50), bench_percentile(latency, 95), bench_percentile(latency, 99));
+        fprintf(fout, "  \"run_rtf\": { \"p50\": %.5f, \"p95\": %.5f, \"p99\": %.5f },\n",
+                bench_percentile(rtf, 50), bench_percentile(rtf, 95), bench_percentile(rtf, 99));
+        fprintf(fout, "  \"memory_mb\": { \"model\": %.3f, \"state\": %.3f },\n", mem_model/1024.0/1024.0, mem_state/1024.0/1024.0);
+        fprintf(fout, "  \"stages\": { ");
+        stages(total);
+        fprintf(fout, " },\n");
+        fprintf(fout, "  \"runs\": [\n");
+        for (int i = 0; i < n_runs; ++i) {
+            const auto & run = runs[i];
+            fprintf(fout, "    { \"file\": \"%s\", \"ok\": %s, \"audio_s\": %.3f, \"wall_ms\": %.3f, \"tokens\": %d, ",
+                    bench_json_escape(params.fname_inp[run.f]).c_str(), run.ok ? "true" : "false", run.t_audio_s, run.t_wall_ms, run.n_tokens);
+            stages(run.timings);
+            fprintf(fout, " }%s\n", i + 1 < n_runs ? "," : "");
+        }
+        fprintf(fout, "  ]\n");
+        fprintf(fout, "}\n");
+
+        fclose(fout);
+
+        fprintf(stderr, "%s: results written to '%s'\n", __func__, params.fname_json.c_str());
+    }
+
+    for (auto * state : states) {
+        whisper_free_state(state);
+    }
+    whisper_free(ctx);
+
+    return n_failed > 0 ? 10 : 0;
+}
+
 int main(int argc, char ** argv) {
     whisper_params params;
 
@@ -153,6 +511,7 @@ int main(int argc, char ** argv) {
         case 0: ret = whisper_bench_full(params);                break;
         case 1: ret = whisper_bench_memcpy(params.n_threads);       break;
         case 2: ret = whisper_bench_ggml_mul_mat(params.n_threads); break;
+        case 3: ret = whisper_bench_files(params);                  break;
         default: fprintf(stderr, "error: unknown benchmark: %d\n", params.what); break;
     }
 
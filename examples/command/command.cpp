@@ -11,6 +11,7 @@
 #include "whisper.h"
 #include "grammar-parser.h"
 
+#include <algorithm>
 #include <sstream>
 #include <cassert>
 #include <cstdio>
@@ -43,12 +44,14 @@ struct whisper_params {
 
     grammar_parser::parse_state grammar_parsed;
 
-    bool speed_up      = false;
-    bool translate     = false;
-    bool print_special = false;
-    bool print_energy  = false;
-    bool no_timestamps = true;
-    bool use_gpu       = true;
+    bool speed_up       = false;
+    bool audio_ctx_auto = false;
+    bool translate      = false;
+    bool print_special  = false;
+    bool print_energy   = false;
+    bool no_timestamps  = true;
+    bool use_gpu        = true;
+    bool score_phrases  = false;
 
     std::string language  = "en";
     std::string model     = "models/ggml-base.en.bin";
@@ -77,11 +80,13 @@ bool whisper_params_parse(int argc, char ** argv, whisper_params & params) {
         else if (arg == "-ac"  || arg == "--audio-ctx")     { params.audio_ctx     = std::stoi(argv[++i]); }
         else if (arg == "-vth" || arg == "--vad-thold")     { params.vad_thold     = std::stof(argv[++i]); }
         else if (arg == "-fth" || arg == "--freq-thold")    { params.freq_thold    = std::stof(argv[++i]); }
+        else if (arg == "-aca" || arg == "--audio-ctx-auto") { params.audio_ctx_auto = true; }
         else if (arg == "-su"  || arg == "--speed-up")      { params.speed_up      = true; }
         else if (arg == "-tr"  || arg == "--translate")     { params.translate     = true; }
         else if (arg == "-ps"  || arg == "--print-special") { params.print_special = true; }
         else if (arg == "-pe"  || arg == "--print-energy")  { params.print_energy  = true; }
         else if (arg == "-ng"  || arg == "--no-gpu")        { params.use_gpu       = false; }
+        else if (arg == "-sp"  || arg == "--score-phrases") { params.score_phrases = true; }
         else if (arg == "-l"   || arg == "--language")      { params.language      = argv[++i]; }
         else if (arg == "-m"   || arg == "--model")         { params.model         = argv[++i]; }
         else if (arg == "-f"   || arg == "--file")          { params.fname_out     = argv[++i]; }
@@ -114,11 +119,13 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "  -ac N,      --audio-ctx N    [%-7d] audio context size (0 - all)\n",                params.audio_ctx);
     fprintf(stderr, "  -vth N,     --vad-thold N    [%-7.2f] voice activity detection threshold\n",        params.vad_thold);
     fprintf(stderr, "  -fth N,     --freq-thold N   [%-7.2f] high-pass frequency cutoff\n",                params.freq_thold);
+    fprintf(stderr, "  -aca,       --audio-ctx-auto [%-7s] size the audio context to the recorded audio\n", params.audio_ctx_auto ? "true" : "false");
     fprintf(stderr, "  -su,        --speed-up       [%-7s] speed up audio by x2 (reduced accuracy)\n",     params.speed_up ? "true" : "false");
     fprintf(stderr, "  -tr,        --translate      [%-7s] translate from source language to english\n",   params.translate ? "true" : "false");
     fprintf(stderr, "  -ps,        --print-special  [%-7s] print special tokens\n",                        params.print_special ? "true" : "false");
     fprintf(stderr, "  -pe,        --print-energy   [%-7s] print sound energy (for debugging)\n",          params.print_energy ? "true" : "false");
     fprintf(stderr, "  -ng,        --no-gpu         [%-7s] disable GPU\n",                                 params.use_gpu ? "false" : "true");
+    fprintf(stderr, "  -sp,        --score-phrases  [%-7s] guided mode: score the complete commands\n",    params.score_phrases ? "true" : "false");
     fprintf(stderr, "  -l LANG,    --language LANG  [%-7s] spoken language\n",                             params.language.c_str());
     fprintf(stderr, "  -m FNAME,   --model FNAME    [%-7s] model path\n",                                  params.model.c_str());
     fprintf(stderr, "  -f FNAME,   --file FNAME     [%-7s] text output file name\n",                       params.fname_out.c_str());
@@ -161,8 +168,9 @@ std::string transcribe(
     wparams.language         = params.language.c_str();
     wparams.n_threads        = params.n_threads;
 
-    wparams.audio_ctx = params.audio_ctx;
-    wparams.speed_up  = params.speed_up;
+    wparams.audio_ctx      = params.audio_ctx;
+    wparams.audio_ctx_auto = params.audio_ctx_auto;
+    wparams.speed_up       = params.speed_up;
 
     wparams.temperature     = 0.4f;
     wparams.temperature_inc = 1.0f;
@@ -289,6 +297,12 @@ int process_command_list(struct whisper_context * ctx, audio_async &audio, const
         max_len = std::max(max_len, (int) cmd.size());
     }
 
+    // the decoder only needs the logits of the command tokens
+    std::vector<whisper_token> allowed_vocab;
+    for (const auto & tokens : allowed_tokens) {
+        allowed_vocab.insert(allowed_vocab.end(), tokens.begin(), tokens.end());
+    }
+
     fprintf(stderr, "%s: allowed commands [ tokens ]:\n", __func__);
     fprintf(stderr, "\n");
     for (int i = 0; i < (int) allowed_commands.size(); ++i) {
@@ -352,6 +366,59 @@ int process_command_list(struct whisper_context * ctx, audio_async &audio, const
 
             const auto t_start = std::chrono::high_resolution_clock::now();
 
+            // score the complete commands instead of their first token
+            if (params.score_phrases) {
+                std::vector<const char *> phrases;
+                for (const auto & cmd : allowed_commands) {
+                    phrases.push_back(cmd.c_str());
+                }
+
+                std::vector<float> scores(phrases.size());
+
+                if (whisper_pcm_to_mel(ctx, pcmf32_cur.data(), pcmf32_cur.size(), params.n_threads) != 0 ||
+                    whisper_score_phrases(ctx, params.language.c_str(), k_tokens.data(), k_tokens.size(),
+                        phrases.data(), phrases.size(), 0, params.n_threads, scores.data()) != 0) {
+                    fprintf(stderr, "%s: ERROR: whisper_score_phrases() failed\n", __func__);
+                    break;
+                }
+
+                // softmax over the commands
+                const float max = *std::max_element(scores.begin(), scores.end());
+
+                std::vector<std::pair<float, int>> probs_id;
+
+                double psum = 0.0;
+                for (int i = 0; i < (int) scores.size(); ++i) {
+                    probs_id.emplace_back(expf(scores[i] - max), i);
+                    psum += probs_id.back().first;
+                }
+
+                for (auto & p : probs_id) {
+                    p.first /= psum;
+                }
+
+                std::sort(probs_id.begin(), probs_id.end(), [](const std::pair<float, int> & a, const std::pair<float, int> & b) {
+                    return a.first > b.first;
+                });
+
+                fprintf(stdout, "\n");
+                for (const auto & cmd : probs_id) {
+                    fprintf(stdout, "%s: %s%-*s%s = %f | log p = %f\n", __func__, "\033[1m", max_len, allowed_commands[cmd.second].c_str(), "\033[0m", cmd.first, scores[cmd.second]);
+                }
+
+                const auto t_end = std::chrono::high_resolution_clock::now();
+
+                fprintf(stdout, "\n");
+                fprintf(stdout, "%s: detected command: %s%s%s | p = %f | t = %d ms\n", __func__,
+                        "\033[1m", allowed_commands[probs_id[0].second].c_str(), "\033[0m", probs_id[0].first,
+                        (int) std::chrono::duration_cast<std::chrono::milliseconds>(t_end - t_start).count());
+                fprintf(stdout, "\n");
+
+                audio.clear();
+
+                continue;
+            }
+
             whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
 
             wparams.print_progress   = false;
@@ -366,11 +433,15 @@ int process_command_list(struct whisper_context * ctx, audio_async &audio, const
             wparams.n_threads        = params.n_threads;
 
             wparams.audio_ctx        = params.audio_ctx;
+            wparams.audio_ctx_auto   = params.audio_ctx_auto;
             wparams.speed_up         = params.speed_up;
 
             wparams.prompt_tokens    = k_tokens.data();
             wparams.prompt_n_tokens  = k_tokens.size();
 
+            wparams.vocab_tokens     = allowed_vocab.data();
+            wparams.vocab_n_tokens   = allowed_vocab.size();
+
             // run the transformer and a single decoding pass
             if (whisper_full(ctx, wparams, pcmf32_cur.data(), pcmf32_cur.size()) != 0) {
                 fprintf(stderr, "%s: ERROR: whisper_full() failed\n", __func__);
@@ -693,7 +764,7 @@ int main(int argc, char ** argv) {
 
     // whisper init
 
-    struct whisper_context_params cparams;
+    struct whisper_context_params cparams = whisper_context_default_params();
     cparams.use_gpu = params.use_gpu;
 
     struct whisper_context * ctx = whisper_init_from_file_with_params(params.model.c_str(), cparams);
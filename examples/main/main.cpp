@@ -2,9 +2,15 @@
 
 #include "whisper.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
+#include <condition_variable>
+#include <deque>
 #include <fstream>
 #include <cstdio>
+#include <mutex>
 #include <string>
 #include <thread>
 #include <vector>
@@ -56,6 +62,14 @@ void replace_all(std::string & s, const std::string & search, const std::string
 struct whisper_params {
     int32_t n_threads    = std::min(4, (int32_t) std::thread::hardware_concurrency());
     int32_t n_processors =  1;
+    int32_t n_files_parallel = 1;
+    int32_t n_threads_enc_next = 0;
+    int32_t n_threads_encode   = 0;
+    int32_t n_threads_decode   = 0;
+    int32_t n_threads_mel      = 0;
+    int32_t numa_node          = 0;
+    int32_t fallback_parallel  = 0;
+    int32_t fallback_threads   = 1;
     int32_t offset_t_ms  =  0;
     int32_t offset_n     =  0;
     int32_t duration_ms  =  0;
@@ -64,19 +78,24 @@ struct whisper_params {
     int32_t max_len      =  0;
     int32_t best_of      =  2;
     int32_t beam_size    = -1;
+    int32_t draft_ngram  =  0;
+    int32_t detect_audio_ctx = 0;
 
+    float beam_patience = -1.00f;
     float word_thold    =  0.01f;
     float entropy_thold =  2.40f;
     float logprob_thold = -1.00f;
 
     bool speed_up        = false;
     bool debug_mode      = false;
+    bool audio_ctx_auto  = false;
     bool translate       = false;
     bool detect_language = false;
     bool diarize         = false;
     bool tinydiarize     = false;
     bool split_on_word   = false;
     bool no_fallback     = false;
+    bool loop_detect     = false;
     bool output_txt      = false;
     bool output_vtt      = false;
     bool output_srt      = false;
@@ -91,11 +110,18 @@ struct whisper_params {
     bool no_timestamps   = false;
     bool log_score       = false;
     bool use_gpu         = true;
+    bool autotune        = false;
+    bool cpu_pin         = false;
+
+    whisper_numa_strategy numa = WHISPER_NUMA_STRATEGY_DISABLED;
 
     std::string language  = "en";
     std::string prompt;
     std::string font_path = "/System/Library/Fonts/Supplemental/Courier New Bold.ttf";
     std::string model     = "models/ggml-base.en.bin";
+    std::string model_draft;
+    std::string fname_profile;
+    std::string fname_autotune;
 
     // [TDRZ] speaker turn string
     std::string tdrz_speaker_turn = " [SPEAKER_TURN]"; // TODO: set from command line
@@ -104,8 +130,45 @@ struct whisper_params {
 
     std::vector<std::string> fname_inp = {};
     std::vector<std::string> fname_out = {};
+
+    std::vector<int> cpus;
 };
 
+// e.g. "0-7,16-23"
+static std::vector<int> parse_cpu_list(const std::string & list) {
+    std::vector<int> result;
+
+    size_t pos = 0;
+    while (pos < list.size()) {
+        size_t end = list.find(',', pos);
+        if (end == std::string::npos) {
+            end = list.size();
+        }
+
+        const std::string range = list.substr(pos, end - pos);
+        const size_t dash = range.find('-');
+
+        const int first = std::stoi(range.substr(0, dash));
+        const int last  = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+
+        for (int cpu = first; cpu <= last; ++cpu) {
+            result.push_back(cpu);
+        }
+
+        pos = end + 1;
+    }
+
+    return result;
+}
+
+static whisper_numa_strategy parse_numa_strategy(const std::string & name) {
+    if (name == "node")       { return WHISPER_NUMA_STRATEGY_NODE; }
+    if (name == "interleave") { return WHISPER_NUMA_STRATEGY_INTERLEAVE; }
+    if (name == "replicate")  { return WHISPER_NUMA_STRATEGY_REPLICATE; }
+
+    return WHISPER_NUMA_STRATEGY_DISABLED;
+}
+
 void whisper_print_usage(int argc, char ** argv, const whisper_params & params);
 
 bool whisper_params_parse(int argc, char ** argv, whisper_params & params) {
@@ -127,7 +190,18 @@ bool whisper_params_parse(int argc, char ** argv, whisper_params & params) {
             exit(0);
         }
         else if (arg == "-t"    || arg == "--threads")         { params.n_threads       = std::stoi(argv[++i]); }
+        else if (arg == "-ten"  || arg == "--threads-enc-next"){ params.n_threads_enc_next = std::stoi(argv[++i]); }
+        else if (arg == "-tenc" || arg == "--threads-encode")  { params.n_threads_encode = std::stoi(argv[++i]); }
+        else if (arg == "-tdec" || arg == "--threads-decode")  { params.n_threads_decode = std::stoi(argv[++i]); }
+        else if (arg == "-tmel" || arg == "--threads-mel")     { params.n_threads_mel    = std::stoi(argv[++i]); }
+        else if (arg == "-at"   || arg == "--autotune")        { params.autotune         = true; }
+        else if (arg == "-atc"  || arg == "--autotune-cache")  { params.fname_autotune   = argv[++i]; params.autotune = true; }
+        else if (                  arg == "--numa")            { params.numa             = parse_numa_strategy(argv[++i]); }
+        else if (arg == "-nn"   || arg == "--numa-node")       { params.numa_node        = std::stoi(argv[++i]); }
+        else if (                  arg == "--cpus")            { params.cpus             = parse_cpu_list(argv[++i]); }
+        else if (                  arg == "--cpu-pin")         { params.cpu_pin          = true; }
         else if (arg == "-p"    || arg == "--processors")      { params.n_processors    = std::stoi(argv[++i]); }
+        else if (arg == "-pf"   || arg == "--parallel-files")  { params.n_files_parallel = std::stoi(argv[++i]); }
         else if (arg == "-ot"   || arg == "--offset-t")        { params.offset_t_ms     = std::stoi(argv[++i]); }
         else if (arg == "-on"   || arg == "--offset-n")        { params.offset_n        = std::stoi(argv[++i]); }
         else if (arg == "-d"    || arg == "--duration")        { params.duration_ms     = std::stoi(argv[++i]); }
@@ -135,11 +209,17 @@ bool whisper_params_parse(int argc, char ** argv, whisper_params & params) {
         else if (arg == "-ml"   || arg == "--max-len")         { params.max_len         = std::stoi(argv[++i]); }
         else if (arg == "-bo"   || arg == "--best-of")         { params.best_of         = std::stoi(argv[++i]); }
         else if (arg == "-bs"   || arg == "--beam-size")       { params.beam_size       = std::stoi(argv[++i]); }
+        else if (arg == "-bp"   || arg == "--beam-patience")   { params.beam_patience   = std::stof(argv[++i]); }
+        else if (arg == "-dng"  || arg == "--draft-ngram")     { params.draft_ngram     = std::stoi(argv[++i]); }
         else if (arg == "-wt"   || arg == "--word-thold")      { params.word_thold      = std::stof(argv[++i]); }
         else if (arg == "-et"   || arg == "--entropy-thold")   { params.entropy_thold   = std::stof(argv[++i]); }
         else if (arg == "-lpt"  || arg == "--logprob-thold")   { params.logprob_thold   = std::stof(argv[++i]); }
+        else if (arg == "-fbp"  || arg == "--fallback-parallel"){ params.fallback_parallel = std::stoi(argv[++i]); }
+        else if (arg == "-fbt"  || arg == "--fallback-threads"){ params.fallback_threads = std::stoi(argv[++i]); }
+        else if (arg == "-ld"   || arg == "--loop-detect")     { params.loop_detect     = true; }
         // else if (arg == "-su"   || arg == "--speed-up")        { params.speed_up        = true; }
         else if (arg == "-debug"|| arg == "--debug-mode")      { params.debug_mode      = true; }
+        else if (arg == "-aca"  || arg == "--audio-ctx-auto")  { params.audio_ctx_auto  = true; }
         else if (arg == "-tr"   || arg == "--translate")       { params.translate       = true; }
         else if (arg == "-di"   || arg == "--diarize")         { params.diarize         = true; }
         else if (arg == "-tdrz" || arg == "--tinydiarize")     { params.tinydiarize     = true; }
@@ -161,12 +241,15 @@ bool whisper_params_parse(int argc, char ** argv, whisper_params & params) {
         else if (arg == "-nt"   || arg == "--no-timestamps")   { params.no_timestamps   = true; }
         else if (arg == "-l"    || arg == "--language")        { params.language        = argv[++i]; }
         else if (arg == "-dl"   || arg == "--detect-language") { params.detect_language = true; }
+        else if (arg == "-dac"  || arg == "--detect-audio-ctx"){ params.detect_audio_ctx = std::stoi(argv[++i]); }
         else if (                  arg == "--prompt")          { params.prompt          = argv[++i]; }
         else if (arg == "-m"    || arg == "--model")           { params.model           = argv[++i]; }
+        else if (arg == "-md"   || arg == "--model-draft")     { params.model_draft     = argv[++i]; }
         else if (arg == "-f"    || arg == "--file")            { params.fname_inp.emplace_back(argv[++i]); }
         else if (arg == "-oved" || arg == "--ov-e-device")     { params.openvino_encode_device = argv[++i]; }
         else if (arg == "-ls"   || arg == "--log-score")       { params.log_score = true; }
         else if (arg == "-ng"   || arg == "--no-gpu")          { params.use_gpu = false; }
+        else if (arg == "-prof" || arg == "--profile")         { params.fname_profile   = argv[++i]; }
         else {
             fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
             whisper_print_usage(argc, argv, params);
@@ -184,7 +267,18 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "options:\n");
     fprintf(stderr, "  -h,        --help              [default] show this help message and exit\n");
     fprintf(stderr, "  -t N,      --threads N         [%-7d] number of threads to use during computation\n",    params.n_threads);
+    fprintf(stderr, "  -ten N,    --threads-enc-next N[%-7d] threads encoding the next window while decoding\n", params.n_threads_enc_next);
+    fprintf(stderr, "  -tenc N,   --threads-encode N  [%-7d] threads for the encoder (0 - same as -t)\n",             params.n_threads_encode);
+    fprintf(stderr, "  -tdec N,   --threads-decode N  [%-7d] threads for the decoder (0 - same as -t)\n",             params.n_threads_decode);
+    fprintf(stderr, "  -tmel N,   --threads-mel N     [%-7d] threads for the mel spectrogram (0 - same as -t)\n",     params.n_threads_mel);
+    fprintf(stderr, "  -at,       --autotune          [%-7s] benchmark the thread counts up to -t before processing\n", params.autotune ? "true" : "false");
+    fprintf(stderr, "  -atc FNAME, --autotune-cache FNAME [%-7s] autotune and cache the thread counts in a file\n", params.fname_autotune.c_str());
+    fprintf(stderr, "             --numa MODE         [%-7s] NUMA placement of the weights: disabled, node, interleave, replicate\n", "");
+    fprintf(stderr, "  -nn N,     --numa-node N       [%-7d] NUMA node of the weights and of the computation\n", params.numa_node);
+    fprintf(stderr, "             --cpus LIST         [%-7s] CPUs of the computation, e.g. 0-7,16-23\n",     "");
+    fprintf(stderr, "             --cpu-pin           [%-7s] pin each compute thread to one of the --cpus\n", params.cpu_pin ? "true" : "false");
     fprintf(stderr, "  -p N,      --processors N      [%-7d] number of processors to use during computation\n", params.n_processors);
+    fprintf(stderr, "  -pf N,     --parallel-files N  [%-7d] number of files to process concurrently\n",       params.n_files_parallel);
     fprintf(stderr, "  -ot N,     --offset-t N        [%-7d] time offset in milliseconds\n",                    params.offset_t_ms);
     fprintf(stderr, "  -on N,     --offset-n N        [%-7d] segment index offset\n",                           params.offset_n);
     fprintf(stderr, "  -d  N,     --duration N        [%-7d] duration of audio to process in milliseconds\n",   params.duration_ms);
@@ -193,11 +287,17 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "  -sow,      --split-on-word     [%-7s] split on word rather than on token\n",             params.split_on_word ? "true" : "false");
     fprintf(stderr, "  -bo N,     --best-of N         [%-7d] number of best candidates to keep\n",              params.best_of);
     fprintf(stderr, "  -bs N,     --beam-size N       [%-7d] beam size for beam search\n",                      params.beam_size);
+    fprintf(stderr, "  -bp N,     --beam-patience N   [%-7.2f] beam search patience (<= 0: run all beams)\n",    params.beam_patience);
+    fprintf(stderr, "  -dng N,    --draft-ngram N     [%-7d] draft tokens by n-gram lookup in the context (0 - off)\n", params.draft_ngram);
     fprintf(stderr, "  -wt N,     --word-thold N      [%-7.2f] word timestamp probability threshold\n",         params.word_thold);
     fprintf(stderr, "  -et N,     --entropy-thold N   [%-7.2f] entropy threshold for decoder fail\n",           params.entropy_thold);
     fprintf(stderr, "  -lpt N,    --logprob-thold N   [%-7.2f] log probability threshold for decoder fail\n",   params.logprob_thold);
+    fprintf(stderr, "  -fbp N,    --fallback-parallel N [%-5d] fallback temperatures decoded concurrently\n", params.fallback_parallel);
+    fprintf(stderr, "  -fbt N,    --fallback-threads N [%-6d] threads per concurrent fallback decode\n",     params.fallback_threads);
+    fprintf(stderr, "  -ld,       --loop-detect       [%-7s] fail repetition loops as soon as they are detected\n", params.loop_detect ? "true" : "false");
     // fprintf(stderr, "  -su,       --speed-up          [%-7s] speed up audio by x2 (reduced accuracy)\n",        params.speed_up ? "true" : "false");
     fprintf(stderr, "  -debug,    --debug-mode        [%-7s] enable debug mode (eg. dump log_mel)\n",           params.debug_mode ? "true" : "false");
+    fprintf(stderr, "  -aca,      --audio-ctx-auto    [%-7s] size the encoder context to the audio (short clips)\n", params.audio_ctx_auto ? "true" : "false");
     fprintf(stderr, "  -tr,       --translate         [%-7s] translate from source language to english\n",      params.translate ? "true" : "false");
     fprintf(stderr, "  -di,       --diarize           [%-7s] stereo audio diarization\n",                       params.diarize ? "true" : "false");
     fprintf(stderr, "  -tdrz,     --tinydiarize       [%-7s] enable tinydiarize (requires a tdrz model)\n",     params.tinydiarize ? "true" : "false");
@@ -218,12 +318,15 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "  -nt,       --no-timestamps     [%-7s] do not print timestamps\n",                        params.no_timestamps ? "true" : "false");
     fprintf(stderr, "  -l LANG,   --language LANG     [%-7s] spoken language ('auto' for auto-detect)\n",       params.language.c_str());
     fprintf(stderr, "  -dl,       --detect-language   [%-7s] exit after automatically detecting language\n",    params.detect_language ? "true" : "false");
+    fprintf(stderr, "  -dac N,    --detect-audio-ctx N [%-7d] audio context for language detection (0 - same as transcription)\n", params.detect_audio_ctx);
     fprintf(stderr, "             --prompt PROMPT     [%-7s] initial prompt\n",                                 params.prompt.c_str());
     fprintf(stderr, "  -m FNAME,  --model FNAME       [%-7s] model path\n",                                     params.model.c_str());
+    fprintf(stderr, "  -md FNAME, --model-draft FNAME [%-7s] draft model path for speculative decoding\n",      params.model_draft.c_str());
     fprintf(stderr, "  -f FNAME,  --file FNAME        [%-7s] input WAV file path\n",                            "");
     fprintf(stderr, "  -oved D,   --ov-e-device DNAME [%-7s] the OpenVINO device used for encode inference\n",  params.openvino_encode_device.c_str());
     fprintf(stderr, "  -ls,       --log-score         [%-7s] log best decoder scores of tokens\n",              params.log_score?"true":"false");
     fprintf(stderr, "  -ng,       --no-gpu            [%-7s] disable GPU\n",                                    params.use_gpu ? "false" : "true");
+    fprintf(stderr, "  -prof FNAME, --profile FNAME   [%-7s] profile the compute graphs and save a Chrome trace\n", params.fname_profile.c_str());
     fprintf(stderr, "\n");
 }
 
@@ -275,11 +378,11 @@ void whisper_print_progress_callback(struct whisper_context * /*ctx*/, struct wh
     }
 }
 
-void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper_state * /*state*/, int n_new, void * user_data) {
+void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper_state * state, int n_new, void * user_data) {
     const auto & params  = *((whisper_print_user_data *) user_data)->params;
     const auto & pcmf32s = *((whisper_print_user_data *) user_data)->pcmf32s;
 
-    const int n_segments = whisper_full_n_segments(ctx);
+    const int n_segments = whisper_full_n_segments_from_state(state);
 
     std::string speaker = "";
 
@@ -295,8 +398,8 @@ void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper
 
     for (int i = s0; i < n_segments; i++) {
         if (!params.no_timestamps || params.diarize) {
-            t0 = whisper_full_get_segment_t0(ctx, i);
-            t1 = whisper_full_get_segment_t1(ctx, i);
+            t0 = whisper_full_get_segment_t0_from_state(state, i);
+            t1 = whisper_full_get_segment_t1_from_state(state, i);
         }
 
         if (!params.no_timestamps) {
@@ -308,29 +411,29 @@ void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper
         }
 
         if (params.print_colors) {
-            for (int j = 0; j < whisper_full_n_tokens(ctx, i); ++j) {
+            for (int j = 0; j < whisper_full_n_tokens_from_state(state, i); ++j) {
                 if (params.print_special == false) {
-                    const whisper_token id = whisper_full_get_token_id(ctx, i, j);
+                    const whisper_token id = whisper_full_get_token_id_from_state(state, i, j);
                     if (id >= whisper_token_eot(ctx)) {
                         continue;
                     }
                 }
 
-                const char * text = whisper_full_get_token_text(ctx, i, j);
-                const float  p    = whisper_full_get_token_p   (ctx, i, j);
+                const char * text = whisper_full_get_token_text_from_state(ctx, state, i, j);
+                const float  p    = whisper_full_get_token_p_from_state(state, i, j);
 
                 const int col = std::max(0, std::min((int) k_colors.size() - 1, (int) (std::pow(p, 3)*float(k_colors.size()))));
 
                 printf("%s%s%s%s", speaker.c_str(), k_colors[col].c_str(), text, "\033[0m");
             }
         } else {
-            const char * text = whisper_full_get_segment_text(ctx, i);
+            const char * text = whisper_full_get_segment_text_from_state(state, i);
 
             printf("%s%s", speaker.c_str(), text);
         }
 
         if (params.tinydiarize) {
-            if (whisper_full_get_segment_speaker_turn_next(ctx, i)) {
+            if (whisper_full_get_segment_speaker_turn_next_from_state(state, i)) {
                 printf("%s", params.tdrz_speaker_turn.c_str());
             }
         }
@@ -344,7 +447,7 @@ void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper
     }
 }
 
-bool output_txt(struct whisper_context * ctx, const char * fname, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
+bool output_txt(struct whisper_context * /*ctx*/, struct whisper_state * state, const char * fname, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
     std::ofstream fout(fname);
     if (!fout.is_open()) {
         fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname);
@@ -353,15 +456,15 @@ bool output_txt(struct whisper_context * ctx, const char * fname, const whisper_
 
     fprintf(stderr, "%s: saving output to '%s'\n", __func__, fname);
 
-    const int n_segments = whisper_full_n_segments(ctx);
+    const int n_segments = whisper_full_n_segments_from_state(state);
     for (int i = 0; i < n_segments; ++i) {
-        const char * text = whisper_full_get_segment_text(ctx, i);
+        const char * text = whisper_full_get_segment_text_from_state(state, i);
         std::string speaker = "";
 
         if (params.diarize && pcmf32s.size() == 2)
         {
-            const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-            const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+            const int64_t t0 = whisper_full_get_segment_t0_from_state(state, i);
+            const int64_t t1 = whisper_full_get_segment_t1_from_state(state, i);
             speaker = estimate_diarization_speaker(pcmf32s, t0, t1);
         }
 
@@ -371,7 +474,7 @@ bool output_txt(struct whisper_context * ctx, const char * fname, const whisper_
     return true;
 }
 
-bool output_vtt(struct whisper_context * ctx, const char * fname, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
+bool output_vtt(struct whisper_context * /*ctx*/, struct whisper_state * state, const char * fname, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
     std::ofstream fout(fname);
     if (!fout.is_open()) {
         fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname);
@@ -382,11 +485,11 @@ bool output_vtt(struct whisper_context * ctx, const char * fname, const whisper_
 
     fout << "WEBVTT\n\n";
 
-    const int n_segments = whisper_full_n_segments(ctx);
+    const int n_segments = whisper_full_n_segments_from_state(state);
     for (int i = 0; i < n_segments; ++i) {
-        const char * text = whisper_full_get_segment_text(ctx, i);
-        const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-        const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+        const char * text = whisper_full_get_segment_text_from_state(state, i);
+        const int64_t t0 = whisper_full_get_segment_t0_from_state(state, i);
+        const int64_t t1 = whisper_full_get_segment_t1_from_state(state, i);
         std::string speaker = "";
 
         if (params.diarize && pcmf32s.size() == 2)
@@ -403,7 +506,7 @@ bool output_vtt(struct whisper_context * ctx, const char * fname, const whisper_
     return true;
 }
 
-bool output_srt(struct whisper_context * ctx, const char * fname, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
+bool output_srt(struct whisper_context * /*ctx*/, struct whisper_state * state, const char * fname, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
     std::ofstream fout(fname);
     if (!fout.is_open()) {
         fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname);
@@ -412,11 +515,11 @@ bool output_srt(struct whisper_context * ctx, const char * fname, const whisper_
 
     fprintf(stderr, "%s: saving output to '%s'\n", __func__, fname);
 
-    const int n_segments = whisper_full_n_segments(ctx);
+    const int n_segments = whisper_full_n_segments_from_state(state);
     for (int i = 0; i < n_segments; ++i) {
-        const char * text = whisper_full_get_segment_text(ctx, i);
-        const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-        const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+        const char * text = whisper_full_get_segment_text_from_state(state, i);
+        const int64_t t0 = whisper_full_get_segment_t0_from_state(state, i);
+        const int64_t t1 = whisper_full_get_segment_t1_from_state(state, i);
         std::string speaker = "";
 
         if (params.diarize && pcmf32s.size() == 2)
@@ -463,7 +566,7 @@ char *escape_double_quotes_and_backslashes(const char *str) {
     return escaped;
 }
 
-bool output_csv(struct whisper_context * ctx, const char * fname, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
+bool output_csv(struct whisper_context * /*ctx*/, struct whisper_state * state, const char * fname, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
     std::ofstream fout(fname);
     if (!fout.is_open()) {
         fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname);
@@ -472,7 +575,7 @@ bool output_csv(struct whisper_context * ctx, const char * fname, const whisper_
 
     fprintf(stderr, "%s: saving output to '%s'\n", __func__, fname);
 
-    const int n_segments = whisper_full_n_segments(ctx);
+    const int n_segments = whisper_full_n_segments_from_state(state);
     fout << "start,end,";
     if (params.diarize && pcmf32s.size() == 2)
     {
@@ -481,9 +584,9 @@ bool output_csv(struct whisper_context * ctx, const char * fname, const whisper_
     fout << "text\n";
 
     for (int i = 0; i < n_segments; ++i) {
-        const char * text = whisper_full_get_segment_text(ctx, i);
-        const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-        const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+        const char * text = whisper_full_get_segment_text_from_state(state, i);
+        const int64_t t0 = whisper_full_get_segment_t0_from_state(state, i);
+        const int64_t t1 = whisper_full_get_segment_t1_from_state(state, i);
         char * text_escaped = escape_double_quotes_and_backslashes(text);
 
         //need to multiply times returned from whisper_full_get_segment_t{0,1}() by 10 to get milliseconds.
@@ -498,18 +601,18 @@ bool output_csv(struct whisper_context * ctx, const char * fname, const whisper_
     return true;
 }
 
-bool output_score(struct whisper_context * ctx, const char * fname, const whisper_params & /*params*/, std::vector<std::vector<float>> /*pcmf32s*/) {
+bool output_score(struct whisper_context * ctx, struct whisper_state * state, const char * fname, const whisper_params & /*params*/, std::vector<std::vector<float>> /*pcmf32s*/) {
     std::ofstream fout(fname);
     fprintf(stderr, "%s: saving output to '%s'\n", __func__, fname);
 
-    const int n_segments = whisper_full_n_segments(ctx);
+    const int n_segments = whisper_full_n_segments_from_state(state);
     // fprintf(stderr,"segments: %d\n",n_segments);
     for (int i = 0; i < n_segments; ++i) {
-        const int n_tokens = whisper_full_n_tokens(ctx, i);
+        const int n_tokens = whisper_full_n_tokens_from_state(state, i);
         // fprintf(stderr,"tokens: %d\n",n_tokens);
         for (int j = 0; j < n_tokens; j++) {
-            auto token = whisper_full_get_token_text(ctx, i, j);
-            auto probability = whisper_full_get_token_p(ctx, i, j);
+            auto token = whisper_full_get_token_text_from_state(ctx, state, i, j);
+            auto probability = whisper_full_get_token_p_from_state(state, i, j);
             fout << token << '\t' << probability << std::endl;
             // fprintf(stderr,"token: %s %f\n",token,probability);
 	    }
@@ -519,6 +622,7 @@ bool output_score(struct whisper_context * ctx, const char * fname, const whispe
 
 bool output_json(
              struct whisper_context * ctx,
+               struct whisper_state * state,
                          const char * fname,
                const whisper_params & params,
     std::vector<std::vector<float>>   pcmf32s,
@@ -636,16 +740,16 @@ bool output_json(
             value_b("translate", params.translate, true);
         end_obj(false);
         start_obj("result");
-            value_s("language", whisper_lang_str(whisper_full_lang_id(ctx)), true);
+            value_s("language", whisper_lang_str(whisper_full_lang_id_from_state(state)), true);
         end_obj(false);
         start_arr("transcription");
 
-            const int n_segments = whisper_full_n_segments(ctx);
+            const int n_segments = whisper_full_n_segments_from_state(state);
             for (int i = 0; i < n_segments; ++i) {
-                const char * text = whisper_full_get_segment_text(ctx, i);
+                const char * text = whisper_full_get_segment_text_from_state(state, i);
 
-                const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-                const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+                const int64_t t0 = whisper_full_get_segment_t0_from_state(state, i);
+                const int64_t t1 = whisper_full_get_segment_t1_from_state(state, i);
 
                 start_obj(nullptr);
                     times_o(t0, t1, false);
@@ -653,9 +757,9 @@ bool output_json(
 
                     if (full) {
                         start_arr("tokens");
-                        const int n = whisper_full_n_tokens(ctx, i);
+                        const int n = whisper_full_n_tokens_from_state(state, i);
                         for (int j = 0; j < n; ++j) {
-                            auto token = whisper_full_get_token_data(ctx, i, j);
+                            auto token = whisper_full_get_token_data_from_state(state, i, j);
                             start_obj(nullptr);
                                 value_s("text", whisper_token_to_str(ctx, token.id), false);
                                 if(token.t0 > -1 && token.t1 > -1) {
@@ -674,7 +778,7 @@ bool output_json(
                     }
 
                     if (params.tinydiarize) {
-                        value_b("speaker_turn_next", whisper_full_get_segment_speaker_turn_next(ctx, i), true);
+                        value_b("speaker_turn_next", whisper_full_get_segment_speaker_turn_next_from_state(state, i), true);
                     }
                 end_obj(i == (n_segments - 1));
             }
@@ -687,7 +791,7 @@ bool output_json(
 // karaoke video generation
 // outputs a bash script that uses ffmpeg to generate a video with the subtitles
 // TODO: font parameter adjustments
-bool output_wts(struct whisper_context * ctx, const char * fname, const char * fname_inp, const whisper_params & params, float t_sec, std::vector<std::vector<float>> pcmf32s) {
+bool output_wts(struct whisper_context * ctx, struct whisper_state * state, const char * fname, const char * fname_inp, const whisper_params & params, float t_sec, std::vector<std::vector<float>> pcmf32s) {
     std::ofstream fout(fname);
 
     fprintf(stderr, "%s: saving output to '%s'\n", __func__, fname);
@@ -705,15 +809,15 @@ bool output_wts(struct whisper_context * ctx, const char * fname, const char * f
 
     fout << "ffmpeg -i " << fname_inp << " -f lavfi -i color=size=1200x120:duration=" << t_sec << ":rate=25:color=black -vf \"";
 
-    for (int i = 0; i < whisper_full_n_segments(ctx); i++) {
-        const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-        const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+    for (int i = 0; i < whisper_full_n_segments_from_state(state); i++) {
+        const int64_t t0 = whisper_full_get_segment_t0_from_state(state, i);
+        const int64_t t1 = whisper_full_get_segment_t1_from_state(state, i);
 
-        const int n = whisper_full_n_tokens(ctx, i);
+        const int n = whisper_full_n_tokens_from_state(state, i);
 
         std::vector<whisper_token_data> tokens(n);
         for (int j = 0; j < n; ++j) {
-            tokens[j] = whisper_full_get_token_data(ctx, i, j);
+            tokens[j] = whisper_full_get_token_data_from_state(state, i, j);
         }
 
         if (i > 0) {
@@ -812,7 +916,7 @@ bool output_wts(struct whisper_context * ctx, const char * fname, const char * f
     return true;
 }
 
-bool output_lrc(struct whisper_context * ctx, const char * fname, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
+bool output_lrc(struct whisper_context * /*ctx*/, struct whisper_state * state, const char * fname, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
     std::ofstream fout(fname);
     if (!fout.is_open()) {
         fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname);
@@ -823,10 +927,10 @@ bool output_lrc(struct whisper_context * ctx, const char * fname, const whisper_
 
     fout << "[by:whisper.cpp]\n";
 
-    const int n_segments = whisper_full_n_segments(ctx);
+    const int n_segments = whisper_full_n_segments_from_state(state);
     for (int i = 0; i < n_segments; ++i) {
-        const char * text = whisper_full_get_segment_text(ctx, i);
-        const int64_t t = whisper_full_get_segment_t0(ctx, i);
+        const char * text = whisper_full_get_segment_text_from_state(state, i);
+        const int64_t t = whisper_full_get_segment_t0_from_state(state, i);
 
         int64_t msec = t * 10;
         int64_t min = msec / (1000 * 60);
@@ -841,8 +945,8 @@ bool output_lrc(struct whisper_context * ctx, const char * fname, const whisper_
 
         if (params.diarize && pcmf32s.size() == 2)
         {
-            const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-            const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+            const int64_t t0 = whisper_full_get_segment_t0_from_state(state, i);
+            const int64_t t1 = whisper_full_get_segment_t1_from_state(state, i);
             speaker = estimate_diarization_speaker(pcmf32s, t0, t1);
         }
 
@@ -852,6 +956,376 @@ bool output_lrc(struct whisper_context * ctx, const char * fname, const whisper_
     return true;
 }
 
+// whisper_full_params for the command-line parameters
+// note: the returned params reference the strings in 'params'
+whisper_full_params make_full_params(const whisper_params & params, struct whisper_context * ctx_draft) {
+    whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+
+    wparams.strategy = params.beam_size > 1 ? WHISPER_SAMPLING_BEAM_SEARCH : WHISPER_SAMPLING_GREEDY;
+
+    wparams.print_realtime   = false;
+    wparams.print_progress   = params.print_progress;
+    wparams.print_timestamps = !params.no_timestamps;
+    wparams.print_special    = params.print_special;
+    wparams.translate        = params.translate;
+    wparams.language         = params.language.c_str();
+    wparams.detect_language  = params.detect_language;
+    wparams.detect_audio_ctx = params.detect_audio_ctx;
+    wparams.n_threads        = params.n_threads;
+    wparams.n_threads_encode_next = params.n_threads_enc_next;
+    wparams.n_threads_encode = params.n_threads_encode;
+    wparams.n_threads_decode = params.n_threads_decode;
+    wparams.n_threads_mel    = params.n_threads_mel;
+    wparams.n_max_text_ctx   = params.max_context >= 0 ? params.max_context : wparams.n_max_text_ctx;
+    wparams.offset_ms        = params.offset_t_ms;
+    wparams.duration_ms      = params.duration_ms;
+
+    wparams.token_timestamps = params.output_wts || params.output_jsn_full || params.max_len > 0;
+    wparams.thold_pt         = params.word_thold;
+    wparams.max_len          = params.output_wts && params.max_len == 0 ? 60 : params.max_len;
+    wparams.split_on_word    = params.split_on_word;
+
+    wparams.speed_up         = params.speed_up;
+    wparams.debug_mode       = params.debug_mode;
+    wparams.audio_ctx_auto   = params.audio_ctx_auto;
+
+    wparams.tdrz_enable      = params.tinydiarize; // [TDRZ]
+
+    wparams.draft_ctx        = ctx_draft;
+    wparams.draft_ngram      = params.draft_ngram;
+
+    wparams.initial_prompt   = params.prompt.c_str();
+
+    wparams.greedy.best_of        = params.best_of;
+    wparams.beam_search.beam_size = params.beam_size;
+    wparams.beam_search.patience  = params.beam_patience;
+
+    wparams.temperature_inc  = params.no_fallback ? 0.0f : wparams.temperature_inc;
+    wparams.entropy_thold    = params.entropy_thold;
+    wparams.logprob_thold    = params.logprob_thold;
+
+    wparams.n_fallback_parallel = params.fallback_parallel;
+    wparams.n_threads_fallback  = params.fallback_threads;
+    wparams.loop_detect         = params.loop_detect;
+
+    return wparams;
+}
+
+// write the results stored in 'state' to all requested output files
+void output_all(
+             struct whisper_context * ctx,
+               struct whisper_state * state,
+               const whisper_params & params,
+                  const std::string & fname_inp,
+                  const std::string & fname_out,
+             const std::vector<float> & pcmf32,
+    const std::vector<std::vector<float>> & pcmf32s) {
+    // output to text file
+    if (params.output_txt) {
+        const auto fname_txt = fname_out + ".txt";
+        output_txt(ctx, state, fname_txt.c_str(), params, pcmf32s);
+    }
+
+    // output to VTT file
+    if (params.output_vtt) {
+        const auto fname_vtt = fname_out + ".vtt";
+        output_vtt(ctx, state, fname_vtt.c_str(), params, pcmf32s);
+    }
+
+    // output to SRT file
+    if (params.output_srt) {
+        const auto fname_srt = fname_out + ".srt";
+        output_srt(ctx, state, fname_srt.c_str(), params, pcmf32s);
+    }
+
+    // output to WTS file
+    if (params.output_wts) {
+        const auto fname_wts = fname_out + ".wts";
+        output_wts(ctx, state, fname_wts.c_str(), fname_inp.c_str(), params, float(pcmf32.size() + 1000)/WHISPER_SAMPLE_RATE, pcmf32s);
+    }
+
+    // output to CSV file
+    if (params.output_csv) {
+        const auto fname_csv = fname_out + ".csv";
+        output_csv(ctx, state, fname_csv.c_str(), params, pcmf32s);
+    }
+
+    // output to JSON file
+    if (params.output_jsn) {
+        const auto fname_jsn = fname_out + ".json";
+        output_json(ctx, state, fname_jsn.c_str(), params, pcmf32s, params.output_jsn_full);
+    }
+
+    // output to LRC file
+    if (params.output_lrc) {
+        const auto fname_lrc = fname_out + ".lrc";
+        output_lrc(ctx, state, fname_lrc.c_str(), params, pcmf32s);
+    }
+
+    // output to score file
+    if (params.log_score) {
+        const auto fname_score = fname_out + ".score.txt";
+        output_score(ctx, state, fname_score.c_str(), params, pcmf32s);
+    }
+}
+
+// [batch mode] blocking queue shared by the reader, the workers and the writer
+template <typename T>
+struct batch_queue {
+    std::mutex              mutex;
+    std::condition_variable cv;
+    std::deque<T>           items;
+
+    size_t n_max  = SIZE_MAX;
+    bool   closed = false;
+
+    void push(T item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return items.size() < n_max; });
+        items.push_back(std::move(item));
+        cv.notify_all();
+    }
+
+    // returns false once the queue is closed and empty
+    bool pop(T & item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return !items.empty() || closed; });
+        if (items.empty()) {
+            return false;
+        }
+        item = std::move(items.front());
+        items.pop_front();
+        cv.notify_all();
+        return true;
+    }
+
+    void close() {
+        std::unique_lock<std::mutex> lock(mutex);
+        closed = true;
+        cv.notify_all();
+    }
+};
+
+struct batch_file {
+    int f = -1; // index in params.fname_inp
+
+    std::vector<float> pcmf32;               // mono-channel F32 PCM
+    std::vector<std::vector<float>> pcmf32s; // stereo-channel F32 PCM
+
+    struct whisper_state * state = nullptr;
+
+    bool ok = false;
+};
+
+// [batch mode] whisper_print_timings() covers only the default state - sum the timings of all states of the run
+static void print_timings_states(const std::vector<struct whisper_state *> & states) {
+    whisper_timings t = {};
+
+    for (auto * state : states) {
+        const whisper_timings ts = whisper_get_timings_from_state(state);
+
+        t.t_mel_us    += ts.t_mel_us;
+        t.t_encode_us += ts.t_encode_us + ts.t_cross_us;
+        t.t_prompt_us += ts.t_prompt_us;
+        t.t_decode_us += ts.t_decode_us;
+        t.t_sample_us += ts.t_sample_us;
+
+        t.n_encode += ts.n_encode;
+        t.n_prompt += ts.n_prompt;
+        t.n_decode += ts.n_decode;
+        t.n_sample += ts.n_sample;
+        t.n_fail_p += ts.n_fail_p;
+        t.n_fail_h += ts.n_fail_h;
+
+        t.n_enc_hit       += ts.n_enc_hit;
+        t.n_window        += ts.n_window;
+        t.n_window_tokens += ts.n_window_tokens;
+    }
+
+    fprintf(stderr, "\n");
+    fprintf(stderr, "%s: summed over %d states\n", __func__, (int) states.size());
+    fprintf(stderr, "%s:     fallbacks = %3d p / %3d h\n", __func__, t.n_fail_p, t.n_fail_h);
+    fprintf(stderr, "%s:      mel time = %8.2f ms\n", __func__, 1e-3f*t.t_mel_us);
+    fprintf(stderr, "%s:   sample time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f*t.t_sample_us, t.n_sample, 1e-3f*t.t_sample_us/std::max(1, t.n_sample));
+    fprintf(stderr, "%s:   encode time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f*t.t_encode_us, t.n_encode, 1e-3f*t.t_encode_us/std::max(1, t.n_encode));
+    fprintf(stderr, "%s:   decode time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f*t.t_decode_us, t.n_decode, 1e-3f*t.t_decode_us/std::max(1, t.n_decode));
+    fprintf(stderr, "%s:   prompt time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f*t.t_prompt_us, t.n_prompt, 1e-3f*t.t_prompt_us/std::max(1, t.n_prompt));
+    if (t.n_window > 0) {
+        fprintf(stderr, "%s:       windows = %5d (%5.1f tokens per window, %d encoder passes reused)\n", __func__, t.n_window, (float) t.n_window_tokens/t.n_window, t.n_enc_hit);
+    }
+}
+
+// [batch mode] process the input files concurrently, each on its own state of the shared model
+//
+// - a reader thread decodes the audio ahead of the workers, longest files first
+// - n_files_parallel workers run whisper_full_with_state() with n_threads each
+// - the calling thread prints the results and writes the output files
+//
+// there is one state more than workers, so the results of a file can be written while all workers are busy
+int process_files_parallel(struct whisper_context * ctx, whisper_params params) {
+    const int n_files   = params.fname_inp.size();
+    const int n_workers = std::min(params.n_files_parallel, n_files);
+
+    if (!whisper_is_multilingual(ctx)) {
+        if (params.language != "en" || params.translate) {
+            params.language = "en";
+            params.translate = false;
+            fprintf(stderr, "%s: WARNING: model is not multilingual, ignoring language and translation options\n", __func__);
+        }
+    }
+    if (params.detect_language) {
+        params.language = "auto";
+    }
+
+    // schedule the longest files first, so that the last files to finish are short ones
+    std::vector<std::pair<int64_t, int>> order;
+    for (int f = 0; f < n_files; ++f) {
+        std::ifstream fin(params.fname_inp[f], std::ios::binary | std::ios::ate);
+        order.emplace_back(fin ? (int64_t) fin.tellg() : 0, f);
+    }
+    std::stable_sort(order.begin(), order.end(), [](const std::pair<int64_t, int> & a, const std::pair<int64_t, int> & b) {
+        return a.first > b.first;
+    });
+
+    fprintf(stderr, "\n");
+    fprintf(stderr, "system_info: n_threads = %d / %d | %s\n",
+            params.n_threads*n_workers, std::thread::hardware_concurrency(), whisper_print_system_info());
+    fprintf(stderr, "\n");
+    fprintf(stderr, "%s: processing %d files, %d at a time, %d threads each, lang = %s, task = %s, %stimestamps = %d ...\n",
+            __func__, n_files, n_workers, params.n_threads,
+            params.language.c_str(),
+            params.translate ? "translate" : "transcribe",
+            params.tinydiarize ? "tdrz = 1, " : "",
+            params.no_timestamps ? 0 : 1);
+
+    batch_queue<struct whisper_state *> states;
+    std::vector<struct whisper_state *> states_own;
+
+    states.push(whisper_get_state(ctx));
+    for (int i = 0; i < n_workers; ++i) {
+        struct whisper_state * state = whisper_init_state(ctx);
+        if (state == nullptr) {
+            fprintf(stderr, "error: failed to initialize whisper state\n");
+            for (auto * s : states_own) {
+                whisper_free_state(s);
+            }
+            return 3;
+        }
+
+        // [EXPERIMENTAL] with a copy of the weights on each NUMA node, the workers are spread over the nodes
+        if (params.numa == WHISPER_NUMA_STRATEGY_REPLICATE && whisper_numa_n_nodes() > 1) {
+            whisper_state_set_affinity(ctx, state, (params.numa_node + i + 1) % whisper_numa_n_nodes(), nullptr, 0, false);
+        }
+
+        states_own.push_back(state);
+        states.push(state);
+    }
+
+    const auto t_start = std::chrono::high_resolution_clock::now();
+
+    batch_queue<batch_file> ready;
+    batch_queue<batch_file> done;
+
+    ready.n_max = 2*n_workers;
+
+    std::atomic<int> n_unreadable(0);
+
+    std::thread reader([&]() {
+        for (const auto & o : order) {
+            batch_file file;
+            file.f = o.second;
+
+            if (!::read_wav(params.fname_inp[file.f], file.pcmf32, file.pcmf32s, params.diarize)) {
+                fprintf(stderr, "error: failed to read WAV file '%s'\n", params.fname_inp[file.f].c_str());
+                n_unreadable++;
+                continue;
+            }
+
+            ready.push(std::move(file));
+        }
+        ready.close();
+    });
+
+    const whisper_full_params wparams = make_full_params(params, nullptr);
+
+    std::atomic<int> n_active(n_workers);
+
+    std::vector<std::thread> workers;
+    for (int i = 0; i < n_workers; ++i) {
+        workers.emplace_back([&]() {
+            batch_file file;
+            while (ready.pop(file)) {
+                states.pop(file.state);
+                file.ok = whisper_full_with_state(ctx, file.state, wparams, file.pcmf32.data(), file.pcmf32.size()) == 0;
+                done.push(std::move(file));
+            }
+            if (--n_active == 0) {
+                done.close();
+            }
+        });
+    }
+
+    int   n_done   = 0;
+    int   n_failed = 0;
+    float t_audio  = 0.0f;
+
+    batch_file file;
+    while (done.pop(file)) {
+        const int f = file.f;
+
+        const auto & fname_inp = params.fname_inp[f];
+        const auto & fname_out = f < (int) params.fname_out.size() && !params.fname_out[f].empty() ? params.fname_out[f] : params.fname_inp[f];
+
+        if (!file.ok) {
+            fprintf(stderr, "%s: failed to process '%s'\n", __func__, fname_inp.c_str());
+            n_failed++;
+        } else {
+            fprintf(stderr, "\n");
+            fprintf(stderr, "%s: '%s' (%d samples, %.1f sec)\n",
+                    __func__, fname_inp.c_str(), int(file.pcmf32.size()), float(file.pcmf32.size())/WHISPER_SAMPLE_RATE);
+
+            whisper_print_user_data user_data = { &params, &file.pcmf32s, 0 };
+            whisper_print_segment_callback(ctx, file.state, whisper_full_n_segments_from_state(file.state), &user_data);
+
+            printf("\n");
+
+            output_all(ctx, file.state, params, fname_inp, fname_out, file.pcmf32, file.pcmf32s);
+
+            n_done++;
+            t_audio += float(file.pcmf32.size())/WHISPER_SAMPLE_RATE;
+        }
+
+        states.push(file.state);
+    }
+
+    reader.join();
+    for (auto & worker : workers) {
+        worker.join();
+    }
+
+    n_failed += n_unreadable;
+
+    {
+        std::vector<struct whisper_state *> states_all = states_own;
+        states_all.push_back(whisper_get_state(ctx));
+
+        print_timings_states(states_all);
+    }
+
+    for (auto * state : states_own) {
+        whisper_free_state(state);
+    }
+
+    const auto t_end = std::chrono::high_resolution_clock::now();
+    const float t_sec = std::chrono::duration_cast<std::chrono::milliseconds>(t_end - t_start).count()/1000.0f;
+
+    fprintf(stderr, "\n");
+    fprintf(stderr, "%s: processed %d files (%.1f sec of audio) in %.1f sec, %.1fx real time, %d failed\n",
+            __func__, n_done, t_audio, t_sec, t_audio/std::max(t_sec, 1e-3f), n_failed);
+
+    return n_failed > 0 ? 10 : 0;
+}
+
 int main(int argc, char ** argv) {
     whisper_params params;
 
@@ -878,10 +1352,26 @@ int main(int argc, char ** argv) {
         exit(0);
     }
 
+    // the draft context has a single state, so it cannot be shared by the files processed in parallel
+    if (params.n_files_parallel > 1 && !params.model_draft.empty()) {
+        fprintf(stderr, "error: cannot use both --parallel-files and --model-draft\n");
+        whisper_print_usage(argc, argv, params);
+        exit(0);
+    }
+
+    // the profiler records the default state only
+    if (params.n_files_parallel > 1 && !params.fname_profile.empty()) {
+        fprintf(stderr, "error: cannot use both --parallel-files and --profile\n");
+        whisper_print_usage(argc, argv, params);
+        exit(0);
+    }
+
     // whisper init
 
-    struct whisper_context_params cparams;
-    cparams.use_gpu = params.use_gpu;
+    struct whisper_context_params cparams = whisper_context_default_params();
+    cparams.use_gpu   = params.use_gpu;
+    cparams.numa      = params.numa;
+    cparams.numa_node = params.numa_node;
 
     struct whisper_context * ctx = whisper_init_from_file_with_params(params.model.c_str(), cparams);
 
@@ -893,6 +1383,59 @@ int main(int argc, char ** argv) {
     // initialize openvino encoder. this has no effect on whisper.cpp builds that don't have OpenVINO configured
     whisper_ctx_init_openvino_encoder(ctx, nullptr, params.openvino_encode_device.c_str(), nullptr);
 
+    // [EXPERIMENTAL] per-node profiler
+    if (!params.fname_profile.empty()) {
+        whisper_profile_enable(ctx, true);
+    }
+
+    // [EXPERIMENTAL] speculative decoding
+    struct whisper_context * ctx_draft = nullptr;
+
+    if (!params.model_draft.empty()) {
+        ctx_draft = whisper_init_from_file_with_params(params.model_draft.c_str(), cparams);
+
+        if (ctx_draft == nullptr) {
+            fprintf(stderr, "error: failed to initialize whisper draft context\n");
+            return 3;
+        }
+    }
+
+    // [EXPERIMENTAL] NUMA node and CPUs of the default state
+    {
+        const bool numa_bind = params.numa == WHISPER_NUMA_STRATEGY_NODE || params.numa == WHISPER_NUMA_STRATEGY_REPLICATE;
+
+        if (numa_bind || !params.cpus.empty()) {
+            if (whisper_state_set_affinity(ctx, whisper_get_state(ctx), numa_bind ? params.numa_node : -1,
+                        params.cpus.empty() ? nullptr : params.cpus.data(), params.cpus.size(), params.cpu_pin) != 0) {
+                fprintf(stderr, "error: failed to set the CPU affinity\n");
+                return 3;
+            }
+        }
+    }
+
+    // [EXPERIMENTAL] thread count autotuning
+    if (params.autotune) {
+        whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+
+        if (whisper_autotune_threads(ctx, params.n_threads, params.fname_autotune.empty() ? nullptr : params.fname_autotune.c_str(), &wparams) < 0) {
+            fprintf(stderr, "error: failed to autotune the thread counts\n");
+            return 3;
+        }
+
+        params.n_threads_encode = wparams.n_threads_encode;
+        params.n_threads_decode = wparams.n_threads_decode;
+        params.n_threads_mel    = wparams.n_threads_mel;
+    }
+
+    if (params.n_files_parallel > 1 && params.fname_inp.size() > 1) {
+        // the timings of all states are printed by process_files_parallel()
+        const int ret = process_files_parallel(ctx, params);
+
+        whisper_free(ctx);
+
+        return ret;
+    }
+
     for (int f = 0; f < (int) params.fname_inp.size(); ++f) {
         const auto fname_inp = params.fname_inp[f];
 		const auto fname_out = f < (int) params.fname_out.size() && !params.fname_out[f].empty() ? params.fname_out[f] : params.fname_inp[f];
@@ -938,40 +1481,7 @@ int main(int argc, char ** argv) {
 
         // run the inference
         {
-            whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
-
-            wparams.strategy = params.beam_size > 1 ? WHISPER_SAMPLING_BEAM_SEARCH : WHISPER_SAMPLING_GREEDY;
-
-            wparams.print_realtime   = false;
-            wparams.print_progress   = params.print_progress;
-            wparams.print_timestamps = !params.no_timestamps;
-            wparams.print_special    = params.print_special;
-            wparams.translate        = params.translate;
-            wparams.language         = params.language.c_str();
-            wparams.detect_language  = params.detect_language;
-            wparams.n_threads        = params.n_threads;
-            wparams.n_max_text_ctx   = params.max_context >= 0 ? params.max_context : wparams.n_max_text_ctx;
-            wparams.offset_ms        = params.offset_t_ms;
-            wparams.duration_ms      = params.duration_ms;
-
-            wparams.token_timestamps = params.output_wts || params.output_jsn_full || params.max_len > 0;
-            wparams.thold_pt         = params.word_thold;
-            wparams.max_len          = params.output_wts && params.max_len == 0 ? 60 : params.max_len;
-            wparams.split_on_word    = params.split_on_word;
-
-            wparams.speed_up         = params.speed_up;
-            wparams.debug_mode       = params.debug_mode;
-
-            wparams.tdrz_enable      = params.tinydiarize; // [TDRZ]
-
-            wparams.initial_prompt   = params.prompt.c_str();
-
-            wparams.greedy.best_of        = params.best_of;
-            wparams.beam_search.beam_size = params.beam_size;
-
-            wparams.temperature_inc  = params.no_fallback ? 0.0f : wparams.temperature_inc;
-            wparams.entropy_thold    = params.entropy_thold;
-            wparams.logprob_thold    = params.logprob_thold;
+            whisper_full_params wparams = make_full_params(params, ctx_draft);
 
             whisper_print_user_data user_data = { &params, &pcmf32s, 0 };
 
@@ -1021,58 +1531,21 @@ int main(int argc, char ** argv) {
         {
             printf("\n");
 
-            // output to text file
-            if (params.output_txt) {
-                const auto fname_txt = fname_out + ".txt";
-                output_txt(ctx, fname_txt.c_str(), params, pcmf32s);
-            }
-
-            // output to VTT file
-            if (params.output_vtt) {
-                const auto fname_vtt = fname_out + ".vtt";
-                output_vtt(ctx, fname_vtt.c_str(), params, pcmf32s);
-            }
-
-            // output to SRT file
-            if (params.output_srt) {
-                const auto fname_srt = fname_out + ".srt";
-                output_srt(ctx, fname_srt.c_str(), params, pcmf32s);
-            }
-
-            // output to WTS file
-            if (params.output_wts) {
-                const auto fname_wts = fname_out + ".wts";
-                output_wts(ctx, fname_wts.c_str(), fname_inp.c_str(), params, float(pcmf32.size() + 1000)/WHISPER_SAMPLE_RATE, pcmf32s);
-            }
-
-            // output to CSV file
-            if (params.output_csv) {
-                const auto fname_csv = fname_out + ".csv";
-                output_csv(ctx, fname_csv.c_str(), params, pcmf32s);
-            }
-
-            // output to JSON file
-            if (params.output_jsn) {
-                const auto fname_jsn = fname_out + ".json";
-                output_json(ctx, fname_jsn.c_str(), params, pcmf32s, params.output_jsn_full);
-            }
-
-            // output to LRC file
-            if (params.output_lrc) {
-                const auto fname_lrc = fname_out + ".lrc";
-                output_lrc(ctx, fname_lrc.c_str(), params, pcmf32s);
-            }
-
-            // output to score file
-            if (params.log_score) {
-                const auto fname_score = fname_out + ".score.txt";
-                output_score(ctx, fname_score.c_str(), params, pcmf32s);
-            }
+            output_all(ctx, whisper_get_state(ctx), params, fname_inp, fname_out, pcmf32, pcmf32s);
         }
     }
 
+    if (!params.fname_profile.empty()) {
+        whisper_profile_print(ctx);
+        whisper_profile_export_trace(ctx, params.fname_profile.c_str());
+    }
+
     whisper_print_timings(ctx);
     whisper_free(ctx);
 
+    if (ctx_draft) {
+        whisper_free(ctx_draft);
+    }
+
     return 0;
 }
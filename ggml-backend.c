@@ -217,6 +217,12 @@ struct ggml_backend_cpu_context {
     int n_threads;
     void * work_data;
     size_t work_size;
+
+    int * cpus; // CPU affinity of the compute threads, see ggml_backend_cpu_set_affinity()
+    int n_cpus;
+    bool cpus_pin;
+
+    int64_t * perf_node_us; // see ggml_backend_cpu_set_perf_node_us()
 };
 
 static const char * ggml_backend_cpu_name(ggml_backend_t backend) {
@@ -228,6 +234,7 @@ static const char * ggml_backend_cpu_name(ggml_backend_t backend) {
 static void ggml_backend_cpu_free(ggml_backend_t backend) {
     struct ggml_backend_cpu_context * cpu_ctx = (struct ggml_backend_cpu_context *)backend->context;
     free(cpu_ctx->work_data);
+    free(cpu_ctx->cpus);
     free(cpu_ctx);
     free(backend);
 }
@@ -319,6 +326,10 @@ static ggml_backend_graph_plan_t ggml_backend_cpu_graph_plan_create(ggml_backend
     struct ggml_backend_plan_cpu * cpu_plan = malloc(sizeof(struct ggml_backend_plan_cpu));
 
     cpu_plan->cplan = ggml_graph_plan(cgraph, cpu_ctx->n_threads);
+    cpu_plan->cplan.cpus     = cpu_ctx->cpus;
+    cpu_plan->cplan.n_cpus   = cpu_ctx->n_cpus;
+    cpu_plan->cplan.cpus_pin = cpu_ctx->cpus_pin;
+    cpu_plan->cplan.perf_node_us = cpu_ctx->perf_node_us;
     cpu_plan->cgraph = *cgraph;
 
     if (cpu_plan->cplan.work_size > 0) {
@@ -358,6 +369,12 @@ static void ggml_backend_cpu_graph_compute(ggml_backend_t backend, struct ggml_c
 
     cplan.work_data = cpu_ctx->work_data;
 
+    cplan.cpus     = cpu_ctx->cpus;
+    cplan.n_cpus   = cpu_ctx->n_cpus;
+    cplan.cpus_pin = cpu_ctx->cpus_pin;
+
+    cplan.perf_node_us = cpu_ctx->perf_node_us;
+
     ggml_graph_compute(cgraph, &cplan);
 }
 
@@ -390,6 +407,11 @@ ggml_backend_t ggml_backend_cpu_init(void) {
     ctx->n_threads = GGML_DEFAULT_N_THREADS;
     ctx->work_data = NULL;
     ctx->work_size = 0;
+    ctx->cpus      = NULL;
+    ctx->n_cpus    = 0;
+    ctx->cpus_pin  = false;
+
+    ctx->perf_node_us = NULL;
 
     ggml_backend_t cpu_backend = malloc(sizeof(struct ggml_backend));
 
@@ -411,6 +433,31 @@ void ggml_backend_cpu_set_n_threads(ggml_backend_t backend_cpu, int n_threads) {
     ctx->n_threads = n_threads;
 }
 
+void ggml_backend_cpu_set_affinity(ggml_backend_t backend_cpu, const int * cpus, int n_cpus, bool pin) {
+    GGML_ASSERT(ggml_backend_is_cpu(backend_cpu));
+
+    struct ggml_backend_cpu_context * ctx = (struct ggml_backend_cpu_context *)backend_cpu->context;
+
+    free(ctx->cpus);
+    ctx->cpus   = NULL;
+    ctx->n_cpus = 0;
+
+    if (cpus != NULL && n_cpus > 0) {
+        ctx->cpus = malloc(n_cpus*sizeof(int));
+        memcpy(ctx->cpus, cpus, n_cpus*sizeof(int));
+        ctx->n_cpus = n_cpus;
+    }
+
+    ctx->cpus_pin = pin;
+}
+
+void ggml_backend_cpu_set_perf_node_us(ggml_backend_t backend_cpu, int64_t * perf_node_us) {
+    GGML_ASSERT(ggml_backend_is_cpu(backend_cpu));
+
+    struct ggml_backend_cpu_context * ctx = (struct ggml_backend_cpu_context *)backend_cpu->context;
+    ctx->perf_node_us = perf_node_us;
+}
+
 ggml_backend_buffer_t ggml_backend_cpu_buffer_from_ptr(ggml_backend_t backend_cpu, void * ptr, size_t size) {
     return ggml_backend_buffer_init(backend_cpu, cpu_backend_buffer_i_from_ptr, ptr, size);
 }
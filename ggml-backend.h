@@ -67,6 +67,12 @@ extern "C" {
     GGML_API bool ggml_backend_is_cpu(ggml_backend_t backend);
     GGML_API void ggml_backend_cpu_set_n_threads(ggml_backend_t backend_cpu, int n_threads);
 
+    // [EXPERIMENTAL] CPU affinity of the compute threads (Linux only), see ggml_cplan.cpus. n_cpus = 0 - not set
+    GGML_API void ggml_backend_cpu_set_affinity(ggml_backend_t backend_cpu, const int * cpus, int n_cpus, bool pin);
+
+    // [EXPERIMENTAL] per-node timings of the following graph computations, see ggml_cplan.perf_node_us. NULL - not recorded
+    GGML_API void ggml_backend_cpu_set_perf_node_us(ggml_backend_t backend_cpu, int64_t * perf_node_us);
+
     // Create a backend buffer from an existing pointer
     GGML_API ggml_backend_buffer_t ggml_backend_cpu_buffer_from_ptr(ggml_backend_t backend_cpu, void * ptr, size_t size);
 
@@ -1447,6 +1447,104 @@ inline static void ggml_vec_gelu_f32(const int n, float * y, const float * x) {
 }
 #endif
 
+inline static void ggml_vec_add_gelu_f32(const int n, float * y, const float * x, const float * b) {
+    ggml_vec_add_f32 (n, y, x, b);
+    ggml_vec_gelu_f32(n, y, y);
+}
+
+// y = (x - mean(x))/sqrt(var(x) + eps)*w + b
+// y can alias x
+inline static void ggml_vec_norm_affine_f32(const int n, float * y, const float * x, const float * w, const float * b, const float eps) {
+#if defined(GGML_SIMD)
+    const int np = (n & ~(GGML_F32_STEP - 1));
+
+    GGML_F32_VEC sum[GGML_F32_ARR] = { GGML_F32_VEC_ZERO };
+
+    GGML_F32_VEC ax[GGML_F32_ARR];
+
+    // mean
+    float mean = 0.0f;
+
+    for (int i = 0; i < np; i += GGML_F32_STEP) {
+        for (int j = 0; j < GGML_F32_ARR; j++) {
+            ax[j]  = GGML_F32_VEC_LOAD(x + i + j*GGML_F32_EPR);
+            sum[j] = GGML_F32_VEC_ADD(sum[j], ax[j]);
+        }
+    }
+
+    GGML_F32_VEC_REDUCE(mean, sum);
+
+    for (int i = np; i < n; ++i) {
+        mean += x[i];
+    }
+
+    mean /= n;
+
+    // variance
+    float sum2 = 0.0f;
+
+    for (int j = 0; j < GGML_F32_ARR; j++) {
+        sum[j] = GGML_F32_VEC_ZERO;
+    }
+
+    const GGML_F32_VEC vm = GGML_F32_VEC_SET1(-mean);
+
+    for (int i = 0; i < np; i += GGML_F32_STEP) {
+        for (int j = 0; j < GGML_F32_ARR; j++) {
+            ax[j]  = GGML_F32_VEC_ADD(GGML_F32_VEC_LOAD(x + i + j*GGML_F32_EPR), vm);
+            sum[j] = GGML_F32_VEC_FMA(sum[j], ax[j], ax[j]);
+        }
+    }
+
+    GGML_F32_VEC_REDUCE(sum2, sum);
+
+    for (int i = np; i < n; ++i) {
+        const float v = x[i] - mean;
+        sum2 += v*v;
+    }
+
+    const float scale = 1.0f/sqrtf(sum2/n + eps);
+
+    // affine
+    const GGML_F32_VEC vs = GGML_F32_VEC_SET1(scale);
+    const GGML_F32_VEC vo = GGML_F32_VEC_SET1(-mean*scale);
+
+    for (int i = 0; i < np; i += GGML_F32_STEP) {
+        for (int j = 0; j < GGML_F32_ARR; j++) {
+            ax[j] = GGML_F32_VEC_FMA(vo, GGML_F32_VEC_LOAD(x + i + j*GGML_F32_EPR), vs);
+            ax[j] = GGML_F32_VEC_FMA(GGML_F32_VEC_LOAD(b + i + j*GGML_F32_EPR), ax[j], GGML_F32_VEC_LOAD(w + i + j*GGML_F32_EPR));
+
+            GGML_F32_VEC_STORE(y + i + j*GGML_F32_EPR, ax[j]);
+        }
+    }
+
+    // leftovers
+    for (int i = np; i < n; ++i) {
+        y[i] = (x[i] - mean)*scale*w[i] + b[i];
+    }
+#else
+    // scalar
+    ggml_float sum = 0.0;
+    for (int i = 0; i < n; ++i) {
+        sum += (ggml_float)x[i];
+    }
+
+    const float mean = sum/n;
+
+    ggml_float sum2 = 0.0;
+    for (int i = 0; i < n; ++i) {
+        const float v = x[i] - mean;
+        sum2 += (ggml_float)(v*v);
+    }
+
+    const float scale = 1.0f/sqrtf(sum2/n + eps);
+
+    for (int i = 0; i < n; ++i) {
+        y[i] = (x[i] - mean)*scale*w[i] + b[i];
+    }
+#endif
+}
+
 inline static float ggml_gelu_quick_f32(float x) {
     return x*(1.0f/(1.0f+expf(GELU_QUICK_COEF*x)));
 }
@@ -1611,6 +1709,9 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "RMS_NORM",
     "RMS_NORM_BACK",
     "GROUP_NORM",
+    "NORM_AFFINE",
+    "ADD_NORM_AFFINE",
+    "ADD_GELU",
 
     "MUL_MAT",
     "OUT_PROD",
@@ -1636,6 +1737,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "CLAMP",
     "CONV_TRANSPOSE_1D",
     "IM2COL",
+    "CONV_1D_K3_PH",
     "CONV_TRANSPOSE_2D",
     "POOL_1D",
     "POOL_2D",
@@ -1666,7 +1768,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "CROSS_ENTROPY_LOSS_BACK",
 };
 
-static_assert(GGML_OP_COUNT == 68, "GGML_OP_COUNT != 68");
+static_assert(GGML_OP_COUNT == 72, "GGML_OP_COUNT != 72");
 
 static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "none",
@@ -1693,6 +1795,9 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "rms_norm(x)",
     "rms_norm_back(x)",
     "group_norm(x)",
+    "norm(x)*w+b",
+    "x+r,norm(x+r)*w+b",
+    "gelu(x+b)",
 
     "X*Y",
     "X*Y",
@@ -1718,6 +1823,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "clamp(x)",
     "conv_transpose_1d(x)",
     "im2col(x)",
+    "conv_1d_k3_ph(x)",
     "conv_transpose_2d(x)",
     "pool_1d(x)",
     "pool_2d(x)",
@@ -1748,7 +1854,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "cross_entropy_loss_back(x,y)",
 };
 
-static_assert(GGML_OP_COUNT == 68, "GGML_OP_COUNT != 68");
+static_assert(GGML_OP_COUNT == 72, "GGML_OP_COUNT != 72");
 
 static_assert(GGML_OP_POOL_COUNT == 2, "GGML_OP_POOL_COUNT != 2");
 
@@ -3837,6 +3943,28 @@ struct ggml_tensor * ggml_gelu_inplace(
     return ggml_unary_inplace(ctx, a, GGML_UNARY_OP_GELU);
 }
 
+// ggml_add_gelu
+
+struct ggml_tensor * ggml_add_gelu(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b) {
+    GGML_ASSERT(ggml_can_repeat_rows(b, a));
+
+    if (a->grad || b->grad) {
+        GGML_ASSERT(false); // TODO: implement backward
+    }
+
+    struct ggml_tensor * result = ggml_dup_tensor(ctx, a);
+
+    result->op   = GGML_OP_ADD_GELU;
+    result->grad = NULL;
+    result->src[0] = a;
+    result->src[1] = b;
+
+    return result;
+}
+
 // ggml_gelu_quick
 
 struct ggml_tensor * ggml_gelu_quick(
@@ -3927,6 +4055,65 @@ struct ggml_tensor * ggml_norm_inplace(
     return ggml_norm_impl(ctx, a, eps, true);
 }
 
+// ggml_norm_affine
+
+struct ggml_tensor * ggml_norm_affine(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * w,
+        struct ggml_tensor  * b,
+        float eps) {
+    GGML_ASSERT(ggml_is_vector(w) && w->ne[0] == a->ne[0]);
+    GGML_ASSERT(ggml_is_vector(b) && b->ne[0] == a->ne[0]);
+
+    if (a->grad || w->grad || b->grad) {
+        GGML_ASSERT(false); // TODO: implement backward
+    }
+
+    struct ggml_tensor * result = ggml_dup_tensor(ctx, a);
+
+    ggml_set_op_params(result, &eps, sizeof(eps));
+
+    result->op   = GGML_OP_NORM_AFFINE;
+    result->grad = NULL;
+    result->src[0] = a;
+    result->src[1] = w;
+    result->src[2] = b;
+
+    return result;
+}
+
+// ggml_add_norm_affine
+
+struct ggml_tensor * ggml_add_norm_affine(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * r,
+        struct ggml_tensor  * w,
+        struct ggml_tensor  * b,
+        float eps) {
+    GGML_ASSERT(ggml_is_matrix(a) && ggml_are_same_shape(a, r));
+    GGML_ASSERT(ggml_is_vector(w) && w->ne[0] == a->ne[0]);
+    GGML_ASSERT(ggml_is_vector(b) && b->ne[0] == a->ne[0]);
+
+    if (a->grad || r->grad || w->grad || b->grad) {
+        GGML_ASSERT(false); // TODO: implement backward
+    }
+
+    struct ggml_tensor * result = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, a->ne[0], a->ne[1], 2);
+
+    ggml_set_op_params(result, &eps, sizeof(eps));
+
+    result->op   = GGML_OP_ADD_NORM_AFFINE;
+    result->grad = NULL;
+    result->src[0] = a;
+    result->src[1] = r;
+    result->src[2] = w;
+    result->src[3] = b;
+
+    return result;
+}
+
 // ggml_rms_norm
 
 static struct ggml_tensor * ggml_rms_norm_impl(
@@ -5151,6 +5338,44 @@ struct ggml_tensor* ggml_conv_1d_ph(
     return ggml_conv_1d(ctx, a, b, s, a->ne[0] / 2, d);
 }
 
+// ggml_conv_1d_k3_ph
+
+struct ggml_tensor * ggml_conv_1d_k3_ph(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+        struct ggml_tensor  * bias,
+        int                   s,
+        bool                  gelu) {
+    GGML_ASSERT(a->ne[0] == 3 && a->ne[3] == 1);
+    GGML_ASSERT(a->ne[1] == b->ne[1] && ggml_is_matrix(b));
+    GGML_ASSERT(ggml_nelements(bias) == a->ne[2] && ggml_is_contiguous(bias));
+    GGML_ASSERT(s == 1 || s == 2);
+
+    if (a->grad || b->grad || bias->grad) {
+        GGML_ASSERT(false); // TODO: implement backward
+    }
+
+    const int64_t OL = ggml_calc_conv_output_size(b->ne[0], a->ne[0], s, 1, 1);
+
+    // the input is transposed to (IC x IL) in the type of the kernel by a separate node, so that the 3 input rows
+    // of each output position are contiguous
+    struct ggml_tensor * bt = ggml_cpy(ctx, ggml_transpose(ctx, b), ggml_new_tensor_2d(ctx, a->type, b->ne[1], b->ne[0]));
+
+    struct ggml_tensor * result = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, OL, a->ne[2]);
+
+    int32_t params[] = { s, gelu ? 1 : 0 };
+    ggml_set_op_params(result, params, sizeof(params));
+
+    result->op   = GGML_OP_CONV_1D_K3_PH;
+    result->grad = NULL;
+    result->src[0] = a;
+    result->src[1] = bt;
+    result->src[2] = bias;
+
+    return result;
+}
+
 // ggml_conv_transpose_1d
 
 static int64_t ggml_calc_conv_transpose_1d_output_size(int64_t ins, int64_t ks, int s, int p, int d) {
@@ -8662,6 +8887,71 @@ static void ggml_compute_forward_relu(
     }
 }
 
+// ggml_compute_forward_add_gelu
+
+static void ggml_compute_forward_add_gelu_f32(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        struct ggml_tensor * dst) {
+    GGML_ASSERT(ggml_can_repeat_rows(src1, src0) && ggml_are_same_shape(src0, dst));
+
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int nr  = ggml_nrows(src0);
+
+    GGML_TENSOR_BINARY_OP_LOCALS
+
+    GGML_ASSERT( nb0 == sizeof(float));
+    GGML_ASSERT(nb00 == sizeof(float));
+    GGML_ASSERT(nb10 == sizeof(float));
+
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    for (int ir = ir0; ir < ir1; ++ir) {
+        // src1 is broadcastable across src0 and dst in i1, i2, i3
+        const int64_t i03 = ir/(ne02*ne01);
+        const int64_t i02 = (ir - i03*ne02*ne01)/ne01;
+        const int64_t i01 = (ir - i03*ne02*ne01 - i02*ne01);
+
+        const int64_t i13 = i03 % ne13;
+        const int64_t i12 = i02 % ne12;
+        const int64_t i11 = i01 % ne11;
+
+        ggml_vec_add_gelu_f32(ne00,
+                (float *) ((char *) dst->data  + i03*nb3  + i02*nb2  + i01*nb1 ),
+                (float *) ((char *) src0->data + i03*nb03 + i02*nb02 + i01*nb01),
+                (float *) ((char *) src1->data + i13*nb13 + i12*nb12 + i11*nb11));
+    }
+}
+
+static void ggml_compute_forward_add_gelu(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        struct ggml_tensor * dst) {
+    switch (src0->type) {
+        case GGML_TYPE_F32:
+            {
+                ggml_compute_forward_add_gelu_f32(params, src0, src1, dst);
+            } break;
+        default:
+            {
+                GGML_ASSERT(false);
+            } break;
+    }
+}
+
 // ggml_compute_forward_gelu
 
 static void ggml_compute_forward_gelu_f32(
@@ -9014,6 +9304,126 @@ static void ggml_compute_forward_norm(
     }
 }
 
+// ggml_compute_forward_norm_affine
+
+static void ggml_compute_forward_norm_affine_f32(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        const struct ggml_tensor * src2,
+        struct ggml_tensor * dst) {
+    GGML_ASSERT(ggml_are_same_shape(src0, dst));
+    GGML_ASSERT(ggml_is_contiguous(src1) && ggml_is_contiguous(src2));
+
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    GGML_ASSERT(src0->nb[0] == sizeof(float));
+    GGML_ASSERT(dst->nb[0]  == sizeof(float));
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    GGML_TENSOR_UNARY_OP_LOCALS
+
+    float eps;
+    memcpy(&eps, dst->op_params, sizeof(float));
+
+    const float * w = (const float *) src1->data;
+    const float * b = (const float *) src2->data;
+
+    for (int64_t i03 = 0; i03 < ne03; i03++) {
+        for (int64_t i02 = 0; i02 < ne02; i02++) {
+            for (int64_t i01 = ith; i01 < ne01; i01 += nth) {
+                ggml_vec_norm_affine_f32(ne00,
+                        (float *) ((char *) dst->data  + i01*nb1  + i02*nb2  + i03*nb3),
+                        (float *) ((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03),
+                        w, b, eps);
+            }
+        }
+    }
+}
+
+static void ggml_compute_forward_norm_affine(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        const struct ggml_tensor * src2,
+        struct ggml_tensor * dst) {
+    switch (src0->type) {
+        case GGML_TYPE_F32:
+            {
+                ggml_compute_forward_norm_affine_f32(params, src0, src1, src2, dst);
+            } break;
+        default:
+            {
+                GGML_ASSERT(false);
+            } break;
+    }
+}
+
+// ggml_compute_forward_add_norm_affine
+
+static void ggml_compute_forward_add_norm_affine_f32(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        const struct ggml_tensor * src2,
+        const struct ggml_tensor * src3,
+        struct ggml_tensor * dst) {
+    GGML_ASSERT(ggml_are_same_shape(src0, src1));
+    GGML_ASSERT(ggml_is_contiguous(src2) && ggml_is_contiguous(src3));
+
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    GGML_ASSERT(src0->nb[0] == sizeof(float));
+    GGML_ASSERT(src1->nb[0] == sizeof(float));
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    GGML_TENSOR_BINARY_OP_LOCALS
+
+    float eps;
+    memcpy(&eps, dst->op_params, sizeof(float));
+
+    const float * w = (const float *) src2->data;
+    const float * b = (const float *) src3->data;
+
+    for (int64_t i01 = ith; i01 < ne01; i01 += nth) {
+        float * s = (float *) ((char *) dst->data + i01*nb1);
+        float * y = (float *) ((char *) dst->data + i01*nb1 + nb2);
+
+        ggml_vec_add_f32(ne00, s,
+                (float *) ((char *) src0->data + i01*nb01),
+                (float *) ((char *) src1->data + i01*nb11));
+
+        ggml_vec_norm_affine_f32(ne00, y, s, w, b, eps);
+    }
+}
+
+static void ggml_compute_forward_add_norm_affine(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        const struct ggml_tensor * src2,
+        const struct ggml_tensor * src3,
+        struct ggml_tensor * dst) {
+    switch (src0->type) {
+        case GGML_TYPE_F32:
+            {
+                ggml_compute_forward_add_norm_affine_f32(params, src0, src1, src2, src3, dst);
+            } break;
+        default:
+            {
+                GGML_ASSERT(false);
+            } break;
+    }
+}
+
 // ggml_compute_forward_group_rms_norm
 
 static void ggml_compute_forward_rms_norm_f32(
@@ -11814,6 +12224,194 @@ static void ggml_compute_forward_im2col(
     }
 }
 
+// ggml_compute_forward_conv_1d_k3_ph
+
+// output channels and output positions per block
+#define GGML_CONV_1D_K3_BLCK_OC 16
+#define GGML_CONV_1D_K3_BLCK_OL 64
+
+static void ggml_compute_forward_conv_1d_k3_ph_f16_f32(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        const struct ggml_tensor * src2,
+              struct ggml_tensor * dst) {
+    GGML_ASSERT(src0->type == GGML_TYPE_F16);
+    GGML_ASSERT(src1->type == GGML_TYPE_F16);
+    GGML_ASSERT( dst->type == GGML_TYPE_F32);
+
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    GGML_TENSOR_BINARY_OP_LOCALS
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int64_t nk = ne00*ne01; // K*IC
+
+    GGML_ASSERT(ne10 == ne01);
+    GGML_ASSERT(nb00 == sizeof(ggml_fp16_t));
+    GGML_ASSERT(nb10 == sizeof(ggml_fp16_t) && nb11 == ne10*nb10);
+
+    ggml_fp16_t * const wdata_kernel = (ggml_fp16_t *) params->wdata + 0;
+    ggml_fp16_t * const src1_data    = (ggml_fp16_t *) src1->data;
+
+    const int32_t s0   = ((const int32_t *)(dst->op_params))[0];
+    const int32_t gelu = ((const int32_t *)(dst->op_params))[1];
+
+    const float * bias = (const float *) src2->data;
+
+    // output channels per thread
+    const int64_t dr = (ne1 + nth - 1)/nth;
+
+    const int64_t ir0 = dr*ith;
+    const int64_t ir1 = MIN(ir0 + dr, ne1);
+
+    for (int64_t io0 = ir0; io0 < ir1; io0 += GGML_CONV_1D_K3_BLCK_OC) {
+        const int64_t io1 = MIN(io0 + GGML_CONV_1D_K3_BLCK_OC, ir1);
+
+        // permute the kernels of this block (src0) from (K x IC) to (IC x K)
+        for (int64_t io = io0; io < io1; io++) {
+            for (int64_t i01 = 0; i01 < ne01; i01++) {
+                const ggml_fp16_t * const src = (ggml_fp16_t *)((char *) src0->data + io*nb02 + i01*nb01);
+                ggml_fp16_t * dst_data = wdata_kernel + io*nk;
+                for (int64_t i00 = 0; i00 < ne00; i00++) {
+                    dst_data[i00*ne01 + i01] = src[i00];
+                }
+            }
+        }
+
+        for (int64_t il0 = 0; il0 < ne0; il0 += GGML_CONV_1D_K3_BLCK_OL) {
+            const int64_t il1 = MIN(il0 + GGML_CONV_1D_K3_BLCK_OL, ne0);
+
+            for (int64_t io = io0; io < io1; io++) {
+                float * dst_data = (float *)((char *) dst->data + io*nb1);
+
+                // the 3 input rows of each output position are contiguous in src1 - at the edges the rows that fall
+                // into the zero padding are skipped
+                for (int64_t il = il0; il < il1; il++) {
+                    const int64_t i1 = il*s0 - 1;
+                    const int64_t k0 = MAX(0, -i1);
+                    const int64_t k1 = MIN(ne00, ne11 - i1);
+
+                    ggml_vec_dot_f16((k1 - k0)*ne10, dst_data + il, wdata_kernel + io*nk + k0*ne10, src1_data + (i1 + k0)*ne10);
+                }
+
+                // epilogue on the block that was just computed
+                ggml_vec_acc1_f32(il1 - il0, dst_data + il0, bias[io]);
+
+                if (gelu) {
+                    ggml_vec_gelu_f32(il1 - il0, dst_data + il0, dst_data + il0);
+                }
+            }
+        }
+    }
+}
+
+static void ggml_compute_forward_conv_1d_k3_ph_f32(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        const struct ggml_tensor * src2,
+              struct ggml_tensor * dst) {
+    GGML_ASSERT(src0->type == GGML_TYPE_F32);
+    GGML_ASSERT(src1->type == GGML_TYPE_F32);
+    GGML_ASSERT( dst->type == GGML_TYPE_F32);
+
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    GGML_TENSOR_BINARY_OP_LOCALS
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int64_t nk = ne00*ne01; // K*IC
+
+    GGML_ASSERT(ne10 == ne01);
+    GGML_ASSERT(nb00 == sizeof(float));
+    GGML_ASSERT(nb10 == sizeof(float) && nb11 == ne10*nb10);
+
+    float * const wdata_kernel = (float *) params->wdata + 0;
+    float * const src1_data    = (float *) src1->data;
+
+    const int32_t s0   = ((const int32_t *)(dst->op_params))[0];
+    const int32_t gelu = ((const int32_t *)(dst->op_params))[1];
+
+    const float * bias = (const float *) src2->data;
+
+    // output channels per thread
+    const int64_t dr = (ne1 + nth - 1)/nth;
+
+    const int64_t ir0 = dr*ith;
+    const int64_t ir1 = MIN(ir0 + dr, ne1);
+
+    for (int64_t io0 = ir0; io0 < ir1; io0 += GGML_CONV_1D_K3_BLCK_OC) {
+        const int64_t io1 = MIN(io0 + GGML_CONV_1D_K3_BLCK_OC, ir1);
+
+        // permute the kernels of this block (src0) from (K x IC) to (IC x K)
+        for (int64_t io = io0; io < io1; io++) {
+            for (int64_t i01 = 0; i01 < ne01; i01++) {
+                const float * const src = (float *)((char *) src0->data + io*nb02 + i01*nb01);
+                float * dst_data = wdata_kernel + io*nk;
+                for (int64_t i00 = 0; i00 < ne00; i00++) {
+                    dst_data[i00*ne01 + i01] = src[i00];
+                }
+            }
+        }
+
+        for (int64_t il0 = 0; il0 < ne0; il0 += GGML_CONV_1D_K3_BLCK_OL) {
+            const int64_t il1 = MIN(il0 + GGML_CONV_1D_K3_BLCK_OL, ne0);
+
+            for (int64_t io = io0; io < io1; io++) {
+                float * dst_data = (float *)((char *) dst->data + io*nb1);
+
+                // the 3 input rows of each output position are contiguous in src1 - at the edges the rows that fall
+                // into the zero padding are skipped
+                for (int64_t il = il0; il < il1; il++) {
+                    const int64_t i1 = il*s0 - 1;
+                    const int64_t k0 = MAX(0, -i1);
+                    const int64_t k1 = MIN(ne00, ne11 - i1);
+
+                    ggml_vec_dot_f32((k1 - k0)*ne10, dst_data + il, wdata_kernel + io*nk + k0*ne10, src1_data + (i1 + k0)*ne10);
+                }
+
+                // epilogue on the block that was just computed
+                ggml_vec_acc1_f32(il1 - il0, dst_data + il0, bias[io]);
+
+                if (gelu) {
+                    ggml_vec_gelu_f32(il1 - il0, dst_data + il0, dst_data + il0);
+                }
+            }
+        }
+    }
+}
+
+static void ggml_compute_forward_conv_1d_k3_ph(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        const struct ggml_tensor * src2,
+              struct ggml_tensor * dst) {
+    switch (src0->type) {
+        case GGML_TYPE_F16:
+            {
+                ggml_compute_forward_conv_1d_k3_ph_f16_f32(params, src0, src1, src2, dst);
+            } break;
+        case GGML_TYPE_F32:
+            {
+                ggml_compute_forward_conv_1d_k3_ph_f32(params, src0, src1, src2, dst);
+            } break;
+        default:
+            {
+                GGML_ASSERT(false);
+            } break;
+    }
+}
+
 // ggml_compute_forward_conv_transpose_2d
 
 static void ggml_compute_forward_conv_transpose_2d(
@@ -13934,6 +14532,18 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             {
                 ggml_compute_forward_group_norm(params, tensor->src[0], tensor);
             } break;
+        case GGML_OP_NORM_AFFINE:
+            {
+                ggml_compute_forward_norm_affine(params, tensor->src[0], tensor->src[1], tensor->src[2], tensor);
+            } break;
+        case GGML_OP_ADD_NORM_AFFINE:
+            {
+                ggml_compute_forward_add_norm_affine(params, tensor->src[0], tensor->src[1], tensor->src[2], tensor->src[3], tensor);
+            } break;
+        case GGML_OP_ADD_GELU:
+            {
+                ggml_compute_forward_add_gelu(params, tensor->src[0], tensor->src[1], tensor);
+            } break;
         case GGML_OP_MUL_MAT:
             {
                 ggml_compute_forward_mul_mat(params, tensor->src[0], tensor->src[1], tensor);
@@ -14026,6 +14636,10 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             {
                 ggml_compute_forward_im2col(params, tensor->src[0], tensor->src[1], tensor);
             } break;
+        case GGML_OP_CONV_1D_K3_PH:
+            {
+                ggml_compute_forward_conv_1d_k3_ph(params, tensor->src[0], tensor->src[1], tensor->src[2], tensor);
+            } break;
         case GGML_OP_CONV_TRANSPOSE_2D:
             {
                 ggml_compute_forward_conv_transpose_2d(params, tensor->src[0], tensor->src[1], tensor);
@@ -14634,6 +15248,12 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
             {
                 GGML_ASSERT(false); // TODO: not implemented
             } break;
+        case GGML_OP_NORM_AFFINE:
+        case GGML_OP_ADD_NORM_AFFINE:
+        case GGML_OP_ADD_GELU:
+            {
+                GGML_ASSERT(false); // TODO: not implemented
+            } break;
         case GGML_OP_MUL_MAT:
             {
                 // https://cs231n.github.io/optimization-2/#staged
@@ -15000,6 +15620,7 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
                 GGML_ASSERT(false); // TODO: not implemented
             } break;
         case GGML_OP_IM2COL:
+        case GGML_OP_CONV_1D_K3_PH:
             {
                 GGML_ASSERT(false); // TODO: not implemented
             } break;
@@ -15567,11 +16188,69 @@ static void clear_numa_thread_affinity(void) {
 
     CPU_FREE(cpus);
 }
+
+// the CPU affinity of the compute plan, see ggml_cplan.cpus
+static void set_cplan_thread_affinity(const struct ggml_cplan * cplan, int thread_n) {
+    int n_cpus_max = 0;
+    for (int i = 0; i < cplan->n_cpus; ++i) {
+        n_cpus_max = MAX(n_cpus_max, cplan->cpus[i] + 1);
+    }
+
+    size_t setsize = CPU_ALLOC_SIZE(n_cpus_max);
+
+    cpu_set_t * cpus = CPU_ALLOC(n_cpus_max);
+    CPU_ZERO_S(setsize, cpus);
+    if (cplan->cpus_pin) {
+        CPU_SET_S(cplan->cpus[thread_n % cplan->n_cpus], setsize, cpus);
+    } else {
+        for (int i = 0; i < cplan->n_cpus; ++i) {
+            CPU_SET_S(cplan->cpus[i], setsize, cpus);
+        }
+    }
+
+    int rv = pthread_setaffinity_np(pthread_self(), setsize, cpus);
+    if (rv) {
+        fprintf(stderr, "warning: pthread_setaffinity_np() failed: %s\n",
+            strerror(rv));
+    }
+
+    CPU_FREE(cpus);
+}
+
+typedef struct {
+    cpu_set_t cpus;
+    bool      valid;
+} ggml_thread_affinity_t;
+
+static void get_thread_affinity(ggml_thread_affinity_t * affinity) {
+    affinity->valid = pthread_getaffinity_np(pthread_self(), sizeof(affinity->cpus), &affinity->cpus) == 0;
+}
+
+static void set_thread_affinity(const ggml_thread_affinity_t * affinity) {
+    if (!affinity->valid) {
+        return;
+    }
+
+    int rv = pthread_setaffinity_np(pthread_self(), sizeof(affinity->cpus), &affinity->cpus);
+    if (rv) {
+        fprintf(stderr, "warning: pthread_setaffinity_np() failed: %s\n",
+            strerror(rv));
+    }
+}
 #else
 // TODO: Windows etc.
 // (the linux implementation may also work on BSD, someone should test)
 static void set_numa_thread_affinity(int thread_n, int n_threads) { UNUSED(thread_n); UNUSED(n_threads);  }
 static void clear_numa_thread_affinity(void) {}
+
+static void set_cplan_thread_affinity(const struct ggml_cplan * cplan, int thread_n) { UNUSED(cplan); UNUSED(thread_n); }
+
+typedef struct {
+    bool valid;
+} ggml_thread_affinity_t;
+
+static void get_thread_affinity(ggml_thread_affinity_t * affinity) { affinity->valid = false; }
+static void set_thread_affinity(const ggml_thread_affinity_t * affinity) { UNUSED(affinity); }
 #endif
 
 struct ggml_compute_state_shared {
@@ -15597,9 +16276,14 @@ struct ggml_compute_state {
     struct ggml_compute_state_shared * shared;
 };
 
+// with ggml_cplan.perf_node_us the node timings are recorded without GGML_PERF
+static int64_t ggml_graph_compute_perf_time_us(const struct ggml_cplan * cplan) {
+    return cplan->perf_node_us != NULL ? ggml_time_us() : ggml_perf_time_us();
+}
+
 static void ggml_graph_compute_perf_stats_node(struct ggml_tensor * node, const struct ggml_compute_state_shared * st) {
     int64_t cycles_cur  = ggml_perf_cycles()  - st->perf_node_start_cycles;
-    int64_t time_us_cur = ggml_perf_time_us() - st->perf_node_start_time_us;
+    int64_t time_us_cur = ggml_graph_compute_perf_time_us(st->cplan) - st->perf_node_start_time_us;
 
     node->perf_runs++;
     node->perf_cycles  += cycles_cur;
@@ -15660,6 +16344,9 @@ static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads) {
         case GGML_OP_RMS_NORM:
         case GGML_OP_RMS_NORM_BACK:
         case GGML_OP_GROUP_NORM:
+        case GGML_OP_NORM_AFFINE:
+        case GGML_OP_ADD_NORM_AFFINE:
+        case GGML_OP_ADD_GELU:
         case GGML_OP_CONCAT:
             {
                 n_tasks = n_threads;
@@ -15733,6 +16420,7 @@ static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads) {
                 n_tasks = n_threads;
             } break;
         case GGML_OP_IM2COL:
+        case GGML_OP_CONV_1D_K3_PH:
             {
                 n_tasks = n_threads;
             } break;
@@ -15827,6 +16515,25 @@ static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads) {
     return n_tasks;
 }
 
+// the COMPUTE pass of a node, timed if the plan asks for it - ith is the thread that runs it
+static void ggml_graph_compute_node(
+        struct ggml_compute_params * params,
+        struct ggml_tensor * node,
+        const struct ggml_cplan * cplan,
+        int node_n,
+        int ith) {
+    if (cplan->perf_node_us == NULL) {
+        ggml_compute_forward(params, node);
+        return;
+    }
+
+    int64_t * t_us = cplan->perf_node_us + 2*((int64_t) node_n*cplan->n_threads + ith);
+
+    t_us[0] = ggml_time_us();
+    ggml_compute_forward(params, node);
+    t_us[1] = ggml_time_us();
+}
+
 static thread_ret_t ggml_graph_compute_thread(void * data) {
     struct ggml_compute_state * state = (struct ggml_compute_state *) data;
 
@@ -15835,7 +16542,11 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
 
     const int   n_threads   = state->shared->n_threads;
 
-    set_numa_thread_affinity(state->ith, n_threads);
+    if (cplan->cpus != NULL && cplan->n_cpus > 0) {
+        set_cplan_thread_affinity(cplan, state->ith);
+    } else {
+        set_numa_thread_affinity(state->ith, n_threads);
+    }
 
     int node_n = -1;
 
@@ -15873,7 +16584,7 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
                 const int n_tasks = ggml_get_n_tasks(node, n_threads);
 
                 state->shared->perf_node_start_cycles  = ggml_perf_cycles();
-                state->shared->perf_node_start_time_us = ggml_perf_time_us();
+                state->shared->perf_node_start_time_us = ggml_graph_compute_perf_time_us(cplan);
 
                 params.nth = n_tasks;
 
@@ -15887,7 +16598,7 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
                     // TODO: maybe push node_n to the atomic but if other threads see n_tasks is 1,
                     // they do something more efficient than spinning (?)
                     params.type = GGML_TASK_COMPUTE;
-                    ggml_compute_forward(&params, node);
+                    ggml_graph_compute_node(&params, node, cplan, node_n, state->ith);
 
                     if (GGML_OP_HAS_FINALIZE[node->op]) {
                         params.type = GGML_TASK_FINALIZE;
@@ -15939,7 +16650,7 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
         };
 
         if (state->ith < n_tasks) {
-            ggml_compute_forward(&params, node);
+            ggml_graph_compute_node(&params, node, cplan, node_n, state->ith);
         }
     }
 
@@ -16049,6 +16760,14 @@ struct ggml_cplan ggml_graph_plan(struct ggml_cgraph * cgraph, int n_threads) {
                 {
                     n_tasks = n_threads;
                 } break;
+            case GGML_OP_CONV_1D_K3_PH:
+                {
+                    const int64_t ne00 = node->src[0]->ne[0];  // K
+                    const int64_t ne01 = node->src[0]->ne[1];  // IC
+                    const int64_t ne02 = node->src[0]->ne[2];  // OC
+
+                    cur = ggml_type_size(node->src[0]->type)*ne00*ne01*ne02;
+                } break;
             case GGML_OP_CONV_TRANSPOSE_2D:
                 {
                     const int64_t ne00 = node->src[0]->ne[0]; // W
@@ -16176,6 +16895,13 @@ int ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
     workers[0].ith = 0;
     workers[0].shared = &state_shared;
 
+    const bool has_affinity = cplan->cpus != NULL && cplan->n_cpus > 0;
+
+    ggml_thread_affinity_t affinity_prev;
+    if (has_affinity) {
+        get_thread_affinity(&affinity_prev);
+    }
+
     const int64_t perf_start_cycles  = ggml_perf_cycles();
     const int64_t perf_start_time_us = ggml_perf_time_us();
 
@@ -16183,7 +16909,11 @@ int ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
     int compute_status = (size_t) ggml_graph_compute_thread(&workers[0]);
 
     // don't leave affinity set on the main thread
-    clear_numa_thread_affinity();
+    if (has_affinity) {
+        set_thread_affinity(&affinity_prev);
+    } else {
+        clear_numa_thread_affinity();
+    }
 
     // join or kill thread pool
     if (n_threads > 1) {
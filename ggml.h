@@ -380,6 +380,9 @@ extern "C" {
         GGML_OP_RMS_NORM,
         GGML_OP_RMS_NORM_BACK,
         GGML_OP_GROUP_NORM,
+        GGML_OP_NORM_AFFINE,     // norm(x)*w + b
+        GGML_OP_ADD_NORM_AFFINE, // x + r, norm(x + r)*w + b
+        GGML_OP_ADD_GELU,        // gelu(x + b)
 
         GGML_OP_MUL_MAT,
         GGML_OP_OUT_PROD,
@@ -405,6 +408,7 @@ extern "C" {
         GGML_OP_CLAMP,
         GGML_OP_CONV_TRANSPOSE_1D,
         GGML_OP_IM2COL,
+        GGML_OP_CONV_1D_K3_PH,
         GGML_OP_CONV_TRANSPOSE_2D,
         GGML_OP_POOL_1D,
         GGML_OP_POOL_2D,
@@ -533,6 +537,17 @@ extern "C" {
         // abort ggml_graph_compute when true
         bool (*abort_callback)(void * data);
         void * abort_callback_data;
+
+        // [EXPERIMENTAL] CPU affinity of the compute threads (Linux only, NULL - not set)
+        // the calling thread is thread 0, its affinity is restored when ggml_graph_compute returns
+        const int * cpus;     // CPU ids
+        int         n_cpus;
+        bool        cpus_pin; // true - thread i runs on cpus[i % n_cpus], false - the threads run on any of the cpus
+
+        // [EXPERIMENTAL] per-node timings (NULL - not recorded), [n_nodes][n_threads][2] zero-initialized by the caller
+        // the COMPUTE pass of node i on thread ith is recorded as the ggml_time_us() at its start and end, and the
+        // perf_* fields of the nodes are updated with the time of the whole node (INIT + COMPUTE + FINALIZE)
+        int64_t * perf_node_us;
     };
 
     enum ggml_cgraph_eval_order {
@@ -955,6 +970,13 @@ extern "C" {
             struct ggml_context * ctx,
             struct ggml_tensor  * a);
 
+    // fused ggml_add + ggml_gelu: gelu(a + b)
+    // b is broadcast across the rows of a
+    GGML_API struct ggml_tensor * ggml_add_gelu(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * b);
+
     GGML_API struct ggml_tensor * ggml_gelu_quick(
             struct ggml_context * ctx,
             struct ggml_tensor  * a);
@@ -989,6 +1011,26 @@ extern "C" {
             struct ggml_tensor  * a,
             float                 eps);
 
+    // fused ggml_norm + ggml_mul + ggml_add: norm(a)*w + b
+    // w and b are vectors with a->ne[0] elements
+    GGML_API struct ggml_tensor * ggml_norm_affine(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * w,
+            struct ggml_tensor  * b,
+            float                 eps);
+
+    // fused residual add + ggml_norm_affine: s = a + r, y = norm(s)*w + b
+    // a and r are matrices of the same shape
+    // the result is [ne0, ne1, 2] with s in the first plane and y in the second
+    GGML_API struct ggml_tensor * ggml_add_norm_affine(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * r,
+            struct ggml_tensor  * w,
+            struct ggml_tensor  * b,
+            float                 eps);
+
     GGML_API struct ggml_tensor * ggml_rms_norm(
             struct ggml_context * ctx,
             struct ggml_tensor  * a,
@@ -1422,6 +1464,21 @@ extern "C" {
             int                   s,
             int                   d);
 
+    // conv_1d with kernel size 3, padding = 1 and dilation = 1, computed directly without im2col
+    // the bias is broadcast along the output rows and is followed by an optional GELU:
+    //   gelu(conv_1d_ph(a, b, s, 1) + bias)
+    // a:      [3, IC, OC]
+    // b:      [IL, IC]
+    // bias:   [1, OC]
+    // result: [OL, OC]
+    GGML_API struct ggml_tensor * ggml_conv_1d_k3_ph(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * b,
+            struct ggml_tensor  * bias,
+            int                   s,
+            bool                  gelu);
+
     GGML_API struct ggml_tensor * ggml_conv_transpose_1d(
             struct ggml_context * ctx,
             struct ggml_tensor  * a,
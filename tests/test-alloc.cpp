@@ -0,0 +1,305 @@
+// checks that the decoding loop of whisper_full() does not allocate heap memory per token in steady state
+//
+// usage: test-alloc models/for-tests-ggml-tiny.en.bin
+//
+// the test models do not contain weights, so a small model with random weights is built in memory from the
+// hyperparameters, mel filters and vocabulary of the given model. the allocations are counted with a global
+// operator new hook and sampled in the logits filter callback, which is called once per decoded token
+//
+// random weights do not reach every path of the decoding loop, so some runs force the tokens in the logits filter
+//
+// it also checks that whisper_state_memory_usage() lists the buffers of the helper states of the concurrent fallback
+//
+#include "whisper.h"
+#include "ggml.h"
+
+#include "test-model.h"
+
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+static std::atomic<int64_t> g_n_alloc(0);
+
+void * operator new(std::size_t size) {
+    g_n_alloc++;
+
+    void * ptr = std::malloc(size == 0 ? 1 : size);
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+
+    return ptr;
+}
+
+void * operator new[](std::size_t size) {
+    return operator new(size);
+}
+
+void * operator new(std::size_t size, const std::nothrow_t &) noexcept {
+    g_n_alloc++;
+
+    return std::malloc(size == 0 ? 1 : size);
+}
+
+void * operator new[](std::size_t size, const std::nothrow_t & tag) noexcept {
+    return operator new(size, tag);
+}
+
+void operator delete(void * ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void * ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void * ptr, std::size_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void * ptr, std::size_t) noexcept {
+    std::free(ptr);
+}
+
+//
+// allocation counting
+//
+
+// tokens forced by the logits filter
+enum test_force {
+    TEST_FORCE_NONE,
+    TEST_FORCE_LOW_ENTROPY, // pseudo-random choice of 3 tokens: the loop detection checks the trigrams on every token
+    TEST_FORCE_FINISH,      // 2 tokens, the first one is followed by the end of the text: beams finish at most steps
+};
+
+struct test_alloc_stats {
+    test_force force = TEST_FORCE_NONE;
+
+    int64_t n_alloc_last = 0;
+
+    int n_window = 0; // windows started so far
+    int n_steps  = 0; // decoded tokens after the first window
+
+    int64_t n_alloc = 0; // allocations while decoding these tokens
+};
+
+// the first call of each window is for the prompt (no tokens yet) and the interval before it contains the work
+// between the windows. the first window warms up the scratch buffers of the state
+static void test_logits_filter(
+        struct whisper_context * ctx,
+          struct whisper_state * /*state*/,
+      const whisper_token_data * tokens,
+                           int   n_tokens,
+                         float * logits,
+                          void * user_data) {
+    auto & stats = *(test_alloc_stats *) user_data;
+
+    const int64_t n_alloc = g_n_alloc.load();
+
+    // arbitrary text tokens
+    const whisper_token id0 = 1000;
+
+    switch (stats.force) {
+        case TEST_FORCE_NONE:
+            break;
+        case TEST_FORCE_LOW_ENTROPY:
+            {
+                const whisper_token id = id0 + (((uint32_t) n_tokens*2654435761u) >> 16) % 3;
+
+                for (int i = 0; i < whisper_n_vocab(ctx); ++i) {
+                    logits[i] = i == id ? 0.0f : -INFINITY;
+                }
+            } break;
+        case TEST_FORCE_FINISH:
+            {
+                const bool finish = n_tokens > 0 && tokens[n_tokens - 1].id == id0;
+
+                for (int i = 0; i < whisper_n_vocab(ctx); ++i) {
+                    if (finish) {
+                        logits[i] = i == whisper_token_eot(ctx) ? 0.0f : -INFINITY;
+                    } else {
+                        logits[i] = i == id0 || i == id0 + 1 ? 0.0f : -INFINITY;
+                    }
+                }
+            } break;
+    }
+
+    if (n_tokens == 0) {
+        stats.n_window++;
+    } else if (stats.n_window > 1) {
+        stats.n_steps++;
+        stats.n_alloc += n_alloc - stats.n_alloc_last;
+    }
+
+    stats.n_alloc_last = g_n_alloc.load();
+}
+
+static void test_log(enum ggml_log_level /*level*/, const char * /*text*/, void * /*user_data*/) {
+}
+
+static bool test_run(struct whisper_context * ctx, const char * name, whisper_full_params params, const std::vector<float> & pcmf32, test_force force = TEST_FORCE_NONE) {
+    test_alloc_stats stats;
+    stats.force = force;
+
+    // the forced tokens are text tokens
+    params.no_timestamps = params.no_timestamps || force != TEST_FORCE_NONE;
+
+    params.n_threads       = 1;
+    params.print_progress  = false;
+    params.temperature_inc = 0.0f; // no fallbacks, every window is decoded once
+
+    params.logits_filter_callback           = test_logits_filter;
+    params.logits_filter_callback_user_data = &stats;
+
+    if (whisper_full(ctx, params, pcmf32.data(), pcmf32.size()) != 0) {
+        fprintf(stderr, "%s: %s: whisper_full() failed\n", __func__, name);
+        return false;
+    }
+
+    const bool ok = stats.n_steps > 0 && stats.n_alloc == 0;
+
+    printf("%s: %-12s: %d windows, %4d tokens after the first window, %4lld allocations - %s\n",
+            __func__, name, stats.n_window, stats.n_steps, (long long) stats.n_alloc, ok ? "OK" : "FAILED");
+
+    return ok;
+}
+
+// the helper states of n_fallback_parallel are created by whisper_full() and must be listed with their own KV caches
+// and decoder compute buffer
+static bool test_memory_usage(struct whisper_context * ctx, const std::vector<float> & pcmf32) {
+    const int n_fallback_parallel = 2;
+
+    whisper_full_params params = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+
+    params.n_threads           = 1;
+    params.print_progress      = false;
+    params.max_tokens          = 4;
+    params.n_fallback_parallel = n_fallback_parallel;
+
+    struct whisper_state * state = whisper_init_state(ctx);
+
+    bool ok = whisper_full_with_state(ctx, state, params, pcmf32.data(), 10*WHISPER_SAMPLE_RATE) == 0;
+
+    if (ok) {
+        std::vector<whisper_memory_entry> entries(whisper_state_memory_usage(state, nullptr, 0));
+        whisper_state_memory_usage(state, entries.data(), entries.size());
+
+        for (int k = 0; k < n_fallback_parallel; ++k) {
+            bool has_kv   = false;
+            bool has_comp = false;
+
+            size_t size = 0;
+
+            for (const auto & entry : entries) {
+                if (entry.helper != k) {
+                    continue;
+                }
+
+                has_kv   = has_kv   || (strcmp(entry.name, "kv_self")        == 0 && entry.size > 0);
+                has_comp = has_comp || (strcmp(entry.name, "compute_decode") == 0 && entry.size > 0);
+
+                size += entry.size;
+            }
+
+            printf("%s: fallback[%d]: %8.2f MB - %s\n", __func__, k, size/1024.0/1024.0, has_kv && has_comp ? "OK" : "FAILED");
+
+            ok = ok && has_kv && has_comp;
+        }
+    } else {
+        fprintf(stderr, "%s: whisper_full() failed\n", __func__);
+    }
+
+    whisper_free_state(state);
+
+    return ok;
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s for-tests-model.bin\n", argv[0]);
+        return 1;
+    }
+
+    whisper_log_set(test_log, nullptr);
+
+    std::vector<uint8_t> model;
+    if (!test_model_build(argv[1], 64, 2, 1, model)) {
+        return 1;
+    }
+
+    struct whisper_context * ctx = whisper_init_from_buffer_with_params(model.data(), model.size(), whisper_context_default_params());
+    if (ctx == nullptr) {
+        fprintf(stderr, "%s: failed to load the model\n", __func__);
+        return 1;
+    }
+
+    // 3 windows of noise
+    std::vector<float> pcmf32(3*30*WHISPER_SAMPLE_RATE);
+    {
+        std::mt19937 rng(1);
+        std::normal_distribution<float> dist(0.0f, 0.1f);
+
+        for (auto & x : pcmf32) {
+            x = dist(rng);
+        }
+    }
+
+    bool ok = true;
+
+    {
+        whisper_full_params params = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+
+        ok = test_run(ctx, "greedy", params, pcmf32) && ok;
+    }
+
+    {
+        whisper_full_params params = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+        params.draft_ngram = 3;
+
+        ok = test_run(ctx, "lookup", params, pcmf32) && ok;
+    }
+
+    {
+        whisper_full_params params = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+        params.temperature    = 0.5f;
+        params.greedy.best_of = 3;
+
+        ok = test_run(ctx, "sampling", params, pcmf32) && ok;
+    }
+
+    {
+        whisper_full_params params = whisper_full_default_params(WHISPER_SAMPLING_BEAM_SEARCH);
+        params.beam_search.beam_size = 3;
+
+        ok = test_run(ctx, "beam search", params, pcmf32) && ok;
+    }
+
+    {
+        whisper_full_params params = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+        params.loop_detect = true;
+
+        ok = test_run(ctx, "loop detect", params, pcmf32, TEST_FORCE_LOW_ENTROPY) && ok;
+    }
+
+    {
+        whisper_full_params params = whisper_full_default_params(WHISPER_SAMPLING_BEAM_SEARCH);
+        params.beam_search.beam_size = 3;
+        params.beam_search.patience  = 2.0f;
+
+        ok = test_run(ctx, "patience", params, pcmf32, TEST_FORCE_FINISH) && ok;
+    }
+
+    ok = test_memory_usage(ctx, pcmf32) && ok;
+
+    whisper_free(ctx);
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,259 @@
+// checks the fused CPU ops used by the whisper graphs against the sequence of ops that they replace
+//
+// usage: test-fused-ops
+//
+// the inputs are random. the fused and the reference results are computed in the same graph with several threads
+// and must agree within a tolerance, since the fused kernels accumulate in a different order
+//
+#include "ggml.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
+static const int n_threads = 3;
+
+static void test_fill(struct ggml_tensor * t, std::mt19937 & rng, float scale, float bias) {
+    std::normal_distribution<float> dist(0.0f, 1.0f);
+
+    const int64_t n = ggml_nelements(t);
+
+    for (int64_t i = 0; i < n; ++i) {
+        const float x = bias + scale*dist(rng);
+
+        if (t->type == GGML_TYPE_F16) {
+            ((ggml_fp16_t *) t->data)[i] = ggml_fp32_to_fp16(x);
+        } else {
+            ((float *) t->data)[i] = x;
+        }
+    }
+}
+
+// element i0, i1 of a F32 tensor, which may be a view
+static float test_get(const struct ggml_tensor * t, int64_t i0, int64_t i1) {
+    return *(const float *)((const char *) t->data + i0*t->nb[0] + i1*t->nb[1]);
+}
+
+static bool test_compare(const std::string & name, const struct ggml_tensor * res, const struct ggml_tensor * ref, float tol) {
+    GGML_ASSERT(res->ne[0] == ref->ne[0] && res->ne[1] == ref->ne[1]);
+
+    float max_err = 0.0f;
+
+    for (int64_t i1 = 0; i1 < res->ne[1]; ++i1) {
+        for (int64_t i0 = 0; i0 < res->ne[0]; ++i0) {
+            const float x = test_get(res, i0, i1);
+            const float y = test_get(ref, i0, i1);
+
+            // also catches NaNs
+            const float err = fabsf(x - y);
+            if (!(err <= max_err)) {
+                max_err = std::isnan(err) ? INFINITY : err;
+            }
+        }
+    }
+
+    const bool ok = max_err <= tol;
+
+    printf("%s: %-40s: max error = %.2e (tol = %.0e) - %s\n", __func__, name.c_str(), max_err, tol, ok ? "OK" : "FAILED");
+
+    return ok;
+}
+
+static struct ggml_context * test_init() {
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ 128*1024*1024,
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ false,
+    };
+
+    return ggml_init(params);
+}
+
+static void test_compute(struct ggml_context * ctx, const std::vector<struct ggml_tensor *> & outputs) {
+    struct ggml_cgraph * gf = ggml_new_graph(ctx);
+
+    for (auto * t : outputs) {
+        ggml_build_forward_expand(gf, t);
+    }
+
+    ggml_graph_compute_with_ctx(ctx, gf, n_threads);
+}
+
+// norm(a)*w + b
+static bool test_norm_affine(std::mt19937 & rng, int64_t ne0, int64_t ne1) {
+    struct ggml_context * ctx = test_init();
+
+    const float eps = 1e-5f;
+
+    struct ggml_tensor * a = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, ne1);
+    struct ggml_tensor * w = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, ne0);
+    struct ggml_tensor * b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, ne0);
+
+    test_fill(a, rng, 2.0f, 0.5f);
+    test_fill(w, rng, 0.1f, 1.0f);
+    test_fill(b, rng, 0.1f, 0.0f);
+
+    struct ggml_tensor * res = ggml_norm_affine(ctx, a, w, b, eps);
+    struct ggml_tensor * ref = ggml_add(ctx, ggml_mul(ctx, ggml_norm(ctx, a, eps), w), b);
+
+    test_compute(ctx, { res, ref });
+
+    const bool ok = test_compare("norm_affine [" + std::to_string(ne0) + ", " + std::to_string(ne1) + "]", res, ref, 1e-4f);
+
+    ggml_free(ctx);
+
+    return ok;
+}
+
+// s = a + r, norm(s)*w + b
+static bool test_add_norm_affine(std::mt19937 & rng, int64_t ne0, int64_t ne1) {
+    struct ggml_context * ctx = test_init();
+
+    const float eps = 1e-5f;
+
+    struct ggml_tensor * a = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, ne1);
+    struct ggml_tensor * r = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, ne1);
+    struct ggml_tensor * w = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, ne0);
+    struct ggml_tensor * b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, ne0);
+
+    test_fill(a, rng, 1.0f, 0.0f);
+    test_fill(r, rng, 2.0f, 0.5f);
+    test_fill(w, rng, 0.1f, 1.0f);
+    test_fill(b, rng, 0.1f, 0.0f);
+
+    struct ggml_tensor * res = ggml_add_norm_affine(ctx, a, r, w, b, eps);
+
+    struct ggml_tensor * res_sum  = ggml_view_2d(ctx, res, res->ne[0], res->ne[1], res->nb[1], 0);
+    struct ggml_tensor * res_norm = ggml_view_2d(ctx, res, res->ne[0], res->ne[1], res->nb[1], res->nb[2]);
+
+    struct ggml_tensor * ref_sum  = ggml_add(ctx, a, r);
+    struct ggml_tensor * ref_norm = ggml_add(ctx, ggml_mul(ctx, ggml_norm(ctx, ref_sum, eps), w), b);
+
+    test_compute(ctx, { res, ref_norm });
+
+    const std::string shape = " [" + std::to_string(ne0) + ", " + std::to_string(ne1) + "]";
+
+    bool ok = true;
+
+    ok = test_compare("add_norm_affine (sum)"  + shape, res_sum,  ref_sum,  0.0f) && ok;
+    ok = test_compare("add_norm_affine (norm)" + shape, res_norm, ref_norm, 1e-4f) && ok;
+
+    ggml_free(ctx);
+
+    return ok;
+}
+
+// gelu(a + b)
+static bool test_add_gelu(std::mt19937 & rng, int64_t ne0, int64_t ne1) {
+    struct ggml_context * ctx = test_init();
+
+    struct ggml_tensor * a = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, ne1);
+    struct ggml_tensor * b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, ne0);
+
+    test_fill(a, rng, 2.0f, 0.0f);
+    test_fill(b, rng, 0.5f, 0.0f);
+
+    struct ggml_tensor * res = ggml_add_gelu(ctx, a, b);
+    struct ggml_tensor * ref = ggml_gelu(ctx, ggml_add(ctx, a, b));
+
+    test_compute(ctx, { res, ref });
+
+    const bool ok = test_compare("add_gelu [" + std::to_string(ne0) + ", " + std::to_string(ne1) + "]", res, ref, 1e-5f);
+
+    ggml_free(ctx);
+
+    return ok;
+}
+
+// gelu(conv_1d_ph(w, x, s, 1) + bias) - x is the first il columns of a [il_full, ic] tensor, like the mel of a window
+// with audio_ctx < n_audio_ctx. im2col has no F32 kernel, so the F32 weights are checked against a plain loop
+static bool test_conv_1d_k3_ph(std::mt19937 & rng, enum ggml_type wtype, int s, int64_t ic, int64_t oc, int64_t il, int64_t il_full) {
+    struct ggml_context * ctx = test_init();
+
+    struct ggml_tensor * w    = ggml_new_tensor_3d(ctx, wtype,         3, ic, oc);
+    struct ggml_tensor * x    = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, il_full, ic);
+    struct ggml_tensor * bias = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 1, oc);
+
+    test_fill(w,    rng, 1.0f/sqrtf(3*ic), 0.0f);
+    test_fill(x,    rng, 1.0f,             0.0f);
+    test_fill(bias, rng, 0.2f,             0.0f);
+
+    if (il < il_full) {
+        x = ggml_view_2d(ctx, x, il, ic, x->nb[1], 0);
+    }
+
+    struct ggml_tensor * res = ggml_conv_1d_k3_ph(ctx, w, x, bias, s, true);
+    struct ggml_tensor * ref = nullptr;
+
+    if (wtype == GGML_TYPE_F16) {
+        ref = ggml_conv_1d_ph(ctx, w, x, s, 1);
+        ref = ggml_gelu(ctx, ggml_add(ctx, ref, ggml_repeat(ctx, bias, ref)));
+
+        test_compute(ctx, { res, ref });
+    } else {
+        test_compute(ctx, { res });
+
+        ref = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, res->ne[0], res->ne[1]);
+
+        for (int64_t io = 0; io < oc; ++io) {
+            for (int64_t ol = 0; ol < ref->ne[0]; ++ol) {
+                double sum = ((const float *) bias->data)[io];
+
+                for (int64_t ii = 0; ii < ic; ++ii) {
+                    for (int64_t k = 0; k < 3; ++k) {
+                        const int64_t i = ol*s + k - 1;
+                        if (i < 0 || i >= il) {
+                            continue;
+                        }
+
+                        sum += (double) ((const float *) w->data)[(io*ic + ii)*3 + k]*test_get(x, i, ii);
+                    }
+                }
+
+                const double gelu = 0.5*sum*(1.0 + tanh(sqrt(2.0/M_PI)*(sum + 0.044715*sum*sum*sum)));
+
+                ((float *) ref->data)[io*ref->ne[0] + ol] = (float) gelu;
+            }
+        }
+    }
+
+    char name[128];
+    snprintf(name, sizeof(name), "conv_1d_k3_ph %s s = %d [%lld/%lld, %lld]",
+            ggml_type_name(wtype), s, (long long) il, (long long) il_full, (long long) ic);
+
+    // the GELU of the CPU backend is read from a F16 table, so a small difference of its input can move the result
+    // by one F16 step
+    const bool ok = test_compare(name, res, ref, 5e-3f);
+
+    ggml_free(ctx);
+
+    return ok;
+}
+
+int main(int /*argc*/, char ** /*argv*/) {
+    std::mt19937 rng(1);
+
+    bool ok = true;
+
+    ok = test_norm_affine(rng, 384, 7) && ok;
+    ok = test_norm_affine(rng, 67,  5) && ok;
+
+    ok = test_add_norm_affine(rng, 384, 7) && ok;
+    ok = test_add_norm_affine(rng, 67,  5) && ok;
+
+    ok = test_add_gelu(rng, 1536, 7) && ok;
+    ok = test_add_gelu(rng, 67,   5) && ok;
+
+    for (enum ggml_type wtype : { GGML_TYPE_F16, GGML_TYPE_F32 }) {
+        for (int s : { 1, 2 }) {
+            ok = test_conv_1d_k3_ph(rng, wtype, s, 80, 40, 200, 200) && ok;
+            ok = test_conv_1d_k3_ph(rng, wtype, s, 80, 40, 137, 200) && ok;
+            ok = test_conv_1d_k3_ph(rng, wtype, s, 40, 40, 1,   4)   && ok;
+        }
+    }
+
+    return ok ? 0 : 1;
+}
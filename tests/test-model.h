@@ -0,0 +1,143 @@
+// small whisper model with random weights, built in memory for the tests
+//
+// the test models do not contain weights, so the hyperparameters, mel filters and vocabulary of one of them are
+// combined with random tensors of the given size
+//
+#pragma once
+
+#include "ggml.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+//
+// random model
+//
+
+struct test_model_writer {
+    std::vector<uint8_t> & buf;
+    std::mt19937 rng;
+
+    void put_i32(int32_t v) {
+        const uint8_t * p = (const uint8_t *) &v;
+        buf.insert(buf.end(), p, p + sizeof(v));
+    }
+
+    // ttype: 0 - F32, 1 - F16
+    void tensor(const std::string & name, const std::vector<int> & ne, int ttype, float scale, float bias) {
+        put_i32((int) ne.size());
+        put_i32((int) name.size());
+        put_i32(ttype);
+
+        size_t n = 1;
+        for (int x : ne) {
+            put_i32(x);
+            n *= x;
+        }
+
+        buf.insert(buf.end(), name.begin(), name.end());
+
+        std::normal_distribution<float> dist(0.0f, 1.0f);
+
+        for (size_t i = 0; i < n; ++i) {
+            const float v = bias + scale*dist(rng);
+
+            if (ttype == 0) {
+                const uint8_t * p = (const uint8_t *) &v;
+                buf.insert(buf.end(), p, p + sizeof(v));
+            } else {
+                const ggml_fp16_t h = ggml_fp32_to_fp16(v);
+                const uint8_t * p = (const uint8_t *) &h;
+                buf.insert(buf.end(), p, p + sizeof(h));
+            }
+        }
+    }
+
+    void layer(const std::string & prefix, int n_state, bool cross) {
+        const float s = 1.0f/sqrtf(n_state);
+
+        tensor(prefix + "mlp_ln.weight",     { n_state },            0, 0.05f, 1.0f);
+        tensor(prefix + "mlp_ln.bias",       { n_state },            0, 0.02f, 0.0f);
+        tensor(prefix + "mlp.0.weight",      { n_state, 4*n_state }, 1, s,     0.0f);
+        tensor(prefix + "mlp.0.bias",        { 4*n_state },          0, 0.02f, 0.0f);
+        tensor(prefix + "mlp.2.weight",      { 4*n_state, n_state }, 1, s/2,   0.0f);
+        tensor(prefix + "mlp.2.bias",        { n_state },            0, 0.02f, 0.0f);
+
+        const char * attns[] = { "attn", "cross_attn" };
+
+        for (int k = 0; k < (cross ? 2 : 1); ++k) {
+            const std::string p = prefix + attns[k];
+
+            tensor(p + "_ln.weight",         { n_state },            0, 0.05f, 1.0f);
+            tensor(p + "_ln.bias",           { n_state },            0, 0.02f, 0.0f);
+            tensor(p + ".query.weight",      { n_state, n_state },   1, s,     0.0f);
+            tensor(p + ".query.bias",        { n_state },            0, 0.02f, 0.0f);
+            tensor(p + ".key.weight",        { n_state, n_state },   1, s,     0.0f);
+            tensor(p + ".value.weight",      { n_state, n_state },   1, s,     0.0f);
+            tensor(p + ".value.bias",        { n_state },            0, 0.02f, 0.0f);
+            tensor(p + ".out.weight",        { n_state, n_state },   1, s,     0.0f);
+            tensor(p + ".out.bias",          { n_state },            0, 0.02f, 0.0f);
+        }
+    }
+};
+
+static bool test_model_build(const char * fname, int n_state, int n_head, int n_layer, std::vector<uint8_t> & buf) {
+    FILE * f = fopen(fname, "rb");
+    if (f == nullptr) {
+        fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname);
+        return false;
+    }
+
+    uint8_t tmp[65536];
+    size_t n;
+    while ((n = fread(tmp, 1, sizeof(tmp), f)) > 0) {
+        buf.insert(buf.end(), tmp, tmp + n);
+    }
+    fclose(f);
+
+    // magic, n_vocab, n_audio_ctx, n_audio_state, n_audio_head, n_audio_layer,
+    // n_text_ctx, n_text_state, n_text_head, n_text_layer, n_mels, ftype
+    int32_t hp[12];
+    memcpy(hp, buf.data(), sizeof(hp));
+
+    const int n_vocab     = hp[1];
+    const int n_audio_ctx = hp[2];
+    const int n_text_ctx  = hp[6];
+    const int n_mels      = hp[10];
+
+    hp[3] = n_state; hp[4] = n_head; hp[5] = n_layer;
+    hp[7] = n_state; hp[8] = n_head; hp[9] = n_layer;
+    hp[11] = 1;
+
+    memcpy(buf.data(), hp, sizeof(hp));
+
+    test_model_writer w = { buf, std::mt19937(42) };
+
+    w.tensor("encoder.positional_embedding", { n_state, n_audio_ctx },   0, 0.1f,                   0.0f);
+    w.tensor("encoder.conv1.weight",         { 3, n_mels, n_state },     1, 1.0f/sqrtf(3*n_mels),   0.0f);
+    w.tensor("encoder.conv1.bias",           { 1, n_state },             0, 0.02f,                  0.0f);
+    w.tensor("encoder.conv2.weight",         { 3, n_state, n_state },    1, 1.0f/sqrtf(3*n_state),  0.0f);
+    w.tensor("encoder.conv2.bias",           { 1, n_state },             0, 0.02f,                  0.0f);
+    w.tensor("encoder.ln_post.weight",       { n_state },                0, 0.05f,                  1.0f);
+    w.tensor("encoder.ln_post.bias",         { n_state },                0, 0.02f,                  0.0f);
+
+    for (int i = 0; i < n_layer; ++i) {
+        w.layer("encoder.blocks." + std::to_string(i) + ".", n_state, false);
+    }
+
+    w.tensor("decoder.positional_embedding",   { n_state, n_text_ctx },  0, 0.1f,                   0.0f);
+    w.tensor("decoder.token_embedding.weight", { n_state, n_vocab },     1, 0.5f,                   0.0f);
+    w.tensor("decoder.ln.weight",              { n_state },              0, 0.05f,                  1.0f);
+    w.tensor("decoder.ln.bias",                { n_state },              0, 0.02f,                  0.0f);
+
+    for (int i = 0; i < n_layer; ++i) {
+        w.layer("decoder.blocks." + std::to_string(i) + ".", n_state, true);
+    }
+
+    return true;
+}
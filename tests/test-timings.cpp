@@ -0,0 +1,147 @@
+// checks that the timings of whisper_full() count the same decoder work with and without concurrent fallback
+//
+// usage: test-timings models/for-tests-ggml-tiny.en.bin
+//
+// the helper states of n_fallback_parallel decode the next temperatures, and their counters and latency histograms
+// are merged into the state of the whisper_full() call. a logits filter forces the same short sequence at every
+// temperature and the logprob threshold rejects all of them, so both runs decode every temperature in full
+//
+#include "whisper.h"
+
+#include "test-model.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+struct test_forced {
+    whisper_token id;  // text token forced at every step
+    whisper_token eot;
+    int n_tokens;      // number of forced text tokens before the end of the text
+};
+
+static void test_logits_filter(
+        struct whisper_context * ctx,
+          struct whisper_state * /*state*/,
+      const whisper_token_data * /*tokens*/,
+                           int   n_tokens,
+                         float * logits,
+                          void * user_data) {
+    const auto & forced = *(const test_forced *) user_data;
+
+    const whisper_token id = n_tokens < forced.n_tokens ? forced.id : forced.eot;
+
+    for (int i = 0; i < whisper_n_vocab(ctx); ++i) {
+        logits[i] = i == id ? 0.0f : -INFINITY;
+    }
+}
+
+static void test_log(enum ggml_log_level /*level*/, const char * /*text*/, void * /*user_data*/) {
+}
+
+static int32_t test_hist_sum(const int32_t * hist) {
+    int32_t sum = 0;
+    for (int i = 0; i < WHISPER_TIMINGS_HIST_SIZE; ++i) {
+        sum += hist[i];
+    }
+    return sum;
+}
+
+static bool test_run(struct whisper_context * ctx, int n_fallback_parallel, test_forced & forced, const std::vector<float> & pcmf32, whisper_timings & timings) {
+    whisper_full_params params = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+
+    params.n_threads           = 1;
+    params.print_progress      = false;
+    params.no_timestamps       = true;
+    params.logprob_thold       = 1.0f; // every temperature falls back
+    params.n_fallback_parallel = n_fallback_parallel;
+
+    params.logits_filter_callback           = test_logits_filter;
+    params.logits_filter_callback_user_data = &forced;
+
+    whisper_reset_timings(ctx);
+
+    if (whisper_full(ctx, params, pcmf32.data(), pcmf32.size()) != 0) {
+        fprintf(stderr, "%s: whisper_full() failed with n_fallback_parallel = %d\n", __func__, n_fallback_parallel);
+        return false;
+    }
+
+    timings = whisper_get_timings(ctx);
+
+    printf("%s: n_fallback_parallel = %d: %3d prompt, %3d decode, %3d sample, %d + %d fallbacks, histograms %d / %d / %d\n",
+            __func__, n_fallback_parallel, timings.n_prompt, timings.n_decode, timings.n_sample, timings.n_fail_p, timings.n_fail_h,
+            test_hist_sum(timings.hist_encode_us), test_hist_sum(timings.hist_prompt_us), test_hist_sum(timings.hist_decode_us));
+
+    return true;
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s for-tests-model.bin\n", argv[0]);
+        return 1;
+    }
+
+    whisper_log_set(test_log, nullptr);
+
+    std::vector<uint8_t> model;
+    if (!test_model_build(argv[1], 64, 2, 1, model)) {
+        return 1;
+    }
+
+    struct whisper_context * ctx = whisper_init_from_buffer_with_params(model.data(), model.size(), whisper_context_default_params());
+    if (ctx == nullptr) {
+        fprintf(stderr, "%s: failed to load the model\n", __func__);
+        return 1;
+    }
+
+    test_forced forced;
+    {
+        whisper_token tokens[8];
+        if (whisper_tokenize(ctx, " the", tokens, 8) != 1) {
+            fprintf(stderr, "%s: failed to tokenize\n", __func__);
+            whisper_free(ctx);
+            return 1;
+        }
+
+        forced.id       = tokens[0];
+        forced.eot      = whisper_token_eot(ctx);
+        forced.n_tokens = 4;
+    }
+
+    // a single window of noise
+    std::vector<float> pcmf32(10*WHISPER_SAMPLE_RATE);
+    {
+        std::mt19937 rng(1);
+        std::normal_distribution<float> dist(0.0f, 0.1f);
+
+        for (auto & x : pcmf32) {
+            x = dist(rng);
+        }
+    }
+
+    whisper_timings t0;
+    whisper_timings t1;
+
+    bool ok = test_run(ctx, 0, forced, pcmf32, t0) && test_run(ctx, 2, forced, pcmf32, t1);
+
+    if (ok) {
+        ok = t0.n_decode > 0 &&
+            t0.n_prompt == t1.n_prompt &&
+            t0.n_decode == t1.n_decode &&
+            t0.n_sample == t1.n_sample &&
+            t0.n_fail_p == t1.n_fail_p &&
+            t0.n_fail_h == t1.n_fail_h &&
+            test_hist_sum(t0.hist_encode_us) == test_hist_sum(t1.hist_encode_us) &&
+            test_hist_sum(t0.hist_prompt_us) == test_hist_sum(t1.hist_prompt_us) &&
+            test_hist_sum(t0.hist_decode_us) == test_hist_sum(t1.hist_decode_us) &&
+            test_hist_sum(t0.hist_window_us) == test_hist_sum(t1.hist_window_us);
+
+        printf("%s: %s\n", __func__, ok ? "OK" : "FAILED");
+    }
+
+    whisper_free(ctx);
+
+    return ok ? 0 : 1;
+}
@@ -21,17 +21,24 @@
 #include "ggml-backend.h"
 
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
+#include <cerrno>
 #define _USE_MATH_DEFINES
 #include <cmath>
 #include <cstdio>
 #include <cstdarg>
+#include <cstdlib>
 #include <cstring>
 #include <fstream>
+#include <limits>
 #include <map>
-#include <set>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
+#include <tuple>
 #include <vector>
 #include <regex>
 #include <random>
@@ -41,6 +48,11 @@
 #pragma warning(disable: 4244 4267) // possible loss of data
 #endif
 
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 #if defined(GGML_BIG_ENDIAN)
 #include <bit>
 
@@ -149,6 +161,10 @@ static void whisper_log_callback_default(ggml_log_level level, const char * text
 //#define WHISPER_USE_FLASH_FF
 #define WHISPER_MAX_DECODERS 16
 #define WHISPER_MAX_NODES 4096
+#define WHISPER_MAX_DRAFT 16
+
+// granularity of the automatic audio context sizing (see whisper_full_params.audio_ctx_auto)
+#define WHISPER_AUDIO_CTX_BUCKET 128
 
 //
 // ggml helpers
@@ -159,12 +175,21 @@ static void ggml_graph_compute_helper(
         std::vector<uint8_t> & buf,
                          int   n_threads,
       whisper_abort_callback   abort_callback,
-                        void * abort_callback_data) {
+                        void * abort_callback_data,
+      const std::vector<int> * cpus = nullptr,
+                     int64_t * perf_node_us = nullptr) {
     struct ggml_cplan plan = ggml_graph_plan(graph, n_threads);
 
     plan.abort_callback = abort_callback;
     plan.abort_callback_data = abort_callback_data;
 
+    plan.perf_node_us = perf_node_us;
+
+    if (cpus != nullptr && !cpus->empty()) {
+        plan.cpus   = cpus->data();
+        plan.n_cpus = cpus->size();
+    }
+
     if (plan.work_size > 0) {
         buf.resize(plan.work_size);
         plan.work_data = buf.data();
@@ -176,9 +201,11 @@ static void ggml_graph_compute_helper(
 static void ggml_graph_compute_helper(
        struct ggml_backend * backend,
         struct ggml_cgraph * graph,
-                       int   n_threads) {
+                       int   n_threads,
+                   int64_t * perf_node_us = nullptr) {
     if (ggml_backend_is_cpu(backend)) {
         ggml_backend_cpu_set_n_threads(backend, n_threads);
+        ggml_backend_cpu_set_perf_node_us(backend, perf_node_us);
     }
 #ifdef GGML_USE_METAL
     if (ggml_backend_is_metal(backend)) {
@@ -186,6 +213,155 @@ static void ggml_graph_compute_helper(
     }
 #endif
     ggml_backend_graph_compute(backend, graph);
+
+    if (ggml_backend_is_cpu(backend)) {
+        ggml_backend_cpu_set_perf_node_us(backend, nullptr);
+    }
+}
+
+// [EXPERIMENTAL] per-node profiler of the compute graphs, see whisper_profile_enable()
+struct whisper_profile_event {
+    const char * graph;   // "conv", "encoder", "cross", "decoder"
+    std::string  name;    // tensor name, empty for the span of a whole graph
+    std::string  op;
+    ggml_type    type;
+    int64_t      ne[4];
+    int          n_threads;
+    int          pid;     // index of the calling thread in whisper_profile::threads
+    int          tid;     // index of the ggml compute thread, -1 for the span of a node over all of its threads
+    int64_t      t_start_us;
+    int64_t      t_dur_us;
+};
+
+struct whisper_profile {
+    std::atomic<bool> enabled { false };
+
+    // graphs can be computed from more than one thread (e.g. encoding the next window in the background)
+    std::mutex mutex;
+
+    std::vector<whisper_profile_event> events;
+    std::vector<std::thread::id>       threads;
+};
+
+static const char * whisper_profile_op_name(const struct ggml_tensor * node) {
+    if (node->op != GGML_OP_UNARY) {
+        return ggml_op_name(node->op);
+    }
+
+    switch (ggml_get_unary_op(node)) {
+        case GGML_UNARY_OP_ABS:        return "ABS";
+        case GGML_UNARY_OP_SGN:        return "SGN";
+        case GGML_UNARY_OP_NEG:        return "NEG";
+        case GGML_UNARY_OP_STEP:       return "STEP";
+        case GGML_UNARY_OP_TANH:       return "TANH";
+        case GGML_UNARY_OP_ELU:        return "ELU";
+        case GGML_UNARY_OP_RELU:       return "RELU";
+        case GGML_UNARY_OP_GELU:       return "GELU";
+        case GGML_UNARY_OP_GELU_QUICK: return "GELU_QUICK";
+        case GGML_UNARY_OP_SILU:       return "SILU";
+        case GGML_UNARY_OP_LEAKY:      return "LEAKY";
+    }
+
+    return "UNARY";
+}
+
+// compute the graph with 'compute', timing its nodes in the ggml compute threads if the profiler is enabled
+// compute(gf, perf_node_us) passes perf_node_us to the CPU backend (see ggml_cplan.perf_node_us). each node gets a span
+// from the perf_* fields of the tensor (INIT + COMPUTE + FINALIZE) and a span for the COMPUTE pass on each of its threads
+// other backends do not time the nodes, so only the span of the whole graph is recorded for them
+template <typename F>
+static void whisper_graph_compute_profiled(whisper_profile & profile, const char * graph, struct ggml_cgraph * gf, int n_threads, F && compute) {
+    if (!profile.enabled) {
+        compute(gf, nullptr);
+        return;
+    }
+
+    std::vector<int64_t> perf_node_us(2*(size_t) gf->n_nodes*n_threads, 0);
+    std::vector<int64_t> perf_time_us(gf->n_nodes);
+
+    for (int i = 0; i < gf->n_nodes; ++i) {
+        perf_time_us[i] = gf->nodes[i]->perf_time_us;
+    }
+
+    const int64_t t_graph_start_us = ggml_time_us();
+
+    compute(gf, perf_node_us.data());
+
+    const int64_t t_graph_end_us = ggml_time_us();
+
+    std::vector<whisper_profile_event> events;
+    events.reserve((size_t) gf->n_nodes*(n_threads + 1) + 1);
+
+    for (int i = 0; i < gf->n_nodes; ++i) {
+        struct ggml_tensor * node = gf->nodes[i];
+
+        whisper_profile_event event;
+        event.graph      = graph;
+        event.name       = ggml_get_name(node);
+        event.op         = whisper_profile_op_name(node);
+        event.type       = node->type;
+        event.n_threads  = n_threads;
+        event.tid        = -1;
+        event.t_start_us = 0;
+        event.t_dur_us   = node->perf_time_us - perf_time_us[i];
+        for (int j = 0; j < 4; ++j) {
+            event.ne[j] = node->ne[j];
+        }
+
+        const size_t i_node = events.size();
+        events.push_back(event);
+
+        for (int ith = 0; ith < n_threads; ++ith) {
+            const int64_t * t_us = perf_node_us.data() + 2*((size_t) i*n_threads + ith);
+            if (t_us[0] == 0) {
+                continue; // no task for this thread
+            }
+
+            if (events[i_node].t_start_us == 0 || t_us[0] < events[i_node].t_start_us) {
+                events[i_node].t_start_us = t_us[0];
+            }
+
+            event.tid        = ith;
+            event.t_start_us = t_us[0];
+            event.t_dur_us   = t_us[1] - t_us[0];
+
+            events.push_back(event);
+        }
+
+        // not computed by the CPU backend
+        if (events.size() == i_node + 1) {
+            events.pop_back();
+        }
+    }
+
+    {
+        whisper_profile_event event;
+        event.graph      = graph;
+        event.op         = graph;
+        event.type       = GGML_TYPE_F32;
+        event.n_threads  = n_threads;
+        event.tid        = 0;
+        event.t_start_us = t_graph_start_us;
+        event.t_dur_us   = t_graph_end_us - t_graph_start_us;
+        event.ne[0] = gf->n_nodes;
+        event.ne[1] = event.ne[2] = event.ne[3] = 1;
+
+        events.push_back(std::move(event));
+    }
+
+    std::lock_guard<std::mutex> lock(profile.mutex);
+
+    const auto id = std::this_thread::get_id();
+
+    int pid = std::find(profile.threads.begin(), profile.threads.end(), id) - profile.threads.begin();
+    if (pid == (int) profile.threads.size()) {
+        profile.threads.push_back(id);
+    }
+
+    for (auto & event : events) {
+        event.pid = pid;
+        profile.events.push_back(std::move(event));
+    }
 }
 
 // faster matrix multiplications for tensors that do not have dimension 0 divisible by "pad"
@@ -221,6 +397,81 @@ static struct ggml_tensor * ggml_mul_mat_pad(struct ggml_context * ctx, struct g
             ggml_mul_mat(ctx, x_1, y_1));
 }
 
+// fused ops are implemented only by the CPU backend - other backends get the equivalent sequence of ops
+static bool whisper_use_fused_ops(ggml_backend_t backend) {
+    return ggml_backend_is_cpu(backend);
+}
+
+// norm(cur)*w + b
+static struct ggml_tensor * whisper_norm(
+        struct ggml_context * ctx,
+         struct ggml_tensor * cur,
+         struct ggml_tensor * w,
+         struct ggml_tensor * b,
+                      float   eps,
+                       bool   fused) {
+    if (fused) {
+        return ggml_norm_affine(ctx, cur, w, b, eps);
+    }
+
+    cur = ggml_norm(ctx, cur, eps);
+
+    return ggml_add(ctx, ggml_mul(ctx, cur, w), b);
+}
+
+// *sum = cur + inp, returns norm(*sum)*w + b
+static struct ggml_tensor * whisper_add_norm(
+        struct ggml_context * ctx,
+         struct ggml_tensor * cur,
+         struct ggml_tensor * inp,
+         struct ggml_tensor * w,
+         struct ggml_tensor * b,
+                      float   eps,
+                       bool   fused,
+        struct ggml_tensor ** sum) {
+    if (fused) {
+        struct ggml_tensor * res = ggml_add_norm_affine(ctx, cur, inp, w, b, eps);
+
+        *sum = ggml_view_2d(ctx, res, res->ne[0], res->ne[1], res->nb[1], 0);
+
+        return ggml_view_2d(ctx, res, res->ne[0], res->ne[1], res->nb[1], res->nb[2]);
+    }
+
+    *sum = ggml_add(ctx, cur, inp);
+
+    return whisper_norm(ctx, *sum, w, b, eps, false);
+}
+
+// gelu(cur + b)
+static struct ggml_tensor * whisper_add_gelu(
+        struct ggml_context * ctx,
+         struct ggml_tensor * cur,
+         struct ggml_tensor * b,
+                       bool   fused) {
+    if (fused) {
+        return ggml_add_gelu(ctx, cur, b);
+    }
+
+    return ggml_gelu(ctx, ggml_add(ctx, cur, b));
+}
+
+// gelu(conv_1d_ph(w, cur) + b) for the encoder front end (kernel size 3)
+static struct ggml_tensor * whisper_conv_gelu(
+        struct ggml_context * ctx,
+         struct ggml_tensor * w,
+         struct ggml_tensor * cur,
+         struct ggml_tensor * b,
+                        int   s,
+                       bool   fused) {
+    if (fused) {
+        return ggml_conv_1d_k3_ph(ctx, w, cur, b, s, true);
+    }
+
+    cur = ggml_conv_1d_ph(ctx, w, cur, s, 1);
+
+    return ggml_gelu(ctx, ggml_add(ctx, cur, ggml_repeat(ctx, b, cur)));
+}
+
 // TODO: check if other platforms can benefit from this optimization
 // TODO: CUDA is currently broken - seems ggml_mul_mat does not handle views correctly
 #if defined(GGML_USE_METAL)
@@ -531,7 +782,9 @@ struct whisper_kv_cache {
 
     ggml_backend_buffer_t buffer;
 
-    int n; // number of tokens currently in the cache
+    int size;  // number of tokens that fit in the cache
+    int n;     // number of tokens currently in the cache
+    int n_max; // largest number of tokens in the cache so far
 };
 
 struct whisper_model {
@@ -590,6 +843,9 @@ struct whisper_grammar {
 
     // buffer for partially generated UTF-8 sequence from accepted tokens
     whisper_partial_utf8                                      partial_utf8;
+
+    // work container of whisper_grammar_accept_token(), swapped with stacks for each accepted character
+    std::vector<std::vector<const whisper_grammar_element *>> stacks_next;
 };
 
 struct whisper_grammar_candidate {
@@ -611,6 +867,28 @@ struct whisper_sequence {
     double score;            // likelihood rank score
 };
 
+// a continuation of the sequence of a decoder by one token
+struct beam_candidate {
+    int decoder_idx;
+    int seek_delta;
+
+    bool has_ts;
+
+    whisper_token_data token;
+
+    double sum_logprobs_all; // of the sequence, including the token
+};
+
+// a hypothesis that is moved out of the beams when it is finished (see beam_search.patience)
+struct beam_hypothesis {
+    int decoder_idx;
+    int seek_delta;
+
+    bool has_ts;
+
+    whisper_sequence sequence;
+};
+
 // TAGS: WHISPER_DECODER_INIT
 struct whisper_decoder {
     // each decoder keeps its own KV-cache
@@ -654,11 +932,40 @@ struct kv_buf {
     std::vector<uint8_t> v;
 };
 
+// work containers of whisper_kv_swap_fast(), reused between the calls to avoid memory allocations
+struct whisper_kv_swap_scratch {
+    std::vector<int> two_copy; // decoder indices, in increasing order
+    std::vector<int> one_copy;
+
+    std::vector<uint8_t> is_two_copy; // [n_decoders]
+    std::vector<uint8_t> is_p_swap;   // [n_decoders]
+
+    std::vector<whisper_pair<int, int>> p_swap_vec;
+};
+
+// storage for the tensor and graph structs of a graph
+// unlike std::vector, it is not zero-filled: ggml initializes what it allocates in it and most of the
+// WHISPER_MAX_NODES capacity is never touched, so filling it would dominate the cost of whisper_init_state()
+struct whisper_meta_buffer {
+    std::unique_ptr<uint8_t[]> buf;
+    size_t n = 0;
+
+    void resize(size_t size) {
+        if (size != n) {
+            buf.reset(new uint8_t[size]);
+            n = size;
+        }
+    }
+
+    uint8_t * data() { return buf.get(); }
+    size_t    size() const { return n; }
+};
+
 // ggml_allocr wrapper for whisper usage
 struct whisper_allocr {
     ggml_allocr * alloc = nullptr;
 
-    std::vector<uint8_t> meta;
+    whisper_meta_buffer meta;
 
     ggml_backend_buffer_t buffer;
 };
@@ -679,23 +986,39 @@ static void whisper_allocr_graph_init(struct whisper_allocr & allocr, ggml_backe
     ggml_allocr_alloc_graph(alloc, get_graph());
 }
 
-static void whisper_allocr_graph_realloc(struct whisper_allocr & allocr, ggml_backend_t backend) {
-    if (allocr.alloc == nullptr) {
-        // this can be null if we use external encoder like CoreML or OpenVINO
-        return;
-    }
-
+// replace the measure allocator (if any) with an allocator over a buffer of the given size
+// the size comes from whisper_allocr_graph_init() or from the sizes cached in the context
+static void whisper_allocr_graph_realloc(struct whisper_allocr & allocr, ggml_backend_t backend, size_t size) {
     auto & alloc  = allocr.alloc;
     auto & buffer = allocr.buffer;
 
-    size_t size = ggml_allocr_max_size(alloc);
+    if (alloc) {
+        ggml_allocr_free(alloc);
+    }
 
-    ggml_allocr_free(alloc);
+    allocr.meta.resize(ggml_tensor_overhead()*WHISPER_MAX_NODES + ggml_graph_overhead());
 
     buffer = ggml_backend_alloc_buffer(backend, size);
     alloc = ggml_allocr_new_from_buffer(buffer);
 }
 
+// replace the allocators of graphs that are never computed at the same time by allocators over a single buffer,
+// sized for the largest graph. the allocators do not own the buffer
+static void whisper_allocr_graph_realloc_shared(const std::vector<whisper_allocr *> & allocrs, ggml_backend_buffer_t & buffer, ggml_backend_t backend, size_t size) {
+    buffer = ggml_backend_alloc_buffer(backend, size);
+
+    for (auto * allocr : allocrs) {
+        if (allocr->alloc) {
+            ggml_allocr_free(allocr->alloc);
+        }
+
+        allocr->meta.resize(ggml_tensor_overhead()*WHISPER_MAX_NODES + ggml_graph_overhead());
+
+        allocr->alloc  = ggml_allocr_new_from_buffer(buffer);
+        allocr->buffer = nullptr;
+    }
+}
+
 static void whisper_allocr_free(struct whisper_allocr & allocr) {
     if (allocr.alloc) {
         ggml_allocr_free(allocr.alloc);
@@ -704,9 +1027,131 @@ static void whisper_allocr_free(struct whisper_allocr & allocr) {
     }
 }
 
+//
+// [EXPERIMENTAL] NUMA placement
+//
+
+// the CPUs of a NUMA node, false if there is no such node
+static bool whisper_numa_node_cpus(int node, std::vector<int> & cpus) {
+    cpus.clear();
+
+#if defined(__linux__)
+    std::ifstream fin("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+    if (!fin) {
+        return false;
+    }
+
+    // e.g. "0-7,16-23"
+    std::string list;
+    std::getline(fin, list);
+
+    const char * p = list.c_str();
+    while (*p != '\0') {
+        char * end = nullptr;
+
+        const long first = std::strtol(p, &end, 10);
+        if (end == p) {
+            break;
+        }
+
+        long last = first;
+        if (*end == '-') {
+            p = end + 1;
+            last = std::strtol(p, &end, 10);
+        }
+
+        for (long cpu = first; cpu <= last; ++cpu) {
+            cpus.push_back((int) cpu);
+        }
+
+        p = *end == ',' ? end + 1 : end;
+    }
+
+    return true;
+#else
+    GGML_UNUSED(node);
+
+    return false;
+#endif
+}
+
+int whisper_numa_n_nodes(void) {
+    static const int n_nodes = []() {
+        std::vector<int> cpus;
+
+        int n = 0;
+        while (n < 64 && whisper_numa_node_cpus(n, cpus)) {
+            ++n;
+        }
+
+        return std::max(1, n);
+    }();
+
+    return n_nodes;
+}
+
+// place the memory pages of a CPU buffer on a NUMA node (node >= 0) or interleave them across all nodes (node < 0)
+// the pages that are already in use are moved, the others are placed when they are first touched
+static bool whisper_numa_place(ggml_backend_buffer_t buffer, int node) {
+    if (buffer == nullptr) {
+        return true;
+    }
+
+#if defined(__linux__) && defined(SYS_mbind)
+    // from <linux/mempolicy.h>
+    const int      mpol_preferred  = 1;
+    const int      mpol_interleave = 3;
+    const unsigned mpol_mf_move    = 1u << 1;
+
+    // mbind() works on whole pages, the partial pages at the ends may be shared with other allocations
+    const uintptr_t page = sysconf(_SC_PAGESIZE);
+    const uintptr_t data = (uintptr_t) ggml_backend_buffer_get_base(buffer);
+
+    const uintptr_t beg = (data + page - 1) & ~(page - 1);
+    const uintptr_t end = (data + ggml_backend_buffer_get_size(buffer)) & ~(page - 1);
+
+    if (end <= beg) {
+        return true;
+    }
+
+    unsigned long mask = 0;
+    if (node >= 0) {
+        mask = 1ul << node;
+    } else {
+        for (int i = 0; i < whisper_numa_n_nodes(); ++i) {
+            mask |= 1ul << i;
+        }
+    }
+
+    if (syscall(SYS_mbind, beg, end - beg, node >= 0 ? mpol_preferred : mpol_interleave, &mask, 8*sizeof(mask) + 1, mpol_mf_move) != 0) {
+        WHISPER_LOG_WARN("%s: mbind() failed: %s\n", __func__, strerror(errno));
+        return false;
+    }
+
+    return true;
+#else
+    GGML_UNUSED(node);
+
+    WHISPER_LOG_WARN("%s: NUMA placement is not supported on this platform\n", __func__);
+
+    return false;
+#endif
+}
+
+// bucket i counts the latencies in [2^i, 2^(i+1)) us, the last bucket is open-ended
+static void whisper_hist_add(int32_t * hist, int64_t t_us) {
+    int i = 0;
+    while (i < WHISPER_TIMINGS_HIST_SIZE - 1 && t_us >= (int64_t(2) << i)) {
+        ++i;
+    }
+
+    hist[i]++;
+}
+
 struct whisper_state {
     int64_t t_sample_us = 0;
     int64_t t_encode_us = 0;
+    int64_t t_cross_us  = 0; // part of t_encode_us
     int64_t t_decode_us = 0;
     int64_t t_prompt_us = 0;
     int64_t t_mel_us = 0;
@@ -718,9 +1163,28 @@ struct whisper_state {
     int32_t n_fail_p = 0; // number of logprob threshold failures
     int32_t n_fail_h = 0; // number of entropy threshold failures
 
+    int32_t n_enc_hit       = 0; // number of windows that reused an encoder pass
+    int32_t n_window        = 0; // number of audio windows processed by whisper_full
+    int32_t n_window_tokens = 0; // number of tokens of the best decoder over these windows
+
+    // latency histograms, see whisper_timings
+    int32_t hist_encode_us[WHISPER_TIMINGS_HIST_SIZE] = {};
+    int32_t hist_prompt_us[WHISPER_TIMINGS_HIST_SIZE] = {};
+    int32_t hist_decode_us[WHISPER_TIMINGS_HIST_SIZE] = {};
+    int32_t hist_window_us[WHISPER_TIMINGS_HIST_SIZE] = {};
+
+    // [EXPERIMENTAL] per-node profiler
+    whisper_profile profile;
+
+    int32_t n_draft        = 0; // number of tokens proposed by the draft model
+    int32_t n_draft_accept = 0; // number of draft tokens accepted by the verification pass
+
     // cross-attention KV cache for the decoders
     // shared between all decoders
-    whisper_kv_cache kv_cross;
+    whisper_kv_cache kv_cross = {};
+
+    // [EXPERIMENTAL] decode-only states (see n_fallback_parallel) have no kv_cross and read the one of another state
+    const whisper_kv_cache * kv_cross_parent = nullptr;
     whisper_mel mel;
 
     whisper_decoder decoders[WHISPER_MAX_DECODERS] = {};
@@ -728,6 +1192,14 @@ struct whisper_state {
     // buffer for swapping KV caches between decoders during beam-search
     std::vector<kv_buf> kv_swap_bufs;
 
+    // work containers of the beam search, reused between the tokens to avoid memory allocations
+    std::vector<whisper_token_data> beam_tokens;     // top-k tokens of a decoder
+    std::vector<beam_candidate>     beam_candidates;
+    std::vector<int>                beam_src;        // the decoder that each decoder continues, -1 - none
+    whisper_sequence                beam_sequences[WHISPER_MAX_DECODERS] = {}; // sequences before the update
+    std::vector<beam_hypothesis>    beam_finished;   // finished hypotheses with patience, their sequences are reserved
+    whisper_kv_swap_scratch         kv_swap_scratch;
+
     ggml_backend_t backend = nullptr;
 
     // ggml-alloc:
@@ -738,7 +1210,18 @@ struct whisper_state {
     whisper_allocr alloc_cross;
     whisper_allocr alloc_decode;
 
+    // the largest number of tokens that fit in the decoder compute buffer, without / with the logits of all tokens
+    // grown on demand by whisper_decode_reserve()
+    int n_decode_max     = 0;
+    int n_decode_all_max = 0;
+
+    // the conv, encoder and cross graphs are computed one after the other, so their allocators share this buffer
+    ggml_backend_buffer_t buffer_enc = nullptr;
+
     // result of the encoder
+    // allocated in alloc_embd, outside of the shared buffer, since they are passed from one graph to the next
+    whisper_allocr alloc_embd;
+
     struct ggml_tensor * embd_conv = nullptr;
     struct ggml_tensor * embd_enc  = nullptr;
 
@@ -748,11 +1231,26 @@ struct whisper_state {
     // decode output (2-dimensional array: [n_tokens][n_vocab])
     std::vector<float> logits;
 
+    // [EXPERIMENTAL] restricted output projection - the rows of d_te for the tokens in vocab_ids
+    // while vocab_active is set, the decoder computes the logits only for these tokens
+    struct ggml_context * ctx_vocab    = nullptr;
+    ggml_backend_buffer_t buffer_vocab = nullptr;
+    struct ggml_tensor  * d_te_vocab   = nullptr;
+
+    std::vector<whisper_token> vocab_ids;
+    std::vector<float>         logits_vocab; // [n_tokens][vocab_ids.size()]
+
+    bool vocab_active = false;
+
     std::vector<whisper_segment> result_all;
     std::vector<whisper_token>   prompt_past;
 
     // work container used to avoid memory allocations
     std::vector<whisper_pair<double, whisper_vocab::id>> logits_id;
+    std::vector<double>                                  probs_cdf; // see whisper_discrete_init()
+
+    // tokens suppressed by suppress_non_speech_tokens, looked up on first use
+    std::vector<whisper_token> non_speech_ids;
 
     mutable std::mt19937 rng; // used for sampling at t > 0.0
 
@@ -778,6 +1276,36 @@ struct whisper_state {
 
     // [EXPERIMENTAL] speed-up techniques
     int32_t exp_n_audio_ctx = 0; // 0 - use default
+
+    // mel offset and audio context of the window that is currently in kv_cross (-1 - none)
+    // lets whisper_full reuse the encoder pass of the language detection
+    int32_t enc_seek  = -1;
+    int32_t enc_n_ctx =  0;
+
+    // [EXPERIMENTAL] pipelined encoding - the next window is encoded into kv_cross_next while the current one
+    // is decoded and the two caches are swapped when the prediction was right
+    whisper_kv_cache kv_cross_next = {};
+
+    int32_t enc_seek_next = -1;
+
+    std::vector<uint8_t> work_encode_next;
+
+    // [EXPERIMENTAL] states that decode the fallback temperatures concurrently (see n_fallback_parallel)
+    std::vector<whisper_state *> fallback_states;
+
+    // [EXPERIMENTAL] NUMA node and CPU affinity, see whisper_state_set_affinity()
+    int numa_node = -1;
+
+    std::vector<int> cpus;
+    bool             cpus_pin = false;
+};
+
+// worst-case sizes of the compute buffers of a state (0 - not measured yet)
+struct whisper_compute_sizes {
+    size_t conv   = 0;
+    size_t encode = 0; // 0 with an external encoder (CoreML, OpenVINO)
+    size_t cross  = 0;
+    size_t decode = 0;
 };
 
 struct whisper_context {
@@ -792,13 +1320,40 @@ struct whisper_context {
     whisper_model model;
     whisper_vocab vocab;
 
+    // [EXPERIMENTAL] copies of the weights on the other NUMA nodes, by node (WHISPER_NUMA_STRATEGY_REPLICATE)
+    std::map<int, whisper_model> model_replicas;
+
     whisper_state * state = nullptr;
 
     ggml_backend_t backend = nullptr;
 
     std::string path_model; // populated by whisper_init_from_file_with_params()
+
+    // compute buffer sizes measured by the first whisper_init_state(), the next states skip the measure passes
+    std::mutex mutex_compute_sizes;
+
+    whisper_compute_sizes compute_sizes;
 };
 
+// the weights read by a state - the copy on the NUMA node of the state, if there is one
+static const whisper_model & whisper_state_model(const whisper_context & wctx, const whisper_state & wstate) {
+    if (wstate.numa_node >= 0) {
+        const auto it = wctx.model_replicas.find(wstate.numa_node);
+        if (it != wctx.model_replicas.end()) {
+            return it->second;
+        }
+    }
+
+    return wctx.model;
+}
+
+// place a buffer of a state on the NUMA node of the state, if it is bound to one
+static void whisper_state_numa_place(const whisper_state & wstate, ggml_backend_buffer_t buffer) {
+    if (wstate.numa_node >= 0 && ggml_backend_is_cpu(wstate.backend)) {
+        whisper_numa_place(buffer, wstate.numa_node);
+    }
+}
+
 struct whisper_global {
     // We save the log callback globally
     ggml_log_callback log_callback = whisper_log_callback_default;
@@ -855,6 +1410,8 @@ static bool kv_cache_init(
         ggml_allocr_free(alloc);
     }
 
+    cache.size = n_ctx;
+
     return true;
 }
 
@@ -898,6 +1455,8 @@ static bool kv_cache_reinit(struct whisper_kv_cache & cache, ggml_backend_t back
         ggml_allocr_free(alloc);
     }
 
+    cache.n_max = 0;
+
     return true;
 }
 
@@ -940,231 +1499,35 @@ static ggml_backend_t whisper_backend_init(const whisper_context_params & params
     return ggml_backend_cpu_init();
 }
 
-// load the model from a ggml file
-//
-// file format:
-//
-//   - hparams
-//   - pre-computed mel filters
-//   - vocab
-//   - weights
-//
-// see the convert-pt-to-ggml.py script for details
-//
-static bool whisper_model_load(struct whisper_model_loader * loader, whisper_context & wctx) {
-    WHISPER_LOG_INFO("%s: loading model\n", __func__);
+// create the ggml context and the tensors of the weights, without allocating them
+static bool whisper_model_init_tensors(whisper_model & model, ggml_type wtype) {
+    const ggml_type vtype = wtype == GGML_TYPE_F32 ? GGML_TYPE_F32 : GGML_TYPE_F16; // conv type
 
-    const int64_t t_start_us = ggml_time_us();
+    // create the ggml context
+    {
+        const auto & hparams = model.hparams;
 
-    wctx.t_start_us = t_start_us;
+        const int n_audio_layer = hparams.n_audio_layer;
+        const int n_text_layer  = hparams.n_text_layer;
 
-    auto & model = wctx.model;
-    auto & vocab = wctx.vocab;
+        const size_t n_tensors = 10 /* input */ + 15 + 15*n_audio_layer + 24*n_text_layer;
 
-    // verify magic
-    {
-        uint32_t magic;
-        read_safe(loader, magic);
-        if (magic != GGML_FILE_MAGIC) {
-            WHISPER_LOG_ERROR("%s: invalid model data (bad magic)\n", __func__);
+        struct ggml_init_params params = {
+            /*.mem_size   =*/ n_tensors*ggml_tensor_overhead(),
+            /*.mem_buffer =*/ nullptr,
+            /*.no_alloc   =*/ true,
+        };
+
+        model.ctx = ggml_init(params);
+        if (!model.ctx) {
+            WHISPER_LOG_ERROR("%s: ggml_init() failed\n", __func__);
             return false;
         }
     }
 
-    //load hparams
+    // prepare tensors for the weights
     {
-        auto & hparams = model.hparams;
-
-        read_safe(loader, hparams.n_vocab);
-        read_safe(loader, hparams.n_audio_ctx);
-        read_safe(loader, hparams.n_audio_state);
-        read_safe(loader, hparams.n_audio_head);
-        read_safe(loader, hparams.n_audio_layer);
-        read_safe(loader, hparams.n_text_ctx);
-        read_safe(loader, hparams.n_text_state);
-        read_safe(loader, hparams.n_text_head);
-        read_safe(loader, hparams.n_text_layer);
-        read_safe(loader, hparams.n_mels);
-        read_safe(loader, hparams.ftype);
-
-        assert(hparams.n_text_state == hparams.n_audio_state);
-
-        std::string mver = "";
-
-        if (hparams.n_audio_layer == 4) {
-            model.type = e_model::MODEL_TINY;
-        }
-
-        if (hparams.n_audio_layer == 6) {
-            model.type = e_model::MODEL_BASE;
-        }
-
-        if (hparams.n_audio_layer == 12) {
-            model.type = e_model::MODEL_SMALL;
-        }
-
-        if (hparams.n_audio_layer == 24) {
-            model.type = e_model::MODEL_MEDIUM;
-        }
-
-        if (hparams.n_audio_layer == 32) {
-            model.type = e_model::MODEL_LARGE;
-
-            if (hparams.n_vocab == 51866) {
-                mver = " v3";
-            }
-        }
-
-        const int32_t qntvr = hparams.ftype / GGML_QNT_VERSION_FACTOR;
-
-        hparams.ftype %= GGML_QNT_VERSION_FACTOR;
-
-        // for the big tensors, we have the option to store the data in 16-bit floats or quantized
-        // in order to save memory and also to speed up the computation
-        wctx.wtype = ggml_ftype_to_ggml_type((ggml_ftype) (model.hparams.ftype));
-        if (wctx.wtype == GGML_TYPE_COUNT) {
-            WHISPER_LOG_ERROR("%s: invalid model (bad ftype value %d)\n", __func__, model.hparams.ftype);
-            return false;
-        }
-
-        WHISPER_LOG_INFO("%s: n_vocab       = %d\n", __func__, hparams.n_vocab);
-        WHISPER_LOG_INFO("%s: n_audio_ctx   = %d\n", __func__, hparams.n_audio_ctx);
-        WHISPER_LOG_INFO("%s: n_audio_state = %d\n", __func__, hparams.n_audio_state);
-        WHISPER_LOG_INFO("%s: n_audio_head  = %d\n", __func__, hparams.n_audio_head);
-        WHISPER_LOG_INFO("%s: n_audio_layer = %d\n", __func__, hparams.n_audio_layer);
-        WHISPER_LOG_INFO("%s: n_text_ctx    = %d\n", __func__, hparams.n_text_ctx);
-        WHISPER_LOG_INFO("%s: n_text_state  = %d\n", __func__, hparams.n_text_state);
-        WHISPER_LOG_INFO("%s: n_text_head   = %d\n", __func__, hparams.n_text_head);
-        WHISPER_LOG_INFO("%s: n_text_layer  = %d\n", __func__, hparams.n_text_layer);
-        WHISPER_LOG_INFO("%s: n_mels        = %d\n", __func__, hparams.n_mels);
-        WHISPER_LOG_INFO("%s: ftype         = %d\n", __func__, model.hparams.ftype);
-        WHISPER_LOG_INFO("%s: qntvr         = %d\n", __func__, qntvr);
-        WHISPER_LOG_INFO("%s: type          = %d (%s%s)\n", __func__, model.type, g_model_name.at(model.type).c_str(), mver.c_str());
-    }
-
-    // load mel filters
-    {
-        auto & filters = wctx.model.filters;
-
-        read_safe(loader, filters.n_mel);
-        read_safe(loader, filters.n_fft);
-
-        filters.data.resize(filters.n_mel * filters.n_fft);
-        loader->read(loader->context, filters.data.data(), filters.data.size() * sizeof(float));
-        BYTESWAP_FILTERS(filters);
-    }
-
-    // load vocab
-    {
-        int32_t n_vocab = 0;
-        read_safe(loader, n_vocab);
-
-        //if (n_vocab != model.hparams.n_vocab) {
-        //    WHISPER_LOG_ERROR("%s: invalid model file '%s' (bad vocab size %d != %d)\n",
-        //            __func__, fname.c_str(), n_vocab, model.hparams.n_vocab);
-        //    return false;
-        //}
-
-        std::string word;
-        std::vector<char> tmp;
-
-        tmp.reserve(128);
-
-        for (int i = 0; i < n_vocab; i++) {
-            uint32_t len;
-            read_safe(loader, len);
-
-            if (len > 0) {
-                tmp.resize(len);
-                loader->read(loader->context, &tmp[0], tmp.size()); // read to buffer
-                word.assign(&tmp[0], tmp.size());
-            } else {
-                // seems like we have an empty-string token in multi-language models (i = 50256)
-                //WHISPER_LOG_WARN("%s: warning: empty-string token in vocab, i = %d\n", __func__, i);
-                word = "";
-            }
-
-            vocab.token_to_id[word] = i;
-            vocab.id_to_token[i] = word;
-
-            //printf("%s: vocab[%d] = '%s'\n", __func__, i, word.c_str());
-        }
-
-        vocab.n_vocab = model.hparams.n_vocab;
-        if (vocab.is_multilingual()) {
-            vocab.token_eot++;
-            vocab.token_sot++;
-
-            // account for variable number of language tokens
-            const int dt = vocab.num_languages() - 98;
-
-            vocab.token_translate  += dt;
-            vocab.token_transcribe += dt;
-            vocab.token_solm       += dt;
-            vocab.token_prev       += dt;
-            vocab.token_nosp       += dt;
-            vocab.token_not        += dt;
-            vocab.token_beg        += dt;
-        }
-
-        if (n_vocab < model.hparams.n_vocab) {
-            WHISPER_LOG_INFO("%s: adding %d extra tokens\n", __func__, model.hparams.n_vocab - n_vocab);
-            for (int i = n_vocab; i < model.hparams.n_vocab; i++) {
-                if (i > vocab.token_beg) {
-                    word = "[_TT_" + std::to_string(i - vocab.token_beg) + "]";
-                } else if (i == vocab.token_eot) {
-                    word = "[_EOT_]";
-                } else if (i == vocab.token_sot) {
-                    word = "[_SOT_]";
-                } else if (i == vocab.token_solm) {
-                    word = "[_SOLM_]";
-                } else if (i == vocab.token_prev) {
-                    word = "[_PREV_]";
-                } else if (i == vocab.token_nosp) {
-                    word = "[_NOSP_]";
-                } else if (i == vocab.token_not) {
-                    word = "[_NOT_]";
-                } else if (i == vocab.token_beg) {
-                    word = "[_BEG_]";
-                } else {
-                    word = "[_extra_token_" + std::to_string(i) + "]";
-                }
-                vocab.token_to_id[word] = i;
-                vocab.id_to_token[i] = word;
-            }
-        }
-
-        WHISPER_LOG_INFO("%s: n_langs       = %d\n", __func__, vocab.num_languages());
-    }
-
-    const ggml_type wtype = wctx.wtype;
-    const ggml_type vtype = wctx.wtype == GGML_TYPE_F32 ? GGML_TYPE_F32 : GGML_TYPE_F16; // conv type
-
-    // create the ggml context
-    {
-        const auto & hparams = model.hparams;
-
-        const int n_audio_layer = hparams.n_audio_layer;
-        const int n_text_layer  = hparams.n_text_layer;
-
-        const size_t n_tensors = 10 /* input */ + 15 + 15*n_audio_layer + 24*n_text_layer;
-
-        struct ggml_init_params params = {
-            /*.mem_size   =*/ n_tensors*ggml_tensor_overhead(),
-            /*.mem_buffer =*/ nullptr,
-            /*.no_alloc   =*/ true,
-        };
-
-        model.ctx = ggml_init(params);
-        if (!model.ctx) {
-            WHISPER_LOG_ERROR("%s: ggml_init() failed\n", __func__);
-            return false;
-        }
-    }
-
-    // prepare tensors for the weights
-    {
-        auto & ctx = model.ctx;
+        auto & ctx = model.ctx;
 
         const auto & hparams = model.hparams;
 
@@ -1188,10 +1551,10 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
             model.e_pe = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_audio_state, n_audio_ctx);
 
             model.e_conv_1_w     = ggml_new_tensor_3d(ctx, vtype,         3, n_mels,     n_audio_state);
-            model.e_conv_1_b     = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 2*n_audio_ctx, n_audio_state);
+            model.e_conv_1_b     = ggml_new_tensor_2d(ctx, GGML_TYPE_F32,         1, n_audio_state);
 
             model.e_conv_2_w     = ggml_new_tensor_3d(ctx, vtype,         3, n_audio_state, n_audio_state);
-            model.e_conv_2_b     = ggml_new_tensor_2d(ctx, GGML_TYPE_F32,    n_audio_ctx,   n_audio_state);
+            model.e_conv_2_b     = ggml_new_tensor_2d(ctx, GGML_TYPE_F32,         1, n_audio_state);
 
             model.e_ln_w = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_audio_state);
             model.e_ln_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_audio_state);
@@ -1358,274 +1721,511 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         }
     }
 
-    wctx.backend = whisper_backend_init(wctx.params);
+    return true;
+}
 
-    {
-        size_t size_main = 0;
+// [EXPERIMENTAL] copy the loaded weights to each NUMA node other than the one of wctx.model
+static bool whisper_model_replicate(whisper_context & wctx) {
+    const auto & model = wctx.model;
 
-        for (const auto & t : model.tensors) {
-            size_main += ggml_nbytes(t.second) + ggml_tensor_overhead();
+    for (int node = 0; node < whisper_numa_n_nodes(); ++node) {
+        if (node == wctx.params.numa_node) {
+            continue;
         }
 
-        model.buffer = ggml_backend_alloc_buffer(wctx.backend, size_main);
-
-        WHISPER_LOG_INFO("%s: %8s buffer size = %8.2f MB\n", __func__, ggml_backend_name(wctx.backend), size_main / 1024.0 / 1024.0);
-    }
+        auto & replica = wctx.model_replicas[node];
 
-    ggml_allocr * alloc = ggml_allocr_new_from_buffer(model.buffer);
+        replica.type    = model.type;
+        replica.hparams = model.hparams;
 
-    // allocate tensors in the backend buffers
-    {
-        for (const auto & t : model.tensors) {
-            ggml_allocr_alloc(alloc, t.second);
+        if (!whisper_model_init_tensors(replica, wctx.wtype)) {
+            return false;
         }
-    }
-
-    // load weights
-    {
-        size_t total_size = 0;
 
-        model.n_loaded = 0;
+        replica.buffer = ggml_backend_alloc_buffer(wctx.backend, ggml_backend_buffer_get_size(model.buffer));
 
-        std::vector<char> read_buf;
+        // the pages are placed on the node before the copy touches them
+        whisper_numa_place(replica.buffer, node);
 
-        while (true) {
-            int32_t n_dims;
-            int32_t length;
-            int32_t ttype;
+        ggml_allocr * alloc = ggml_allocr_new_from_buffer(replica.buffer);
 
-            read_safe(loader, n_dims);
-            read_safe(loader, length);
-            read_safe(loader, ttype);
+        for (const auto & t : replica.tensors) {
+            ggml_allocr_alloc(alloc, t.second);
 
-            if (loader->eof(loader->context)) {
-                break;
-            }
+            memcpy(t.second->data, model.tensors.at(t.first)->data, ggml_nbytes(t.second));
+        }
 
-            int32_t nelements = 1;
-            int32_t ne[4] = { 1, 1, 1, 1 };
-            for (int i = 0; i < n_dims; ++i) {
-                read_safe(loader, ne[i]);
-                nelements *= ne[i];
-            }
+        ggml_allocr_free(alloc);
 
-            std::string name;
-            std::vector<char> tmp(length); // create a buffer
-            loader->read(loader->context, &tmp[0], tmp.size()); // read to buffer
-            name.assign(&tmp[0], tmp.size());
+        replica.n_loaded = model.n_loaded;
 
-            if (model.tensors.find(name) == model.tensors.end()) {
-                WHISPER_LOG_ERROR("%s: unknown tensor '%s' in model file\n", __func__, name.data());
-                return false;
-            }
+        WHISPER_LOG_INFO("%s: copy of the weights on NUMA node %d\n", __func__, node);
+    }
 
-            auto tensor = model.tensors[name.data()];
+    return true;
+}
 
-            const bool is_conv_bias = (name == "encoder.conv1.bias" || name == "encoder.conv2.bias");
+// load the model from a ggml file
+//
+// file format:
+//
+//   - hparams
+//   - pre-computed mel filters
+//   - vocab
+//   - weights
+//
+// see the convert-pt-to-ggml.py script for details
+//
+static bool whisper_model_load(struct whisper_model_loader * loader, whisper_context & wctx) {
+    WHISPER_LOG_INFO("%s: loading model\n", __func__);
 
-            if (!is_conv_bias) {
-                if (ggml_nelements(tensor) != nelements) {
-                    WHISPER_LOG_ERROR("%s: tensor '%s' has wrong size in model file\n", __func__, name.data());
-                    WHISPER_LOG_ERROR("%s: shape: [%d, %d, %d], expected: [%d, %d, %d]\n",
-                            __func__, ne[0], ne[1], ne[2], (int) tensor->ne[0], (int) tensor->ne[1], (int) tensor->ne[2]);
-                    return false;
-                }
+    const int64_t t_start_us = ggml_time_us();
 
-                if (tensor->ne[0] != ne[0] || tensor->ne[1] != ne[1] || tensor->ne[2] != ne[2]) {
-                    WHISPER_LOG_ERROR("%s: tensor '%s' has wrong shape in model file: got [%d, %d, %d], expected [%d, %d, %d]\n",
-                            __func__, name.data(), (int) tensor->ne[0], (int) tensor->ne[1], (int) tensor->ne[2], ne[0], ne[1], ne[2]);
-                    return false;
-                }
+    wctx.t_start_us = t_start_us;
 
-                const size_t bpe = ggml_type_size(ggml_type(ttype));
+    auto & model = wctx.model;
+    auto & vocab = wctx.vocab;
 
-                if ((nelements*bpe)/ggml_blck_size(tensor->type) != ggml_nbytes(tensor)) {
-                    WHISPER_LOG_ERROR("%s: tensor '%s' has wrong size in model file: got %zu, expected %zu\n",
-                            __func__, name.data(), ggml_nbytes(tensor), nelements*bpe);
-                    return false;
-                }
-            }
+    // verify magic
+    {
+        uint32_t magic;
+        read_safe(loader, magic);
+        if (magic != GGML_FILE_MAGIC) {
+            WHISPER_LOG_ERROR("%s: invalid model data (bad magic)\n", __func__);
+            return false;
+        }
+    }
 
-            ggml_backend_t backend = wctx.backend;
+    //load hparams
+    {
+        auto & hparams = model.hparams;
 
-            //printf("%s: [%5.5s] %s\n", __func__, ggml_backend_name(backend), name.c_str());
+        read_safe(loader, hparams.n_vocab);
+        read_safe(loader, hparams.n_audio_ctx);
+        read_safe(loader, hparams.n_audio_state);
+        read_safe(loader, hparams.n_audio_head);
+        read_safe(loader, hparams.n_audio_layer);
+        read_safe(loader, hparams.n_text_ctx);
+        read_safe(loader, hparams.n_text_state);
+        read_safe(loader, hparams.n_text_head);
+        read_safe(loader, hparams.n_text_layer);
+        read_safe(loader, hparams.n_mels);
+        read_safe(loader, hparams.ftype);
 
-            if ((ggml_backend_is_cpu(backend)
-#ifdef GGML_USE_METAL
-                || ggml_backend_is_metal(backend)
-#endif
-                ) && !is_conv_bias) {
-                // for the CPU and Metal backend, we can read directly into the tensor
-                loader->read(loader->context, tensor->data, ggml_nbytes(tensor));
-                BYTESWAP_TENSOR(tensor);
-            } else {
-                // read into a temporary buffer first, then copy to device memory
-                read_buf.resize(ggml_nbytes(tensor));
+        assert(hparams.n_text_state == hparams.n_audio_state);
 
-                // we repeat the 2 bias tensors along dim 0:
-                // [1, 512] -> [3000, 512] (conv1.bias)
-                // [1, 512] -> [1500, 512] (conv2.bias)
-                if (is_conv_bias) {
-                    loader->read(loader->context, read_buf.data(), read_buf.size() / tensor->ne[0]);
+        std::string mver = "";
 
-                    float * data_f32 = (float *) read_buf.data();
-                    for (int64_t y = 0; y < tensor->ne[1]; ++y) {
-                        const int64_t yy = tensor->ne[1] - y - 1;
-                        const float val = data_f32[yy];
+        if (hparams.n_audio_layer == 4) {
+            model.type = e_model::MODEL_TINY;
+        }
 
-                        for (int64_t x = 0; x < tensor->ne[0]; ++x) {
-                            data_f32[yy*tensor->ne[0] + x] = val;
-                        }
-                    }
-                } else {
-                    loader->read(loader->context, read_buf.data(), read_buf.size());
-                }
+        if (hparams.n_audio_layer == 6) {
+            model.type = e_model::MODEL_BASE;
+        }
 
-                ggml_backend_tensor_set(tensor, read_buf.data(), 0, ggml_nbytes(tensor));
-            }
+        if (hparams.n_audio_layer == 12) {
+            model.type = e_model::MODEL_SMALL;
+        }
 
-            //printf("%48s - [%5d, %5d, %5d], type = %6s, %6.2f MB\n", name.data(), ne[0], ne[1], ne[2], ggml_type_name((ggml_type) ttype), ggml_nbytes(tensor)/1024.0/1024.0);
-            total_size += ggml_nbytes(tensor);
-            model.n_loaded++;
+        if (hparams.n_audio_layer == 24) {
+            model.type = e_model::MODEL_MEDIUM;
         }
 
-        WHISPER_LOG_INFO("%s: model size    = %7.2f MB\n", __func__, total_size/1024.0/1024.0);
+        if (hparams.n_audio_layer == 32) {
+            model.type = e_model::MODEL_LARGE;
 
-        if (model.n_loaded == 0) {
-            WHISPER_LOG_WARN("%s: WARN no tensors loaded from model file - assuming empty model for testing\n", __func__);
-        } else if (model.n_loaded != (int) model.tensors.size()) {
-            WHISPER_LOG_ERROR("%s: ERROR not all tensors loaded from model file - expected %zu, got %d\n", __func__, model.tensors.size(), model.n_loaded);
-            return false;
+            if (hparams.n_vocab == 51866) {
+                mver = " v3";
+            }
         }
-    }
-
-    ggml_allocr_free(alloc);
 
-    wctx.t_load_us = ggml_time_us() - t_start_us;
+        const int32_t qntvr = hparams.ftype / GGML_QNT_VERSION_FACTOR;
 
-    return true;
-}
+        hparams.ftype %= GGML_QNT_VERSION_FACTOR;
 
-static bool whisper_encode_external(const whisper_state & wstate) {
-    GGML_UNUSED(wstate);
+        // for the big tensors, we have the option to store the data in 16-bit floats or quantized
+        // in order to save memory and also to speed up the computation
+        wctx.wtype = ggml_ftype_to_ggml_type((ggml_ftype) (model.hparams.ftype));
+        if (wctx.wtype == GGML_TYPE_COUNT) {
+            WHISPER_LOG_ERROR("%s: invalid model (bad ftype value %d)\n", __func__, model.hparams.ftype);
+            return false;
+        }
 
-#ifndef WHISPER_USE_COREML
-    const bool use_coreml = false;
-#else
-    const bool use_coreml = wstate.ctx_coreml != nullptr;
-#endif
+        WHISPER_LOG_INFO("%s: n_vocab       = %d\n", __func__, hparams.n_vocab);
+        WHISPER_LOG_INFO("%s: n_audio_ctx   = %d\n", __func__, hparams.n_audio_ctx);
+        WHISPER_LOG_INFO("%s: n_audio_state = %d\n", __func__, hparams.n_audio_state);
+        WHISPER_LOG_INFO("%s: n_audio_head  = %d\n", __func__, hparams.n_audio_head);
+        WHISPER_LOG_INFO("%s: n_audio_layer = %d\n", __func__, hparams.n_audio_layer);
+        WHISPER_LOG_INFO("%s: n_text_ctx    = %d\n", __func__, hparams.n_text_ctx);
+        WHISPER_LOG_INFO("%s: n_text_state  = %d\n", __func__, hparams.n_text_state);
+        WHISPER_LOG_INFO("%s: n_text_head   = %d\n", __func__, hparams.n_text_head);
+        WHISPER_LOG_INFO("%s: n_text_layer  = %d\n", __func__, hparams.n_text_layer);
+        WHISPER_LOG_INFO("%s: n_mels        = %d\n", __func__, hparams.n_mels);
+        WHISPER_LOG_INFO("%s: ftype         = %d\n", __func__, model.hparams.ftype);
+        WHISPER_LOG_INFO("%s: qntvr         = %d\n", __func__, qntvr);
+        WHISPER_LOG_INFO("%s: type          = %d (%s%s)\n", __func__, model.type, g_model_name.at(model.type).c_str(), mver.c_str());
+    }
 
-#ifndef WHISPER_USE_OPENVINO
-    const bool use_openvino = false;
-#else
-    const bool use_openvino = wstate.ctx_openvino != nullptr;
-#endif
+    // load mel filters
+    {
+        auto & filters = wctx.model.filters;
 
-    return use_coreml || use_openvino;
-}
+        read_safe(loader, filters.n_mel);
+        read_safe(loader, filters.n_fft);
 
-static struct ggml_cgraph * whisper_build_graph_conv(
-        whisper_context & wctx,
-          whisper_state & wstate,
-              const int   mel_offset) {
-    const auto & model   = wctx.model;
-    const auto & mel_inp = wstate.mel;
-    const auto & hparams = model.hparams;
+        filters.data.resize(filters.n_mel * filters.n_fft);
+        loader->read(loader->context, filters.data.data(), filters.data.size() * sizeof(float));
+        BYTESWAP_FILTERS(filters);
+    }
 
-    const int n_ctx   = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
-    const int n_state = hparams.n_audio_state; GGML_UNUSED(n_state);
+    // load vocab
+    {
+        int32_t n_vocab = 0;
+        read_safe(loader, n_vocab);
 
-    const int n_mels = hparams.n_mels;
+        //if (n_vocab != model.hparams.n_vocab) {
+        //    WHISPER_LOG_ERROR("%s: invalid model file '%s' (bad vocab size %d != %d)\n",
+        //            __func__, fname.c_str(), n_vocab, model.hparams.n_vocab);
+        //    return false;
+        //}
 
-    struct ggml_init_params params = {
-        /*.mem_size   =*/ wstate.alloc_conv.meta.size(),
-        /*.mem_buffer =*/ wstate.alloc_conv.meta.data(),
-        /*.no_alloc   =*/ true,
-    };
+        std::string word;
+        std::vector<char> tmp;
 
-    struct ggml_context * ctx0 = ggml_init(params);
+        tmp.reserve(128);
 
-    ggml_cgraph * gf = ggml_new_graph(ctx0);
+        for (int i = 0; i < n_vocab; i++) {
+            uint32_t len;
+            read_safe(loader, len);
 
-    ggml_allocr * alloc = wstate.alloc_conv.alloc;
+            if (len > 0) {
+                tmp.resize(len);
+                loader->read(loader->context, &tmp[0], tmp.size()); // read to buffer
+                word.assign(&tmp[0], tmp.size());
+            } else {
+                // seems like we have an empty-string token in multi-language models (i = 50256)
+                //WHISPER_LOG_WARN("%s: warning: empty-string token in vocab, i = %d\n", __func__, i);
+                word = "";
+            }
 
-    struct ggml_tensor * mel = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, 2*n_ctx, n_mels);
-    ggml_allocr_alloc(alloc, mel);
+            vocab.token_to_id[word] = i;
+            vocab.id_to_token[i] = word;
 
-    assert(mel->type == GGML_TYPE_F32);
-    if (!ggml_allocr_is_measure(alloc)) {
-        assert(mel_inp.n_mel == n_mels);
+            //printf("%s: vocab[%d] = '%s'\n", __func__, i, word.c_str());
+        }
 
-        wstate.inp_mel.resize(ggml_nelements(mel));
+        vocab.n_vocab = model.hparams.n_vocab;
+        if (vocab.is_multilingual()) {
+            vocab.token_eot++;
+            vocab.token_sot++;
 
-        float * dst = wstate.inp_mel.data();
-        memset(dst, 0, ggml_nbytes(mel));
+            // account for variable number of language tokens
+            const int dt = vocab.num_languages() - 98;
 
-        const int i0 = std::min(mel_offset,           mel_inp.n_len);
-        const int i1 = std::min(mel_offset + 2*n_ctx, mel_inp.n_len);
+            vocab.token_translate  += dt;
+            vocab.token_transcribe += dt;
+            vocab.token_solm       += dt;
+            vocab.token_prev       += dt;
+            vocab.token_nosp       += dt;
+            vocab.token_not        += dt;
+            vocab.token_beg        += dt;
+        }
 
-        for (int j = 0; j < mel_inp.n_mel; ++j) {
-            for (int i = i0; i < i1; ++i) {
-                dst[j*2*n_ctx + (i - i0)] = mel_inp.data[j*mel_inp.n_len + i];
+        if (n_vocab < model.hparams.n_vocab) {
+            WHISPER_LOG_INFO("%s: adding %d extra tokens\n", __func__, model.hparams.n_vocab - n_vocab);
+            for (int i = n_vocab; i < model.hparams.n_vocab; i++) {
+                if (i > vocab.token_beg) {
+                    word = "[_TT_" + std::to_string(i - vocab.token_beg) + "]";
+                } else if (i == vocab.token_eot) {
+                    word = "[_EOT_]";
+                } else if (i == vocab.token_sot) {
+                    word = "[_SOT_]";
+                } else if (i == vocab.token_solm) {
+                    word = "[_SOLM_]";
+                } else if (i == vocab.token_prev) {
+                    word = "[_PREV_]";
+                } else if (i == vocab.token_nosp) {
+                    word = "[_NOSP_]";
+                } else if (i == vocab.token_not) {
+                    word = "[_NOT_]";
+                } else if (i == vocab.token_beg) {
+                    word = "[_BEG_]";
+                } else {
+                    word = "[_extra_token_" + std::to_string(i) + "]";
+                }
+                vocab.token_to_id[word] = i;
+                vocab.id_to_token[i] = word;
             }
         }
 
-        ggml_backend_tensor_set(mel, wstate.inp_mel.data(), 0, ggml_nelements(mel)*sizeof(float));
+        WHISPER_LOG_INFO("%s: n_langs       = %d\n", __func__, vocab.num_languages());
     }
 
-    struct ggml_tensor * cur = nullptr;
-
-    if (!whisper_encode_external(wstate)) {
-        // convolution + gelu
-        {
-            cur = ggml_conv_1d_ph(ctx0, model.e_conv_1_w, mel, 1, 1);
-            cur = ggml_add(ctx0, cur, model.e_conv_1_b);
-            //cur = ggml_add(ctx0,
-            //        ggml_repeat(ctx0,
-            //            model.e_conv_1_b,
-            //            cur),
-            //        cur);
+    if (!whisper_model_init_tensors(model, wctx.wtype)) {
+        return false;
+    }
 
-            cur = ggml_gelu(ctx0, cur);
+    wctx.backend = whisper_backend_init(wctx.params);
 
-            cur = ggml_conv_1d_ph(ctx0, model.e_conv_2_w, cur, 2, 1);
-            cur = ggml_add(ctx0, cur, model.e_conv_2_b);
-            //cur = ggml_add(ctx0,
-            //        ggml_repeat(ctx0,
-            //            model.e_conv_2_b,
-            //            cur),
-            //        cur);
+    {
+        size_t size_main = 0;
 
-            cur = ggml_gelu(ctx0, cur);
+        for (const auto & t : model.tensors) {
+            size_main += ggml_nbytes(t.second) + ggml_tensor_overhead();
         }
 
-        ggml_set_name(cur, "embd_conv");
-        wstate.embd_conv = cur;
-    } else {
-#ifdef WHISPER_USE_COREML
-        cur = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_ctx);
-        ggml_allocr_alloc(alloc, cur);
+        model.buffer = ggml_backend_alloc_buffer(wctx.backend, size_main);
 
-        if (!ggml_allocr_is_measure(alloc)) {
-            whisper_coreml_encode(wstate.ctx_coreml, mel->ne[0], mel->ne[1], (float *) mel->data, (float *) cur->data);
-        }
-#endif
-#ifdef WHISPER_USE_OPENVINO
-        cur = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_ctx);
-        ggml_allocr_alloc(alloc, cur);
+        WHISPER_LOG_INFO("%s: %8s buffer size = %8.2f MB\n", __func__, ggml_backend_name(wctx.backend), size_main / 1024.0 / 1024.0);
+    }
 
-        if (!ggml_allocr_is_measure(alloc)) {
-            whisper_openvino_encode(wstate.ctx_openvino, mel, cur);
-        }
-#endif
+    // [EXPERIMENTAL] NUMA placement of the weights, before the loader touches the pages
+    const auto numa = ggml_backend_is_cpu(wctx.backend) ? wctx.params.numa : WHISPER_NUMA_STRATEGY_DISABLED;
 
-        ggml_set_name(cur, "embd_enc");
-        wstate.embd_enc = cur;
+    if (numa != wctx.params.numa) {
+        WHISPER_LOG_WARN("%s: NUMA placement requires the CPU backend, ignoring\n", __func__);
     }
 
-    ggml_build_forward_expand(gf, cur);
+    if (numa == WHISPER_NUMA_STRATEGY_INTERLEAVE) {
+        whisper_numa_place(model.buffer, -1);
+    } else if (numa == WHISPER_NUMA_STRATEGY_NODE || numa == WHISPER_NUMA_STRATEGY_REPLICATE) {
+        if (wctx.params.numa_node < 0 || wctx.params.numa_node >= whisper_numa_n_nodes()) {
+            WHISPER_LOG_ERROR("%s: invalid NUMA node %d, the host has %d\n", __func__, wctx.params.numa_node, whisper_numa_n_nodes());
+            return false;
+        }
 
-    ggml_free(ctx0);
+        whisper_numa_place(model.buffer, wctx.params.numa_node);
+    }
+
+    ggml_allocr * alloc = ggml_allocr_new_from_buffer(model.buffer);
+
+    // allocate tensors in the backend buffers
+    {
+        for (const auto & t : model.tensors) {
+            ggml_allocr_alloc(alloc, t.second);
+        }
+    }
+
+    // load weights
+    {
+        size_t total_size = 0;
+
+        model.n_loaded = 0;
+
+        std::vector<char> read_buf;
+
+        while (true) {
+            int32_t n_dims;
+            int32_t length;
+            int32_t ttype;
+
+            read_safe(loader, n_dims);
+            read_safe(loader, length);
+            read_safe(loader, ttype);
+
+            if (loader->eof(loader->context)) {
+                break;
+            }
+
+            int32_t nelements = 1;
+            int32_t ne[4] = { 1, 1, 1, 1 };
+            for (int i = 0; i < n_dims; ++i) {
+                read_safe(loader, ne[i]);
+                nelements *= ne[i];
+            }
+
+            std::string name;
+            std::vector<char> tmp(length); // create a buffer
+            loader->read(loader->context, &tmp[0], tmp.size()); // read to buffer
+            name.assign(&tmp[0], tmp.size());
+
+            if (model.tensors.find(name) == model.tensors.end()) {
+                WHISPER_LOG_ERROR("%s: unknown tensor '%s' in model file\n", __func__, name.data());
+                return false;
+            }
+
+            auto tensor = model.tensors[name.data()];
+
+            if (ggml_nelements(tensor) != nelements) {
+                WHISPER_LOG_ERROR("%s: tensor '%s' has wrong size in model file\n", __func__, name.data());
+                WHISPER_LOG_ERROR("%s: shape: [%d, %d, %d], expected: [%d, %d, %d]\n",
+                        __func__, ne[0], ne[1], ne[2], (int) tensor->ne[0], (int) tensor->ne[1], (int) tensor->ne[2]);
+                return false;
+            }
+
+            if (tensor->ne[0] != ne[0] || tensor->ne[1] != ne[1] || tensor->ne[2] != ne[2]) {
+                WHISPER_LOG_ERROR("%s: tensor '%s' has wrong shape in model file: got [%d, %d, %d], expected [%d, %d, %d]\n",
+                        __func__, name.data(), (int) tensor->ne[0], (int) tensor->ne[1], (int) tensor->ne[2], ne[0], ne[1], ne[2]);
+                return false;
+            }
+
+            const size_t bpe = ggml_type_size(ggml_type(ttype));
+
+            if ((nelements*bpe)/ggml_blck_size(tensor->type) != ggml_nbytes(tensor)) {
+                WHISPER_LOG_ERROR("%s: tensor '%s' has wrong size in model file: got %zu, expected %zu\n",
+                        __func__, name.data(), ggml_nbytes(tensor), nelements*bpe);
+                return false;
+            }
+
+            ggml_backend_t backend = wctx.backend;
+
+            //printf("%s: [%5.5s] %s\n", __func__, ggml_backend_name(backend), name.c_str());
+
+            if ((ggml_backend_is_cpu(backend)
+#ifdef GGML_USE_METAL
+                || ggml_backend_is_metal(backend)
+#endif
+                )) {
+                // for the CPU and Metal backend, we can read directly into the tensor
+                loader->read(loader->context, tensor->data, ggml_nbytes(tensor));
+                BYTESWAP_TENSOR(tensor);
+            } else {
+                // read into a temporary buffer first, then copy to device memory
+                read_buf.resize(ggml_nbytes(tensor));
+
+                loader->read(loader->context, read_buf.data(), read_buf.size());
+
+                ggml_backend_tensor_set(tensor, read_buf.data(), 0, ggml_nbytes(tensor));
+            }
+
+            //printf("%48s - [%5d, %5d, %5d], type = %6s, %6.2f MB\n", name.data(), ne[0], ne[1], ne[2], ggml_type_name((ggml_type) ttype), ggml_nbytes(tensor)/1024.0/1024.0);
+            total_size += ggml_nbytes(tensor);
+            model.n_loaded++;
+        }
+
+        WHISPER_LOG_INFO("%s: model size    = %7.2f MB\n", __func__, total_size/1024.0/1024.0);
+
+        if (model.n_loaded == 0) {
+            WHISPER_LOG_WARN("%s: WARN no tensors loaded from model file - assuming empty model for testing\n", __func__);
+        } else if (model.n_loaded != (int) model.tensors.size()) {
+            WHISPER_LOG_ERROR("%s: ERROR not all tensors loaded from model file - expected %zu, got %d\n", __func__, model.tensors.size(), model.n_loaded);
+            return false;
+        }
+    }
+
+    ggml_allocr_free(alloc);
+
+    if (numa == WHISPER_NUMA_STRATEGY_REPLICATE && !whisper_model_replicate(wctx)) {
+        return false;
+    }
+
+    wctx.t_load_us = ggml_time_us() - t_start_us;
+
+    return true;
+}
+
+static bool whisper_encode_external(const whisper_state & wstate) {
+    GGML_UNUSED(wstate);
+
+#ifndef WHISPER_USE_COREML
+    const bool use_coreml = false;
+#else
+    const bool use_coreml = wstate.ctx_coreml != nullptr;
+#endif
+
+#ifndef WHISPER_USE_OPENVINO
+    const bool use_openvino = false;
+#else
+    const bool use_openvino = wstate.ctx_openvino != nullptr;
+#endif
+
+    return use_coreml || use_openvino;
+}
+
+static struct ggml_cgraph * whisper_build_graph_conv(
+        whisper_context & wctx,
+          whisper_state & wstate,
+              const int   mel_offset) {
+    const auto & model   = whisper_state_model(wctx, wstate);
+    const auto & mel_inp = wstate.mel;
+    const auto & hparams = model.hparams;
+
+    const int n_ctx   = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
+    const int n_state = hparams.n_audio_state; GGML_UNUSED(n_state);
+
+    const int n_mels = hparams.n_mels;
+
+    const bool fused = whisper_use_fused_ops(wstate.backend);
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ wstate.alloc_conv.meta.size(),
+        /*.mem_buffer =*/ wstate.alloc_conv.meta.data(),
+        /*.no_alloc   =*/ true,
+    };
+
+    struct ggml_context * ctx0 = ggml_init(params);
+
+    ggml_cgraph * gf = ggml_new_graph(ctx0);
+
+    ggml_allocr * alloc = wstate.alloc_conv.alloc;
+
+    // the output is the input of the next graph, see whisper_state::alloc_embd
+    ggml_allocr * alloc_embd = wstate.alloc_embd.alloc;
+    ggml_allocr_reset(alloc_embd);
+
+    struct ggml_tensor * mel = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, 2*n_ctx, n_mels);
+    ggml_allocr_alloc(alloc, mel);
+
+    assert(mel->type == GGML_TYPE_F32);
+    if (!ggml_allocr_is_measure(alloc)) {
+        assert(mel_inp.n_mel == n_mels);
+
+        wstate.inp_mel.resize(ggml_nelements(mel));
+
+        float * dst = wstate.inp_mel.data();
+        memset(dst, 0, ggml_nbytes(mel));
+
+        const int i0 = std::min(mel_offset,           mel_inp.n_len);
+        const int i1 = std::min(mel_offset + 2*n_ctx, mel_inp.n_len);
+
+        for (int j = 0; j < mel_inp.n_mel; ++j) {
+            for (int i = i0; i < i1; ++i) {
+                dst[j*2*n_ctx + (i - i0)] = mel_inp.data[j*mel_inp.n_len + i];
+            }
+        }
+
+        ggml_backend_tensor_set(mel, wstate.inp_mel.data(), 0, ggml_nelements(mel)*sizeof(float));
+    }
+
+    struct ggml_tensor * cur = nullptr;
+
+    if (!whisper_encode_external(wstate)) {
+        // convolution + gelu
+        {
+            cur = whisper_conv_gelu(ctx0, model.e_conv_1_w, mel, model.e_conv_1_b, 1, fused);
+            cur = whisper_conv_gelu(ctx0, model.e_conv_2_w, cur, model.e_conv_2_b, 2, fused);
+        }
+
+        ggml_allocr_alloc(alloc_embd, cur);
+
+        ggml_set_name(cur, "embd_conv");
+        wstate.embd_conv = cur;
+    } else {
+#ifdef WHISPER_USE_COREML
+        cur = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_ctx);
+        ggml_allocr_alloc(alloc_embd, cur);
+
+        if (!ggml_allocr_is_measure(alloc)) {
+            whisper_coreml_encode(wstate.ctx_coreml, mel->ne[0], mel->ne[1], (float *) mel->data, (float *) cur->data);
+        }
+#endif
+#ifdef WHISPER_USE_OPENVINO
+        cur = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_ctx);
+        ggml_allocr_alloc(alloc_embd, cur);
+
+        if (!ggml_allocr_is_measure(alloc)) {
+            whisper_openvino_encode(wstate.ctx_openvino, mel, cur);
+        }
+#endif
+
+        ggml_set_name(cur, "embd_enc");
+        wstate.embd_enc = cur;
+    }
+
+    ggml_build_forward_expand(gf, cur);
+
+    ggml_free(ctx0);
 
     return gf;
 }
@@ -1633,7 +2233,7 @@ static struct ggml_cgraph * whisper_build_graph_conv(
 static struct ggml_cgraph * whisper_build_graph_encoder(
         whisper_context & wctx,
           whisper_state & wstate) {
-    const auto & model   = wctx.model;
+    const auto & model   = whisper_state_model(wctx, wstate);
     const auto & hparams = model.hparams;
 
     const int n_ctx   = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
@@ -1641,6 +2241,8 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
     const int n_head  = hparams.n_audio_head;
     const int n_layer = hparams.n_audio_layer;
 
+    const bool fused = whisper_use_fused_ops(wstate.backend);
+
     struct ggml_init_params params = {
         /*.mem_size   =*/ wstate.alloc_encode.meta.size(),
         /*.mem_buffer =*/ wstate.alloc_encode.meta.data(),
@@ -1701,12 +2303,8 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
 
         // norm
         {
-            cur = ggml_norm(ctx0, inpL, hparams.eps);
-
-            // cur = ln_0_w*cur + ln_0_b
-            cur = ggml_add(ctx0,
-                    ggml_mul(ctx0, cur, layer.attn_ln_0_w),
-                    layer.attn_ln_0_b);
+            // cur = ln_0_w*norm(inpL) + ln_0_b
+            cur = whisper_norm(ctx0, inpL, layer.attn_ln_0_w, layer.attn_ln_0_b, hparams.eps, fused);
         }
 
         // self-attention
@@ -1809,21 +2407,15 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
             cur = ggml_add(ctx0, cur, layer.attn_ln_1_b);
         }
 
-        // add the input
-        cur = ggml_add(ctx0, cur, inpL);
-
-        struct ggml_tensor * inpFF = cur;
+        struct ggml_tensor * inpFF = nullptr;
 
         // feed-forward network
         {
-            // norm
+            // add the input + norm
             {
-                cur = ggml_norm(ctx0, inpFF, hparams.eps);
-
-                // cur = mlp_ln_w*cur + mlp_ln_b
-                cur = ggml_add(ctx0,
-                        ggml_mul(ctx0, cur, layer.mlp_ln_w),
-                        layer.mlp_ln_b);
+                // inpFF = cur + inpL
+                // cur   = mlp_ln_w*norm(inpFF) + mlp_ln_b
+                cur = whisper_add_norm(ctx0, cur, inpL, layer.mlp_ln_w, layer.mlp_ln_b, hparams.eps, fused, &inpFF);
             }
 
 #ifdef WHISPER_USE_FLASH_FF
@@ -1836,10 +2428,8 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
                     layer.mlp_0_w,
                     cur);
 
-            cur = ggml_add(ctx0, cur, layer.mlp_0_b);
-
             // GELU activation
-            cur = ggml_gelu(ctx0, cur);
+            cur = whisper_add_gelu(ctx0, cur, layer.mlp_0_b, fused);
 
             // projection
             cur = ggml_mul_mat(ctx0,
@@ -1857,14 +2447,12 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
 
     // norm
     {
-        cur = ggml_norm(ctx0, cur, hparams.eps);
-
-        // cur = ln_f_g*cur + ln_f_b
-        cur = ggml_add(ctx0,
-                ggml_mul(ctx0, cur, model.e_ln_w),
-                model.e_ln_b);
+        // cur = ln_f_g*norm(cur) + ln_f_b
+        cur = whisper_norm(ctx0, cur, model.e_ln_w, model.e_ln_b, hparams.eps, fused);
     }
 
+    ggml_allocr_alloc(wstate.alloc_embd.alloc, cur);
+
     ggml_build_forward_expand(gf, cur);
 
     wstate.embd_enc = cur;
@@ -1888,8 +2476,9 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
 // pre-compute cross-attention memory
 static struct ggml_cgraph * whisper_build_graph_cross(
         whisper_context & wctx,
-          whisper_state & wstate) {
-    const auto & model   = wctx.model;
+          whisper_state & wstate,
+       whisper_kv_cache & kv_cross) {
+    const auto & model   = whisper_state_model(wctx, wstate);
     const auto & hparams = model.hparams;
 
     const int n_ctx   = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
@@ -1943,13 +2532,13 @@ static struct ggml_cgraph * whisper_build_graph_cross(
 
         Vcross = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcross, n_state, n_ctx));
 
-        struct ggml_tensor * k = ggml_view_1d(ctx0, wstate.kv_cross.k,
+        struct ggml_tensor * k = ggml_view_1d(ctx0, kv_cross.k,
                 n_state*n_ctx,
-                (ggml_element_size(wstate.kv_cross.k)*n_state)*(il*n_ctx));
+                (ggml_element_size(kv_cross.k)*n_state)*(il*n_ctx));
 
-        struct ggml_tensor * v = ggml_view_2d(ctx0, wstate.kv_cross.v, n_ctx, n_state,
-                (   n_ctx)*ggml_element_size(wstate.kv_cross.v),
-                (il*n_ctx)*ggml_element_size(wstate.kv_cross.v)*n_state);
+        struct ggml_tensor * v = ggml_view_2d(ctx0, kv_cross.v, n_ctx, n_state,
+                (   n_ctx)*ggml_element_size(kv_cross.v),
+                (il*n_ctx)*ggml_element_size(kv_cross.v)*n_state);
 
         ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcross, k));
         ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcross, v));
@@ -1965,22 +2554,36 @@ static struct ggml_cgraph * whisper_build_graph_cross(
 // evaluate the encoder with the given state
 //
 // given audio recording (more specifically, its log mel spectrogram), runs forward pass of the encoder
-// part of the transformer model and returns the encoded features
+// part of the transformer model and stores the cross-attention KV of the encoded features in kv_cross
 //
 //   - wctx:      the model
 //   - wstate:     the state of the encoder
-//   - n_threads:  number of threads to use
+//   - kv_cross:   the cross-attention KV cache to fill
 //   - mel_offset: offset in the mel spectrogram (i.e. audio offset)
+//   - n_threads:  number of threads to use
+//   - work:       if not null, compute on the CPU with this work buffer instead of the state backend
+//                 (used to encode the next window while the decoder is running on the backend)
 //
-static bool whisper_encode_internal(
+static bool whisper_encode_window(
         whisper_context & wctx,
           whisper_state & wstate,
+       whisper_kv_cache & kv_cross,
               const int   mel_offset,
               const int   n_threads,
+   std::vector<uint8_t> * work,
  whisper_abort_callback   abort_callback,
                    void * abort_callback_data) {
     const int64_t t_start_us = ggml_time_us();
 
+    auto compute = [&](ggml_cgraph * gf, int64_t * perf_node_us) {
+        if (work) {
+            // the threads of the pipelined encoder run next to the ones of the decoder, so they are not pinned
+            ggml_graph_compute_helper(gf, *work, n_threads, nullptr, nullptr, &wstate.cpus, perf_node_us);
+        } else {
+            ggml_graph_compute_helper(wstate.backend, gf, n_threads, perf_node_us);
+        }
+    };
+
     // conv
     {
         auto & alloc = wstate.alloc_conv.alloc;
@@ -1992,7 +2595,7 @@ static bool whisper_encode_internal(
         ggml_allocr_alloc_graph(alloc, gf);
 
         if (!whisper_encode_external(wstate)) {
-            ggml_graph_compute_helper(wstate.backend, gf, n_threads);
+            whisper_graph_compute_profiled(wstate.profile, "conv", gf, n_threads, compute);
         }
     }
 
@@ -2006,40 +2609,70 @@ static bool whisper_encode_internal(
 
         ggml_allocr_alloc_graph(alloc, gf);
 
-        ggml_graph_compute_helper(wstate.backend, gf, n_threads);
+        whisper_graph_compute_profiled(wstate.profile, "encoder", gf, n_threads, compute);
     }
 
     // cross
     {
+        const int64_t t_cross_start_us = ggml_time_us();
+
         auto & alloc = wstate.alloc_cross.alloc;
 
         ggml_allocr_reset(alloc);
 
-        ggml_cgraph * gf = whisper_build_graph_cross(wctx, wstate);
+        ggml_cgraph * gf = whisper_build_graph_cross(wctx, wstate, kv_cross);
 
         ggml_allocr_alloc_graph(alloc, gf);
 
-        ggml_graph_compute_helper(wstate.backend, gf, n_threads);
+        whisper_graph_compute_profiled(wstate.profile, "cross", gf, n_threads, compute);
+
+        wstate.t_cross_us += ggml_time_us() - t_cross_start_us;
     }
 
+    // the cross-attention KV of the first n_audio_ctx positions has been computed
+    kv_cross.n     = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : wctx.model.hparams.n_audio_ctx;
+    kv_cross.n_max = std::max(kv_cross.n_max, kv_cross.n);
+
     wstate.t_encode_us += ggml_time_us() - t_start_us;
     wstate.n_encode++;
 
+    whisper_hist_add(wstate.hist_encode_us, ggml_time_us() - t_start_us);
+
     return !(abort_callback && abort_callback(abort_callback_data));
 }
 
+static bool whisper_encode_internal(
+        whisper_context & wctx,
+          whisper_state & wstate,
+              const int   mel_offset,
+              const int   n_threads,
+ whisper_abort_callback   abort_callback,
+                   void * abort_callback_data) {
+    if (!whisper_encode_window(wctx, wstate, wstate.kv_cross, mel_offset, n_threads, nullptr, abort_callback, abort_callback_data)) {
+        return false;
+    }
+
+    wstate.enc_seek  = mel_offset;
+    wstate.enc_n_ctx = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : wctx.model.hparams.n_audio_ctx;
+
+    return true;
+}
+
 static struct ggml_cgraph * whisper_build_graph_decoder(
          whisper_context & wctx,
          whisper_state   & wstate,
          whisper_decoder & decoder,
      const whisper_token * tokens,
                    int   n_tokens,
-                   int   n_past) {
-    const auto & model   = wctx.model;
+                   int   n_past,
+                  bool   logits_all) {
+    const auto & model   = whisper_state_model(wctx, wstate);
     const auto & hparams = model.hparams;
 
     auto & kv_self = decoder.kv_self;
 
+    const auto & kv_cross = wstate.kv_cross_parent ? *wstate.kv_cross_parent : wstate.kv_cross;
+
     WHISPER_ASSERT(!!kv_self.ctx);
 
     const int n_ctx   = hparams.n_text_ctx;
@@ -2050,6 +2683,8 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
     const int N = n_tokens;
     const int M = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
 
+    const bool fused = whisper_use_fused_ops(wstate.backend);
+
     //WHISPER_PRINT_DEBUG("%s: n_past = %d, N = %d, M = %d, n_ctx = %d\n", __func__, n_past, N, M, n_ctx);
 
     struct ggml_init_params params = {
@@ -2102,14 +2737,8 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
 
         // norm
         {
-            cur = ggml_norm(ctx0, inpL, hparams.eps);
-
-            // cur = ln_0_w*cur + ln_0_b
-            cur = ggml_add(ctx0,
-                    ggml_mul(ctx0,
-                        cur,
-                        layer.attn_ln_0_w),
-                    layer.attn_ln_0_b);
+            // cur = ln_0_w*norm(inpL) + ln_0_b
+            cur = whisper_norm(ctx0, inpL, layer.attn_ln_0_w, layer.attn_ln_0_b, hparams.eps, fused);
         }
 
         // self-attention
@@ -2202,19 +2831,13 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
                     layer.attn_ln_1_b);
         }
 
-        // add the input
-        struct ggml_tensor * inpCA = ggml_add(ctx0, cur, inpL);
+        struct ggml_tensor * inpCA = nullptr;
 
-        // norm
+        // add the input + norm
         {
-            cur = ggml_norm(ctx0, inpCA, hparams.eps); // note: we use inpCA here
-
-            // cur = ln_0_w*cur + ln_0_b
-            cur = ggml_add(ctx0,
-                    ggml_mul(ctx0,
-                        cur,
-                        layer.cross_attn_ln_0_w),
-                    layer.cross_attn_ln_0_b);
+            // inpCA = cur + inpL
+            // cur   = ln_0_w*norm(inpCA) + ln_0_b
+            cur = whisper_add_norm(ctx0, cur, inpL, layer.cross_attn_ln_0_w, layer.cross_attn_ln_0_b, hparams.eps, fused, &inpCA);
         }
 
         // cross-attention
@@ -2231,15 +2854,15 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
 
             // Kcross is already scaled
             struct ggml_tensor * Kcross =
-                ggml_view_3d(ctx0, wstate.kv_cross.k,
+                ggml_view_3d(ctx0, kv_cross.k,
                         n_state/n_head, M, n_head,
-                        ggml_element_size(wstate.kv_cross.k)*n_state,
-                        ggml_element_size(wstate.kv_cross.k)*n_state/n_head,
-                        ggml_element_size(wstate.kv_cross.k)*n_state*M*il);
+                        ggml_element_size(kv_cross.k)*n_state,
+                        ggml_element_size(kv_cross.k)*n_state/n_head,
+                        ggml_element_size(kv_cross.k)*n_state*M*il);
 
             //struct ggml_tensor * Vcross =
             //    ggml_reshape_3d(ctx0,
-            //            ggml_view_1d(ctx0, wstate.kv_cross.v, M*n_state, il*M*ggml_element_size(wstate.kv_cross.v)*n_state),
+            //            ggml_view_1d(ctx0, kv_cross.v, M*n_state, il*M*ggml_element_size(kv_cross.v)*n_state),
             //            n_state/n_head, n_head, M);
 
             //struct ggml_tensor * V_trans =
@@ -2248,11 +2871,11 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
             //            ggml_new_tensor_3d(ctx0, Vcross->type, M, n_state/n_head, n_head));
 
             struct ggml_tensor * V =
-                ggml_view_3d(ctx0, wstate.kv_cross.v,
+                ggml_view_3d(ctx0, kv_cross.v,
                         M, n_state/n_head, n_head,
-                        M*ggml_element_size(wstate.kv_cross.v),
-                        M*ggml_element_size(wstate.kv_cross.v)*n_state/n_head,
-                        il*M*ggml_element_size(wstate.kv_cross.v)*n_state);
+                        M*ggml_element_size(kv_cross.v),
+                        M*ggml_element_size(kv_cross.v)*n_state/n_head,
+                        il*M*ggml_element_size(kv_cross.v)*n_state);
 
             // ------
 
@@ -2296,23 +2919,15 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
                     layer.cross_attn_ln_1_b);
         }
 
-        // add the input
-        cur = ggml_add(ctx0, cur, inpCA);
-
-        struct ggml_tensor * inpFF = cur;
+        struct ggml_tensor * inpFF = nullptr;
 
         // feed-forward network
         {
-            // norm
+            // add the input + norm
             {
-                cur = ggml_norm(ctx0, inpFF, hparams.eps);
-
-                // cur = mlp_ln_w*cur + mlp_ln_b
-                cur = ggml_add(ctx0,
-                        ggml_mul(ctx0,
-                            cur,
-                            layer.mlp_ln_w),
-                        layer.mlp_ln_b);
+                // inpFF = cur + inpCA
+                // cur   = mlp_ln_w*norm(inpFF) + mlp_ln_b
+                cur = whisper_add_norm(ctx0, cur, inpCA, layer.mlp_ln_w, layer.mlp_ln_b, hparams.eps, fused, &inpFF);
             }
 
             // fully connected
@@ -2320,12 +2935,8 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
                     layer.mlp_0_w,
                     cur);
 
-            cur = ggml_add(ctx0,
-                    cur,
-                    layer.mlp_0_b);
-
             // GELU activation
-            cur = ggml_gelu(ctx0, cur);
+            cur = whisper_add_gelu(ctx0, cur, layer.mlp_0_b, fused);
 
             // projection
             cur = ggml_mul_mat(ctx0,
@@ -2344,21 +2955,15 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
 
     // norm
     {
-        cur = ggml_norm(ctx0, cur, hparams.eps);
-
-        cur = ggml_add(ctx0,
-                ggml_mul(ctx0,
-                    cur,
-                    model.d_ln_w),
-                model.d_ln_b);
+        cur = whisper_norm(ctx0, cur, model.d_ln_w, model.d_ln_b, hparams.eps, fused);
     }
 
-    // compute logits only for the last token
-    // comment this line to compute logits for all N tokens
-    // might be useful in the future
-    cur = ggml_view_2d(ctx0, cur, cur->ne[0], 1, cur->nb[1], (cur->ne[1] - 1)*cur->nb[1]);
+    // compute logits only for the last token, unless all of them are needed (speculative decoding)
+    if (!logits_all) {
+        cur = ggml_view_2d(ctx0, cur, cur->ne[0], 1, cur->nb[1], (cur->ne[1] - 1)*cur->nb[1]);
+    }
 
-    struct ggml_tensor * logits = ggml_mul_mat(ctx0, model.d_te, cur);
+    struct ggml_tensor * logits = ggml_mul_mat(ctx0, wstate.vocab_active ? wstate.d_te_vocab : model.d_te, cur);
 
     ggml_build_forward_expand(gf, logits);
 
@@ -2376,20 +2981,77 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
 //   - tokens:     text prompt
 //   - n_tokens:   number of tokens in the prompt
 //   - n_past:     number of past tokens to prefix the prompt with
+//   - logits_all: compute the logits for all N tokens instead of only the last one
 //
-static bool whisper_decode_internal(
+// the longest prompt of whisper_full(): the previous text token, up to n_text_ctx/2 tokens of past text, followed by
+// the sot, language, task and no timestamps tokens
+static int whisper_n_prompt_max(const whisper_hparams & hparams) {
+    return std::min(hparams.n_text_ctx, hparams.n_text_ctx/2 + 5);
+}
+
+// the worst-case decoder graph for n_tokens tokens: the tokens are placed at the end of the context, so that the
+// attention covers the whole KV cache, and the cross-attention covers the whole audio context, whatever the audio_ctx
+// of the current window is
+static struct ggml_cgraph * whisper_build_graph_decoder_worst(
+        whisper_context & wctx,
+          whisper_state & wstate,
+              const int   n_tokens,
+             const bool   logits_all) {
+    const int n_past = std::max(0, wctx.model.hparams.n_text_ctx - n_tokens);
+
+    const int32_t exp_n_audio_ctx = wstate.exp_n_audio_ctx;
+    wstate.exp_n_audio_ctx = 0;
+
+    struct ggml_cgraph * gf = whisper_build_graph_decoder(wctx, wstate, wstate.decoders[0], nullptr, n_tokens, n_past, logits_all);
+
+    wstate.exp_n_audio_ctx = exp_n_audio_ctx;
+
+    return gf;
+}
+
+// whisper_init_state() sizes the decoder compute buffer for the prompts of whisper_full() and for the speculative
+// verification pass. longer inputs (e.g. a long prompt passed to whisper_decode()) re-measure the graph and grow it
+static void whisper_decode_reserve(whisper_context & wctx, whisper_state & wstate, int n_tokens, bool logits_all) {
+    int & n_max = logits_all ? wstate.n_decode_all_max : wstate.n_decode_max;
+
+    if (n_tokens <= n_max) {
+        return;
+    }
+
+    auto & allocr = wstate.alloc_decode;
+
+    const size_t size_cur = ggml_backend_buffer_get_size(allocr.buffer);
+
+    whisper_allocr_free(allocr);
+    whisper_allocr_graph_init(allocr, wctx.backend,
+            [&]() {
+                return whisper_build_graph_decoder_worst(wctx, wstate, n_tokens, logits_all);
+            });
+
+    const size_t size = std::max(size_cur, ggml_allocr_max_size(allocr.alloc));
+
+    whisper_allocr_graph_realloc(allocr, wctx.backend, size);
+    whisper_state_numa_place(wstate, allocr.buffer);
+
+    WHISPER_LOG_INFO("%s: compute buffer (decode) = %7.2f MB (%d tokens)\n", __func__, (allocr.meta.size() + size) / 1024.0 / 1024.0, n_tokens);
+
+    n_max = n_tokens;
+}
+
+static bool whisper_decode_internal(
         whisper_context & wctx,
           whisper_state & wstate,
         whisper_decoder & decoder,
     const whisper_token * tokens,
               const int   n_tokens,
               const int   n_past,
+             const bool   logits_all,
               const int   n_threads,
  whisper_abort_callback   abort_callback,
                    void * abort_callback_data) {
     const int64_t t_start_us = ggml_time_us();
 
-    const auto & model   = wctx.model;
+    const auto & model   = whisper_state_model(wctx, wstate);
     const auto & hparams = model.hparams;
 
     const int n_vocab = hparams.n_vocab;
@@ -2400,28 +3062,50 @@ static bool whisper_decode_internal(
 
     // decoder
     {
+        whisper_decode_reserve(wctx, wstate, n_tokens, logits_all);
+
         auto & alloc = wstate.alloc_decode.alloc;
 
         ggml_allocr_reset(alloc);
 
-        ggml_cgraph * gf = whisper_build_graph_decoder(wctx, wstate, decoder, tokens, n_tokens, n_past);
+        ggml_cgraph * gf = whisper_build_graph_decoder(wctx, wstate, decoder, tokens, n_tokens, n_past, logits_all);
 
         ggml_allocr_alloc_graph(alloc, gf);
 
         logits = gf->nodes[gf->n_nodes - 1];
 
-        ggml_graph_compute_helper(wstate.backend, gf, n_threads);
+        whisper_graph_compute_profiled(wstate.profile, "decoder", gf, n_threads, [&](ggml_cgraph * g, int64_t * perf_node_us) {
+            ggml_graph_compute_helper(wstate.backend, g, n_threads, perf_node_us);
+        });
     }
 
-    // extract logits for all N tokens
-    //logits_out.resize(n_tokens*n_vocab);
-    //memcpy(logits_out.data(), ggml_get_data(logits), sizeof(float)*n_tokens*n_vocab);
-    //ggml_backend_tensor_get(logits, logits_out.data(), (n_vocab*(n_tokens - 1))*sizeof(float), sizeof(float)*n_vocab);
+    if (wstate.vocab_active) {
+        const auto & ids = wstate.vocab_ids;
+
+        const int n_ids  = ids.size();
+        const int n_rows = logits_all ? n_tokens : 1;
 
-    // extract logits only for the last token
-    logits_out.resize(n_vocab);
-    //memcpy(logits_out.data(), ggml_get_data(logits), sizeof(float)*n_vocab);
-    ggml_backend_tensor_get(logits, logits_out.data(), 0, sizeof(float)*n_vocab);
+        wstate.logits_vocab.resize(n_rows*n_ids);
+        ggml_backend_tensor_get(logits, wstate.logits_vocab.data(), 0, sizeof(float)*n_rows*n_ids);
+
+        // the tokens outside of the subset can not be produced
+        logits_out.assign(n_rows*n_vocab, -INFINITY);
+
+        for (int r = 0; r < n_rows; ++r) {
+            for (int k = 0; k < n_ids; ++k) {
+                logits_out[r*n_vocab + ids[k]] = wstate.logits_vocab[r*n_ids + k];
+            }
+        }
+    } else if (logits_all) {
+        // extract logits for all N tokens
+        logits_out.resize(n_tokens*n_vocab);
+        ggml_backend_tensor_get(logits, logits_out.data(), 0, sizeof(float)*n_tokens*n_vocab);
+    } else {
+        // extract logits only for the last token
+        logits_out.resize(n_vocab);
+        //memcpy(logits_out.data(), ggml_get_data(logits), sizeof(float)*n_vocab);
+        ggml_backend_tensor_get(logits, logits_out.data(), 0, sizeof(float)*n_vocab);
+    }
 
     if (n_tokens > 1) {
         //printf("%s: used_mem = %f MB, %f MB, %f MB %f MB %f MB\n", __func__,
@@ -2432,12 +3116,18 @@ static bool whisper_decode_internal(
         //        wstate.get_buf_max_mem(3)/1024.0/1024.0);
     }
 
-    if (n_tokens == 1) {
+    decoder.kv_self.n_max = std::max(decoder.kv_self.n_max, n_past + n_tokens);
+
+    if (n_tokens == 1 || logits_all) {
         wstate.t_decode_us += ggml_time_us() - t_start_us;
         wstate.n_decode++;
+
+        whisper_hist_add(wstate.hist_decode_us, ggml_time_us() - t_start_us);
     } else {
         wstate.t_prompt_us += ggml_time_us() - t_start_us;
         wstate.n_prompt++;
+
+        whisper_hist_add(wstate.hist_prompt_us, ggml_time_us() - t_start_us);
     }
 
     return !(abort_callback && abort_callback(abort_callback_data));
@@ -2654,6 +3344,9 @@ static bool log_mel_spectrogram(
               whisper_mel & mel) {
     const int64_t t_start_us = ggml_time_us();
 
+    // the encoded window no longer matches the mel
+    wstate.enc_seek = -1;
+
     // Hanning window (Use cosf to eliminate difference)
     // ref: https://pytorch.org/docs/stable/generated/torch.hann_window.html
     // ref: https://github.com/openai/whisper/blob/main/whisper/audio.py#L147
@@ -2848,11 +3541,15 @@ static std::string whisper_openvino_get_path_cache(std::string path_bin) {
 }
 #endif
 
-struct whisper_state * whisper_init_state(whisper_context * ctx) {
+// kv_cross_parent != nullptr: a decode-only state that reads the cross-attention cache of another state and has no
+// encoder buffers of its own (see n_fallback_parallel). the other state must have been created first
+static struct whisper_state * whisper_init_state(whisper_context * ctx, const whisper_kv_cache * kv_cross_parent) {
     fill_sin_cos_table();
 
     whisper_state * state = new whisper_state;
 
+    state->kv_cross_parent = kv_cross_parent;
+
     state->backend = whisper_backend_init(ctx->params);
 
     if (!kv_cache_init(ctx->model.hparams, state->decoders[0].kv_self, ctx->backend, ctx->itype, ctx->model.hparams.n_text_ctx)) {
@@ -2866,32 +3563,34 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
         WHISPER_LOG_INFO("%s: kv self size  = %7.2f MB\n", __func__, memory_size / 1024.0 / 1024.0);
     }
 
-    if (!kv_cache_init(ctx->model.hparams, state->kv_cross, ctx->backend, ctx->itype, ctx->model.hparams.n_audio_ctx)) {
-        WHISPER_LOG_ERROR("%s: kv_cache_init() failed for cross-attention cache\n", __func__);
-        delete state;
-        return nullptr;
-    }
+    if (kv_cross_parent == nullptr) {
+        if (!kv_cache_init(ctx->model.hparams, state->kv_cross, ctx->backend, ctx->itype, ctx->model.hparams.n_audio_ctx)) {
+            WHISPER_LOG_ERROR("%s: kv_cache_init() failed for cross-attention cache\n", __func__);
+            delete state;
+            return nullptr;
+        }
 
-    {
         const size_t memory_size = ggml_nbytes(state->kv_cross.k) + ggml_nbytes(state->kv_cross.v);
         WHISPER_LOG_INFO("%s: kv cross size = %7.2f MB\n", __func__, memory_size / 1024.0 / 1024.0);
     }
 
 #ifdef WHISPER_USE_COREML
-    const auto path_coreml = whisper_get_coreml_path_encoder(ctx->path_model);
+    if (kv_cross_parent == nullptr) {
+        const auto path_coreml = whisper_get_coreml_path_encoder(ctx->path_model);
 
-    WHISPER_LOG_INFO("%s: loading Core ML model from '%s'\n", __func__, path_coreml.c_str());
-    WHISPER_LOG_INFO("%s: first run on a device may take a while ...\n", __func__);
+        WHISPER_LOG_INFO("%s: loading Core ML model from '%s'\n", __func__, path_coreml.c_str());
+        WHISPER_LOG_INFO("%s: first run on a device may take a while ...\n", __func__);
 
-    state->ctx_coreml = whisper_coreml_init(path_coreml.c_str());
-    if (!state->ctx_coreml) {
-        WHISPER_LOG_ERROR("%s: failed to load Core ML model from '%s'\n", __func__, path_coreml.c_str());
+        state->ctx_coreml = whisper_coreml_init(path_coreml.c_str());
+        if (!state->ctx_coreml) {
+            WHISPER_LOG_ERROR("%s: failed to load Core ML model from '%s'\n", __func__, path_coreml.c_str());
 #ifndef WHISPER_COREML_ALLOW_FALLBACK
-        delete state;
-        return nullptr;
+            delete state;
+            return nullptr;
 #endif
-    } else {
-        WHISPER_LOG_INFO("%s: Core ML model loaded\n", __func__);
+        } else {
+            WHISPER_LOG_INFO("%s: Core ML model loaded\n", __func__);
+        }
     }
 #endif
 
@@ -2906,62 +3605,116 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
     state->decoders[0].logits.reserve  (ctx->vocab.n_vocab);
     state->decoders[0].logprobs.reserve(ctx->vocab.n_vocab);
 
-    // conv allocator
-    {
-        whisper_allocr_graph_init(state->alloc_conv, ctx->backend,
-                [&]() {
-                    return whisper_build_graph_conv(*ctx, *state, 0);
-                });
-
-        WHISPER_LOG_INFO("%s: compute buffer (conv)   = %7.2f MB\n", __func__, whisper_allocr_size(state->alloc_conv) / 1024.0 / 1024.0);
-    }
+    // encoder results - embd_conv and embd_enc, both [n_audio_state, n_audio_ctx]
+    if (kv_cross_parent == nullptr) {
+        const auto & hparams = ctx->model.hparams;
 
-    // encoder allocator
-    if (!whisper_encode_external(*state)) {
-        whisper_allocr_graph_init(state->alloc_encode, ctx->backend,
-                [&]() {
-                    return whisper_build_graph_encoder(*ctx, *state);
-                });
+        const size_t size = 2*(ggml_type_size(GGML_TYPE_F32)*hparams.n_audio_state*hparams.n_audio_ctx + ggml_backend_get_alignment(ctx->backend));
 
-        WHISPER_LOG_INFO("%s: compute buffer (encode) = %7.2f MB\n", __func__, whisper_allocr_size(state->alloc_encode) / 1024.0 / 1024.0);
+        state->alloc_embd.buffer = ggml_backend_alloc_buffer(ctx->backend, size);
+        state->alloc_embd.alloc  = ggml_allocr_new_from_buffer(state->alloc_embd.buffer);
     }
 
-    // cross allocator
+    // compute buffers
+    // the first state measures the worst-case graphs, the next states of the context reuse the measured sizes
+    whisper_compute_sizes sizes;
     {
-        whisper_allocr_graph_init(state->alloc_cross, ctx->backend,
-                [&]() {
-                    return whisper_build_graph_cross(*ctx, *state);
-                });
-
-        WHISPER_LOG_INFO("%s: compute buffer (cross)  = %7.2f MB\n", __func__, whisper_allocr_size(state->alloc_cross) / 1024.0 / 1024.0);
+        std::lock_guard<std::mutex> lock(ctx->mutex_compute_sizes);
+        sizes = ctx->compute_sizes;
     }
 
-    // decoder allocator
-    {
-        whisper_allocr_graph_init(state->alloc_decode, ctx->backend,
-                [&]() {
-                    const auto & hparams = ctx->model.hparams;
+    const bool measured = sizes.decode > 0 && (kv_cross_parent != nullptr || whisper_encode_external(*state) || sizes.encode > 0);
 
-                    // TODO: make sure this is the worst-case scenario
-                    const int n_tokens = hparams.n_text_ctx;
-                    const int n_past   = 0;
+    WHISPER_ASSERT(measured || kv_cross_parent == nullptr);
 
-                    return whisper_build_graph_decoder(*ctx, *state, state->decoders[0], nullptr, n_tokens, n_past);
-                });
+    if (!measured) {
+        // conv allocator
+        {
+            whisper_allocr_graph_init(state->alloc_conv, ctx->backend,
+                    [&]() {
+                        return whisper_build_graph_conv(*ctx, *state, 0);
+                    });
+
+            WHISPER_LOG_INFO("%s: compute buffer (conv)   = %7.2f MB\n", __func__, whisper_allocr_size(state->alloc_conv) / 1024.0 / 1024.0);
+        }
 
-        WHISPER_LOG_INFO("%s: compute buffer (decode) = %7.2f MB\n", __func__, whisper_allocr_size(state->alloc_decode) / 1024.0 / 1024.0);
+        // encoder allocator
+        if (!whisper_encode_external(*state)) {
+            whisper_allocr_graph_init(state->alloc_encode, ctx->backend,
+                    [&]() {
+                        return whisper_build_graph_encoder(*ctx, *state);
+                    });
+
+            WHISPER_LOG_INFO("%s: compute buffer (encode) = %7.2f MB\n", __func__, whisper_allocr_size(state->alloc_encode) / 1024.0 / 1024.0);
+        }
+
+        // cross allocator
+        {
+            whisper_allocr_graph_init(state->alloc_cross, ctx->backend,
+                    [&]() {
+                        return whisper_build_graph_cross(*ctx, *state, state->kv_cross);
+                    });
+
+            WHISPER_LOG_INFO("%s: compute buffer (cross)  = %7.2f MB\n", __func__, whisper_allocr_size(state->alloc_cross) / 1024.0 / 1024.0);
+        }
+
+        // decoder allocator
+        {
+            // sized for the longest prompt of whisper_full() instead of the whole text context
+            whisper_allocr_graph_init(state->alloc_decode, ctx->backend,
+                    [&]() {
+                        return whisper_build_graph_decoder_worst(*ctx, *state, whisper_n_prompt_max(ctx->model.hparams), false);
+                    });
+
+            // the speculative verification pass computes the logits for all of its tokens
+            ggml_allocr_reset(state->alloc_decode.alloc);
+            ggml_allocr_alloc_graph(state->alloc_decode.alloc,
+                    whisper_build_graph_decoder_worst(*ctx, *state, WHISPER_MAX_DRAFT + 1, true));
+
+            WHISPER_LOG_INFO("%s: compute buffer (decode) = %7.2f MB\n", __func__, whisper_allocr_size(state->alloc_decode) / 1024.0 / 1024.0);
+        }
+
+        sizes.conv   = ggml_allocr_max_size(state->alloc_conv.alloc);
+        sizes.encode = state->alloc_encode.alloc ? ggml_allocr_max_size(state->alloc_encode.alloc) : 0;
+        sizes.cross  = ggml_allocr_max_size(state->alloc_cross.alloc);
+        sizes.decode = ggml_allocr_max_size(state->alloc_decode.alloc);
+
+        std::lock_guard<std::mutex> lock(ctx->mutex_compute_sizes);
+        ctx->compute_sizes = sizes;
     }
 
-    whisper_allocr_graph_realloc(state->alloc_conv,   ctx->backend);
-    whisper_allocr_graph_realloc(state->alloc_encode, ctx->backend);
-    whisper_allocr_graph_realloc(state->alloc_cross,  ctx->backend);
-    whisper_allocr_graph_realloc(state->alloc_decode, ctx->backend);
+    if (kv_cross_parent != nullptr) {
+        // decode only
+    } else if (whisper_encode_external(*state)) {
+        whisper_allocr_graph_realloc_shared({ &state->alloc_conv, &state->alloc_cross }, state->buffer_enc, ctx->backend,
+                std::max(sizes.conv, sizes.cross));
+    } else {
+        whisper_allocr_graph_realloc_shared({ &state->alloc_conv, &state->alloc_encode, &state->alloc_cross }, state->buffer_enc, ctx->backend,
+                std::max(std::max(sizes.conv, sizes.encode), sizes.cross));
+    }
+
+    whisper_allocr_graph_realloc(state->alloc_decode, ctx->backend, sizes.decode);
+
+    state->n_decode_max     = whisper_n_prompt_max(ctx->model.hparams);
+    state->n_decode_all_max = WHISPER_MAX_DRAFT + 1;
+
+    if (!measured) {
+        WHISPER_LOG_INFO("%s: compute buffer (shared conv/encode/cross) = %7.2f MB\n", __func__, ggml_backend_buffer_get_size(state->buffer_enc) / 1024.0 / 1024.0);
+    }
 
     state->rng = std::mt19937(0);
 
     return state;
 }
 
+struct whisper_state * whisper_init_state(whisper_context * ctx) {
+    return whisper_init_state(ctx, nullptr);
+}
+
+struct whisper_state * whisper_get_state(struct whisper_context * ctx) {
+    return ctx->state;
+}
+
 int whisper_ctx_init_openvino_encoder(
         struct whisper_context * ctx,
                     const char * model_path,
@@ -3014,6 +3767,8 @@ int whisper_ctx_init_openvino_encoder(
 struct whisper_context_params whisper_context_default_params() {
     struct whisper_context_params result = {
         /*.use_gpu    =*/ true,
+        /*.numa       =*/ WHISPER_NUMA_STRATEGY_DISABLED,
+        /*.numa_node  =*/ 0,
     };
     return result;
 }
@@ -3184,6 +3939,16 @@ void whisper_free_state(struct whisper_state * state)
 {
     if (state) {
         kv_cache_free(state->kv_cross);
+        kv_cache_free(state->kv_cross_next);
+
+        for (auto * fstate : state->fallback_states) {
+            whisper_free_state(fstate);
+        }
+
+        if (state->ctx_vocab) {
+            ggml_free(state->ctx_vocab);
+            ggml_backend_buffer_free(state->buffer_vocab);
+        }
 
         for (int i = 0; i < WHISPER_MAX_DECODERS; ++i) {
             kv_cache_free(state->decoders[i].kv_self);
@@ -3207,6 +3972,9 @@ void whisper_free_state(struct whisper_state * state)
         whisper_allocr_free(state->alloc_encode);
         whisper_allocr_free(state->alloc_cross);
         whisper_allocr_free(state->alloc_decode);
+        whisper_allocr_free(state->alloc_embd);
+
+        ggml_backend_buffer_free(state->buffer_enc);
 
         ggml_backend_free(state->backend);
 
@@ -3224,6 +3992,11 @@ void whisper_free(struct whisper_context * ctx) {
             ggml_backend_buffer_free(ctx->model.buffer);
         }
 
+        for (auto & kv : ctx->model_replicas) {
+            ggml_free(kv.second.ctx);
+            ggml_backend_buffer_free(kv.second.buffer);
+        }
+
         whisper_free_state(ctx->state);
 
         ggml_backend_free(ctx->backend);
@@ -3296,6 +4069,8 @@ int whisper_set_mel_with_state(
     state->mel.n_len_org = n_len;
     state->mel.n_mel     = n_mel;
 
+    state->enc_seek = -1;
+
     state->mel.data.resize(n_len*n_mel);
     memcpy(state->mel.data.data(), data, n_len*n_mel*sizeof(float));
 
@@ -3331,7 +4106,7 @@ int whisper_encode(struct whisper_context * ctx, int offset, int n_threads) {
 int whisper_decode_with_state(struct whisper_context * ctx, struct whisper_state * state, const whisper_token * tokens, int n_tokens, int n_past, int n_threads) {
     const int selected_decoder_id = 0;
 
-    if (!whisper_decode_internal(*ctx, *state, state->decoders[selected_decoder_id], tokens, n_tokens, n_past, n_threads, nullptr, nullptr)) {
+    if (!whisper_decode_internal(*ctx, *state, state->decoders[selected_decoder_id], tokens, n_tokens, n_past, false, n_threads, nullptr, nullptr)) {
         WHISPER_LOG_ERROR("%s: failed to eval\n", __func__);
         return 1;
     }
@@ -3348,7 +4123,7 @@ int whisper_decode(struct whisper_context * ctx, const whisper_token * tokens, i
         return false;
     }
 
-    if (!whisper_decode_internal(*ctx, *ctx->state, ctx->state->decoders[selected_decoder_id], tokens, n_tokens, n_past, n_threads, nullptr, nullptr)) {
+    if (!whisper_decode_internal(*ctx, *ctx->state, ctx->state->decoders[selected_decoder_id], tokens, n_tokens, n_past, false, n_threads, nullptr, nullptr)) {
         WHISPER_LOG_ERROR("%s: failed to eval\n", __func__);
         return 1;
     }
@@ -3488,6 +4263,181 @@ int whisper_lang_auto_detect(
     return whisper_lang_auto_detect_with_state(ctx, ctx->state, offset_ms, n_threads, lang_probs);
 }
 
+int whisper_score_phrases_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+                    const char * language,
+           const whisper_token * prompt_tokens,
+                           int   prompt_n_tokens,
+                   const char ** phrases,
+                           int   n_phrases,
+                           int   offset_ms,
+                           int   n_threads,
+                         float * scores) {
+    const int seek    = offset_ms/10;
+    const int n_vocab = whisper_n_vocab(ctx);
+
+    if (seek < 0 || seek >= state->mel.n_len_org) {
+        WHISPER_LOG_ERROR("%s: offset %dms is outside of the audio (%dms)\n", __func__, offset_ms, state->mel.n_len_org*10);
+        return -1;
+    }
+
+    // task prompt
+    std::vector<whisper_token> prompt;
+
+    if (prompt_tokens != nullptr && prompt_n_tokens > 0) {
+        prompt.push_back(whisper_token_prev(ctx));
+        prompt.insert(prompt.end(), prompt_tokens, prompt_tokens + prompt_n_tokens);
+    }
+
+    prompt.push_back(whisper_token_sot(ctx));
+
+    if (whisper_is_multilingual(ctx)) {
+        const int lang_id = whisper_lang_id(language != nullptr ? language : "en");
+        if (lang_id < 0) {
+            WHISPER_LOG_ERROR("%s: unknown language '%s'\n", __func__, language);
+            return -2;
+        }
+
+        prompt.push_back(whisper_token_lang(ctx, lang_id));
+        prompt.push_back(whisper_token_transcribe(ctx));
+    }
+
+    prompt.push_back(whisper_token_not(ctx));
+
+    // the phrases, each followed by the end of text token
+    std::vector<std::vector<whisper_token>> tokens(n_phrases);
+
+    for (int i = 0; i < n_phrases; ++i) {
+        const std::string text = std::string(" ") + phrases[i];
+
+        tokens[i].resize(text.size() + 1);
+
+        const int n = whisper_tokenize(ctx, text.c_str(), tokens[i].data(), tokens[i].size());
+        if (n < 0) {
+            WHISPER_LOG_ERROR("%s: failed to tokenize phrase '%s'\n", __func__, phrases[i]);
+            return -3;
+        }
+
+        tokens[i].resize(n);
+        tokens[i].push_back(whisper_token_eot(ctx));
+
+        if ((int) (prompt.size() + tokens[i].size()) > whisper_n_text_ctx(ctx)/2) {
+            WHISPER_LOG_ERROR("%s: phrase '%s' is too long\n", __func__, phrases[i]);
+            return -3;
+        }
+    }
+
+    // run the encoder, unless the window is already encoded
+    const int n_audio_ctx = state->exp_n_audio_ctx > 0 ? state->exp_n_audio_ctx : whisper_n_audio_ctx(ctx);
+
+    if (state->enc_seek != seek || state->enc_n_ctx != n_audio_ctx) {
+        if (!whisper_encode_internal(*ctx, *state, seek, n_threads, nullptr, nullptr)) {
+            WHISPER_LOG_ERROR("%s: failed to encode\n", __func__);
+            return -6;
+        }
+    } else {
+        state->n_enc_hit++;
+    }
+
+    auto & decoder = state->decoders[0];
+
+    if (!whisper_decode_internal(*ctx, *state, decoder, prompt.data(), prompt.size(), 0, false, n_threads, nullptr, nullptr)) {
+        WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
+        return -7;
+    }
+
+    const int n_past = prompt.size();
+
+    // log_softmax of the logits that predict the next phrase token
+    auto log_softmax = [n_vocab](const float * logits, std::vector<float> & logprobs) {
+        const float max = *std::max_element(logits, logits + n_vocab);
+
+        double sum = 0.0;
+        for (int k = 0; k < n_vocab; ++k) {
+            sum += exp(logits[k] - max);
+        }
+
+        const float lse = max + log(sum);
+
+        logprobs.resize(n_vocab);
+        for (int k = 0; k < n_vocab; ++k) {
+            logprobs[k] = logits[k] - lse;
+        }
+    };
+
+    // the phrases are visited in lexicographic order of their tokens, so that the tokens of the current path
+    // that are shared with the next phrase are already in the KV cache
+    // rows[d] holds the log probabilities after the first d tokens of the path
+    std::vector<whisper_token>      path;
+    std::vector<std::vector<float>> rows(1);
+
+    log_softmax(state->logits.data(), rows[0]);
+
+    std::vector<int> order(n_phrases);
+    for (int i = 0; i < n_phrases; ++i) {
+        order[i] = i;
+    }
+
+    std::sort(order.begin(), order.end(), [&](int a, int b) {
+        return tokens[a] < tokens[b];
+    });
+
+    for (const int i : order) {
+        const auto & cur = tokens[i];
+
+        // the last token (end of text) is only scored, never decoded
+        const int n_cur = cur.size() - 1;
+
+        int n_common = 0;
+        while (n_common < (int) path.size() && n_common < n_cur && path[n_common] == cur[n_common]) {
+            ++n_common;
+        }
+
+        path.resize(n_common);
+        rows.resize(n_common + 1);
+
+        // decode the rest of the phrase, as many tokens at a time as the decoder compute buffer allows
+        while ((int) path.size() < n_cur) {
+            const int n_batch = std::min(n_cur - (int) path.size(), WHISPER_MAX_DRAFT + 1);
+
+            if (!whisper_decode_internal(*ctx, *state, decoder, cur.data() + path.size(), n_batch, n_past + path.size(), true, n_threads, nullptr, nullptr)) {
+                WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
+                return -7;
+            }
+
+            for (int k = 0; k < n_batch; ++k) {
+                path.push_back(cur[path.size()]);
+
+                rows.emplace_back();
+                log_softmax(state->logits.data() + k*n_vocab, rows.back());
+            }
+        }
+
+        double score = 0.0;
+        for (int d = 0; d <= n_cur; ++d) {
+            score += rows[d][cur[d]];
+        }
+
+        scores[i] = score;
+    }
+
+    return 0;
+}
+
+int whisper_score_phrases(
+        struct whisper_context * ctx,
+                    const char * language,
+           const whisper_token * prompt_tokens,
+                           int   prompt_n_tokens,
+                   const char ** phrases,
+                           int   n_phrases,
+                           int   offset_ms,
+                           int   n_threads,
+                         float * scores) {
+    return whisper_score_phrases_with_state(ctx, ctx->state, language, prompt_tokens, prompt_n_tokens, phrases, n_phrases, offset_ms, n_threads, scores);
+}
+
 int whisper_model_n_vocab(struct whisper_context * ctx) {
     return ctx->model.hparams.n_vocab;
 }
@@ -3647,1273 +4597,2823 @@ void whisper_print_timings(struct whisper_context * ctx) {
         WHISPER_LOG_INFO("%s:   encode time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_encode_us, n_encode, 1e-3f * ctx->state->t_encode_us / n_encode);
         WHISPER_LOG_INFO("%s:   decode time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_decode_us, n_decode, 1e-3f * ctx->state->t_decode_us / n_decode);
         WHISPER_LOG_INFO("%s:   prompt time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_prompt_us, n_prompt, 1e-3f * ctx->state->t_prompt_us / n_prompt);
+        if (ctx->state->n_draft > 0) {
+            WHISPER_LOG_INFO("%s:  draft tokens = %5d / %5d accepted (%5.1f %%)\n", __func__, ctx->state->n_draft_accept, ctx->state->n_draft, 100.0f*ctx->state->n_draft_accept/ctx->state->n_draft);
+        }
+        if (ctx->state->n_window > 0) {
+            WHISPER_LOG_INFO("%s:       windows = %5d (%5.1f tokens per window, %d encoder passes reused)\n", __func__, ctx->state->n_window, (float) ctx->state->n_window_tokens/ctx->state->n_window, ctx->state->n_enc_hit);
+        }
     }
     WHISPER_LOG_INFO("%s:    total time = %8.2f ms\n", __func__, (t_end_us - ctx->t_start_us)/1000.0f);
 }
 
+static void whisper_reset_timings_state(whisper_state & state) {
+    state.t_mel_us = 0;
+    state.t_sample_us = 0;
+    state.t_encode_us = 0;
+    state.t_cross_us = 0;
+    state.t_decode_us = 0;
+    state.t_prompt_us = 0;
+    state.n_sample = 0;
+    state.n_encode = 0;
+    state.n_decode = 0;
+    state.n_prompt = 0;
+    state.n_fail_p = 0;
+    state.n_fail_h = 0;
+    state.n_draft = 0;
+    state.n_draft_accept = 0;
+    state.n_enc_hit = 0;
+    state.n_window = 0;
+    state.n_window_tokens = 0;
+
+    std::fill(std::begin(state.hist_encode_us), std::end(state.hist_encode_us), 0);
+    std::fill(std::begin(state.hist_prompt_us), std::end(state.hist_prompt_us), 0);
+    std::fill(std::begin(state.hist_decode_us), std::end(state.hist_decode_us), 0);
+    std::fill(std::begin(state.hist_window_us), std::end(state.hist_window_us), 0);
+}
+
+static void whisper_accumulate_timings(whisper_state & dst, const whisper_state & src) {
+    dst.t_mel_us    += src.t_mel_us;
+    dst.t_sample_us += src.t_sample_us;
+    dst.t_encode_us += src.t_encode_us;
+    dst.t_cross_us  += src.t_cross_us;
+    dst.t_decode_us += src.t_decode_us;
+    dst.t_prompt_us += src.t_prompt_us;
+
+    dst.n_sample += src.n_sample;
+    dst.n_encode += src.n_encode;
+    dst.n_decode += src.n_decode;
+    dst.n_prompt += src.n_prompt;
+    dst.n_fail_p += src.n_fail_p;
+    dst.n_fail_h += src.n_fail_h;
+
+    dst.n_draft        += src.n_draft;
+    dst.n_draft_accept += src.n_draft_accept;
+
+    dst.n_enc_hit       += src.n_enc_hit;
+    dst.n_window        += src.n_window;
+    dst.n_window_tokens += src.n_window_tokens;
+
+    for (int i = 0; i < WHISPER_TIMINGS_HIST_SIZE; ++i) {
+        dst.hist_encode_us[i] += src.hist_encode_us[i];
+        dst.hist_prompt_us[i] += src.hist_prompt_us[i];
+        dst.hist_decode_us[i] += src.hist_decode_us[i];
+        dst.hist_window_us[i] += src.hist_window_us[i];
+    }
+}
+
 void whisper_reset_timings(struct whisper_context * ctx) {
     ctx->t_start_us = ggml_time_us();
     if (ctx->state != nullptr) {
-        ctx->state->t_mel_us = 0;
-        ctx->state->t_sample_us = 0;
-        ctx->state->t_encode_us = 0;
-        ctx->state->t_decode_us = 0;
-        ctx->state->t_prompt_us = 0;
-        ctx->state->n_sample = 0;
-        ctx->state->n_encode = 0;
-        ctx->state->n_decode = 0;
-        ctx->state->n_prompt = 0;
+        whisper_reset_timings_state(*ctx->state);
     }
 }
 
-static int whisper_has_coreml(void) {
-#ifdef WHISPER_USE_COREML
-    return 1;
-#else
-    return 0;
-#endif
+struct whisper_timings whisper_get_timings_from_state(struct whisper_state * state) {
+    whisper_timings timings;
+
+    timings.t_mel_us    = state->t_mel_us;
+    timings.t_encode_us = state->t_encode_us - state->t_cross_us;
+    timings.t_cross_us  = state->t_cross_us;
+    timings.t_prompt_us = state->t_prompt_us;
+    timings.t_decode_us = state->t_decode_us;
+    timings.t_sample_us = state->t_sample_us;
+
+    timings.n_encode = state->n_encode;
+    timings.n_prompt = state->n_prompt;
+    timings.n_decode = state->n_decode;
+    timings.n_sample = state->n_sample;
+    timings.n_fail_p = state->n_fail_p;
+    timings.n_fail_h = state->n_fail_h;
+
+    timings.n_enc_hit       = state->n_enc_hit;
+    timings.n_window        = state->n_window;
+    timings.n_window_tokens = state->n_window_tokens;
+
+    std::copy(std::begin(state->hist_encode_us), std::end(state->hist_encode_us), timings.hist_encode_us);
+    std::copy(std::begin(state->hist_prompt_us), std::end(state->hist_prompt_us), timings.hist_prompt_us);
+    std::copy(std::begin(state->hist_decode_us), std::end(state->hist_decode_us), timings.hist_decode_us);
+    std::copy(std::begin(state->hist_window_us), std::end(state->hist_window_us), timings.hist_window_us);
+
+    return timings;
 }
 
-static int whisper_has_openvino(void) {
-#ifdef WHISPER_USE_OPENVINO
-    return 1;
-#else
-    return 0;
-#endif
+struct whisper_timings whisper_get_timings(struct whisper_context * ctx) {
+    if (ctx->state == nullptr) {
+        WHISPER_LOG_ERROR("%s: no state\n", __func__);
+        return whisper_timings {};
+    }
+
+    return whisper_get_timings_from_state(ctx->state);
 }
 
-const char * whisper_print_system_info(void) {
-    static std::string s;
+static whisper_memory_entry whisper_memory_entry_make(const char * name, const char * backend, int32_t id, size_t size, size_t used, size_t peak) {
+    whisper_memory_entry entry;
 
-    s  = "";
-    s += "AVX = "       + std::to_string(ggml_cpu_has_avx())       + " | ";
-    s += "AVX2 = "      + std::to_string(ggml_cpu_has_avx2())      + " | ";
-    s += "AVX512 = "    + std::to_string(ggml_cpu_has_avx512())    + " | ";
-    s += "FMA = "       + std::to_string(ggml_cpu_has_fma())       + " | ";
-    s += "NEON = "      + std::to_string(ggml_cpu_has_neon())      + " | ";
-    s += "ARM_FMA = "   + std::to_string(ggml_cpu_has_arm_fma())   + " | ";
-    s += "METAL = "     + std::to_string(ggml_cpu_has_metal())     + " | ";
-    s += "F16C = "      + std::to_string(ggml_cpu_has_f16c())      + " | ";
-    s += "FP16_VA = "   + std::to_string(ggml_cpu_has_fp16_va())   + " | ";
-    s += "WASM_SIMD = " + std::to_string(ggml_cpu_has_wasm_simd()) + " | ";
-    s += "BLAS = "      + std::to_string(ggml_cpu_has_blas())      + " | ";
-    s += "SSE3 = "      + std::to_string(ggml_cpu_has_sse3())      + " | ";
-    s += "SSSE3 = "     + std::to_string(ggml_cpu_has_ssse3())     + " | ";
-    s += "VSX = "       + std::to_string(ggml_cpu_has_vsx())       + " | ";
-    s += "CUDA = "      + std::to_string(ggml_cpu_has_cublas())    + " | ";
-    s += "COREML = "    + std::to_string(whisper_has_coreml())     + " | ";
-    s += "OPENVINO = "  + std::to_string(whisper_has_openvino())   + " | ";
+    entry.name    = name;
+    entry.backend = backend;
+    entry.id      = id;
+    entry.size    = size;
+    entry.used    = used;
+    entry.peak    = peak;
+    entry.helper  = -1;
 
-    return s.c_str();
+    return entry;
 }
 
-//////////////////////////////////
-// Grammar - ported from llama.cpp
-//////////////////////////////////
+static int whisper_memory_entries_copy(const std::vector<whisper_memory_entry> & src, struct whisper_memory_entry * entries, int n_entries) {
+    for (int i = 0; i < std::min(n_entries, (int) src.size()); ++i) {
+        entries[i] = src[i];
+    }
 
-// Decodes a UTF-8 string which may end in an incomplete sequence. Adds a terminating 0 for use as
-// pointer. If an invalid sequence is encountered, returns `whisper_partial_utf8.n_remain == -1`.
-std::pair<std::vector<uint32_t>, whisper_partial_utf8> decode_utf8(
-        const char         * src,
-        whisper_partial_utf8   partial_start) {
-    static const int      lookup[] = { 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 2, 2, 3, 4 };
-    const char          * pos      = src;
-    std::vector<uint32_t> code_points;
-    uint32_t              value    = partial_start.value;
-    int                   n_remain = partial_start.n_remain;
+    return src.size();
+}
 
-    // continue previous decode, if applicable
-    while (*pos != 0 && n_remain > 0) {
-        uint8_t next_byte = static_cast<uint8_t>(*pos);
-        if ((next_byte >> 6) != 2) {
-            // invalid sequence, abort
-            code_points.push_back(0);
-            return std::make_pair(std::move(code_points), whisper_partial_utf8{ 0, -1 });
-        }
-        value = (value << 6) + (next_byte & 0x3F);
-        ++pos;
-        --n_remain;
-    }
+int whisper_model_memory_usage(struct whisper_context * ctx, struct whisper_memory_entry * entries, int n_entries) {
+    const char * backend = ggml_backend_name(ctx->backend);
 
-    if (partial_start.n_remain > 0 && n_remain == 0) {
-        code_points.push_back(value);
+    // bytes of the weights for each tensor type, in the order of the ggml_type enum
+    std::vector<size_t> type_size(GGML_TYPE_COUNT, 0);
+
+    size_t used = 0;
+    for (const auto & kv : ctx->model.tensors) {
+        type_size[kv.second->type] += ggml_nbytes(kv.second);
+        used += ggml_nbytes(kv.second);
     }
 
-    // decode any subsequent utf-8 sequences, which may end in an incomplete one
-    while (*pos != 0) {
-        uint8_t  first_byte = static_cast<uint8_t>(*pos);
-        uint8_t  highbits   = first_byte >> 4;
-                 n_remain   = lookup[highbits] - 1;
+    std::vector<whisper_memory_entry> res;
 
-        if (n_remain < 0) {
-            // invalid sequence, abort
-            code_points.clear();
-            code_points.push_back(0);
-            return std::make_pair(std::move(code_points), whisper_partial_utf8{ 0, n_remain });
-        }
+    const size_t size = ctx->model.buffer ? ggml_backend_buffer_get_size(ctx->model.buffer) : 0;
+    res.push_back(whisper_memory_entry_make("weights", backend, -1, size, used, used));
 
-        uint8_t  mask       = (1 << (7 - n_remain)) - 1;
-                 value      = first_byte & mask;
-        ++pos;
-        while (*pos != 0 && n_remain > 0) {
-            value = (value << 6) + (static_cast<uint8_t>(*pos) & 0x3F);
-            ++pos;
-            --n_remain;
-        }
-        if (n_remain == 0) {
-            code_points.push_back(value);
+    for (int t = 0; t < GGML_TYPE_COUNT; ++t) {
+        if (type_size[t] > 0) {
+            res.push_back(whisper_memory_entry_make("weights", backend, t, type_size[t], type_size[t], type_size[t]));
         }
     }
-    code_points.push_back(0);
-
-    return std::make_pair(std::move(code_points), whisper_partial_utf8{ value, n_remain });
-}
 
-// returns true iff pos points to the end of one of the definitions of a rule
-static bool whisper_grammar_is_end_of_sequence(const whisper_grammar_element * pos) {
-    switch (pos->type) {
-        case WHISPER_GRETYPE_END: return true;  // NOLINT
-        case WHISPER_GRETYPE_ALT: return true;  // NOLINT
-        default:                return false;
+    for (const auto & kv : ctx->model_replicas) {
+        const size_t size_replica = ggml_backend_buffer_get_size(kv.second.buffer);
+        res.push_back(whisper_memory_entry_make("weights_replica", backend, kv.first, size_replica, used, used));
     }
+
+    return whisper_memory_entries_copy(res, entries, n_entries);
 }
 
-// returns true iff chr satisfies the char range at pos (regular or inverse range)
-// asserts that pos is pointing to a char range element
-static std::pair<bool, const whisper_grammar_element *> whisper_grammar_match_char(
-        const whisper_grammar_element * pos,
-        const uint32_t                chr) {
+// append the buffers of one state to res, helper is the index of the fallback helper state or -1
+static void whisper_state_memory_entries(const whisper_state * state, int32_t helper, std::vector<whisper_memory_entry> & res) {
+    const char * backend = ggml_backend_name(state->backend);
 
-    bool found            = false;
-    bool is_positive_char = pos->type == WHISPER_GRETYPE_CHAR;
+    const size_t n_res = res.size();
 
-    WHISPER_ASSERT(is_positive_char || pos->type == WHISPER_GRETYPE_CHAR_NOT); // NOLINT
+    const auto add_kv = [&](const char * name, int32_t id, const whisper_kv_cache & kv) {
+        if (kv.ctx == nullptr) {
+            return;
+        }
 
-    do {
-        if (pos[1].type == WHISPER_GRETYPE_CHAR_RNG_UPPER) {
-            // inclusive range, e.g. [a-z]
-            found = found || (pos->value <= chr && chr <= pos[1].value);
-            pos += 2;
-        } else {
-            // exact char match, e.g. [a] or "a"
-            found = found || pos->value == chr;
-            pos += 1;
+        const size_t size      = ggml_backend_buffer_get_size(kv.buffer);
+        const size_t per_token = (ggml_nbytes(kv.k) + ggml_nbytes(kv.v))/std::max(1, kv.size);
+
+        res.push_back(whisper_memory_entry_make(name, backend, id, size, per_token*kv.n, per_token*kv.n_max));
+    };
+
+    const auto add_allocr = [&](const char * name, const whisper_allocr & allocr) {
+        if (allocr.alloc == nullptr) {
+            return;
         }
-    } while (pos->type == WHISPER_GRETYPE_CHAR_ALT);
 
-    return std::make_pair(found == is_positive_char, pos);
-}
+        const size_t size = ggml_backend_buffer_get_size(allocr.buffer) + allocr.meta.size();
+        const size_t peak = ggml_allocr_max_size(allocr.alloc) + allocr.meta.size();
 
-// returns true iff some continuation of the given partial UTF-8 sequence could satisfy the char
-// range at pos (regular or inverse range)
-// asserts that pos is pointing to a char range element
-static bool whisper_grammar_match_partial_char(
-        const whisper_grammar_element * pos,
-        const whisper_partial_utf8      partial_utf8) {
+        // the buffer is reset for every graph, so the current usage is the peak
+        res.push_back(whisper_memory_entry_make(name, backend, -1, size, peak, peak));
+    };
 
-    bool is_positive_char = pos->type == WHISPER_GRETYPE_CHAR;
-    WHISPER_ASSERT(is_positive_char || pos->type == WHISPER_GRETYPE_CHAR_NOT);
+    const auto add_host = [&](const char * name, int32_t id, size_t size, size_t used) {
+        if (size == 0) {
+            return;
+        }
 
-    uint32_t partial_value = partial_utf8.value;
-    int      n_remain      = partial_utf8.n_remain;
+        res.push_back(whisper_memory_entry_make(name, "host", id, size, used, used));
+    };
 
-    // invalid sequence or 7-bit char split across 2 bytes (overlong)
-    if (n_remain < 0 || (n_remain == 1 && partial_value < 2)) {
-        return false;
+    for (int i = 0; i < WHISPER_MAX_DECODERS; ++i) {
+        add_kv("kv_self", i, state->decoders[i].kv_self);
     }
 
-    // range of possible code points this partial UTF-8 sequence could complete to
-    uint32_t low  = partial_value << (n_remain * 6);
-    uint32_t high = low | ((1 << (n_remain * 6)) - 1);
+    add_kv("kv_cross",      -1, state->kv_cross);
+    add_kv("kv_cross_next", -1, state->kv_cross_next);
 
-    if (low == 0) {
-        if (n_remain == 2) {
-            low = 1 << 11;
-        } else if (n_remain == 3) {
-            low = 1 << 16;
-        }
-    }
+    // conv, encode and cross share buffer_enc
+    if (state->buffer_enc) {
+        size_t size = ggml_backend_buffer_get_size(state->buffer_enc);
+        size_t peak = 0;
 
-    do {
-        if (pos[1].type == WHISPER_GRETYPE_CHAR_RNG_UPPER) {
-            // inclusive range, e.g. [a-z]
-            if (pos->value <= high && low <= pos[1].value) {
-                return is_positive_char;
-            }
-            pos += 2;
-        } else {
-            // exact char match, e.g. [a] or "a"
-            if (low <= pos->value && pos->value <= high) {
-                return is_positive_char;
+        for (const auto * allocr : { &state->alloc_conv, &state->alloc_encode, &state->alloc_cross }) {
+            if (allocr->alloc) {
+                size += allocr->meta.size();
+                peak  = std::max(peak, ggml_allocr_max_size(allocr->alloc) + allocr->meta.size());
             }
-            pos += 1;
         }
-    } while (pos->type == WHISPER_GRETYPE_CHAR_ALT);
 
-    return !is_positive_char;
-}
+        res.push_back(whisper_memory_entry_make("compute_encode", backend, -1, size, peak, peak));
+    }
 
+    add_allocr("compute_decode", state->alloc_decode);
 
-// transforms a grammar pushdown stack into N possible stacks, all ending
-// at a character range (terminal element)
-static void whisper_grammar_advance_stack(
-        const std::vector<std::vector<whisper_grammar_element>>   & rules,
-        const std::vector<const whisper_grammar_element *>        & stack,
-        std::vector<std::vector<const whisper_grammar_element *>> & new_stacks) {
+    if (state->alloc_embd.alloc) {
+        const size_t size = ggml_backend_buffer_get_size(state->alloc_embd.buffer);
+        const size_t peak = ggml_allocr_max_size(state->alloc_embd.alloc);
 
-    if (stack.empty()) {
-        new_stacks.push_back(stack);
-        return;
+        res.push_back(whisper_memory_entry_make("embd", backend, -1, size, peak, peak));
     }
 
-    const whisper_grammar_element * pos = stack.back();
+    if (state->buffer_vocab) {
+        const size_t size = ggml_backend_buffer_get_size(state->buffer_vocab);
+        res.push_back(whisper_memory_entry_make("vocab", backend, -1, size, size, size));
+    }
 
-    switch (pos->type) {
-        case WHISPER_GRETYPE_RULE_REF: {
-            const size_t                  rule_id = static_cast<size_t>(pos->value);
-            const whisper_grammar_element * subpos  = rules[rule_id].data();
-            do {
-                // init new stack without the top (pos)
-                std::vector<const whisper_grammar_element *> new_stack(stack.begin(), stack.end() - 1);
-                if (!whisper_grammar_is_end_of_sequence(pos + 1)) {
-                    // if this rule ref is followed by another element, add that to stack
-                    new_stack.push_back(pos + 1);
-                }
-                if (!whisper_grammar_is_end_of_sequence(subpos)) {
-                    // if alternate is nonempty, add to stack
-                    new_stack.push_back(subpos);
-                }
-                whisper_grammar_advance_stack(rules, new_stack, new_stacks);
-                while (!whisper_grammar_is_end_of_sequence(subpos)) {
-                    // scan to end of alternate def
-                    subpos++;
-                }
-                if (subpos->type == WHISPER_GRETYPE_ALT) {
-                    // there's another alternate def of this rule to process
-                    subpos++;
-                } else {
-                    break;
-                }
-            } while (true);
-            break;
-        }
-        case WHISPER_GRETYPE_CHAR:
-        case WHISPER_GRETYPE_CHAR_NOT:
-            new_stacks.push_back(stack);
-            break;
-        default:
-            // end of alternate (WHISPER_GRETYPE_END, WHISPER_GRETYPE_ALT) or middle of char range
-            // (WHISPER_GRETYPE_CHAR_ALT, WHISPER_GRETYPE_CHAR_RNG_UPPER); stack should never be left on
-            // those
-            WHISPER_ASSERT(false);
+    for (int i = 0; i < (int) state->kv_swap_bufs.size(); ++i) {
+        const auto & buf = state->kv_swap_bufs[i];
+        add_host("kv_swap", i, buf.k.capacity() + buf.v.capacity(), buf.k.size() + buf.v.size());
     }
-}
 
-// takes a set of possible pushdown stacks on a grammar, which are required to
-// be positioned at a character range (see `whisper_grammar_advance_stack`), and
-// produces the N possible stacks if the given char is accepted at those
-// positions
-static std::vector<std::vector<const whisper_grammar_element *>> whisper_grammar_accept(
-        const std::vector<std::vector<whisper_grammar_element>>         & rules,
-        const std::vector<std::vector<const whisper_grammar_element *>> & stacks,
-        const uint32_t                                                  chr) {
+    for (int i = 0; i < WHISPER_MAX_DECODERS; ++i) {
+        const auto & decoder = state->decoders[i];
 
-    std::vector<std::vector<const whisper_grammar_element *>> new_stacks;
+        const size_t size = sizeof(float)*(decoder.probs.capacity() + decoder.logits.capacity() + decoder.logprobs.capacity()) +
+            sizeof(whisper_token_data)*decoder.sequence.tokens.capacity();
+        const size_t used = sizeof(float)*(decoder.probs.size() + decoder.logits.size() + decoder.logprobs.size()) +
+            sizeof(whisper_token_data)*decoder.sequence.tokens.size();
 
-    for (const auto & stack : stacks) {
-        if (stack.empty()) {
-            continue;
-        }
+        add_host("decoder", i, size, used);
+    }
 
-        auto match = whisper_grammar_match_char(stack.back(), chr);
-        if (match.first) {
-            const whisper_grammar_element * pos = match.second;
+    add_host("mel",         -1, sizeof(float)*state->mel.data.capacity(), sizeof(float)*state->mel.data.size());
+    add_host("logits",      -1, sizeof(float)*state->logits.capacity(),    sizeof(float)*state->logits.size());
+    add_host("work_encode", -1, state->work_encode_next.capacity(),        state->work_encode_next.size());
 
-            // update top of stack to next element, if any
-            std::vector<const whisper_grammar_element *> new_stack(stack.begin(), stack.end() - 1);
-            if (!whisper_grammar_is_end_of_sequence(pos)) {
-                new_stack.push_back(pos);
-            }
-            whisper_grammar_advance_stack(rules, new_stack, new_stacks);
-        }
+    for (size_t i = n_res; i < res.size(); ++i) {
+        res[i].helper = helper;
     }
-
-    return new_stacks;
 }
 
-static std::vector<whisper_grammar_candidate> whisper_grammar_reject_candidates(
-        const std::vector<std::vector<whisper_grammar_element>>         & rules,
-        const std::vector<std::vector<const whisper_grammar_element *>> & stacks,
-        const std::vector<whisper_grammar_candidate>                    & candidates);
+int whisper_state_memory_usage(struct whisper_state * state, struct whisper_memory_entry * entries, int n_entries) {
+    std::vector<whisper_memory_entry> res;
 
-static std::vector<whisper_grammar_candidate> whisper_grammar_reject_candidates_for_stack(
-        const std::vector<std::vector<whisper_grammar_element>> & rules,
-        const std::vector<const whisper_grammar_element *>      & stack,
-        const std::vector<whisper_grammar_candidate>            & candidates) {
+    whisper_state_memory_entries(state, -1, res);
 
-    std::vector<whisper_grammar_candidate> rejects;
+    // the helper states of the concurrent fallback are created by whisper_full() and freed with the state
+    for (int k = 0; k < (int) state->fallback_states.size(); ++k) {
+        whisper_state_memory_entries(state->fallback_states[k], k, res);
+    }
 
-    if (stack.empty()) {
-        for (auto tok : candidates) {
-            if (*tok.code_points != 0 || tok.partial_utf8.n_remain != 0) {
-                rejects.push_back(tok);
-            }
+    return whisper_memory_entries_copy(res, entries, n_entries);
+}
+
+static void whisper_print_memory_entries(const char * what, const std::vector<whisper_memory_entry> & entries) {
+    const char * func = "whisper_print_memory_usage";
+
+    size_t total = 0;
+    for (const auto & entry : entries) {
+        if (entry.id < 0 || strcmp(entry.name, "weights") != 0) {
+            total += entry.size;
         }
-        return rejects;
     }
 
-    const whisper_grammar_element * stack_pos = stack.back();
+    WHISPER_LOG_INFO("%s: %s = %8.2f MB\n", func, what, total/1024.0/1024.0);
 
-    std::vector<whisper_grammar_candidate> next_candidates;
-    for (auto tok : candidates) {
-        if (*tok.code_points == 0) {
-            // reached end of full codepoints in token, reject iff it ended in a partial sequence
-            // that cannot satisfy this position in grammar
-            if (tok.partial_utf8.n_remain != 0 &&
-                    !whisper_grammar_match_partial_char(stack_pos, tok.partial_utf8)) {
-                rejects.push_back(tok);
-            }
-        } else if (whisper_grammar_match_char(stack_pos, *tok.code_points).first) {
-            next_candidates.push_back({ tok.id, tok.code_points + 1, tok.partial_utf8 });
+    for (const auto & entry : entries) {
+        char prefix[32] = "";
+        if (entry.helper >= 0) {
+            snprintf(prefix, sizeof(prefix), "fallback[%d].", entry.helper);
+        }
+
+        char name[64];
+        if (strcmp(entry.name, "weights") == 0 && entry.id >= 0) {
+            snprintf(name, sizeof(name), "%s (%s)", entry.name, ggml_type_name((ggml_type) entry.id));
+        } else if (entry.id >= 0) {
+            snprintf(name, sizeof(name), "%s%s[%d]", prefix, entry.name, entry.id);
         } else {
-            rejects.push_back(tok);
+            snprintf(name, sizeof(name), "%s%s", prefix, entry.name);
         }
+
+        WHISPER_LOG_INFO("%s:   %-28s %-6s size = %8.2f MB, used = %8.2f MB, peak = %8.2f MB\n", func,
+                name, entry.backend, entry.size/1024.0/1024.0, entry.used/1024.0/1024.0, entry.peak/1024.0/1024.0);
     }
+}
 
-    const auto * stack_pos_after = whisper_grammar_match_char(stack_pos, 0).second;
+void whisper_print_memory_usage(struct whisper_context * ctx, struct whisper_state * state) {
+    std::vector<whisper_memory_entry> entries;
 
-    // update top of stack to next element, if any
-    std::vector<const whisper_grammar_element *> stack_after(stack.begin(), stack.end() - 1);
-    if (!whisper_grammar_is_end_of_sequence(stack_pos_after)) {
-        stack_after.push_back(stack_pos_after);
+    if (ctx != nullptr) {
+        entries.resize(whisper_model_memory_usage(ctx, nullptr, 0));
+        whisper_model_memory_usage(ctx, entries.data(), entries.size());
+
+        whisper_print_memory_entries("model", entries);
     }
-    std::vector<std::vector<const whisper_grammar_element *>> next_stacks;
-    whisper_grammar_advance_stack(rules, stack_after, next_stacks);
 
-    auto next_rejects = whisper_grammar_reject_candidates(rules, next_stacks, next_candidates);
-    for (auto tok : next_rejects) {
-        rejects.push_back({ tok.id, tok.code_points - 1, tok.partial_utf8 });
+    if (state != nullptr) {
+        entries.resize(whisper_state_memory_usage(state, nullptr, 0));
+        whisper_state_memory_usage(state, entries.data(), entries.size());
+
+        whisper_print_memory_entries("state", entries);
     }
+}
 
-    return rejects;
+void whisper_profile_enable_with_state(struct whisper_state * state, bool enable) {
+    state->profile.enabled = enable;
 }
 
-static std::vector<whisper_grammar_candidate> whisper_grammar_reject_candidates(
-        const std::vector<std::vector<whisper_grammar_element>>         & rules,
-        const std::vector<std::vector<const whisper_grammar_element *>> & stacks,
-        const std::vector<whisper_grammar_candidate>                    & candidates) {
-    if (candidates.empty() || stacks.empty()) {
-        return std::vector<whisper_grammar_candidate>();
+void whisper_profile_enable(struct whisper_context * ctx, bool enable) {
+    if (ctx->state == nullptr) {
+        WHISPER_LOG_ERROR("%s: no state\n", __func__);
+        return;
     }
 
-    auto rejects = whisper_grammar_reject_candidates_for_stack(rules, stacks.front(), candidates);
+    whisper_profile_enable_with_state(ctx->state, enable);
+}
 
-    for (size_t i = 1, size = stacks.size(); i < size; ++i) {
-        rejects = whisper_grammar_reject_candidates_for_stack(rules, stacks[i], rejects);
+void whisper_profile_reset_with_state(struct whisper_state * state) {
+    std::lock_guard<std::mutex> lock(state->profile.mutex);
+
+    state->profile.events.clear();
+    state->profile.threads.clear();
+}
+
+void whisper_profile_reset(struct whisper_context * ctx) {
+    if (ctx->state == nullptr) {
+        WHISPER_LOG_ERROR("%s: no state\n", __func__);
+        return;
     }
-    return rejects;
+
+    whisper_profile_reset_with_state(ctx->state);
 }
 
-static struct whisper_grammar whisper_grammar_init(
-            const whisper_grammar_element ** rules,
-                                 size_t      n_rules,
-                                 size_t      i_start_rule) {
-    const whisper_grammar_element * pos;
+void whisper_profile_print_with_state(struct whisper_state * state) {
+    std::lock_guard<std::mutex> lock(state->profile.mutex);
 
-    // copy rule definitions into vectors
-    std::vector<std::vector<whisper_grammar_element>> vec_rules(n_rules);
-    for (size_t i = 0; i < n_rules; i++) {
-        for (pos = rules[i]; pos->type != WHISPER_GRETYPE_END; pos++) {
-            vec_rules[i].push_back(*pos);
-        }
-        vec_rules[i].push_back({WHISPER_GRETYPE_END, 0});
-    }
+    struct op_stats {
+        std::string op;
 
-    // loop over alternates of start rule to build initial stacks
-    std::vector<std::vector<const whisper_grammar_element *>> stacks;
-    pos = rules[i_start_rule];
-    do {
-        std::vector<const whisper_grammar_element *> stack;
+        int     n    = 0;
+        int64_t t_us = 0;
+    };
+
+    struct graph_stats {
+        std::string graph;
+
+        int     n    = 0; // number of graph computations
+        int64_t t_us = 0;
+
+        std::vector<op_stats> ops;
+    };
+
+    // graphs and ops in order of first appearance
+    std::vector<graph_stats> graphs;
+
+    for (const auto & event : state->profile.events) {
+        auto it_graph = std::find_if(graphs.begin(), graphs.end(), [&](const graph_stats & g) { return g.graph == event.graph; });
+        if (it_graph == graphs.end()) {
+            graphs.emplace_back();
+            graphs.back().graph = event.graph;
+            it_graph = graphs.end() - 1;
+        }
+
+        // span of the whole graph
+        if (event.name.empty()) {
+            it_graph->n    += 1;
+            it_graph->t_us += event.t_dur_us;
+            continue;
+        }
+
+        // the spans of the compute threads are part of the span of their node
+        if (event.tid >= 0) {
+            continue;
+        }
+
+        auto it_op = std::find_if(it_graph->ops.begin(), it_graph->ops.end(), [&](const op_stats & o) { return o.op == event.op; });
+        if (it_op == it_graph->ops.end()) {
+            it_graph->ops.emplace_back();
+            it_graph->ops.back().op = event.op;
+            it_op = it_graph->ops.end() - 1;
+        }
+
+        it_op->n    += 1;
+        it_op->t_us += event.t_dur_us;
+    }
+
+    WHISPER_LOG_INFO("\n");
+    WHISPER_LOG_INFO("%s: %d events\n", __func__, (int) state->profile.events.size());
+
+    for (auto & graph : graphs) {
+        WHISPER_LOG_INFO("%s: %-8s %6d runs, %10.2f ms\n", __func__, graph.graph.c_str(), graph.n, 1e-3*graph.t_us);
+
+        std::sort(graph.ops.begin(), graph.ops.end(), [](const op_stats & a, const op_stats & b) {
+            return a.t_us > b.t_us;
+        });
+
+        for (const auto & op : graph.ops) {
+            WHISPER_LOG_INFO("%s:   %-14s %8d nodes, %10.2f ms (%5.1f %%)\n", __func__,
+                    op.op.c_str(), op.n, 1e-3*op.t_us, graph.t_us > 0 ? 100.0*op.t_us/graph.t_us : 0.0);
+        }
+    }
+}
+
+void whisper_profile_print(struct whisper_context * ctx) {
+    if (ctx->state == nullptr) {
+        WHISPER_LOG_ERROR("%s: no state\n", __func__);
+        return;
+    }
+
+    whisper_profile_print_with_state(ctx->state);
+}
+
+int whisper_profile_export_trace_with_state(struct whisper_state * state, const char * fname) {
+    std::ofstream fout(fname);
+    if (!fout.is_open()) {
+        WHISPER_LOG_ERROR("%s: failed to open '%s' for writing\n", __func__, fname);
+        return -1;
+    }
+
+    std::lock_guard<std::mutex> lock(state->profile.mutex);
+
+    // the timestamps are relative to the first event, so that the trace starts at 0
+    int64_t t_first_us = 0;
+    for (size_t i = 0; i < state->profile.events.size(); ++i) {
+        const int64_t t_us = state->profile.events[i].t_start_us;
+        if (i == 0 || t_us < t_first_us) {
+            t_first_us = t_us;
+        }
+    }
+
+    fout << "{\"traceEvents\":[\n";
+
+    // one process per calling thread and one thread per ggml compute thread. the spans of the nodes over all of their
+    // threads would overlap the spans of the threads, so they are left out
+    int n_written = 0;
+
+    for (const auto & event : state->profile.events) {
+        if (event.tid < 0) {
+            continue;
+        }
+
+        fout << (n_written++ > 0 ? ",\n" : "");
+        fout << "{\"name\":\"" << event.op << "\",\"cat\":\"" << event.graph << "\",\"ph\":\"X\""
+             << ",\"ts\":"  << event.t_start_us - t_first_us
+             << ",\"dur\":" << event.t_dur_us
+             << ",\"pid\":" << event.pid << ",\"tid\":" << event.tid
+             << ",\"args\":{";
+
+        if (event.name.empty()) {
+            fout << "\"n_nodes\":" << event.ne[0];
+        } else {
+            // tensor names are generated by the graph builders and never need escaping
+            fout << "\"name\":\"" << event.name << "\",\"type\":\"" << ggml_type_name(event.type) << "\""
+                 << ",\"ne\":[" << event.ne[0] << "," << event.ne[1] << "," << event.ne[2] << "," << event.ne[3] << "]";
+        }
+
+        fout << ",\"n_threads\":" << event.n_threads << "}}";
+    }
+
+    fout << "\n],\"displayTimeUnit\":\"ms\"}\n";
+
+    if (!fout.good()) {
+        WHISPER_LOG_ERROR("%s: failed to write '%s'\n", __func__, fname);
+        return -2;
+    }
+
+    WHISPER_LOG_INFO("%s: saved %d events to '%s'\n", __func__, n_written, fname);
+
+    return 0;
+}
+
+int whisper_profile_export_trace(struct whisper_context * ctx, const char * fname) {
+    if (ctx->state == nullptr) {
+        WHISPER_LOG_ERROR("%s: no state\n", __func__);
+        return -1;
+    }
+
+    return whisper_profile_export_trace_with_state(ctx->state, fname);
+}
+
+void whisper_state_reset(struct whisper_state * state) {
+    whisper_reset_timings_state(*state);
+    whisper_profile_reset_with_state(state);
+
+    state->mel.n_len     = 0;
+    state->mel.n_len_org = 0;
+    state->mel.data.clear();
+
+    state->energy.clear();
+    state->result_all.clear();
+    state->prompt_past.clear();
+
+    state->lang_id         = 0;
+    state->exp_n_audio_ctx = 0;
+    state->vocab_active    = false;
+
+    state->t_beg    = 0;
+    state->t_last   = 0;
+    state->tid_last = 0;
+
+    // the KV caches are overwritten by the next encoder and decoder passes, only the bookkeeping is reset
+    state->enc_seek      = -1;
+    state->enc_n_ctx     =  0;
+    state->enc_seek_next = -1;
+
+    state->kv_cross.n      = 0;
+    state->kv_cross_next.n = 0;
+
+    for (int i = 0; i < WHISPER_MAX_DECODERS; ++i) {
+        auto & decoder = state->decoders[i];
+
+        decoder.kv_self.n = 0;
+
+        decoder.sequence.tokens.clear();
+        decoder.sequence.result_len = 0;
+    }
+
+    state->rng = std::mt19937(0);
+}
+
+struct whisper_state * whisper_state_clone(struct whisper_context * ctx, struct whisper_state * src) {
+    whisper_state * state = whisper_init_state(ctx);
+    if (state == nullptr) {
+        return nullptr;
+    }
+
+    if (src->numa_node >= 0 || !src->cpus.empty()) {
+        whisper_state_set_affinity(ctx, state, src->numa_node, src->cpus.data(), src->cpus.size(), src->cpus_pin);
+    }
+
+    state->mel    = src->mel;
+    state->energy = src->energy;
+
+    state->result_all  = src->result_all;
+    state->prompt_past = src->prompt_past;
+
+    state->lang_id         = src->lang_id;
+    state->exp_n_audio_ctx = src->exp_n_audio_ctx;
+
+    // the encoded window, so that the clone can decode it without running the encoder again
+    if (src->enc_seek >= 0) {
+        ggml_backend_tensor_copy(src->kv_cross.k, state->kv_cross.k);
+        ggml_backend_tensor_copy(src->kv_cross.v, state->kv_cross.v);
+
+        state->kv_cross.n     = src->kv_cross.n;
+        state->kv_cross.n_max = src->kv_cross.n;
+
+        state->enc_seek  = src->enc_seek;
+        state->enc_n_ctx = src->enc_n_ctx;
+    }
+
+    return state;
+}
+
+int whisper_state_set_affinity(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+                           int   numa_node,
+                     const int * cpus,
+                           int   n_cpus,
+                          bool   pin) {
+    if (!ggml_backend_is_cpu(state->backend)) {
+        WHISPER_LOG_ERROR("%s: the affinity requires the CPU backend\n", __func__);
+        return -1;
+    }
+
+    if (numa_node >= whisper_numa_n_nodes()) {
+        WHISPER_LOG_ERROR("%s: invalid NUMA node %d, the host has %d\n", __func__, numa_node, whisper_numa_n_nodes());
+        return -2;
+    }
+
+    std::vector<int> cpus_state;
+
+    if (cpus != nullptr && n_cpus > 0) {
+        cpus_state.assign(cpus, cpus + n_cpus);
+    } else if (numa_node >= 0 && !whisper_numa_node_cpus(numa_node, cpus_state)) {
+        WHISPER_LOG_ERROR("%s: failed to read the CPUs of NUMA node %d\n", __func__, numa_node);
+        return -3;
+    }
+
+    state->numa_node = std::max(-1, numa_node);
+    state->cpus      = std::move(cpus_state);
+    state->cpus_pin  = pin;
+
+    ggml_backend_cpu_set_affinity(state->backend, state->cpus.data(), state->cpus.size(), pin);
+
+    // move the buffers that already exist, the ones created later are placed when they are allocated
+    if (state->numa_node >= 0) {
+        whisper_state_numa_place(*state, state->kv_cross.buffer);
+        whisper_state_numa_place(*state, state->kv_cross_next.buffer);
+        whisper_state_numa_place(*state, state->buffer_enc);
+        whisper_state_numa_place(*state, state->buffer_vocab);
+
+        for (const auto * allocr : { &state->alloc_conv, &state->alloc_encode, &state->alloc_cross, &state->alloc_decode, &state->alloc_embd }) {
+            if (allocr->alloc != nullptr) {
+                whisper_state_numa_place(*state, allocr->buffer);
+            }
+        }
+
+        for (const auto & decoder : state->decoders) {
+            if (decoder.kv_self.ctx != nullptr) {
+                whisper_state_numa_place(*state, decoder.kv_self.buffer);
+            }
+        }
+    }
+
+    // the concurrent fallback decoders share the CPUs of the state
+    for (auto * fstate : state->fallback_states) {
+        whisper_state_set_affinity(ctx, fstate, numa_node, state->cpus.data(), state->cpus.size(), false);
+    }
+
+    return 0;
+}
+
+static int whisper_has_coreml(void) {
+#ifdef WHISPER_USE_COREML
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+static int whisper_has_openvino(void) {
+#ifdef WHISPER_USE_OPENVINO
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+const char * whisper_print_system_info(void) {
+    static std::string s;
+
+    s  = "";
+    s += "AVX = "       + std::to_string(ggml_cpu_has_avx())       + " | ";
+    s += "AVX2 = "      + std::to_string(ggml_cpu_has_avx2())      + " | ";
+    s += "AVX512 = "    + std::to_string(ggml_cpu_has_avx512())    + " | ";
+    s += "FMA = "       + std::to_string(ggml_cpu_has_fma())       + " | ";
+    s += "NEON = "      + std::to_string(ggml_cpu_has_neon())      + " | ";
+    s += "ARM_FMA = "   + std::to_string(ggml_cpu_has_arm_fma())   + " | ";
+    s += "METAL = "     + std::to_string(ggml_cpu_has_metal())     + " | ";
+    s += "F16C = "      + std::to_string(ggml_cpu_has_f16c())      + " | ";
+    s += "FP16_VA = "   + std::to_string(ggml_cpu_has_fp16_va())   + " | ";
+    s += "WASM_SIMD = " + std::to_string(ggml_cpu_has_wasm_simd()) + " | ";
+    s += "BLAS = "      + std::to_string(ggml_cpu_has_blas())      + " | ";
+    s += "SSE3 = "      + std::to_string(ggml_cpu_has_sse3())      + " | ";
+    s += "SSSE3 = "     + std::to_string(ggml_cpu_has_ssse3())     + " | ";
+    s += "VSX = "       + std::to_string(ggml_cpu_has_vsx())       + " | ";
+    s += "CUDA = "      + std::to_string(ggml_cpu_has_cublas())    + " | ";
+    s += "COREML = "    + std::to_string(whisper_has_coreml())     + " | ";
+    s += "OPENVINO = "  + std::to_string(whisper_has_openvino())   + " | ";
+
+    return s.c_str();
+}
+
+//////////////////////////////////
+// Grammar - ported from llama.cpp
+//////////////////////////////////
+
+// Decodes a UTF-8 string which may end in an incomplete sequence. Adds a terminating 0 for use as
+// pointer. If an invalid sequence is encountered, returns `whisper_partial_utf8.n_remain == -1`.
+std::pair<std::vector<uint32_t>, whisper_partial_utf8> decode_utf8(
+        const char         * src,
+        whisper_partial_utf8   partial_start) {
+    static const int      lookup[] = { 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 2, 2, 3, 4 };
+    const char          * pos      = src;
+    std::vector<uint32_t> code_points;
+    uint32_t              value    = partial_start.value;
+    int                   n_remain = partial_start.n_remain;
+
+    // continue previous decode, if applicable
+    while (*pos != 0 && n_remain > 0) {
+        uint8_t next_byte = static_cast<uint8_t>(*pos);
+        if ((next_byte >> 6) != 2) {
+            // invalid sequence, abort
+            code_points.push_back(0);
+            return std::make_pair(std::move(code_points), whisper_partial_utf8{ 0, -1 });
+        }
+        value = (value << 6) + (next_byte & 0x3F);
+        ++pos;
+        --n_remain;
+    }
+
+    if (partial_start.n_remain > 0 && n_remain == 0) {
+        code_points.push_back(value);
+    }
+
+    // decode any subsequent utf-8 sequences, which may end in an incomplete one
+    while (*pos != 0) {
+        uint8_t  first_byte = static_cast<uint8_t>(*pos);
+        uint8_t  highbits   = first_byte >> 4;
+                 n_remain   = lookup[highbits] - 1;
+
+        if (n_remain < 0) {
+            // invalid sequence, abort
+            code_points.clear();
+            code_points.push_back(0);
+            return std::make_pair(std::move(code_points), whisper_partial_utf8{ 0, n_remain });
+        }
+
+        uint8_t  mask       = (1 << (7 - n_remain)) - 1;
+                 value      = first_byte & mask;
+        ++pos;
+        while (*pos != 0 && n_remain > 0) {
+            value = (value << 6) + (static_cast<uint8_t>(*pos) & 0x3F);
+            ++pos;
+            --n_remain;
+        }
+        if (n_remain == 0) {
+            code_points.push_back(value);
+        }
+    }
+    code_points.push_back(0);
+
+    return std::make_pair(std::move(code_points), whisper_partial_utf8{ value, n_remain });
+}
+
+// returns true iff pos points to the end of one of the definitions of a rule
+static bool whisper_grammar_is_end_of_sequence(const whisper_grammar_element * pos) {
+    switch (pos->type) {
+        case WHISPER_GRETYPE_END: return true;  // NOLINT
+        case WHISPER_GRETYPE_ALT: return true;  // NOLINT
+        default:                return false;
+    }
+}
+
+// returns true iff chr satisfies the char range at pos (regular or inverse range)
+// asserts that pos is pointing to a char range element
+static std::pair<bool, const whisper_grammar_element *> whisper_grammar_match_char(
+        const whisper_grammar_element * pos,
+        const uint32_t                chr) {
+
+    bool found            = false;
+    bool is_positive_char = pos->type == WHISPER_GRETYPE_CHAR;
+
+    WHISPER_ASSERT(is_positive_char || pos->type == WHISPER_GRETYPE_CHAR_NOT); // NOLINT
+
+    do {
+        if (pos[1].type == WHISPER_GRETYPE_CHAR_RNG_UPPER) {
+            // inclusive range, e.g. [a-z]
+            found = found || (pos->value <= chr && chr <= pos[1].value);
+            pos += 2;
+        } else {
+            // exact char match, e.g. [a] or "a"
+            found = found || pos->value == chr;
+            pos += 1;
+        }
+    } while (pos->type == WHISPER_GRETYPE_CHAR_ALT);
+
+    return std::make_pair(found == is_positive_char, pos);
+}
+
+// returns true iff some continuation of the given partial UTF-8 sequence could satisfy the char
+// range at pos (regular or inverse range)
+// asserts that pos is pointing to a char range element
+static bool whisper_grammar_match_partial_char(
+        const whisper_grammar_element * pos,
+        const whisper_partial_utf8      partial_utf8) {
+
+    bool is_positive_char = pos->type == WHISPER_GRETYPE_CHAR;
+    WHISPER_ASSERT(is_positive_char || pos->type == WHISPER_GRETYPE_CHAR_NOT);
+
+    uint32_t partial_value = partial_utf8.value;
+    int      n_remain      = partial_utf8.n_remain;
+
+    // invalid sequence or 7-bit char split across 2 bytes (overlong)
+    if (n_remain < 0 || (n_remain == 1 && partial_value < 2)) {
+        return false;
+    }
+
+    // range of possible code points this partial UTF-8 sequence could complete to
+    uint32_t low  = partial_value << (n_remain * 6);
+    uint32_t high = low | ((1 << (n_remain * 6)) - 1);
+
+    if (low == 0) {
+        if (n_remain == 2) {
+            low = 1 << 11;
+        } else if (n_remain == 3) {
+            low = 1 << 16;
+        }
+    }
+
+    do {
+        if (pos[1].type == WHISPER_GRETYPE_CHAR_RNG_UPPER) {
+            // inclusive range, e.g. [a-z]
+            if (pos->value <= high && low <= pos[1].value) {
+                return is_positive_char;
+            }
+            pos += 2;
+        } else {
+            // exact char match, e.g. [a] or "a"
+            if (low <= pos->value && pos->value <= high) {
+                return is_positive_char;
+            }
+            pos += 1;
+        }
+    } while (pos->type == WHISPER_GRETYPE_CHAR_ALT);
+
+    return !is_positive_char;
+}
+
+
+// transforms a grammar pushdown stack into N possible stacks, all ending
+// at a character range (terminal element)
+static void whisper_grammar_advance_stack(
+        const std::vector<std::vector<whisper_grammar_element>>   & rules,
+        const std::vector<const whisper_grammar_element *>        & stack,
+        std::vector<std::vector<const whisper_grammar_element *>> & new_stacks) {
+
+    if (stack.empty()) {
+        new_stacks.push_back(stack);
+        return;
+    }
+
+    const whisper_grammar_element * pos = stack.back();
+
+    switch (pos->type) {
+        case WHISPER_GRETYPE_RULE_REF: {
+            const size_t                  rule_id = static_cast<size_t>(pos->value);
+            const whisper_grammar_element * subpos  = rules[rule_id].data();
+            do {
+                // init new stack without the top (pos)
+                std::vector<const whisper_grammar_element *> new_stack(stack.begin(), stack.end() - 1);
+                if (!whisper_grammar_is_end_of_sequence(pos + 1)) {
+                    // if this rule ref is followed by another element, add that to stack
+                    new_stack.push_back(pos + 1);
+                }
+                if (!whisper_grammar_is_end_of_sequence(subpos)) {
+                    // if alternate is nonempty, add to stack
+                    new_stack.push_back(subpos);
+                }
+                whisper_grammar_advance_stack(rules, new_stack, new_stacks);
+                while (!whisper_grammar_is_end_of_sequence(subpos)) {
+                    // scan to end of alternate def
+                    subpos++;
+                }
+                if (subpos->type == WHISPER_GRETYPE_ALT) {
+                    // there's another alternate def of this rule to process
+                    subpos++;
+                } else {
+                    break;
+                }
+            } while (true);
+            break;
+        }
+        case WHISPER_GRETYPE_CHAR:
+        case WHISPER_GRETYPE_CHAR_NOT:
+            new_stacks.push_back(stack);
+            break;
+        default:
+            // end of alternate (WHISPER_GRETYPE_END, WHISPER_GRETYPE_ALT) or middle of char range
+            // (WHISPER_GRETYPE_CHAR_ALT, WHISPER_GRETYPE_CHAR_RNG_UPPER); stack should never be left on
+            // those
+            WHISPER_ASSERT(false);
+    }
+}
+
+// takes a set of possible pushdown stacks on a grammar, which are required to
+// be positioned at a character range (see `whisper_grammar_advance_stack`), and
+// produces the N possible stacks if the given char is accepted at those
+// positions
+static void whisper_grammar_accept(
+        const std::vector<std::vector<whisper_grammar_element>>         & rules,
+        const std::vector<std::vector<const whisper_grammar_element *>> & stacks,
+        const uint32_t                                                  chr,
+              std::vector<std::vector<const whisper_grammar_element *>> & new_stacks) {
+
+    new_stacks.clear();
+
+    for (const auto & stack : stacks) {
+        if (stack.empty()) {
+            continue;
+        }
+
+        auto match = whisper_grammar_match_char(stack.back(), chr);
+        if (match.first) {
+            const whisper_grammar_element * pos = match.second;
+
+            // update top of stack to next element, if any
+            std::vector<const whisper_grammar_element *> new_stack(stack.begin(), stack.end() - 1);
+            if (!whisper_grammar_is_end_of_sequence(pos)) {
+                new_stack.push_back(pos);
+            }
+            whisper_grammar_advance_stack(rules, new_stack, new_stacks);
+        }
+    }
+}
+
+static std::vector<whisper_grammar_candidate> whisper_grammar_reject_candidates(
+        const std::vector<std::vector<whisper_grammar_element>>         & rules,
+        const std::vector<std::vector<const whisper_grammar_element *>> & stacks,
+        const std::vector<whisper_grammar_candidate>                    & candidates);
+
+static std::vector<whisper_grammar_candidate> whisper_grammar_reject_candidates_for_stack(
+        const std::vector<std::vector<whisper_grammar_element>> & rules,
+        const std::vector<const whisper_grammar_element *>      & stack,
+        const std::vector<whisper_grammar_candidate>            & candidates) {
+
+    std::vector<whisper_grammar_candidate> rejects;
+
+    if (stack.empty()) {
+        for (auto tok : candidates) {
+            if (*tok.code_points != 0 || tok.partial_utf8.n_remain != 0) {
+                rejects.push_back(tok);
+            }
+        }
+        return rejects;
+    }
+
+    const whisper_grammar_element * stack_pos = stack.back();
+
+    std::vector<whisper_grammar_candidate> next_candidates;
+    for (auto tok : candidates) {
+        if (*tok.code_points == 0) {
+            // reached end of full codepoints in token, reject iff it ended in a partial sequence
+            // that cannot satisfy this position in grammar
+            if (tok.partial_utf8.n_remain != 0 &&
+                    !whisper_grammar_match_partial_char(stack_pos, tok.partial_utf8)) {
+                rejects.push_back(tok);
+            }
+        } else if (whisper_grammar_match_char(stack_pos, *tok.code_points).first) {
+            next_candidates.push_back({ tok.id, tok.code_points + 1, tok.partial_utf8 });
+        } else {
+            rejects.push_back(tok);
+        }
+    }
+
+    const auto * stack_pos_after = whisper_grammar_match_char(stack_pos, 0).second;
+
+    // update top of stack to next element, if any
+    std::vector<const whisper_grammar_element *> stack_after(stack.begin(), stack.end() - 1);
+    if (!whisper_grammar_is_end_of_sequence(stack_pos_after)) {
+        stack_after.push_back(stack_pos_after);
+    }
+    std::vector<std::vector<const whisper_grammar_element *>> next_stacks;
+    whisper_grammar_advance_stack(rules, stack_after, next_stacks);
+
+    auto next_rejects = whisper_grammar_reject_candidates(rules, next_stacks, next_candidates);
+    for (auto tok : next_rejects) {
+        rejects.push_back({ tok.id, tok.code_points - 1, tok.partial_utf8 });
+    }
+
+    return rejects;
+}
+
+static std::vector<whisper_grammar_candidate> whisper_grammar_reject_candidates(
+        const std::vector<std::vector<whisper_grammar_element>>         & rules,
+        const std::vector<std::vector<const whisper_grammar_element *>> & stacks,
+        const std::vector<whisper_grammar_candidate>                    & candidates) {
+    if (candidates.empty() || stacks.empty()) {
+        return std::vector<whisper_grammar_candidate>();
+    }
+
+    auto rejects = whisper_grammar_reject_candidates_for_stack(rules, stacks.front(), candidates);
+
+    for (size_t i = 1, size = stacks.size(); i < size; ++i) {
+        rejects = whisper_grammar_reject_candidates_for_stack(rules, stacks[i], rejects);
+    }
+    return rejects;
+}
+
+static struct whisper_grammar whisper_grammar_init(
+            const whisper_grammar_element ** rules,
+                                 size_t      n_rules,
+                                 size_t      i_start_rule) {
+    const whisper_grammar_element * pos;
+
+    // copy rule definitions into vectors
+    std::vector<std::vector<whisper_grammar_element>> vec_rules(n_rules);
+    for (size_t i = 0; i < n_rules; i++) {
+        for (pos = rules[i]; pos->type != WHISPER_GRETYPE_END; pos++) {
+            vec_rules[i].push_back(*pos);
+        }
+        vec_rules[i].push_back({WHISPER_GRETYPE_END, 0});
+    }
+
+    // loop over alternates of start rule to build initial stacks
+    std::vector<std::vector<const whisper_grammar_element *>> stacks;
+    pos = rules[i_start_rule];
+    do {
+        std::vector<const whisper_grammar_element *> stack;
         if (!whisper_grammar_is_end_of_sequence(pos)) {
             // if alternate is nonempty, add to stack
             stack.push_back(pos);
         }
-        whisper_grammar_advance_stack(vec_rules, stack, stacks);
-        while (!whisper_grammar_is_end_of_sequence(pos)) {
-            // scan to end of alternate def
-            pos++;
+        whisper_grammar_advance_stack(vec_rules, stack, stacks);
+        while (!whisper_grammar_is_end_of_sequence(pos)) {
+            // scan to end of alternate def
+            pos++;
+        }
+        if (pos->type == WHISPER_GRETYPE_ALT) {
+            // there's another alternate def of this rule to process
+            pos++;
+        } else {
+            break;
+        }
+    } while (true);
+
+    return { std::move(vec_rules), std::move(stacks), {}, {} };
+}
+
+static void whisper_suppress_invalid_grammar(
+             whisper_context  & ctx,
+    const whisper_full_params & params,
+           std::vector<float> & logits,
+    const     whisper_grammar & grammar) {
+
+    if (grammar.rules.empty() || grammar.stacks.empty()) {
+        return;
+    }
+
+    //bool allow_eot = false;
+    //for (const auto & stack : grammar.stacks) {
+    //    if (stack.empty()) {
+    //        allow_eot = true;
+    //        break;
+    //    }
+    //}
+
+    const whisper_token eot = whisper_token_eot(&ctx);
+
+    std::vector<std::pair<std::vector<uint32_t>, whisper_partial_utf8>> candidates_decoded;
+    std::vector<whisper_grammar_candidate>                              candidates_grammar;
+
+    for (whisper_token id = 0; id < eot; ++id) {
+        const std::string & text = ctx.vocab.id_to_token[id];
+        if (!text.empty()) {
+            candidates_decoded.push_back(decode_utf8(text.c_str(), grammar.partial_utf8));
+            candidates_grammar.push_back({ id, candidates_decoded.back().first.data(), candidates_decoded.back().second });
+        }
+    }
+
+    const auto rejects = whisper_grammar_reject_candidates(grammar.rules, grammar.stacks, candidates_grammar);
+
+    for (const auto & reject : rejects) {
+        logits[reject.id] -= params.grammar_penalty;
+    }
+
+    // when the grammar allows a continuation, we penalize the end-of-text token
+    //if (!allow_eot) {
+    //    logits[eot] -= params.grammar_penalty;
+    //}
+    //fprintf(stderr, "Allowed: (%zu tokens)\n", size - rejects.size());
+}
+
+static void whisper_grammar_accept_token(whisper_context & ctx, whisper_grammar & grammar, whisper_token token) {
+    if (grammar.rules.empty() || grammar.stacks.empty()) {
+        return;
+    }
+
+    //fprintf(stderr, "Accept: '%s'\n", ctx.vocab.id_to_token[token].c_str());
+
+    const std::string & text = ctx.vocab.id_to_token[token];
+
+    if (text.rfind("[_", 0) == 0) {
+        // fprintf(stderr, " (skipped)\n");
+        return;
+    }
+    // fprintf(stderr, "\n");
+
+    // Note terminating 0 in decoded string
+    const auto   decoded     = decode_utf8(text.c_str(), grammar.partial_utf8);
+    const auto & code_points = decoded.first;
+    for (auto it = code_points.begin(), end = code_points.end() - 1; it != end; ++it) {
+        whisper_grammar_accept(grammar.rules, grammar.stacks, *it, grammar.stacks_next);
+        grammar.stacks.swap(grammar.stacks_next);
+    }
+    grammar.partial_utf8 = decoded.second;
+}
+
+//////////////
+// END grammar
+//////////////
+
+////////////////////////////////////////////////////////////////////////////
+
+struct whisper_context_params * whisper_context_default_params_by_ref() {
+    struct whisper_context_params params = whisper_context_default_params();
+
+    struct whisper_context_params* result = new whisper_context_params();
+    *result = params;
+    return result;
+}
+
+struct whisper_full_params * whisper_full_default_params_by_ref(enum whisper_sampling_strategy strategy) {
+    struct whisper_full_params params = whisper_full_default_params(strategy);
+
+    struct whisper_full_params* result = new whisper_full_params();
+    *result = params;
+    return result;
+}
+
+struct whisper_full_params whisper_full_default_params(enum whisper_sampling_strategy strategy) {
+    struct whisper_full_params result = {
+        /*.strategy          =*/ strategy,
+
+        /*.n_threads         =*/ std::min(4, (int32_t) std::thread::hardware_concurrency()),
+        /*.n_threads_encode  =*/ 0,
+        /*.n_threads_decode  =*/ 0,
+        /*.n_threads_mel     =*/ 0,
+        /*.n_max_text_ctx    =*/ 16384,
+        /*.offset_ms         =*/ 0,
+        /*.duration_ms       =*/ 0,
+
+        /*.translate         =*/ false,
+        /*.no_context        =*/ true,
+        /*.no_timestamps     =*/ false,
+        /*.single_segment    =*/ false,
+        /*.print_special     =*/ false,
+        /*.print_progress    =*/ true,
+        /*.print_realtime    =*/ false,
+        /*.print_timestamps  =*/ true,
+
+        /*.token_timestamps  =*/ false,
+        /*.thold_pt          =*/ 0.01f,
+        /*.thold_ptsum       =*/ 0.01f,
+        /*.max_len           =*/ 0,
+        /*.split_on_word     =*/ false,
+        /*.max_tokens        =*/ 0,
+
+        /*.speed_up          =*/ false,
+        /*.debug_mode        =*/ false,
+        /*.audio_ctx         =*/ 0,
+        /*.audio_ctx_auto    =*/ false,
+        /*.n_threads_encode_next =*/ 0,
+
+        /*.tdrz_enable       =*/ false,
+
+        /*.draft_ctx         =*/ nullptr,
+        /*.draft_n_tokens    =*/ 4,
+        /*.draft_ngram       =*/ 0,
+
+        /*.initial_prompt    =*/ nullptr,
+        /*.prompt_tokens     =*/ nullptr,
+        /*.prompt_n_tokens   =*/ 0,
+
+        /*.language          =*/ "en",
+        /*.detect_language   =*/ false,
+        /*.detect_audio_ctx  =*/ 0,
+
+        /*.suppress_blank    =*/ true,
+        /*.suppress_non_speech_tokens =*/ false,
+
+        /*.temperature       =*/  0.0f,
+        /*.max_initial_ts    =*/  1.0f,
+        /*.length_penalty    =*/ -1.0f,
+
+        /*.temperature_inc   =*/  0.4f,
+        /*.entropy_thold     =*/  2.4f,
+        /*.logprob_thold     =*/ -1.0f,
+        /*.no_speech_thold   =*/  0.6f,
+
+        /*.n_fallback_parallel =*/ 0,
+        /*.n_threads_fallback  =*/ 1,
+        /*.loop_detect         =*/ false,
+
+        /*.greedy            =*/ {
+            /*.best_of   =*/ -1,
+        },
+
+        /*.beam_search      =*/ {
+            /*.beam_size =*/ -1,
+
+            /*.patience  =*/ -1.0f,
+        },
+
+        /*.new_segment_callback           =*/ nullptr,
+        /*.new_segment_callback_user_data =*/ nullptr,
+
+        /*.progress_callback           =*/ nullptr,
+        /*.progress_callback_user_data =*/ nullptr,
+
+        /*.encoder_begin_callback           =*/ nullptr,
+        /*.encoder_begin_callback_user_data =*/ nullptr,
+
+        /*.abort_callback                   =*/ nullptr,
+        /*.abort_callback_user_data         =*/ nullptr,
+
+        /*.logits_filter_callback           =*/ nullptr,
+        /*.logits_filter_callback_user_data =*/ nullptr,
+
+        /*.grammar_rules   =*/ nullptr,
+        /*.n_grammar_rules =*/ 0,
+        /*.i_start_rule    =*/ 0,
+        /*.grammar_penalty =*/ 100.0f,
+
+        /*.vocab_tokens   =*/ nullptr,
+        /*.vocab_n_tokens =*/ 0,
+    };
+
+    switch (strategy) {
+        case WHISPER_SAMPLING_GREEDY:
+            {
+                result.greedy = {
+                    /*.best_of   =*/ 2, // TODO: increase to 5 when we speed-up batch decoding
+                };
+            } break;
+        case WHISPER_SAMPLING_BEAM_SEARCH:
+            {
+                result.beam_search = {
+                    /*.beam_size =*/ 2, // TODO: increase to 5 when we speed-up batch decoding
+
+                    /*.patience  =*/ -1.0f,
+                };
+            } break;
+    }
+
+    return result;
+}
+
+// forward declarations
+static std::vector<float> get_signal_energy(const float * signal, int n_samples, int n_samples_per_half_window);
+static void whisper_exp_compute_token_level_timestamps(
+        struct whisper_context & ctx,
+          struct whisper_state & state,
+                           int   i_segment,
+                         float   thold_pt,
+                         float   thold_ptsum);
+
+static inline bool should_split_on_word(const char * txt, bool split_on_word) {
+    if (!split_on_word) return true;
+
+    return txt[0] == ' ';
+}
+
+// wrap the last segment to max_len characters
+// returns the number of new segments
+// the last segment is split in place, each split moves the remaining tokens to a new segment
+static int whisper_wrap_segment(struct whisper_context & ctx, struct whisper_state & state, int max_len, bool split_on_word) {
+    auto & result_all = state.result_all;
+
+    int res = 1;
+    int acc = 0;
+
+    std::string text;
+
+    for (int i = 0; i < (int) result_all.back().tokens.size(); i++) {
+        const auto token = result_all.back().tokens[i];
+        if (token.id >= whisper_token_eot(&ctx)) {
+            continue;
+        }
+
+        const auto txt = whisper_token_to_str(&ctx, token.id);
+        const int cur = strlen(txt);
+
+        if (acc + cur > max_len && i > 0 && should_split_on_word(txt, split_on_word)) {
+            const size_t i_segment = result_all.size() - 1;
+
+            result_all.push_back({});
+
+            auto & segment = result_all[i_segment];
+            auto & next    = result_all.back();
+
+            next.t0 = token.t0;
+            next.t1 = segment.t1;
+
+            // move tokens [i, end] to the new segment
+            next.tokens.assign(segment.tokens.begin() + i, segment.tokens.end());
+
+            next.speaker_turn_next = segment.speaker_turn_next;
+
+            segment.text = std::move(text);
+            segment.t1 = token.t0;
+            segment.tokens.resize(i);
+            segment.speaker_turn_next = false;
+
+            acc = 0;
+            text = "";
+
+            i = -1;
+
+            res++;
+        } else {
+            acc += cur;
+            text += txt;
+        }
+    }
+
+    result_all.back().text = std::move(text);
+
+    return res;
+}
+
+static const std::vector<std::string> non_speech_tokens = {
+    "\"", "#", "(", ")", "*", "+", "/", ":", ";", "<", "=", ">", "@", "[", "\\", "]", "^",
+    "_", "`", "{", "|", "}", "~", "「", "」", "『", "』", "<<", ">>", "<<<", ">>>", "--",
+    "---", "-(", "-[", "('", "(\"", "((", "))", "(((", ")))", "[[", "]]", "{{", "}}", "♪♪",
+    "♪♪♪","♩", "♪", "♫", "♬", "♭", "♮", "♯"
+};
+
+// process the logits for the selected decoder
+// - applies logit filters
+// - computes logprobs and probs
+static void whisper_process_logits(
+              struct whisper_context & ctx,
+               struct whisper_state  & state,
+    const struct whisper_full_params   params,
+              struct whisper_decoder & decoder,
+                               float   temperature) {
+    const auto & vocab      = ctx.vocab;
+    const auto & tokens_cur = decoder.sequence.tokens;
+
+    const bool is_initial = tokens_cur.size() == 0;
+    const int  n_logits   = vocab.id_to_token.size();
+
+    WHISPER_ASSERT(n_logits == ctx.vocab.n_vocab);
+
+    // extract the logits for the last token
+    // we will be mutating, and therefore we don't want to use the ctx.logits buffer directly
+    auto & probs    = decoder.probs;
+    auto & logits   = decoder.logits;
+    auto & logprobs = decoder.logprobs;
+    {
+        logits.resize(n_logits);
+        memcpy(logits.data(), state.logits.data() + (state.logits.size() - n_logits), n_logits*sizeof(float));
+
+        if (temperature > 0.0f) {
+            for (int i = 0; i < n_logits; i++) {
+                logits[i] /= temperature;
+            }
+        }
+
+        // will be populated a bit later
+        probs.resize(n_logits);
+        logprobs.resize(n_logits);
+    }
+
+    // apply logit filters here
+    // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L480-L493
+    {
+        // suppress blank
+        // https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L388-L390
+        if (params.suppress_blank) {
+            if (is_initial) {
+                logits[vocab.token_eot]           = -INFINITY;
+                logits[vocab.token_to_id.at(" ")] = -INFINITY;
+            }
+        }
+
+        // suppress <|notimestamps|> token
+        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L410-L412
+        logits[vocab.token_not] = -INFINITY;
+        if (params.no_timestamps) {
+            for (int i = vocab.token_beg; i < n_logits; ++i) {
+                logits[i] = -INFINITY;
+            }
+        }
+
+        // suppress sot and nosp tokens
+        logits[vocab.token_sot]  = -INFINITY;
+        logits[vocab.token_nosp] = -INFINITY; // TODO: ignore this token for now
+
+        // [TDRZ] when tinydiarize is disabled, suppress solm token
+        if (params.tdrz_enable == false) {
+            logits[vocab.token_solm] = -INFINITY;
+        }
+
+        // suppress task tokens
+        logits[vocab.token_translate]  = -INFINITY;
+        logits[vocab.token_transcribe] = -INFINITY;
+        logits[vocab.token_prev]       = -INFINITY;
+
+        // suppress lang tokens
+        for (size_t i = 0; i < g_lang.size(); ++i) {
+            logits[whisper_token_lang(&ctx, i)] = -INFINITY;
+        }
+
+        // suppress prev token
+        logits[vocab.token_prev] = -INFINITY;
+
+        if (params.logits_filter_callback) {
+            params.logits_filter_callback(&ctx, &state, tokens_cur.data(), tokens_cur.size(), logits.data(), params.logits_filter_callback_user_data);
+        }
+
+        // suppress non-speech tokens
+        // ref: https://github.com/openai/whisper/blob/7858aa9c08d98f75575035ecd6481f462d66ca27/whisper/tokenizer.py#L224-L253
+        if (params.suppress_non_speech_tokens) {
+            auto & ids = state.non_speech_ids;
+
+            if (ids.empty()) {
+                for (const std::string & token : non_speech_tokens) {
+                    const std::string suppress_tokens[] = {token, " " + token};
+                    for (const std::string & suppress_token : suppress_tokens) {
+                        if (vocab.token_to_id.find(suppress_token) != vocab.token_to_id.end()) {
+                            ids.push_back(vocab.token_to_id.at(suppress_token));
+                        }
+                    }
+                }
+
+                // allow hyphens "-" and single quotes "'" between words, but not at the beginning of a word
+                if (vocab.token_to_id.find(" -") != vocab.token_to_id.end()) {
+                    ids.push_back(vocab.token_to_id.at(" -"));
+                }
+                if (vocab.token_to_id.find(" '") != vocab.token_to_id.end()) {
+                    ids.push_back(vocab.token_to_id.at(" '"));
+                }
+            }
+
+            for (const whisper_token id : ids) {
+                logits[id] = -INFINITY;
+            }
+        }
+
+        // timestamps have to appear in pairs, except directly before EOT; mask logits accordingly
+        // https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L414-L424
+        {
+            const bool last_was_timestamp        = tokens_cur.size() > 0 && tokens_cur.back().id >= vocab.token_beg;
+            const bool penultimate_was_timestamp = tokens_cur.size() < 2 || tokens_cur[tokens_cur.size() - 2].id >= vocab.token_beg;
+
+            //WHISPER_LOG_INFO("last_was_timestamp=%d penultimate_was_timestamp=%d\n", last_was_timestamp, penultimate_was_timestamp);
+
+            if (last_was_timestamp) {
+                if (penultimate_was_timestamp) {
+                    for (int i = vocab.token_beg; i < n_logits; ++i) {
+                        logits[i] = -INFINITY;
+                    }
+                } else {
+                    for (int i = 0; i < vocab.token_eot; ++i) {
+                        logits[i] = -INFINITY;
+                    }
+                }
+            }
+        }
+
+        // the initial timestamp cannot be larger than max_initial_ts
+        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L426-L429
+        if (is_initial && params.max_initial_ts > 0.0f) {
+            const float precision = float(WHISPER_CHUNK_SIZE)/ctx.model.hparams.n_audio_ctx;
+            const int   tid0      = std::round(params.max_initial_ts/precision);
+
+            for (int i = vocab.token_beg + tid0 + 1; i < n_logits; ++i) {
+                logits[i] = -INFINITY;
+            }
+        }
+
+        // condition timestamp tokens to be increasing
+        // ref: https://github.com/openai/whisper/pull/831#issuecomment-1385910556
+        if (decoder.has_ts) {
+            const int tid0 = decoder.seek_delta/2;
+
+            for (int i = vocab.token_beg; i < vocab.token_beg + tid0; ++i) {
+                logits[i] = -INFINITY;
+            }
+        }
+
+        // populate the logprobs array (log_softmax)
+        {
+            const float logit_max = *std::max_element(logits.begin(), logits.end());
+            float logsumexp = 0.0f;
+            for (int i = 0; i < n_logits; ++i) {
+                if (logits[i] > -INFINITY) {
+                    logsumexp += expf(logits[i] - logit_max);
+                }
+            }
+            logsumexp = logf(logsumexp) + logit_max;
+
+            for (int i = 0; i < n_logits; ++i) {
+                if (logits[i] > -INFINITY) {
+                    logprobs[i] = logits[i] - logsumexp;
+                } else {
+                    logprobs[i] = -INFINITY;
+                }
+            }
+        }
+
+        // if sum of probability over timestamps is above any other token, sample timestamp
+        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L431-L437
+        {
+            // logsumexp over timestamps
+            float timestamp_logprob = -INFINITY;
+            {
+                float logsumexp = 0.0f;
+                const float logprob_max = *std::max_element(logprobs.begin() + vocab.token_beg, logprobs.end());
+                for (int i = vocab.token_beg; i < n_logits; ++i) {
+                    if (logprobs[i] > -INFINITY) {
+                        logsumexp += expf(logprobs[i] - logprob_max);
+                    }
+                }
+                if (logsumexp > 0.0f) {
+                    timestamp_logprob = logf(logsumexp) + logprob_max;
+                }
+            }
+
+            const float max_text_token_logprob = *std::max_element(logprobs.begin(), logprobs.begin() + vocab.token_beg);
+
+            //WHISPER_LOG_INFO("timestamp_logprob=%f max_text_token_logprob=%f\n", timestamp_logprob, max_text_token_logprob);
+
+            if (timestamp_logprob > max_text_token_logprob) {
+                //printf("sampling timestamp\n");
+                for (int i = 0; i < vocab.token_beg; ++i) {
+                    logits[i]   = -INFINITY;
+                    logprobs[i] = -INFINITY;
+                }
+            } else if (params.n_grammar_rules > 0) {
+                whisper_suppress_invalid_grammar(ctx, params, logits, decoder.grammar);
+
+                // populate the logprobs array (log_softmax)
+                {
+                    const float logit_max = *std::max_element(logits.begin(), logits.end());
+                    float logsumexp = 0.0f;
+                    for (int i = 0; i < n_logits; ++i) {
+                        if (logits[i] > -INFINITY) {
+                            logsumexp += expf(logits[i] - logit_max);
+                        }
+                    }
+                    logsumexp = logf(logsumexp) + logit_max;
+
+                    for (int i = 0; i < n_logits; ++i) {
+                        if (logits[i] > -INFINITY) {
+                            logprobs[i] = logits[i] - logsumexp;
+                        } else {
+                            logprobs[i] = -INFINITY;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // compute probs
+    {
+        for (int i = 0; i < n_logits; ++i) {
+            if (logits[i] == -INFINITY) {
+                probs[i] = 0.0f;
+            } else {
+                probs[i] = expf(logprobs[i]);
+            }
+        }
+    }
+
+#if 0
+    // print first 100 logits - token string : logit
+    //for (int i = 0; i < 10; i++) {
+    //    const auto token   = vocab.id_to_token.at(i);
+    //    const auto prob    = probs[i];
+    //    const auto logit   = logits[i];
+    //    const auto logprob = logprobs[i];
+    //    printf("%16s : prob=%9.5f logit=%9.5f logprob=%9.5f\n", token.c_str(), prob, logit, logprob);
+    //}
+
+    // print sorted
+    {
+        std::vector<std::pair<float, int>> pairs;
+
+        for (int i = 0; i < n_logits; ++i) {
+            pairs.push_back(std::make_pair(probs[i], i));
+        }
+
+        std::sort(pairs.begin(), pairs.end(), [](const std::pair<float, int>& a, const std::pair<float, int>& b) {
+            return a.first > b.first;
+        });
+
+        for (int i = 0; i < 10; i++) {
+            const auto token   = vocab.id_to_token.at(pairs[i].second);
+            const auto prob    = pairs[i].first;
+            const auto logit   = logits[pairs[i].second];
+            const auto logprob = logprobs[pairs[i].second];
+            printf("%16s : id=%6d prob=%9.5f logit=%9.5f logprob=%9.5f '%s'\n", token.c_str(), pairs[i].second, prob, logit, logprob, token.c_str());
+        }
+
+        printf("----------------\n");
+    }
+
+    // "And", "and", " And", " and"
+    //printf("logits[\"and\"]  = %f\n", logits[vocab.token_to_id.at("and")]);
+    //printf("logits[\"And\"]  = %f\n", logits[vocab.token_to_id.at("And")]);
+    //printf("logits[\" and\"] = %f\n", logits[vocab.token_to_id.at(" and")]);
+    //printf("logits[\" And\"] = %f\n", logits[vocab.token_to_id.at(" And")]);
+    //printf("logits[\" so\"]  = %f\n", logits[vocab.token_to_id.at(" so")]);
+
+    //printf("logprobs[\"and\"]  = %f\n", logprobs[vocab.token_to_id.at("and")]);
+    //printf("logprobs[\"And\"]  = %f\n", logprobs[vocab.token_to_id.at("And")]);
+    //printf("logprobs[\" and\"] = %f\n", logprobs[vocab.token_to_id.at(" and")]);
+    //printf("logprobs[\" And\"] = %f\n", logprobs[vocab.token_to_id.at(" And")]);
+    //printf("logprobs[\" so\"]  = %f\n", logprobs[vocab.token_to_id.at(" so")]);
+
+    //printf("probs[\"and\"]  = %f\n", probs[vocab.token_to_id.at("and")]);
+    //printf("probs[\"And\"]  = %f\n", probs[vocab.token_to_id.at("And")]);
+    //printf("probs[\" and\"] = %f\n", probs[vocab.token_to_id.at(" and")]);
+    //printf("probs[\" And\"] = %f\n", probs[vocab.token_to_id.at(" And")]);
+    //printf("probs[\" so\"]  = %f\n", probs[vocab.token_to_id.at(" so")]);
+#endif
+}
+
+// sampling from the discrete distribution with the probabilities probs (not necessarily normalized)
+// same algorithm as std::discrete_distribution, which allocates its tables on each construction. the cumulative
+// distribution is built in a buffer of the state instead, so that it is reused between the tokens
+static void whisper_discrete_init(const std::vector<float> & probs, std::vector<double> & cdf) {
+    const int n = probs.size();
+
+    cdf.clear();
+
+    if (n < 2) {
+        return;
+    }
+
+    double sum = 0.0;
+    for (int i = 0; i < n; ++i) {
+        sum += probs[i];
+    }
+
+    cdf.resize(n);
+
+    double acc = 0.0;
+    for (int i = 0; i < n; ++i) {
+        acc += probs[i]/sum;
+        cdf[i] = acc;
+    }
+
+    cdf[n - 1] = 1.0;
+}
+
+static int whisper_discrete_sample(const std::vector<double> & cdf, std::mt19937 & rng) {
+    if (cdf.empty()) {
+        return 0;
+    }
+
+    const double p = std::generate_canonical<double, std::numeric_limits<double>::digits>(rng);
+
+    return std::lower_bound(cdf.begin(), cdf.end(), p) - cdf.begin();
+}
+
+static whisper_token_data whisper_sample_token(
+            whisper_context & ctx,
+              whisper_state & state,
+      const whisper_decoder & decoder,
+                       bool   best) {
+    whisper_token_data result = {
+        0, 0, 0.0f, 0.0f, 0.0f, 0.0f, -1, -1, 0.0f,
+    };
+
+    const auto & vocab = ctx.vocab;
+
+    const auto & probs    = decoder.probs;
+    const auto & logprobs = decoder.logprobs;
+
+    const int n_logits = vocab.n_vocab;
+
+    {
+        double sum_ts = 0.0;
+        double max_ts = 0.0;
+
+        for (int i = vocab.token_beg; i < n_logits; i++) {
+            if (probs[i] == -INFINITY) {
+                continue;
+            }
+
+            sum_ts += probs[i];
+            if (max_ts < probs[i]) {
+                max_ts = probs[i];
+                result.tid = i;
+            }
+        }
+
+        result.pt    = max_ts/(sum_ts + 1e-10);
+        result.ptsum = sum_ts;
+    }
+
+    if (best) {
+        for (int i = 0; i < n_logits; ++i) {
+            if (result.p < probs[i]) {
+                result.id   = i;
+                result.p    = probs[i];
+                result.plog = logprobs[i];
+            }
+        }
+    } else {
+        whisper_discrete_init(probs, state.probs_cdf);
+
+        result.id   = whisper_discrete_sample(state.probs_cdf, state.rng);
+        result.p    = probs[result.id];
+        result.plog = logprobs[result.id];
+    }
+
+    if (result.id >= vocab.token_beg) {
+        result.tid = result.id;
+        result.pt  = result.p;
+    }
+
+    state.n_sample++;
+
+    return result;
+}
+
+static void whisper_sample_token_topk(
+            whisper_context & ctx,
+              whisper_state & state,
+      const whisper_decoder & decoder,
+                        int   k,
+    std::vector<whisper_token_data> & result) {
+    const auto & vocab = ctx.vocab;
+
+    const auto & probs    = decoder.probs;
+    const auto & logits   = decoder.logits;
+    const auto & logprobs = decoder.logprobs;
+
+    const int n_logits = vocab.n_vocab;
+
+    auto & logits_id = state.logits_id;
+
+    logits_id.resize(n_logits);
+    for (int i = 0; i < n_logits; ++i) {
+        logits_id[i].first = logits[i];
+        logits_id[i].second = i;
+    }
+
+    {
+        using pair_type = std::remove_reference<decltype(logits_id)>::type::value_type;
+        std::partial_sort(
+                logits_id.begin(),
+                logits_id.begin() + k, logits_id.end(),
+                [](const pair_type & a, const pair_type & b) {
+            return a.first > b.first;
+        });
+    }
+
+    result.clear();
+
+    whisper_token tid = vocab.token_beg;
+
+    float pt    = 0.0;
+    float ptsum = 0.0;
+
+    {
+        double sum_ts = 0.0;
+        double max_ts = 0.0;
+
+        for (int i = vocab.token_beg; i < n_logits; i++) {
+            if (probs[i] == -INFINITY) {
+                continue;
+            }
+
+            sum_ts += probs[i];
+            if (max_ts < probs[i]) {
+                max_ts = probs[i];
+                tid = i;
+            }
+        }
+
+        pt    = max_ts/(sum_ts + 1e-10);
+        ptsum = sum_ts;
+    }
+
+    whisper_discrete_init(probs, state.probs_cdf);
+
+    for (int i = 0; i < k; ++i) {
+        const auto id = whisper_discrete_sample(state.probs_cdf, state.rng);
+        //printf("XXX %d %d %f %f %f %f\n", id, tid, probs[id], logprobs[id], pt, ptsum);
+
+        result.push_back({ id, tid, probs[id], logprobs[id], pt, ptsum, -1, -1, 0.0f, });
+
+        if (result[i].id >= vocab.token_beg) {
+            result[i].tid = result[i].id;
+            result[i].pt  = result[i].p;
+        }
+    }
+
+    state.n_sample++;
+}
+
+// ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L178-L192
+static void whisper_sequence_score(
+        const struct whisper_full_params & params,
+                        whisper_sequence & sequence) {
+    if (sequence.result_len == 0) {
+        return;
+    }
+
+    double result = 0.0f;
+
+    for (int i = 0; i < sequence.result_len; ++i) {
+        result += sequence.tokens[i].plog;
+    }
+
+    sequence.sum_logprobs = result;
+    sequence.avg_logprobs = result/sequence.result_len;
+
+    double penalty = sequence.result_len;
+
+    if (params.length_penalty > 0.0f) {
+        penalty = pow((5.0 + penalty)/6.0, params.length_penalty);
+    }
+
+    sequence.score = result/penalty;
+
+    // compute the entropy of the sequence of the last 32 tokens
+    {
+        const int n = 32;
+
+        int cnt = 0;
+        double entropy = 0.0f;
+
+        std::map<whisper_token, int> token_counts;
+        for (int i = std::max(0, sequence.result_len - n); i < sequence.result_len; ++i) {
+            token_counts[sequence.tokens[i].id]++;
+            cnt++;
+        }
+
+        for (const auto & kv : token_counts) {
+            const auto p = kv.second/(double)cnt;
+            entropy -= p*log(p);
+
+            //WHISPER_PRINT_DEBUG("entropy: %d %f %f, count %d\n", kv.first, p, log(p), kv.second);
+        }
+
+        sequence.entropy = entropy;
+    }
+}
+
+static bool whisper_kv_swap_fast(
+                   std::vector<int> & view,
+                    whisper_decoder   src[],
+                std::vector<kv_buf> & kv_swap_bufs,
+            whisper_kv_swap_scratch & scratch,
+                          const int & n_decoders) {
+    WHISPER_PRINT_DEBUG("%s: n_decoders %d\n", __func__, n_decoders);
+
+    // (decoder->buffer->decoder or decoder->buffer + decoder->decoder)
+    auto & two_copy = scratch.two_copy; // decoder indices require two copies to safely modify KV caches
+    auto & is_two_copy = scratch.is_two_copy;
+
+    // (buffer->decoder or decoder->decoder)
+    auto & one_copy = scratch.one_copy; // decoder indices require one copy to safely modify KV caches
+
+    // (decoder<->decoder)
+    auto & is_p_swap  = scratch.is_p_swap; // decoder indices able to swap KV-cache pointers
+    auto & p_swap_vec = scratch.p_swap_vec;
+
+    two_copy.clear();
+    one_copy.clear();
+    p_swap_vec.clear();
+
+    is_two_copy.assign(n_decoders, 0);
+    is_p_swap.assign(n_decoders, 0);
+
+    // see https://github.com/ggerganov/whisper.cpp/wiki
+    for (int i = 0; i < n_decoders; i++) {
+        // zero-copy (no modification)
+        if (i == view[i] || view[i] < 0) {
+            continue;
+        }
+
+        bool is_one_copy = true;
+        // since we modify data sequentially, we only consider decoder indices after current index
+        for (int j = i + 1; j < n_decoders; j++) {
+            if (i == view[j]) {
+                // detect symmetric diagram
+                if (j == view[i]) {
+                    is_p_swap[i] = 1;
+                    is_p_swap[j] = 1;
+                    p_swap_vec.emplace_back(i, j);
+                } else {
+                    two_copy.push_back(i);
+                    is_two_copy[i] = 1;
+                    is_one_copy = false;
+                }
+                break;
+            }
         }
-        if (pos->type == WHISPER_GRETYPE_ALT) {
-            // there's another alternate def of this rule to process
-            pos++;
-        } else {
-            break;
+        if (is_one_copy) {
+            one_copy.push_back(i);
         }
-    } while (true);
+    }
 
-    return { std::move(vec_rules), std::move(stacks), {} };
-}
+    kv_swap_bufs.resize(n_decoders);
 
-static void whisper_suppress_invalid_grammar(
-             whisper_context  & ctx,
-    const whisper_full_params & params,
-           std::vector<float> & logits,
-    const     whisper_grammar & grammar) {
+    for (int i = 0; i < n_decoders; i++) {
+        kv_swap_bufs[i].k.resize(ggml_nbytes(src[i].kv_self.k));
+        kv_swap_bufs[i].v.resize(ggml_nbytes(src[i].kv_self.v));
+    }
 
-    if (grammar.rules.empty() || grammar.stacks.empty()) {
-        return;
+    for (auto & i : two_copy) {
+        // make a copy of KV caches
+        WHISPER_PRINT_DEBUG("%s: store KV cache into swap: idx %d\n", __func__, i);
+        //memcpy(kv_swap_bufs[i].k.data(), src[i].kv_self.k->data, kv_swap_bufs[i].k.size());
+        //memcpy(kv_swap_bufs[i].v.data(), src[i].kv_self.v->data, kv_swap_bufs[i].v.size());
+        ggml_backend_tensor_get(src[i].kv_self.k, kv_swap_bufs[i].k.data(), 0, kv_swap_bufs[i].k.size());
+        ggml_backend_tensor_get(src[i].kv_self.v, kv_swap_bufs[i].v.data(), 0, kv_swap_bufs[i].v.size());
     }
 
-    //bool allow_eot = false;
-    //for (const auto & stack : grammar.stacks) {
-    //    if (stack.empty()) {
-    //        allow_eot = true;
-    //        break;
-    //    }
-    //}
+    // since two-copy decoder KV caches are protected by kv_swap_bufs, modify them first
+    for (auto & i : two_copy) {
+        // skip the decoder indices that require pointer swapping
+        if (is_p_swap[i]) {
+            continue;
+        }
 
-    const whisper_token eot = whisper_token_eot(&ctx);
+        if (is_two_copy[view[i]]) {
+            // modify KV caches of decoder using data from kv_swap_bufs
+            WHISPER_PRINT_DEBUG("%s: two-copy decoder using   swap buffers: swap[%d] -> %d\n", __func__, view[i], i);
+            //memcpy(src[i].kv_self.k->data, kv_swap_bufs[view[i]].k.data(), kv_swap_bufs[view[i]].k.size());
+            //memcpy(src[i].kv_self.v->data, kv_swap_bufs[view[i]].v.data(), kv_swap_bufs[view[i]].v.size());
+            ggml_backend_tensor_set(src[i].kv_self.k, kv_swap_bufs[view[i]].k.data(), 0, kv_swap_bufs[view[i]].k.size());
+            ggml_backend_tensor_set(src[i].kv_self.v, kv_swap_bufs[view[i]].v.data(), 0, kv_swap_bufs[view[i]].v.size());
+        } else {
+            // modify KV caches of decoder using data from correspond decoder KV caches directly
+            WHISPER_PRINT_DEBUG("%s: two-copy decoder without swap buffers:      %d  -> %d\n", __func__, view[i], i);
+            //memcpy(src[i].kv_self.k->data, src[view[i]].kv_self.k->data, ggml_nbytes(src[view[i]].kv_self.k));
+            //memcpy(src[i].kv_self.v->data, src[view[i]].kv_self.v->data, ggml_nbytes(src[view[i]].kv_self.v));
+            ggml_backend_tensor_copy(src[view[i]].kv_self.k, src[i].kv_self.k);
+            ggml_backend_tensor_copy(src[view[i]].kv_self.v, src[i].kv_self.v);
+        }
+    }
 
-    std::vector<std::pair<std::vector<uint32_t>, whisper_partial_utf8>> candidates_decoded;
-    std::vector<whisper_grammar_candidate>                              candidates_grammar;
+    // then modify one-copy decoder KV caches
+    for (auto & i : one_copy) {
+        // skip the decoder indices that require pointer swapping
+        if (is_p_swap[i]) {
+            continue;
+        }
 
-    for (whisper_token id = 0; id < eot; ++id) {
-        const std::string & text = ctx.vocab.id_to_token[id];
-        if (!text.empty()) {
-            candidates_decoded.push_back(decode_utf8(text.c_str(), grammar.partial_utf8));
-            candidates_grammar.push_back({ id, candidates_decoded.back().first.data(), candidates_decoded.back().second });
+        if (is_two_copy[view[i]]) {
+            // modify KV caches of decoder using data from kv_swap_bufs
+            WHISPER_PRINT_DEBUG("%s: one-copy decoder using   swap buffers: swap[%d] -> %d\n", __func__, view[i], i);
+            //memcpy(src[i].kv_self.k->data, kv_swap_bufs[view[i]].k.data(), kv_swap_bufs[view[i]].k.size());
+            //memcpy(src[i].kv_self.v->data, kv_swap_bufs[view[i]].v.data(), kv_swap_bufs[view[i]].v.size());
+            ggml_backend_tensor_set(src[i].kv_self.k, kv_swap_bufs[view[i]].k.data(), 0, kv_swap_bufs[view[i]].k.size());
+            ggml_backend_tensor_set(src[i].kv_self.v, kv_swap_bufs[view[i]].v.data(), 0, kv_swap_bufs[view[i]].v.size());
+        } else {
+            // modify KV caches of decoder using data from correspond decoder KV caches directly
+            WHISPER_PRINT_DEBUG("%s: one-copy decoder without swap buffers:      %d  -> %d\n", __func__, view[i], i);
+            //memcpy(src[i].kv_self.k->data, src[view[i]].kv_self.k->data, ggml_nbytes(src[view[i]].kv_self.k));
+            //memcpy(src[i].kv_self.v->data, src[view[i]].kv_self.v->data, ggml_nbytes(src[view[i]].kv_self.v));
+            ggml_backend_tensor_copy(src[view[i]].kv_self.k, src[i].kv_self.k);
+            ggml_backend_tensor_copy(src[view[i]].kv_self.v, src[i].kv_self.v);
         }
     }
 
-    const auto rejects = whisper_grammar_reject_candidates(grammar.rules, grammar.stacks, candidates_grammar);
-
-    for (const auto & reject : rejects) {
-        logits[reject.id] -= params.grammar_penalty;
+    // swap the pointers
+    for (auto & i : p_swap_vec) {
+        WHISPER_PRINT_DEBUG("%s: swap pointers: %d <-> %d\n", __func__, i.first, i.second);
+        std::swap(src[i.first].kv_self, src[i.second].kv_self);
     }
 
-    // when the grammar allows a continuation, we penalize the end-of-text token
-    //if (!allow_eot) {
-    //    logits[eot] -= params.grammar_penalty;
-    //}
-    //fprintf(stderr, "Allowed: (%zu tokens)\n", size - rejects.size());
+    return true;
 }
 
-static void whisper_grammar_accept_token(whisper_context & ctx, whisper_grammar & grammar, whisper_token token) {
-    if (grammar.rules.empty() || grammar.stacks.empty()) {
-        return;
-    }
+// smallest audio context bucket that covers n_len mel frames of audio
+// the compute buffers are measured for the full context, so every bucket fits in them
+static int whisper_audio_ctx_auto(const whisper_context & ctx, int n_len) {
+    const int n_audio_ctx = ctx.model.hparams.n_audio_ctx;
 
-    //fprintf(stderr, "Accept: '%s'\n", ctx.vocab.id_to_token[token].c_str());
+    // each encoder position covers 2 mel frames (stride of the second conv)
+    const int n_ctx = (n_len + 1)/2;
+    const int n_ctx_bucket = ((n_ctx + WHISPER_AUDIO_CTX_BUCKET - 1)/WHISPER_AUDIO_CTX_BUCKET)*WHISPER_AUDIO_CTX_BUCKET;
 
-    const std::string & text = ctx.vocab.id_to_token[token];
+    return std::max(1, std::min(n_audio_ctx, n_ctx_bucket));
+}
 
-    if (text.rfind("[_", 0) == 0) {
-        // fprintf(stderr, " (skipped)\n");
-        return;
-    }
-    // fprintf(stderr, "\n");
+// [EXPERIMENTAL] speculative decoding
+// bring the draft decoder KV cache in sync with the accepted tokens and let the draft model propose up to n_draft
+// greedy tokens. tokens is the context (prompt + accepted tokens of sequence), draft_past holds the tokens currently
+// stored in the draft KV cache
+static bool whisper_draft_tokens(
+                     whisper_context & dctx,
+                       whisper_state & dstate,
+           const whisper_full_params & params,
+    const std::vector<whisper_token> & tokens,
+              const whisper_sequence & sequence,
+          std::vector<whisper_token> & draft_past,
+                                 int   n_draft,
+                                 int   n_threads,
+          std::vector<whisper_token> & drafted) {
+    auto & decoder = dstate.decoders[0];
 
-    // Note terminating 0 in decoded string
-    const auto   decoded     = decode_utf8(text.c_str(), grammar.partial_utf8);
-    const auto & code_points = decoded.first;
-    for (auto it = code_points.begin(), end = code_points.end() - 1; it != end; ++it) {
-        grammar.stacks = whisper_grammar_accept(grammar.rules, grammar.stacks, *it);
-    }
-    grammar.partial_utf8 = decoded.second;
-}
+    drafted.clear();
 
-//////////////
-// END grammar
-//////////////
+    // reuse the longest common prefix of the draft KV cache, but always evaluate at least the last token
+    int n_past = 0;
+    while (n_past < (int) draft_past.size() && n_past < (int) tokens.size() - 1 && draft_past[n_past] == tokens[n_past]) {
+        ++n_past;
+    }
 
-////////////////////////////////////////////////////////////////////////////
+    // the draft model sees the same token history, so the timestamp rules are applied consistently
+    decoder.sequence.tokens = sequence.tokens;
+    decoder.grammar = {};
 
-struct whisper_context_params * whisper_context_default_params_by_ref() {
-    struct whisper_context_params params = whisper_context_default_params();
+    // user callbacks expect the main context
+    whisper_full_params dparams = params;
+    dparams.logits_filter_callback = nullptr;
 
-    struct whisper_context_params* result = new whisper_context_params();
-    *result = params;
-    return result;
-}
+    draft_past.assign(tokens.begin(), tokens.end());
 
-struct whisper_full_params * whisper_full_default_params_by_ref(enum whisper_sampling_strategy strategy) {
-    struct whisper_full_params params = whisper_full_default_params(strategy);
+    const whisper_token * eval   = tokens.data() + n_past;
+    int                   eval_n = tokens.size() - n_past;
 
-    struct whisper_full_params* result = new whisper_full_params();
-    *result = params;
-    return result;
-}
+    for (int i = 0; i < n_draft; ++i) {
+        if (!whisper_decode_internal(dctx, dstate, decoder, eval, eval_n, n_past, false, n_threads, params.abort_callback, params.abort_callback_user_data)) {
+            return false;
+        }
 
-struct whisper_full_params whisper_full_default_params(enum whisper_sampling_strategy strategy) {
-    struct whisper_full_params result = {
-        /*.strategy          =*/ strategy,
+        n_past += eval_n;
 
-        /*.n_threads         =*/ std::min(4, (int32_t) std::thread::hardware_concurrency()),
-        /*.n_max_text_ctx    =*/ 16384,
-        /*.offset_ms         =*/ 0,
-        /*.duration_ms       =*/ 0,
+        whisper_process_logits(dctx, dstate, dparams, decoder, 0.0f);
 
-        /*.translate         =*/ false,
-        /*.no_context        =*/ true,
-        /*.no_timestamps     =*/ false,
-        /*.single_segment    =*/ false,
-        /*.print_special     =*/ false,
-        /*.print_progress    =*/ true,
-        /*.print_realtime    =*/ false,
-        /*.print_timestamps  =*/ true,
+        const auto token = whisper_sample_token(dctx, dstate, decoder, true);
 
-        /*.token_timestamps  =*/ false,
-        /*.thold_pt          =*/ 0.01f,
-        /*.thold_ptsum       =*/ 0.01f,
-        /*.max_len           =*/ 0,
-        /*.split_on_word     =*/ false,
-        /*.max_tokens        =*/ 0,
+        drafted.push_back(token.id);
 
-        /*.speed_up          =*/ false,
-        /*.debug_mode        =*/ false,
-        /*.audio_ctx         =*/ 0,
+        if (token.id == whisper_token_eot(&dctx) || n_past + 1 >= dctx.model.hparams.n_text_ctx) {
+            break;
+        }
 
-        /*.tdrz_enable       =*/ false,
+        decoder.sequence.tokens.push_back(token);
+        draft_past.push_back(token.id);
 
-        /*.initial_prompt    =*/ nullptr,
-        /*.prompt_tokens     =*/ nullptr,
-        /*.prompt_n_tokens   =*/ 0,
+        eval   = &draft_past.back();
+        eval_n = 1;
+    }
 
-        /*.language          =*/ "en",
-        /*.detect_language   =*/ false,
+    // the last drafted token has not been evaluated by the draft model
+    draft_past.resize(n_past);
 
-        /*.suppress_blank    =*/ true,
-        /*.suppress_non_speech_tokens =*/ false,
+    return true;
+}
 
-        /*.temperature       =*/  0.0f,
-        /*.max_initial_ts    =*/  1.0f,
-        /*.length_penalty    =*/ -1.0f,
+// [EXPERIMENTAL] prompt lookup
+// find an earlier occurrence of the last n tokens of the context (prompt + accepted tokens) and propose the
+// tokens that followed it. longer n-grams are tried first, down to bigrams
+static void whisper_draft_lookup(
+    const std::vector<whisper_token> & tokens,
+                                 int   n_ngram,
+                                 int   n_draft,
+          std::vector<whisper_token> & drafted) {
+    drafted.clear();
 
-        /*.temperature_inc   =*/  0.4f,
-        /*.entropy_thold     =*/  2.4f,
-        /*.logprob_thold     =*/ -1.0f,
-        /*.no_speech_thold   =*/  0.6f,
+    const int n_tokens = tokens.size();
 
-        /*.greedy            =*/ {
-            /*.best_of   =*/ -1,
-        },
+    for (int n = std::min(n_ngram, n_tokens - 1); n >= std::min(2, n_ngram); --n) {
+        const whisper_token * ngram = tokens.data() + n_tokens - n;
 
-        /*.beam_search      =*/ {
-            /*.beam_size =*/ -1,
+        // prefer the most recent match that is followed by n_draft tokens
+        // matches close to the end (e.g. inside a repetition) only have a short continuation
+        int i_best = -1;
+        int n_best = 0;
 
-            /*.patience  =*/ -1.0f,
-        },
+        for (int i = n_tokens - n - 1; i >= 0 && n_best < n_draft; --i) {
+            if (std::equal(ngram, ngram + n, tokens.data() + i) && n_tokens - (i + n) > n_best) {
+                i_best = i;
+                n_best = n_tokens - (i + n);
+            }
+        }
 
-        /*.new_segment_callback           =*/ nullptr,
-        /*.new_segment_callback_user_data =*/ nullptr,
+        if (i_best >= 0) {
+            drafted.assign(tokens.begin() + i_best + n, tokens.begin() + i_best + n + std::min(n_best, n_draft));
+            return;
+        }
+    }
+}
 
-        /*.progress_callback           =*/ nullptr,
-        /*.progress_callback_user_data =*/ nullptr,
+// [EXPERIMENTAL] restricted output projection
+// gather the rows of the token embedding for the given tokens, the copy is reused while the set does not change
+static bool whisper_vocab_init(whisper_context & wctx, whisper_state & wstate, const std::vector<whisper_token> & ids) {
+    if (wstate.ctx_vocab != nullptr && wstate.vocab_ids == ids) {
+        return true;
+    }
 
-        /*.encoder_begin_callback           =*/ nullptr,
-        /*.encoder_begin_callback_user_data =*/ nullptr,
+    if (wstate.ctx_vocab != nullptr) {
+        ggml_free(wstate.ctx_vocab);
+        ggml_backend_buffer_free(wstate.buffer_vocab);
 
-        /*.abort_callback                   =*/ nullptr,
-        /*.abort_callback_user_data         =*/ nullptr,
+        wstate.ctx_vocab = nullptr;
+    }
 
-        /*.logits_filter_callback           =*/ nullptr,
-        /*.logits_filter_callback_user_data =*/ nullptr,
+    const auto * d_te = whisper_state_model(wctx, wstate).d_te;
 
-        /*.grammar_rules   =*/ nullptr,
-        /*.n_grammar_rules =*/ 0,
-        /*.i_start_rule    =*/ 0,
-        /*.grammar_penalty =*/ 100.0f,
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ ggml_tensor_overhead(),
+        /*.mem_buffer =*/ nullptr,
+        /*.no_alloc   =*/ true,
     };
 
-    switch (strategy) {
-        case WHISPER_SAMPLING_GREEDY:
-            {
-                result.greedy = {
-                    /*.best_of   =*/ 2, // TODO: increase to 5 when we speed-up batch decoding
-                };
-            } break;
-        case WHISPER_SAMPLING_BEAM_SEARCH:
-            {
-                result.beam_search = {
-                    /*.beam_size =*/ 2, // TODO: increase to 5 when we speed-up batch decoding
+    wstate.ctx_vocab = ggml_init(params);
 
-                    /*.patience  =*/ -1.0f,
-                };
-            } break;
+    if (!wstate.ctx_vocab) {
+        WHISPER_LOG_ERROR("%s: failed to allocate memory for the token embedding subset\n", __func__);
+        return false;
     }
 
-    return result;
-}
+    wstate.d_te_vocab   = ggml_new_tensor_2d(wstate.ctx_vocab, d_te->type, d_te->ne[0], ids.size());
+    wstate.buffer_vocab = ggml_backend_alloc_buffer(wctx.backend, ggml_nbytes(wstate.d_te_vocab));
 
-// forward declarations
-static std::vector<float> get_signal_energy(const float * signal, int n_samples, int n_samples_per_half_window);
-static void whisper_exp_compute_token_level_timestamps(
-        struct whisper_context & ctx,
-          struct whisper_state & state,
-                           int   i_segment,
-                         float   thold_pt,
-                         float   thold_ptsum);
+    whisper_state_numa_place(wstate, wstate.buffer_vocab);
 
-static inline bool should_split_on_word(const char * txt, bool split_on_word) {
-    if (!split_on_word) return true;
+    {
+        ggml_allocr * alloc = ggml_allocr_new_from_buffer(wstate.buffer_vocab);
 
-    return txt[0] == ' ';
-}
+        ggml_allocr_alloc(alloc, wstate.d_te_vocab);
 
-// wrap the last segment to max_len characters
-// returns the number of new segments
-static int whisper_wrap_segment(struct whisper_context & ctx, struct whisper_state & state, int max_len, bool split_on_word) {
-    auto segment = state.result_all.back();
+        ggml_allocr_free(alloc);
+    }
 
-    int res = 1;
-    int acc = 0;
+    const size_t row_size = d_te->nb[1];
 
-    std::string text;
+    std::vector<uint8_t> row(row_size);
 
-    for (int i = 0; i < (int) segment.tokens.size(); i++) {
-        const auto & token = segment.tokens[i];
-        if (token.id >= whisper_token_eot(&ctx)) {
-            continue;
-        }
+    for (size_t k = 0; k < ids.size(); ++k) {
+        ggml_backend_tensor_get(d_te, row.data(), ids[k]*row_size, row_size);
+        ggml_backend_tensor_set(wstate.d_te_vocab, row.data(), k*row_size, row_size);
+    }
 
-        const auto txt = whisper_token_to_str(&ctx, token.id);
-        const int cur = strlen(txt);
+    wstate.vocab_ids = ids;
+
+    return true;
+}
 
-        if (acc + cur > max_len && i > 0 && should_split_on_word(txt, split_on_word)) {
-            state.result_all.back().text = std::move(text);
-            state.result_all.back().t1 = token.t0;
-            state.result_all.back().tokens.resize(i);
-            state.result_all.back().speaker_turn_next = false;
+// TAGS: WHISPER_DECODER_INIT
+static bool whisper_decoders_init(whisper_context & ctx, whisper_state & state, int n_decoders) {
+    // the beam search copies the sequences into these, reserve them so that the copies do not reallocate
+    for (int j = 0; j < n_decoders; j++) {
+        state.beam_sequences[j].tokens.reserve(state.decoders[0].sequence.tokens.capacity());
+    }
 
-            state.result_all.push_back({});
-            state.result_all.back().t0 = token.t0;
-            state.result_all.back().t1 = segment.t1;
+    for (int j = 1; j < n_decoders; j++) {
+        auto & decoder = state.decoders[j];
 
-            // add tokens [i, end] to the new segment
-            state.result_all.back().tokens.insert(
-                state.result_all.back().tokens.end(),
-                    segment.tokens.begin() + i,
-                    segment.tokens.end());
+        if (decoder.kv_self.ctx == nullptr) {
+            decoder.kv_self = state.decoders[0].kv_self;
+            if (!kv_cache_reinit(decoder.kv_self, ctx.backend)) {
+                WHISPER_LOG_ERROR("%s: kv_cache_reinit() failed for self-attention, decoder %d\n", __func__, j);
+                return false;
+            }
 
-            state.result_all.back().speaker_turn_next = segment.speaker_turn_next;
+            whisper_state_numa_place(state, decoder.kv_self.buffer);
 
-            acc = 0;
-            text = "";
+            WHISPER_PRINT_DEBUG("%s: initialized self-attention kv cache, decoder %d\n", __func__, j);
 
-            segment = state.result_all.back();
-            i = -1;
+            decoder.sequence.tokens.reserve(state.decoders[0].sequence.tokens.capacity());
 
-            res++;
-        } else {
-            acc += cur;
-            text += txt;
+            decoder.probs.resize   (ctx.vocab.n_vocab);
+            decoder.logits.resize  (ctx.vocab.n_vocab);
+            decoder.logprobs.resize(ctx.vocab.n_vocab);
         }
     }
 
-    state.result_all.back().text = std::move(text);
-
-    return res;
+    return true;
 }
 
-static const std::vector<std::string> non_speech_tokens = {
-    "\"", "#", "(", ")", "*", "+", "/", ":", ";", "<", "=", ">", "@", "[", "\\", "]", "^",
-    "_", "`", "{", "|", "}", "~", "「", "」", "『", "』", "<<", ">>", "<<<", ">>>", "--",
-    "---", "-(", "-[", "('", "(\"", "((", "))", "(((", ")))", "[[", "]]", "{{", "}}", "♪♪",
-    "♪♪♪","♩", "♪", "♫", "♬", "♭", "♮", "♯"
+// [EXPERIMENTAL] concurrent fallback - the decodes at higher temperatures are stopped once a result is accepted
+struct whisper_fallback_abort {
+    std::atomic<bool> stop { false };
+
+    whisper_abort_callback abort_callback;
+    void * abort_callback_user_data;
 };
 
-// process the logits for the selected decoder
-// - applies logit filters
-// - computes logprobs and probs
-static void whisper_process_logits(
-              struct whisper_context & ctx,
-               struct whisper_state  & state,
-    const struct whisper_full_params   params,
-              struct whisper_decoder & decoder,
-                               float   temperature) {
-    const auto & vocab      = ctx.vocab;
-    const auto & tokens_cur = decoder.sequence.tokens;
+static bool whisper_fallback_abort_callback(void * data) {
+    auto * abort = (whisper_fallback_abort *) data;
 
-    const bool is_initial = tokens_cur.size() == 0;
-    const int  n_logits   = vocab.id_to_token.size();
+    return abort->stop || (abort->abort_callback && abort->abort_callback(abort->abort_callback_user_data));
+}
 
-    WHISPER_ASSERT(n_logits == ctx.vocab.n_vocab);
+// returned by whisper_full_decode_window() when a decode was stopped because another temperature was accepted
+#define WHISPER_FALLBACK_CANCELLED -13
 
-    // extract the logits for the last token
-    // we will be mutating, and therefore we don't want to use the ctx.logits buffer directly
-    auto & probs    = decoder.probs;
-    auto & logits   = decoder.logits;
-    auto & logprobs = decoder.logprobs;
-    {
-        logits.resize(n_logits);
-        memcpy(logits.data(), state.logits.data() + (state.logits.size() - n_logits), n_logits*sizeof(float));
+static bool whisper_fallback_cancelled(whisper_abort_callback abort_callback, void * abort_callback_user_data) {
+    return abort_callback == whisper_fallback_abort_callback && ((whisper_fallback_abort *) abort_callback_user_data)->stop;
+}
 
-        if (temperature > 0.0f) {
-            for (int i = 0; i < n_logits; i++) {
-                logits[i] /= temperature;
-            }
-        }
+// [EXPERIMENTAL] online loop detection, checked after every sampled token
+// the decoder is stuck when the last tokens have a low entropy (the check used when ranking the sequences) and they
+// either repeat with a short period or compress well, estimated by the number of distinct trigrams
+static bool whisper_sequence_looping(
+        const struct whisper_full_params & params,
+                  const whisper_sequence & sequence) {
+    constexpr int n = 32; // same window as whisper_sequence_score
+    constexpr int w = 48; // window for the repetition checks
 
-        // will be populated a bit later
-        probs.resize(n_logits);
-        logprobs.resize(n_logits);
+    const auto & tokens = sequence.tokens;
+
+    const int n_tokens = tokens.size();
+    if (n_tokens < w) {
+        return false;
     }
 
-    // apply logit filters here
-    // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L480-L493
+    // running entropy
     {
-        // suppress blank
-        // https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L388-L390
-        if (params.suppress_blank) {
-            if (is_initial) {
-                logits[vocab.token_eot]           = -INFINITY;
-                logits[vocab.token_to_id.at(" ")] = -INFINITY;
-            }
+        whisper_token ids[n];
+        for (int k = 0; k < n; ++k) {
+            ids[k] = tokens[n_tokens - n + k].id;
         }
+        std::sort(ids, ids + n);
 
-        // suppress <|notimestamps|> token
-        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L410-L412
-        logits[vocab.token_not] = -INFINITY;
-        if (params.no_timestamps) {
-            for (int i = vocab.token_beg; i < n_logits; ++i) {
-                logits[i] = -INFINITY;
+        double entropy = 0.0;
+
+        for (int k0 = 0, k1 = 0; k0 < n; k0 = k1) {
+            while (k1 < n && ids[k1] == ids[k0]) {
+                ++k1;
             }
-        }
 
-        // suppress sot and nosp tokens
-        logits[vocab.token_sot]  = -INFINITY;
-        logits[vocab.token_nosp] = -INFINITY; // TODO: ignore this token for now
+            const double p = (k1 - k0)/(double) n;
+            entropy -= p*log(p);
+        }
 
-        // [TDRZ] when tinydiarize is disabled, suppress solm token
-        if (params.tdrz_enable == false) {
-            logits[vocab.token_solm] = -INFINITY;
+        if (entropy >= params.entropy_thold) {
+            return false;
         }
+    }
 
-        // suppress task tokens
-        logits[vocab.token_translate]  = -INFINITY;
-        logits[vocab.token_transcribe] = -INFINITY;
-        logits[vocab.token_prev]       = -INFINITY;
+    // n-gram repeat - the tail is periodic with period p and repeats at least 3 times
+    for (int p = 1; p <= w/3; ++p) {
+        const int len = std::max(n, 3*p);
 
-        // suppress lang tokens
-        for (size_t i = 0; i < g_lang.size(); ++i) {
-            logits[whisper_token_lang(&ctx, i)] = -INFINITY;
+        int k = 0;
+        while (k < len - p && tokens[n_tokens - 1 - k].id == tokens[n_tokens - 1 - k - p].id) {
+            ++k;
         }
 
-        // suppress prev token
-        logits[vocab.token_prev] = -INFINITY;
-
-        if (params.logits_filter_callback) {
-            params.logits_filter_callback(&ctx, &state, tokens_cur.data(), tokens_cur.size(), logits.data(), params.logits_filter_callback_user_data);
+        if (k == len - p) {
+            return true;
         }
+    }
 
-        // suppress non-speech tokens
-        // ref: https://github.com/openai/whisper/blob/7858aa9c08d98f75575035ecd6481f462d66ca27/whisper/tokenizer.py#L224-L253
-        if (params.suppress_non_speech_tokens) {
-            for (const std::string & token : non_speech_tokens) {
-                const std::string suppress_tokens[] = {token, " " + token};
-                for (const std::string & suppress_token : suppress_tokens) {
-                    if (vocab.token_to_id.find(suppress_token) != vocab.token_to_id.end()) {
-                        logits[vocab.token_to_id.at(suppress_token)] = -INFINITY;
-                    }
-                }
-            }
+    // compression ratio estimate - loops with drifting timestamps are not periodic, but reuse the same trigrams
+    {
+        std::array<std::tuple<whisper_token, whisper_token, whisper_token>, w - 2> trigrams;
 
-            // allow hyphens "-" and single quotes "'" between words, but not at the beginning of a word
-            if (vocab.token_to_id.find(" -") != vocab.token_to_id.end()) {
-                logits[vocab.token_to_id.at(" -")] = -INFINITY;
-            }
-            if (vocab.token_to_id.find(" '") != vocab.token_to_id.end()) {
-                logits[vocab.token_to_id.at(" '")] = -INFINITY;
-            }
+        for (int k = 0; k < w - 2; ++k) {
+            const int i0 = n_tokens - w + k;
+            trigrams[k] = std::make_tuple(tokens[i0].id, tokens[i0 + 1].id, tokens[i0 + 2].id);
         }
 
-        // timestamps have to appear in pairs, except directly before EOT; mask logits accordingly
-        // https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L414-L424
-        {
-            const bool last_was_timestamp        = tokens_cur.size() > 0 && tokens_cur.back().id >= vocab.token_beg;
-            const bool penultimate_was_timestamp = tokens_cur.size() < 2 || tokens_cur[tokens_cur.size() - 2].id >= vocab.token_beg;
+        std::sort(trigrams.begin(), trigrams.end());
 
-            //WHISPER_LOG_INFO("last_was_timestamp=%d penultimate_was_timestamp=%d\n", last_was_timestamp, penultimate_was_timestamp);
+        const int n_distinct = std::unique(trigrams.begin(), trigrams.end()) - trigrams.begin();
 
-            if (last_was_timestamp) {
-                if (penultimate_was_timestamp) {
-                    for (int i = vocab.token_beg; i < n_logits; ++i) {
-                        logits[i] = -INFINITY;
-                    }
-                } else {
-                    for (int i = 0; i < vocab.token_eot; ++i) {
-                        logits[i] = -INFINITY;
-                    }
-                }
-            }
+        if ((w - 2) >= 4*n_distinct) {
+            return true;
         }
+    }
 
-        // the initial timestamp cannot be larger than max_initial_ts
-        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L426-L429
-        if (is_initial && params.max_initial_ts > 0.0f) {
-            const float precision = float(WHISPER_CHUNK_SIZE)/ctx.model.hparams.n_audio_ctx;
-            const int   tid0      = std::round(params.max_initial_ts/precision);
+    return false;
+}
 
-            for (int i = vocab.token_beg + tid0 + 1; i < n_logits; ++i) {
-                logits[i] = -INFINITY;
-            }
-        }
+// [EXPERIMENTAL] speculative decoding of the greedy decoder at t = 0
+struct whisper_speculation {
+    whisper_state * state = nullptr; // draft model state, nullptr for prompt lookup only
 
-        // condition timestamp tokens to be increasing
-        // ref: https://github.com/openai/whisper/pull/831#issuecomment-1385910556
-        if (decoder.has_ts) {
-            const int tid0 = decoder.seek_delta/2;
+    int n_max = 0; // max drafted tokens per verification pass
+    int ngram = 0; // prompt lookup n-gram size, 0 = disabled
 
-            for (int i = vocab.token_beg; i < vocab.token_beg + tid0; ++i) {
-                logits[i] = -INFINITY;
-            }
-        }
+    std::vector<whisper_token> past;    // tokens in the draft KV cache
+    std::vector<whisper_token> tokens;  // tokens proposed for the last verification pass
+    std::vector<float>         logits;  // logits of the last verification pass [n_tokens][n_vocab]
+    std::vector<whisper_token> context; // prompt + accepted tokens, the input of the drafting
+};
 
-        // populate the logprobs array (log_softmax)
-        {
-            const float logit_max = *std::max_element(logits.begin(), logits.end());
-            float logsumexp = 0.0f;
-            for (int i = 0; i < n_logits; ++i) {
-                if (logits[i] > -INFINITY) {
-                    logsumexp += expf(logits[i] - logit_max);
-                }
-            }
-            logsumexp = logf(logsumexp) + logit_max;
+// decode the current window at temperature t_cur with the decoders of the given state
+// on success, best_decoder_id is the decoder with the best scoring sequence and prompt holds the prompt it was given
+static int whisper_full_decode_window(
+               struct whisper_context * ctx,
+                 struct whisper_state * state,
+            const whisper_full_params & params,
+                                float   t_cur,
+                                  int   seek,
+                                  int   seek_end,
+     const std::vector<whisper_token> & prompt_past,
+     const std::vector<whisper_token> & prompt_init,
+           std::vector<whisper_token> & prompt,
+                  whisper_speculation & spec,
+                                  int   n_threads,
+               whisper_abort_callback   abort_callback,
+                                 void * abort_callback_user_data,
+                                  int & best_decoder_id) {
+    whisper_state * draft_state = spec.state;
+
+    const int n_draft_max = spec.n_max;
+    const int draft_ngram = spec.ngram;
+
+    auto & draft_past   = spec.past;
+    auto & draft_tokens = spec.tokens;
+    auto & draft_logits = spec.logits;
+
+    auto & beam_candidates = state->beam_candidates;
+
+    int n_decoders_cur = 1;
 
-            for (int i = 0; i < n_logits; ++i) {
-                if (logits[i] > -INFINITY) {
-                    logprobs[i] = logits[i] - logsumexp;
+    switch (params.strategy) {
+        case whisper_sampling_strategy::WHISPER_SAMPLING_GREEDY:
+            {
+                if (t_cur > 0.0f) {
+                    n_decoders_cur = params.greedy.best_of;
+                }
+            } break;
+        case whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH:
+            {
+                if (t_cur > 0.0f) {
+                    n_decoders_cur = params.greedy.best_of;
                 } else {
-                    logprobs[i] = -INFINITY;
+                    n_decoders_cur = params.beam_search.beam_size;
                 }
+            } break;
+    };
+
+    n_decoders_cur = std::max(1, n_decoders_cur);
+
+    // beam search patience, ref: https://arxiv.org/pdf/2204.05424.pdf
+    // finished hypotheses are moved out of the beams, which keep searching until round(patience*n_beams) are finished
+    const bool beam_patience  = params.strategy == WHISPER_SAMPLING_BEAM_SEARCH && params.beam_search.patience > 0.0f;
+    const int  n_finished_max = std::max(1, (int) std::round(params.beam_search.patience*n_decoders_cur));
+
+    // the finished hypotheses are swapped into the first n_finished slots, so that they are not copied
+    auto & beam_finished = state->beam_finished;
+    int n_finished = 0;
+
+    if (beam_patience) {
+        // up to n_decoders_cur hypotheses finish at the step that reaches n_finished_max
+        const int n_slots = n_finished_max + n_decoders_cur - 1;
+
+        if ((int) beam_finished.size() < n_slots) {
+            beam_finished.resize(n_slots);
+
+            for (auto & hyp : beam_finished) {
+                hyp.sequence.tokens.reserve(state->decoders[0].sequence.tokens.capacity());
             }
         }
+    }
 
-        // if sum of probability over timestamps is above any other token, sample timestamp
-        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L431-L437
-        {
-            // logsumexp over timestamps
-            float timestamp_logprob = -INFINITY;
-            {
-                float logsumexp = 0.0f;
-                const float logprob_max = *std::max_element(logprobs.begin() + vocab.token_beg, logprobs.end());
-                for (int i = vocab.token_beg; i < n_logits; ++i) {
-                    if (logprobs[i] > -INFINITY) {
-                        logsumexp += expf(logprobs[i] - logprob_max);
-                    }
-                }
-                if (logsumexp > 0.0f) {
-                    timestamp_logprob = logf(logsumexp) + logprob_max;
-                }
-            }
+    // greedy decoding at temperature 0 can be sped up with drafted tokens without changing the result
+    const bool speculate = (draft_state != nullptr || draft_ngram > 0) && n_decoders_cur == 1 && t_cur < 1e-6f;
 
-            const float max_text_token_logprob = *std::max_element(logprobs.begin(), logprobs.begin() + vocab.token_beg);
+    // index of the next draft token that has verified logits in draft_logits
+    int i_draft = 0;
 
-            //WHISPER_LOG_INFO("timestamp_logprob=%f max_text_token_logprob=%f\n", timestamp_logprob, max_text_token_logprob);
+    draft_past.clear();
+    draft_tokens.clear();
 
-            if (timestamp_logprob > max_text_token_logprob) {
-                //printf("sampling timestamp\n");
-                for (int i = 0; i < vocab.token_beg; ++i) {
-                    logits[i]   = -INFINITY;
-                    logprobs[i] = -INFINITY;
-                }
-            } else if (params.n_grammar_rules > 0) {
-                whisper_suppress_invalid_grammar(ctx, params, logits, decoder.grammar);
+    WHISPER_PRINT_DEBUG("\n%s: strategy = %d, decoding with %d decoders, temperature = %.2f\n", __func__, params.strategy, n_decoders_cur, t_cur);
 
-                // populate the logprobs array (log_softmax)
-                {
-                    const float logit_max = *std::max_element(logits.begin(), logits.end());
-                    float logsumexp = 0.0f;
-                    for (int i = 0; i < n_logits; ++i) {
-                        if (logits[i] > -INFINITY) {
-                            logsumexp += expf(logits[i] - logit_max);
-                        }
-                    }
-                    logsumexp = logf(logsumexp) + logit_max;
+    // TAGS: WHISPER_DECODER_INIT
+    for (int j = 0; j < n_decoders_cur; ++j) {
+        auto & decoder = state->decoders[j];
 
-                    for (int i = 0; i < n_logits; ++i) {
-                        if (logits[i] > -INFINITY) {
-                            logprobs[i] = logits[i] - logsumexp;
-                        } else {
-                            logprobs[i] = -INFINITY;
-                        }
-                    }
-                }
-            }
+        decoder.kv_self.n = 0;
+
+        decoder.sequence.tokens.clear();
+        decoder.sequence.result_len       = 0;
+        decoder.sequence.sum_logprobs_all = 0.0;
+        decoder.sequence.sum_logprobs     = -INFINITY;
+        decoder.sequence.avg_logprobs     = -INFINITY;
+        decoder.sequence.entropy          = 0.0;
+        decoder.sequence.score            = -INFINITY;
+
+        decoder.seek_delta = 100*WHISPER_CHUNK_SIZE;
+
+        decoder.failed    = false;
+        decoder.completed = false;
+        decoder.has_ts    = false;
+
+        if (params.grammar_rules != nullptr) {
+            decoder.grammar = whisper_grammar_init(
+                params.grammar_rules, params.n_grammar_rules, params.i_start_rule);
+        } else {
+            decoder.grammar = {};
         }
     }
 
-    // compute probs
+    // init prompt and kv cache for the current iteration
+    // run whisper_decoder() only for decoder 0 and copy the results for the other decoders
     {
-        for (int i = 0; i < n_logits; ++i) {
-            if (logits[i] == -INFINITY) {
-                probs[i] = 0.0f;
-            } else {
-                probs[i] = expf(logprobs[i]);
+        prompt.clear();
+
+        // if we have already generated some text, use it as a prompt to condition the next generation
+        if (!prompt_past.empty() && t_cur < 0.5f && params.n_max_text_ctx > 0) {
+            int n_take = std::min(std::min(params.n_max_text_ctx, whisper_n_text_ctx(ctx)/2), int(prompt_past.size()));
+
+            prompt = { whisper_token_prev(ctx) };
+            prompt.insert(prompt.begin() + 1, prompt_past.end() - n_take, prompt_past.end());
+        }
+
+        // init new transcription with sot, language (opt) and task tokens
+        prompt.insert(prompt.end(), prompt_init.begin(), prompt_init.end());
+
+        // print the prompt
+        WHISPER_PRINT_DEBUG("\n\n");
+        for (int i = 0; i < (int) prompt.size(); i++) {
+            WHISPER_PRINT_DEBUG("%s: prompt[%d] = %s\n", __func__, i, ctx->vocab.id_to_token.at(prompt[i]).c_str());
+        }
+        WHISPER_PRINT_DEBUG("\n\n");
+
+        if (!whisper_decode_internal(*ctx, *state, state->decoders[0], prompt.data(), prompt.size(), 0, false, n_threads, abort_callback, abort_callback_user_data)) {
+            if (whisper_fallback_cancelled(abort_callback, abort_callback_user_data)) {
+                return WHISPER_FALLBACK_CANCELLED;
             }
+            WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
+            return -7;
         }
-    }
 
-#if 0
-    // print first 100 logits - token string : logit
-    //for (int i = 0; i < 10; i++) {
-    //    const auto token   = vocab.id_to_token.at(i);
-    //    const auto prob    = probs[i];
-    //    const auto logit   = logits[i];
-    //    const auto logprob = logprobs[i];
-    //    printf("%16s : prob=%9.5f logit=%9.5f logprob=%9.5f\n", token.c_str(), prob, logit, logprob);
-    //}
+        {
+            const int64_t t_start_sample_us = ggml_time_us();
+
+            whisper_process_logits(*ctx, *state, params, state->decoders[0], t_cur);
+
+            state->decoders[0].kv_self.n += prompt.size();
+
+            for (int j = 1; j < n_decoders_cur; ++j) {
+                auto & decoder = state->decoders[j];
+
+                // TODO: fix CUDA
+                //memcpy(decoder.kv_self.k->data, state->decoders[0].kv_self.k->data, ggml_nbytes(decoder.kv_self.k));
+                //memcpy(decoder.kv_self.v->data, state->decoders[0].kv_self.v->data, ggml_nbytes(decoder.kv_self.v));
+                ggml_backend_tensor_copy(state->decoders[0].kv_self.k, decoder.kv_self.k);
+                ggml_backend_tensor_copy(state->decoders[0].kv_self.v, decoder.kv_self.v);
 
-    // print sorted
-    {
-        std::vector<std::pair<float, int>> pairs;
+                decoder.kv_self.n += prompt.size();
 
-        for (int i = 0; i < n_logits; ++i) {
-            pairs.push_back(std::make_pair(probs[i], i));
+                memcpy(decoder.probs.data(),    state->decoders[0].probs.data(),    decoder.probs.size()*sizeof(decoder.probs[0]));
+                memcpy(decoder.logits.data(),   state->decoders[0].logits.data(),   decoder.logits.size()*sizeof(decoder.logits[0]));
+                memcpy(decoder.logprobs.data(), state->decoders[0].logprobs.data(), decoder.logprobs.size()*sizeof(decoder.logprobs[0]));
+            }
+
+            state->t_sample_us += ggml_time_us() - t_start_sample_us;
         }
+    }
 
-        std::sort(pairs.begin(), pairs.end(), [](const std::pair<float, int>& a, const std::pair<float, int>& b) {
-            return a.first > b.first;
-        });
+    for (int i = 0, n_max = whisper_n_text_ctx(ctx)/2 - 4; i < n_max; ++i) {
+        const int64_t t_start_sample_us = ggml_time_us();
 
-        for (int i = 0; i < 10; i++) {
-            const auto token   = vocab.id_to_token.at(pairs[i].second);
-            const auto prob    = pairs[i].first;
-            const auto logit   = logits[pairs[i].second];
-            const auto logprob = logprobs[pairs[i].second];
-            printf("%16s : id=%6d prob=%9.5f logit=%9.5f logprob=%9.5f '%s'\n", token.c_str(), pairs[i].second, prob, logit, logprob, token.c_str());
+        if (params.strategy == whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH) {
+            beam_candidates.clear();
         }
 
-        printf("----------------\n");
-    }
+        // generate new sequence candidates for each decoder
+        for (int j = 0; j < n_decoders_cur; ++j) {
+            auto & decoder = state->decoders[j];
 
-    // "And", "and", " And", " and"
-    //printf("logits[\"and\"]  = %f\n", logits[vocab.token_to_id.at("and")]);
-    //printf("logits[\"And\"]  = %f\n", logits[vocab.token_to_id.at("And")]);
-    //printf("logits[\" and\"] = %f\n", logits[vocab.token_to_id.at(" and")]);
-    //printf("logits[\" And\"] = %f\n", logits[vocab.token_to_id.at(" And")]);
-    //printf("logits[\" so\"]  = %f\n", logits[vocab.token_to_id.at(" so")]);
+            if (decoder.completed || decoder.failed) {
+                continue;
+            }
 
-    //printf("logprobs[\"and\"]  = %f\n", logprobs[vocab.token_to_id.at("and")]);
-    //printf("logprobs[\"And\"]  = %f\n", logprobs[vocab.token_to_id.at("And")]);
-    //printf("logprobs[\" and\"] = %f\n", logprobs[vocab.token_to_id.at(" and")]);
-    //printf("logprobs[\" And\"] = %f\n", logprobs[vocab.token_to_id.at(" And")]);
-    //printf("logprobs[\" so\"]  = %f\n", logprobs[vocab.token_to_id.at(" so")]);
+            switch (params.strategy) {
+                case whisper_sampling_strategy::WHISPER_SAMPLING_GREEDY:
+                    {
+                        if (t_cur < 1e-6f) {
+                            decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, *state, decoder, true));
+                        } else {
+                            decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, *state, decoder, false));
+                        }
 
-    //printf("probs[\"and\"]  = %f\n", probs[vocab.token_to_id.at("and")]);
-    //printf("probs[\"And\"]  = %f\n", probs[vocab.token_to_id.at("And")]);
-    //printf("probs[\" and\"] = %f\n", probs[vocab.token_to_id.at(" and")]);
-    //printf("probs[\" And\"] = %f\n", probs[vocab.token_to_id.at(" And")]);
-    //printf("probs[\" so\"]  = %f\n", probs[vocab.token_to_id.at(" so")]);
-#endif
-}
+                        decoder.sequence.sum_logprobs_all += decoder.sequence.tokens.back().plog;
+                    } break;
+                case whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH:
+                    {
+                        whisper_sample_token_topk(*ctx, *state, decoder, params.beam_search.beam_size, state->beam_tokens);
 
-static whisper_token_data whisper_sample_token(
-            whisper_context & ctx,
-              whisper_state & state,
-      const whisper_decoder & decoder,
-                       bool   best) {
-    whisper_token_data result = {
-        0, 0, 0.0f, 0.0f, 0.0f, 0.0f, -1, -1, 0.0f,
-    };
+                        for (const auto & token : state->beam_tokens) {
+                            beam_candidates.push_back({ j, decoder.seek_delta, decoder.has_ts, token, decoder.sequence.sum_logprobs_all + token.plog });
 
-    const auto & vocab = ctx.vocab;
+                            //WHISPER_PRINT_DEBUG("%s: beam candidate: %s (%f, %f)\n", __func__, ctx->vocab.id_to_token.at(token.id).c_str(), token.plog, beam_candidates.back().sum_logprobs_all);
+                        }
+                    } break;
+            };
+        }
 
-    const auto & probs    = decoder.probs;
-    const auto & logprobs = decoder.logprobs;
+        // for beam-search, choose the top candidates and update the KV caches
+        if (params.strategy == whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH) {
+            std::sort(
+                    beam_candidates.begin(),
+                    beam_candidates.end(),
+                    [](const beam_candidate & a, const beam_candidate & b) {
+                return a.sum_logprobs_all > b.sum_logprobs_all;
+            });
 
-    const int n_logits = vocab.n_vocab;
+            uint32_t cur_c = 0;
 
-    {
-        double sum_ts = 0.0;
-        double max_ts = 0.0;
+            auto & decoder_idx = state->beam_src;
+            decoder_idx.assign(n_decoders_cur, -1);
 
-        for (int i = vocab.token_beg; i < n_logits; i++) {
-            if (probs[i] == -INFINITY) {
-                continue;
+            // the candidates continue the sequences from before the update
+            auto & sequences = state->beam_sequences;
+            for (int j = 0; j < n_decoders_cur; ++j) {
+                sequences[j] = state->decoders[j].sequence;
             }
 
-            sum_ts += probs[i];
-            if (max_ts < probs[i]) {
-                max_ts = probs[i];
-                result.tid = i;
-            }
-        }
+            for (int j = 0; j < n_decoders_cur; ++j) {
+                auto & decoder = state->decoders[j];
 
-        result.pt    = max_ts/(sum_ts + 1e-10);
-        result.ptsum = sum_ts;
-    }
+                // with patience, the slots of the finished hypotheses take new beams
+                if ((decoder.completed && !beam_patience) || decoder.failed) {
+                    continue;
+                }
 
-    if (best) {
-        for (int i = 0; i < n_logits; ++i) {
-            if (result.p < probs[i]) {
-                result.id   = i;
-                result.p    = probs[i];
-                result.plog = logprobs[i];
+                if (cur_c >= beam_candidates.size()) {
+                    cur_c = 0;
+                }
+
+                auto & cur = beam_candidates[cur_c++];
+
+                while (beam_candidates.size() > cur_c && beam_candidates[cur_c].sum_logprobs_all == cur.sum_logprobs_all && i > 0) {
+                    ++cur_c;
+                }
+
+                decoder.sequence = sequences[cur.decoder_idx];
+                decoder.sequence.tokens.push_back(cur.token);
+                decoder.sequence.sum_logprobs_all = cur.sum_logprobs_all;
+
+                decoder.seek_delta = cur.seek_delta;
+                decoder.has_ts     = cur.has_ts;
+
+                if (decoder.completed) {
+                    decoder.completed = false;
+                    decoder.kv_self.n = state->decoders[cur.decoder_idx].kv_self.n;
+                }
+
+                decoder_idx[j] = cur.decoder_idx;
+                WHISPER_PRINT_DEBUG("%s: beam search: decoder %d: from decoder %d: token = %10s, plog = %8.5f, sum_logprobs = %8.5f\n",
+                        __func__, j, cur.decoder_idx, ctx->vocab.id_to_token.at(decoder.sequence.tokens.back().id).c_str(), decoder.sequence.tokens.back().plog, decoder.sequence.sum_logprobs_all);
             }
+
+            // update KV caches
+            whisper_kv_swap_fast(decoder_idx, state->decoders, state->kv_swap_bufs, state->kv_swap_scratch, n_decoders_cur);
         }
-    } else {
-        std::discrete_distribution<> dist(probs.begin(), probs.end());
 
-        result.id   = dist(state.rng);
-        result.p    = probs[result.id];
-        result.plog = logprobs[result.id];
-    }
+        // update the decoder state
+        // - check if the sequence is completed
+        // - check if the sequence is failed
+        // - update sliding window based on timestamp tokens
+        for (int j = 0; j < n_decoders_cur; ++j) {
+            auto & decoder = state->decoders[j];
 
-    if (result.id >= vocab.token_beg) {
-        result.tid = result.id;
-        result.pt  = result.p;
-    }
+            if (decoder.completed || decoder.failed) {
+                continue;
+            }
 
-    state.n_sample++;
+            auto & has_ts     = decoder.has_ts;
+            auto & failed     = decoder.failed;
+            auto & completed  = decoder.completed;
+            auto & seek_delta = decoder.seek_delta;
+            auto & result_len = decoder.sequence.result_len;
 
-    return result;
-}
+            {
+                const auto & token = decoder.sequence.tokens.back();
 
-static std::vector<whisper_token_data> whisper_sample_token_topk(
-            whisper_context & ctx,
-              whisper_state & state,
-      const whisper_decoder & decoder,
-                        int   k) {
-    const auto & vocab = ctx.vocab;
+                // timestamp token - update sliding window
+                if (token.id > whisper_token_beg(ctx)) {
+                    const int seek_delta_new = 2*(token.id - whisper_token_beg(ctx));
 
-    const auto & probs    = decoder.probs;
-    const auto & logits   = decoder.logits;
-    const auto & logprobs = decoder.logprobs;
+                    // do not allow to go back in time
+                    if (has_ts && seek_delta > seek_delta_new && result_len < i) {
+                        failed = true; // TODO: maybe this is not a failure ?
+                        continue;
+                    }
 
-    const int n_logits = vocab.n_vocab;
+                    seek_delta = seek_delta_new;
+                    result_len = i + 1;
+                    has_ts = true;
+                }
 
-    auto & logits_id = state.logits_id;
+                whisper_grammar_accept_token(*ctx, decoder.grammar, token.id);
 
-    logits_id.resize(n_logits);
-    for (int i = 0; i < n_logits; ++i) {
-        logits_id[i].first = logits[i];
-        logits_id[i].second = i;
-    }
+#ifdef WHISPER_DEBUG
+                {
+                    const auto tt = token.pt > 0.10 ? ctx->vocab.id_to_token.at(token.tid) : "[?]";
+                    WHISPER_PRINT_DEBUG("%s: id = %3d, decoder = %d, token = %6d, p = %6.3f, ts = %10s, %6.3f, result_len = %4d '%s'\n",
+                            __func__, i, j, token.id, token.p, tt.c_str(), token.pt, result_len, ctx->vocab.id_to_token.at(token.id).c_str());
+                }
+#endif
 
-    {
-        using pair_type = std::remove_reference<decltype(logits_id)>::type::value_type;
-        std::partial_sort(
-                logits_id.begin(),
-                logits_id.begin() + k, logits_id.end(),
-                [](const pair_type & a, const pair_type & b) {
-            return a.first > b.first;
-        });
-    }
+                // end of segment
+                if (token.id == whisper_token_eot(ctx) ||               // end of text token
+                   (params.max_tokens > 0 && i >= params.max_tokens) || // max tokens per segment reached
+                   (has_ts && seek + seek_delta + 100 >= seek_end)      // end of audio reached
+                   ) {
+                    if (result_len == 0) {
+                        if (seek + seek_delta + 100 >= seek_end) {
+                            result_len = i + 1;
+                        } else {
+                            failed = true;
+                            continue;
+                        }
+                    }
 
-    std::vector<whisper_token_data> result;
-    result.reserve(k);
+                    if (params.single_segment) {
+                        result_len = i + 1;
+                        seek_delta = 100*WHISPER_CHUNK_SIZE;
+                    }
 
-    whisper_token tid = vocab.token_beg;
+                    completed = true;
+                    continue;
+                }
 
-    float pt    = 0.0;
-    float ptsum = 0.0;
+                // TESTS: if no tensors are loaded, it means we are running tests
+                if (ctx->model.n_loaded == 0) {
+                    seek_delta = 100*WHISPER_CHUNK_SIZE;
+                    completed = true;
+                    continue;
+                }
+            }
 
-    {
-        double sum_ts = 0.0;
-        double max_ts = 0.0;
+            // sometimes, the decoding can get stuck in a repetition loop
+            // this is an attempt to mitigate such cases - we flag the decoding as failed and use a fallback strategy
+            if (i == n_max - 1 && (result_len == 0 || seek_delta < 100*WHISPER_CHUNK_SIZE/2)) {
+                failed = true;
+                continue;
+            }
 
-        for (int i = vocab.token_beg; i < n_logits; i++) {
-            if (probs[i] == -INFINITY) {
+            // [EXPERIMENTAL] do not wait for n_max to detect the loop
+            if (params.loop_detect && whisper_sequence_looping(params, decoder.sequence)) {
+                WHISPER_PRINT_DEBUG("%s: decoder %2d: repetition loop detected after %d tokens\n", __func__, j, i + 1);
+
+                failed = true;
+                state->n_fail_h++;
                 continue;
             }
+        }
 
-            sum_ts += probs[i];
-            if (max_ts < probs[i]) {
-                max_ts = probs[i];
-                tid = i;
+        // move the hypotheses finished at this step out of the beams
+        if (beam_patience) {
+            for (int j = 0; j < n_decoders_cur; ++j) {
+                auto & decoder = state->decoders[j];
+
+                if (decoder.completed) {
+                    auto & hyp = beam_finished[n_finished++];
+
+                    hyp.decoder_idx = j;
+                    hyp.seek_delta  = decoder.seek_delta;
+                    hyp.has_ts      = decoder.has_ts;
+
+                    // the slot of the decoder takes a new beam at the next step, which overwrites its sequence
+                    std::swap(hyp.sequence, decoder.sequence);
+                }
             }
         }
 
-        pt    = max_ts/(sum_ts + 1e-10);
-        ptsum = sum_ts;
-    }
+        // check if all decoders have finished (i.e. completed or failed)
+        {
+            bool completed_all = true;
 
-    std::discrete_distribution<> dist(probs.begin(), probs.end());
+            for (int j = 0; j < n_decoders_cur; ++j) {
+                auto & decoder = state->decoders[j];
 
-    for (int i = 0; i < k; ++i) {
-        const auto id = dist(state.rng);
-        //printf("XXX %d %d %f %f %f %f\n", id, tid, probs[id], logprobs[id], pt, ptsum);
+                if (decoder.completed || decoder.failed) {
+                    continue;
+                }
 
-        result.push_back({ id, tid, probs[id], logprobs[id], pt, ptsum, -1, -1, 0.0f, });
+                completed_all = false;
+            }
 
-        if (result[i].id >= vocab.token_beg) {
-            result[i].tid = result[i].id;
-            result[i].pt  = result[i].p;
+            if (completed_all) {
+                break;
+            }
+
+            // early stopping - enough hypotheses are finished
+            if (beam_patience && n_finished >= n_finished_max) {
+                WHISPER_PRINT_DEBUG("%s: beam search: %d finished hypotheses after %d tokens\n", __func__, n_finished, i + 1);
+                break;
+            }
         }
-    }
 
-    state.n_sample++;
+        state->t_sample_us += ggml_time_us() - t_start_sample_us;
 
-    return result;
-}
+        // obtain logits for the next token
+        for (int j = 0; j < n_decoders_cur; ++j) {
+            auto & decoder = state->decoders[j];
 
-// ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L178-L192
-static void whisper_sequence_score(
-        const struct whisper_full_params & params,
-                        whisper_sequence & sequence) {
-    if (sequence.result_len == 0) {
-        return;
-    }
+            if (decoder.failed || decoder.completed) {
+                continue;
+            }
 
-    double result = 0.0f;
+            decoder.tokens_tmp.resize(1);
+            decoder.tokens_tmp[0] = decoder.sequence.tokens.back().id;
 
-    for (int i = 0; i < sequence.result_len; ++i) {
-        result += sequence.tokens[i].plog;
-    }
+            //WHISPER_PRINT_DEBUG("%s: decoder %d: token %d, kv_self.n %d, seek_delta %d\n", __func__, j, decoder.tokens_tmp[0], decoder.kv_self.n, decoder.seek_delta);
 
-    sequence.sum_logprobs = result;
-    sequence.avg_logprobs = result/sequence.result_len;
+            if (speculate) {
+                const int n_vocab = ctx->vocab.n_vocab;
 
-    double penalty = sequence.result_len;
+                if (i_draft < (int) draft_tokens.size() && draft_tokens[i_draft] == decoder.tokens_tmp[0]) {
+                    // the sampled token matches the draft - its logits were computed by the last verification pass
+                    ++i_draft;
+                    state->logits.assign(draft_logits.begin() + i_draft*n_vocab, draft_logits.begin() + (i_draft + 1)*n_vocab);
+                    state->n_draft_accept++;
+                } else {
+                    // draft new tokens and verify them together with the sampled token in a single pass
+                    const int n_draft = std::min(n_draft_max, whisper_n_text_ctx(ctx) - decoder.kv_self.n - 1);
 
-    if (params.length_penalty > 0.0f) {
-        penalty = pow((5.0 + penalty)/6.0, params.length_penalty);
-    }
+                    draft_tokens.clear();
 
-    sequence.score = result/penalty;
+                    if (n_draft > 0) {
+                        spec.context.assign(prompt.begin(), prompt.end());
+                        for (const auto & token : decoder.sequence.tokens) {
+                            spec.context.push_back(token.id);
+                        }
+                    }
 
-    // compute the entropy of the sequence of the last 32 tokens
-    {
-        const int n = 32;
+                    if (n_draft > 0 && draft_ngram > 0) {
+                        whisper_draft_lookup(spec.context, draft_ngram, n_draft, draft_tokens);
+                    }
 
-        int cnt = 0;
-        double entropy = 0.0f;
+                    if (n_draft > 0 && draft_tokens.empty() && draft_state != nullptr) {
+                        if (!whisper_draft_tokens(*params.draft_ctx, *draft_state, params, spec.context, decoder.sequence, draft_past, n_draft, n_threads, draft_tokens)) {
+                            WHISPER_LOG_ERROR("%s: failed to decode with the draft model\n", __func__);
+                            return -8;
+                        }
+                    }
 
-        std::map<whisper_token, int> token_counts;
-        for (int i = std::max(0, sequence.result_len - n); i < sequence.result_len; ++i) {
-            token_counts[sequence.tokens[i].id]++;
-            cnt++;
-        }
+                    decoder.tokens_tmp.insert(decoder.tokens_tmp.end(), draft_tokens.begin(), draft_tokens.end());
 
-        for (const auto & kv : token_counts) {
-            const auto p = kv.second/(double)cnt;
-            entropy -= p*log(p);
+                    if (!whisper_decode_internal(*ctx, *state, decoder, decoder.tokens_tmp.data(), decoder.tokens_tmp.size(), decoder.kv_self.n, true, n_threads, abort_callback, abort_callback_user_data)) {
+                        if (whisper_fallback_cancelled(abort_callback, abort_callback_user_data)) {
+                            return WHISPER_FALLBACK_CANCELLED;
+                        }
+                        WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
+                        return -8;
+                    }
 
-            //WHISPER_PRINT_DEBUG("entropy: %d %f %f, count %d\n", kv.first, p, log(p), kv.second);
-        }
+                    draft_logits.swap(state->logits);
+                    state->logits.assign(draft_logits.begin(), draft_logits.begin() + n_vocab);
+                    state->n_draft += draft_tokens.size();
 
-        sequence.entropy = entropy;
-    }
-}
+                    i_draft = 0;
+                }
+            } else if (!whisper_decode_internal(*ctx, *state, decoder, decoder.tokens_tmp.data(), decoder.tokens_tmp.size(), decoder.kv_self.n, false, n_threads, abort_callback, abort_callback_user_data)) {
+                if (whisper_fallback_cancelled(abort_callback, abort_callback_user_data)) {
+                    return WHISPER_FALLBACK_CANCELLED;
+                }
+                WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
+                return -8;
+            }
 
-static bool whisper_kv_swap_fast(
-                   std::vector<int> & view,
-                    whisper_decoder   src[],
-                std::vector<kv_buf> & kv_swap_bufs,
-                          const int & n_decoders) {
-    WHISPER_PRINT_DEBUG("%s: n_decoders %d\n", __func__, n_decoders);
+            {
+                const int64_t t_start_sample_us = ggml_time_us();
+
+                whisper_process_logits(*ctx, *state, params, decoder, t_cur);
 
-    // (decoder->buffer->decoder or decoder->buffer + decoder->decoder)
-    std::set<int> two_copy; // decoder indices require two copies to safely modify KV caches
+                ++decoder.kv_self.n;
 
-    // (buffer->decoder or decoder->decoder)
-    std::set<int> one_copy; // decoder indices require one copy to safely modify KV caches
+                state->t_sample_us += ggml_time_us() - t_start_sample_us;
+            }
+        }
+    }
 
-    // (decoder<->decoder)
-    std::set<int> p_swap_set; // decoder indices able to swap KV-cache pointers
-    std::vector<whisper_pair<int, int>> p_swap_vec;
-    p_swap_vec.reserve(n_decoders);
+    // with patience, the finished hypotheses are ranked instead of the beams
+    if (beam_patience && n_finished > 0) {
+        for (int k = 0; k < n_finished; ++k) {
+            auto & hyp = beam_finished[k];
 
-    // see https://github.com/ggerganov/whisper.cpp/wiki
-    for (int i = 0; i < n_decoders; i++) {
-        // zero-copy (no modification)
-        if (i == view[i] || view[i] < 0) {
-            continue;
+            hyp.sequence.tokens.resize(hyp.sequence.result_len);
+            whisper_sequence_score(params, hyp.sequence);
         }
 
-        bool is_one_copy = true;
-        // since we modify data sequentially, we only consider decoder indices after current index
-        for (int j = i + 1; j < n_decoders; j++) {
-            if (i == view[j]) {
-                // detect symmetric diagram
-                if (j == view[i]) {
-                    p_swap_set.insert(i);
-                    p_swap_set.insert(j);
-                    p_swap_vec.emplace_back(i, j);
-                } else {
-                    two_copy.insert(i);
-                    is_one_copy = false;
-                }
-                break;
+        std::stable_sort(beam_finished.begin(), beam_finished.begin() + n_finished, [](const beam_hypothesis & a, const beam_hypothesis & b) {
+            return a.sequence.score > b.sequence.score;
+        });
+
+        for (int j = 0; j < n_decoders_cur; ++j) {
+            auto & decoder = state->decoders[j];
+
+            if (j < n_finished) {
+                std::swap(decoder.sequence, beam_finished[j].sequence);
+                decoder.seek_delta = beam_finished[j].seek_delta;
+                decoder.has_ts     = beam_finished[j].has_ts;
+                decoder.completed  = true;
+                decoder.failed     = false;
+            } else {
+                decoder.failed = true;
             }
         }
-        if (is_one_copy) {
-            one_copy.insert(i);
-        }
     }
 
-    kv_swap_bufs.resize(n_decoders);
+    // rank the resulting sequences and select the best one
+    {
+        double best_score = -INFINITY;
 
-    for (int i = 0; i < n_decoders; i++) {
-        kv_swap_bufs[i].k.resize(ggml_nbytes(src[i].kv_self.k));
-        kv_swap_bufs[i].v.resize(ggml_nbytes(src[i].kv_self.v));
-    }
+        for (int j = 0; j < n_decoders_cur; ++j) {
+            auto & decoder = state->decoders[j];
 
-    for (auto & i : two_copy) {
-        // make a copy of KV caches
-        WHISPER_PRINT_DEBUG("%s: store KV cache into swap: idx %d\n", __func__, i);
-        //memcpy(kv_swap_bufs[i].k.data(), src[i].kv_self.k->data, kv_swap_bufs[i].k.size());
-        //memcpy(kv_swap_bufs[i].v.data(), src[i].kv_self.v->data, kv_swap_bufs[i].v.size());
-        ggml_backend_tensor_get(src[i].kv_self.k, kv_swap_bufs[i].k.data(), 0, kv_swap_bufs[i].k.size());
-        ggml_backend_tensor_get(src[i].kv_self.v, kv_swap_bufs[i].v.data(), 0, kv_swap_bufs[i].v.size());
-    }
+            if (decoder.failed) {
+                continue;
+            }
 
-    // since two-copy decoder KV caches are protected by kv_swap_bufs, modify them first
-    for (auto & i : two_copy) {
-        // skip the decoder indices that require pointer swapping
-        if (p_swap_set.find(i) != p_swap_set.end()) {
-            continue;
-        }
+            decoder.sequence.tokens.resize(decoder.sequence.result_len);
+            whisper_sequence_score(params, decoder.sequence);
 
-        if (two_copy.find(view[i]) != two_copy.end()) {
-            // modify KV caches of decoder using data from kv_swap_bufs
-            WHISPER_PRINT_DEBUG("%s: two-copy decoder using   swap buffers: swap[%d] -> %d\n", __func__, view[i], i);
-            //memcpy(src[i].kv_self.k->data, kv_swap_bufs[view[i]].k.data(), kv_swap_bufs[view[i]].k.size());
-            //memcpy(src[i].kv_self.v->data, kv_swap_bufs[view[i]].v.data(), kv_swap_bufs[view[i]].v.size());
-            ggml_backend_tensor_set(src[i].kv_self.k, kv_swap_bufs[view[i]].k.data(), 0, kv_swap_bufs[view[i]].k.size());
-            ggml_backend_tensor_set(src[i].kv_self.v, kv_swap_bufs[view[i]].v.data(), 0, kv_swap_bufs[view[i]].v.size());
-        } else {
-            // modify KV caches of decoder using data from correspond decoder KV caches directly
-            WHISPER_PRINT_DEBUG("%s: two-copy decoder without swap buffers:      %d  -> %d\n", __func__, view[i], i);
-            //memcpy(src[i].kv_self.k->data, src[view[i]].kv_self.k->data, ggml_nbytes(src[view[i]].kv_self.k));
-            //memcpy(src[i].kv_self.v->data, src[view[i]].kv_self.v->data, ggml_nbytes(src[view[i]].kv_self.v));
-            ggml_backend_tensor_copy(src[view[i]].kv_self.k, src[i].kv_self.k);
-            ggml_backend_tensor_copy(src[view[i]].kv_self.v, src[i].kv_self.v);
-        }
-    }
+            WHISPER_PRINT_DEBUG("%s: decoder %2d: score = %8.5f, result_len = %3d, avg_logprobs = %8.5f, entropy = %8.5f\n",
+                    __func__, j, decoder.sequence.score, decoder.sequence.result_len, decoder.sequence.avg_logprobs, decoder.sequence.entropy);
 
-    // then modify one-copy decoder KV caches
-    for (auto & i : one_copy) {
-        // skip the decoder indices that require pointer swapping
-        if (p_swap_set.find(i) != p_swap_set.end()) {
-            continue;
-        }
+            if (decoder.sequence.result_len > 32 && decoder.sequence.entropy < params.entropy_thold) {
+                WHISPER_PRINT_DEBUG("%s: decoder %2d: failed due to entropy %8.5f < %8.5f\n",
+                        __func__, j, decoder.sequence.entropy, params.entropy_thold);
 
-        if (two_copy.find(view[i]) != two_copy.end()) {
-            // modify KV caches of decoder using data from kv_swap_bufs
-            WHISPER_PRINT_DEBUG("%s: one-copy decoder using   swap buffers: swap[%d] -> %d\n", __func__, view[i], i);
-            //memcpy(src[i].kv_self.k->data, kv_swap_bufs[view[i]].k.data(), kv_swap_bufs[view[i]].k.size());
-            //memcpy(src[i].kv_self.v->data, kv_swap_bufs[view[i]].v.data(), kv_swap_bufs[view[i]].v.size());
-            ggml_backend_tensor_set(src[i].kv_self.k, kv_swap_bufs[view[i]].k.data(), 0, kv_swap_bufs[view[i]].k.size());
-            ggml_backend_tensor_set(src[i].kv_self.v, kv_swap_bufs[view[i]].v.data(), 0, kv_swap_bufs[view[i]].v.size());
-        } else {
-            // modify KV caches of decoder using data from correspond decoder KV caches directly
-            WHISPER_PRINT_DEBUG("%s: one-copy decoder without swap buffers:      %d  -> %d\n", __func__, view[i], i);
-            //memcpy(src[i].kv_self.k->data, src[view[i]].kv_self.k->data, ggml_nbytes(src[view[i]].kv_self.k));
-            //memcpy(src[i].kv_self.v->data, src[view[i]].kv_self.v->data, ggml_nbytes(src[view[i]].kv_self.v));
-            ggml_backend_tensor_copy(src[view[i]].kv_self.k, src[i].kv_self.k);
-            ggml_backend_tensor_copy(src[view[i]].kv_self.v, src[i].kv_self.v);
+                decoder.failed = true;
+                state->n_fail_h++;
+
+                continue;
+            }
+
+            if (best_score < decoder.sequence.score) {
+                best_score = decoder.sequence.score;
+                best_decoder_id = j;
+            }
         }
-    }
 
-    // swap the pointers
-    for (auto & i : p_swap_vec) {
-        WHISPER_PRINT_DEBUG("%s: swap pointers: %d <-> %d\n", __func__, i.first, i.second);
-        std::swap(src[i.first].kv_self, src[i.second].kv_self);
+        WHISPER_PRINT_DEBUG("%s: best decoder = %d\n", __func__, best_decoder_id);
     }
 
-    return true;
+    return 0;
 }
 
 int whisper_full_with_state(
@@ -4927,6 +7427,9 @@ int whisper_full_with_state(
 
     result_all.clear();
 
+    const int n_threads_encode = params.n_threads_encode > 0 ? params.n_threads_encode : params.n_threads;
+    const int n_threads_mel    = params.n_threads_mel    > 0 ? params.n_threads_mel    : params.n_threads;
+
     if (n_samples > 0) {
         // compute log mel spectrogram
         if (params.speed_up) {
@@ -4934,18 +7437,49 @@ int whisper_full_with_state(
             WHISPER_LOG_ERROR("%s: failed to compute log mel spectrogram\n", __func__);
             return -1;
         } else {
-            if (whisper_pcm_to_mel_with_state(ctx, state, samples, n_samples, params.n_threads) != 0) {
+            if (whisper_pcm_to_mel_with_state(ctx, state, samples, n_samples, n_threads_mel) != 0) {
                 WHISPER_LOG_ERROR("%s: failed to compute log mel spectrogram\n", __func__);
                 return -2;
             }
         }
     }
 
+    // overwrite audio_ctx, max allowed is hparams.n_audio_ctx
+    if (params.audio_ctx > whisper_n_audio_ctx(ctx)) {
+        WHISPER_LOG_ERROR("%s: audio_ctx is larger than the maximum allowed (%d > %d)\n", __func__, params.audio_ctx, whisper_n_audio_ctx(ctx));
+        return -5;
+    }
+    state->exp_n_audio_ctx = params.audio_ctx;
+
+    // with audio_ctx_auto the audio context changes from window to window, the state is left with params.audio_ctx
+    // so that a later whisper_encode() or whisper_score_phrases() does not inherit the context of the last window
+    struct whisper_audio_ctx_restore {
+        whisper_state * state;
+        int32_t         audio_ctx;
+        ~whisper_audio_ctx_restore() {
+            state->exp_n_audio_ctx = audio_ctx;
+        }
+    } audio_ctx_restore = { state, params.audio_ctx };
+
+    const int seek_start = params.offset_ms/10;
+    const int seek_end = params.duration_ms == 0 ? whisper_n_len_from_state(state) : seek_start + params.duration_ms/10;
+
     // auto-detect language if not specified
     if (params.language == nullptr || strlen(params.language) == 0 || strcmp(params.language, "auto") == 0 || params.detect_language) {
         std::vector<float> probs(whisper_lang_max_id() + 1, 0.0f);
 
-        const auto lang_id = whisper_lang_auto_detect_with_state(ctx, state, 0, params.n_threads, probs.data());
+        // detect on the first window, encoded with the same audio context as in the main loop so that the
+        // encoder pass can be reused there. a smaller detect_audio_ctx trades detection accuracy for speed
+        if (params.detect_audio_ctx > 0) {
+            state->exp_n_audio_ctx = std::min(params.detect_audio_ctx, whisper_n_audio_ctx(ctx));
+        } else if (params.audio_ctx_auto) {
+            state->exp_n_audio_ctx = whisper_audio_ctx_auto(*ctx, seek_end - seek_start);
+        }
+
+        const auto lang_id = whisper_lang_auto_detect_with_state(ctx, state, params.offset_ms, n_threads_encode, probs.data());
+
+        state->exp_n_audio_ctx = params.audio_ctx;
+
         if (lang_id < 0) {
             WHISPER_LOG_ERROR("%s: failed to auto-detect language\n", __func__);
             return -3;
@@ -4968,9 +7502,6 @@ int whisper_full_with_state(
         }
     }
 
-    const int seek_start = params.offset_ms/10;
-    const int seek_end = params.duration_ms == 0 ? whisper_n_len_from_state(state) : seek_start + params.duration_ms/10;
-
     // if length of spectrogram is less than 1.0s (100 frames), then return
     // basically don't process anything that is less than 1.0s
     // see issue #39: https://github.com/ggerganov/whisper.cpp/issues/39
@@ -5005,25 +7536,8 @@ int whisper_full_with_state(
 
     n_decoders = std::max(1, n_decoders);
 
-    // TAGS: WHISPER_DECODER_INIT
-    for (int j = 1; j < n_decoders; j++) {
-        auto & decoder = state->decoders[j];
-
-        if (decoder.kv_self.ctx == nullptr) {
-            decoder.kv_self = state->decoders[0].kv_self;
-            if (!kv_cache_reinit(decoder.kv_self, ctx->backend)) {
-                WHISPER_LOG_ERROR("%s: kv_cache_reinit() failed for self-attention, decoder %d\n", __func__, j);
-                return -4;
-            }
-
-            WHISPER_PRINT_DEBUG("%s: initialized self-attention kv cache, decoder %d\n", __func__, j);
-
-            decoder.sequence.tokens.reserve(state->decoders[0].sequence.tokens.capacity());
-
-            decoder.probs.resize   (ctx->vocab.n_vocab);
-            decoder.logits.resize  (ctx->vocab.n_vocab);
-            decoder.logprobs.resize(ctx->vocab.n_vocab);
-        }
+    if (!whisper_decoders_init(*ctx, *state, n_decoders)) {
+        return -4;
     }
 
     // the accumulated text context so far
@@ -5054,479 +7568,380 @@ int whisper_full_with_state(
         }
     }
 
-    // overwrite audio_ctx, max allowed is hparams.n_audio_ctx
-    if (params.audio_ctx > whisper_n_audio_ctx(ctx)) {
-        WHISPER_LOG_ERROR("%s: audio_ctx is larger than the maximum allowed (%d > %d)\n", __func__, params.audio_ctx, whisper_n_audio_ctx(ctx));
-        return -5;
-    }
-    state->exp_n_audio_ctx = params.audio_ctx;
+    // [EXPERIMENTAL] speculative decoding - the draft model works on the same mel
+    whisper_state * draft_state = nullptr;
 
-    // these tokens determine the task that will be performed
-    std::vector<whisper_token> prompt_init = { whisper_token_sot(ctx), };
+    if (params.draft_ctx != nullptr && params.draft_n_tokens > 0 && params.strategy == WHISPER_SAMPLING_GREEDY) {
+        const auto & hparams       = ctx->model.hparams;
+        const auto & hparams_draft = params.draft_ctx->model.hparams;
 
-    if (whisper_is_multilingual(ctx)) {
-        const int lang_id = whisper_lang_id(params.language);
-        state->lang_id = lang_id;
-        prompt_init.push_back(whisper_token_lang(ctx, lang_id));
-        if (params.translate) {
-            prompt_init.push_back(whisper_token_translate(ctx));
-        } else {
-            prompt_init.push_back(whisper_token_transcribe(ctx));
+        if (params.draft_ctx->state == nullptr || params.draft_ctx->state == state) {
+            WHISPER_LOG_ERROR("%s: the draft context needs a state of its own\n", __func__);
+            return -9;
         }
-    }
 
-    // distilled models require the "no_timestamps" token
-    {
-        const bool is_distil = ctx->model.hparams.n_text_layer == 2;
-        if (is_distil && !params.no_timestamps) {
-            WHISPER_LOG_WARN("%s: using distilled model - forcing no_timestamps\n", __func__);
-            params.no_timestamps = true;
+        if (hparams_draft.n_vocab != hparams.n_vocab || hparams_draft.n_mels != hparams.n_mels || hparams_draft.n_audio_ctx != hparams.n_audio_ctx) {
+            WHISPER_LOG_ERROR("%s: the draft model is not compatible with the model (n_vocab = %d / %d, n_mels = %d / %d)\n", __func__,
+                    hparams_draft.n_vocab, hparams.n_vocab, hparams_draft.n_mels, hparams.n_mels);
+            return -9;
         }
-    }
 
-    if (params.no_timestamps) {
-        prompt_init.push_back(whisper_token_not(ctx));
+        draft_state = params.draft_ctx->state;
+        draft_state->mel = state->mel;
     }
 
-    int seek = seek_start;
-
-    std::vector<whisper_token> prompt;
-    prompt.reserve(whisper_n_text_ctx(ctx));
-
-    struct beam_candidate {
-        int decoder_idx;
-        int seek_delta;
+    whisper_speculation spec;
 
-        bool has_ts;
+    spec.state = draft_state;
+    spec.n_max = std::min(params.draft_n_tokens, WHISPER_MAX_DRAFT);
+    spec.ngram = params.strategy == WHISPER_SAMPLING_GREEDY && spec.n_max > 0 ? params.draft_ngram : 0;
 
-        whisper_sequence sequence;
-    };
-
-    std::vector<beam_candidate> beam_candidates;
-
-    // main loop
-    while (true) {
-        if (params.progress_callback) {
-            const int progress_cur = (100*(seek - seek_start))/(seek_end - seek_start);
+    if (spec.state != nullptr || spec.ngram > 0) {
+        spec.context.reserve(whisper_n_text_ctx(ctx));
+    }
 
-            params.progress_callback(
-                ctx, ctx->state, progress_cur, params.progress_callback_user_data);
-        }
+    // [EXPERIMENTAL] pipelined encoding - the threads are taken from n_threads while decoding
+    int n_threads_encode_next = 0;
 
-        // of only 1 second left, then stop
-        if (seek + 100 >= seek_end) {
-            break;
-        }
+    if (params.n_threads_encode_next > 0 && params.n_threads > 1 && ggml_backend_is_cpu(state->backend) && !whisper_encode_external(*state)) {
+        n_threads_encode_next = std::min(params.n_threads_encode_next, params.n_threads - 1);
 
-        if (params.encoder_begin_callback) {
-            if (params.encoder_begin_callback(ctx, state, params.encoder_begin_callback_user_data) == false) {
-                WHISPER_LOG_ERROR("%s: encoder_begin_callback returned false - aborting\n", __func__);
-                break;
+        if (state->kv_cross_next.ctx == nullptr) {
+            if (!kv_cache_init(ctx->model.hparams, state->kv_cross_next, ctx->backend, ctx->itype, ctx->model.hparams.n_audio_ctx)) {
+                WHISPER_LOG_ERROR("%s: kv_cache_init() failed for the pipelined cross-attention cache\n", __func__);
+                return -10;
             }
-        }
-
-        // encode audio features starting at offset seek
-        if (!whisper_encode_internal(*ctx, *state, seek, params.n_threads, params.abort_callback, params.abort_callback_user_data)) {
-            WHISPER_LOG_ERROR("%s: failed to encode\n", __func__);
-            return -6;
-        }
 
-        // if there is a very short audio segment left to process, we remove any past prompt since it tends
-        // to confuse the decoder and often make it repeat or hallucinate stuff
-        if (seek > seek_start && seek + 500 >= seek_end) {
-            prompt_past.clear();
+            whisper_state_numa_place(*state, state->kv_cross_next.buffer);
         }
+    }
 
-        int best_decoder_id = 0;
-
-        for (int it = 0; it < (int) temperatures.size(); ++it) {
-            const float t_cur = temperatures[it];
-
-            int n_decoders_cur = 1;
-
-            switch (params.strategy) {
-                case whisper_sampling_strategy::WHISPER_SAMPLING_GREEDY:
-                    {
-                        if (t_cur > 0.0f) {
-                            n_decoders_cur = params.greedy.best_of;
-                        }
-                    } break;
-                case whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH:
-                    {
-                        if (t_cur > 0.0f) {
-                            n_decoders_cur = params.greedy.best_of;
-                        } else {
-                            n_decoders_cur = params.beam_search.beam_size;
-                        }
-                    } break;
-            };
-
-            n_decoders_cur = std::max(1, n_decoders_cur);
-
-            WHISPER_PRINT_DEBUG("\n%s: strategy = %d, decoding with %d decoders, temperature = %.2f\n", __func__, params.strategy, n_decoders_cur, t_cur);
-
-            // TAGS: WHISPER_DECODER_INIT
-            for (int j = 0; j < n_decoders_cur; ++j) {
-                auto & decoder = state->decoders[j];
-
-                decoder.kv_self.n = 0;
-
-                decoder.sequence.tokens.clear();
-                decoder.sequence.result_len       = 0;
-                decoder.sequence.sum_logprobs_all = 0.0;
-                decoder.sequence.sum_logprobs     = -INFINITY;
-                decoder.sequence.avg_logprobs     = -INFINITY;
-                decoder.sequence.entropy          = 0.0;
-                decoder.sequence.score            = -INFINITY;
+    // the pipelined encoder takes its threads from n_threads
+    int n_threads_decode = params.n_threads_decode > 0 ? params.n_threads_decode : params.n_threads;
 
-                decoder.seek_delta = 100*WHISPER_CHUNK_SIZE;
+    if (n_threads_encode_next > 0) {
+        n_threads_decode = std::min(n_threads_decode, params.n_threads - n_threads_encode_next);
+    }
 
-                decoder.failed    = false;
-                decoder.completed = false;
-                decoder.has_ts    = false;
+    // the encoder thread only touches the encoder buffers and kv_cross_next
+    std::thread encode_next;
 
-                if (params.grammar_rules != nullptr) {
-                    decoder.grammar = whisper_grammar_init(
-                        params.grammar_rules, params.n_grammar_rules, params.i_start_rule);
-                } else {
-                    decoder.grammar = {};
-                }
+    struct whisper_thread_join {
+        std::thread & thread;
+        ~whisper_thread_join() {
+            if (thread.joinable()) {
+                thread.join();
             }
+        }
+    } encode_next_join = { encode_next };
 
-            // init prompt and kv cache for the current iteration
-            // run whisper_decoder() only for decoder 0 and copy the results for the other decoders
-            {
-                prompt.clear();
-
-                // if we have already generated some text, use it as a prompt to condition the next generation
-                if (!prompt_past.empty() && t_cur < 0.5f && params.n_max_text_ctx > 0) {
-                    int n_take = std::min(std::min(params.n_max_text_ctx, whisper_n_text_ctx(ctx)/2), int(prompt_past.size()));
+    // [EXPERIMENTAL] concurrent fallback - the next temperatures are decoded on helper states that share the
+    // encoder output, while the current one is decoded on this state
+    int n_fallback_parallel = 0;
 
-                    prompt = { whisper_token_prev(ctx) };
-                    prompt.insert(prompt.begin() + 1, prompt_past.end() - n_take, prompt_past.end());
-                }
+    if (params.n_fallback_parallel > 0 && temperatures.size() > 1 && ggml_backend_is_cpu(state->backend)) {
+        n_fallback_parallel = std::min(params.n_fallback_parallel, (int) temperatures.size() - 1);
 
-                // init new transcription with sot, language (opt) and task tokens
-                prompt.insert(prompt.end(), prompt_init.begin(), prompt_init.end());
+        while ((int) state->fallback_states.size() < n_fallback_parallel) {
+            whisper_state * fstate = whisper_init_state(ctx, &state->kv_cross);
+            if (fstate == nullptr) {
+                WHISPER_LOG_ERROR("%s: failed to initialize the fallback state\n", __func__);
+                return -11;
+            }
 
-                // print the prompt
-                WHISPER_PRINT_DEBUG("\n\n");
-                for (int i = 0; i < (int) prompt.size(); i++) {
-                    WHISPER_PRINT_DEBUG("%s: prompt[%d] = %s\n", __func__, i, ctx->vocab.id_to_token.at(prompt[i]).c_str());
-                }
-                WHISPER_PRINT_DEBUG("\n\n");
+            // the fallback decoders share the CPUs of the state
+            if (state->numa_node >= 0 || !state->cpus.empty()) {
+                whisper_state_set_affinity(ctx, fstate, state->numa_node, state->cpus.data(), state->cpus.size(), false);
+            }
 
-                if (!whisper_decode_internal(*ctx, *state, state->decoders[0], prompt.data(), prompt.size(), 0, params.n_threads, params.abort_callback, params.abort_callback_user_data)) {
-                    WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
-                    return -7;
-                }
+            state->fallback_states.push_back(fstate);
+        }
 
-                {
-                    const int64_t t_start_sample_us = ggml_time_us();
+        for (int k = 0; k < n_fallback_parallel; ++k) {
+            if (!whisper_decoders_init(*ctx, *state->fallback_states[k], n_decoders)) {
+                return -4;
+            }
+        }
+    }
 
-                    whisper_process_logits(*ctx, *state, params, state->decoders[0], t_cur);
+    std::vector<std::thread>                fallback_workers(n_fallback_parallel);
+    std::vector<int>                        fallback_ret    (n_fallback_parallel + 1, 0);
+    std::vector<int>                        fallback_best   (n_fallback_parallel + 1, 0);
+    std::vector<std::vector<whisper_token>> fallback_prompt (n_fallback_parallel + 1);
+    std::vector<whisper_speculation>        fallback_spec   (n_fallback_parallel + 1);
 
-                    state->decoders[0].kv_self.n += prompt.size();
+    whisper_fallback_abort fallback_abort;
 
-                    for (int j = 1; j < n_decoders_cur; ++j) {
-                        auto & decoder = state->decoders[j];
+    fallback_abort.abort_callback           = params.abort_callback;
+    fallback_abort.abort_callback_user_data = params.abort_callback_user_data;
 
-                        // TODO: fix CUDA
-                        //memcpy(decoder.kv_self.k->data, state->decoders[0].kv_self.k->data, ggml_nbytes(decoder.kv_self.k));
-                        //memcpy(decoder.kv_self.v->data, state->decoders[0].kv_self.v->data, ggml_nbytes(decoder.kv_self.v));
-                        ggml_backend_tensor_copy(state->decoders[0].kv_self.k, decoder.kv_self.k);
-                        ggml_backend_tensor_copy(state->decoders[0].kv_self.v, decoder.kv_self.v);
+    // [EXPERIMENTAL] restricted output projection
+    struct whisper_vocab_reset {
+        whisper_state * state;
+        ~whisper_vocab_reset() {
+            state->vocab_active = false;
+            for (auto * fstate : state->fallback_states) {
+                fstate->vocab_active = false;
+            }
+        }
+    } vocab_reset = { state };
 
-                        decoder.kv_self.n += prompt.size();
+    if (params.vocab_tokens != nullptr && params.vocab_n_tokens > 0) {
+        std::vector<whisper_token> ids(params.vocab_tokens, params.vocab_tokens + params.vocab_n_tokens);
 
-                        memcpy(decoder.probs.data(),    state->decoders[0].probs.data(),    decoder.probs.size()*sizeof(decoder.probs[0]));
-                        memcpy(decoder.logits.data(),   state->decoders[0].logits.data(),   decoder.logits.size()*sizeof(decoder.logits[0]));
-                        memcpy(decoder.logprobs.data(), state->decoders[0].logprobs.data(), decoder.logprobs.size()*sizeof(decoder.logprobs[0]));
-                    }
+        // the segments must be able to end
+        ids.push_back(whisper_token_eot(ctx));
 
-                    state->t_sample_us += ggml_time_us() - t_start_sample_us;
-                }
+        if (!params.no_timestamps) {
+            for (whisper_token id = whisper_token_beg(ctx); id < whisper_n_vocab(ctx); ++id) {
+                ids.push_back(id);
             }
+        }
 
-            for (int i = 0, n_max = whisper_n_text_ctx(ctx)/2 - 4; i < n_max; ++i) {
-                const int64_t t_start_sample_us = ggml_time_us();
-
-                if (params.strategy == whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH) {
-                    beam_candidates.clear();
-                }
+        std::sort(ids.begin(), ids.end());
+        ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
 
-                // generate new sequence candidates for each decoder
-                for (int j = 0; j < n_decoders_cur; ++j) {
-                    auto & decoder = state->decoders[j];
+        if (ids.front() < 0 || ids.back() >= whisper_n_vocab(ctx)) {
+            WHISPER_LOG_ERROR("%s: vocab_tokens contains an invalid token\n", __func__);
+            return -12;
+        }
 
-                    if (decoder.completed || decoder.failed) {
-                        continue;
-                    }
+        if (!whisper_vocab_init(*ctx, *state, ids)) {
+            return -12;
+        }
 
-                    switch (params.strategy) {
-                        case whisper_sampling_strategy::WHISPER_SAMPLING_GREEDY:
-                            {
-                                if (t_cur < 1e-6f) {
-                                    decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, *state, decoder, true));
-                                } else {
-                                    decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, *state, decoder, false));
-                                }
+        state->vocab_active = true;
 
-                                decoder.sequence.sum_logprobs_all += decoder.sequence.tokens.back().plog;
-                            } break;
-                        case whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH:
-                            {
-                                const auto tokens_new = whisper_sample_token_topk(*ctx, *state, decoder, params.beam_search.beam_size);
+        for (int k = 0; k < n_fallback_parallel; ++k) {
+            if (!whisper_vocab_init(*ctx, *state->fallback_states[k], ids)) {
+                return -12;
+            }
 
-                                for (const auto & token : tokens_new) {
-                                    beam_candidates.push_back({ j, decoder.seek_delta, decoder.has_ts, decoder.sequence });
-                                    beam_candidates.back().sequence.tokens.push_back(token);
-                                    beam_candidates.back().sequence.sum_logprobs_all += token.plog;
+            state->fallback_states[k]->vocab_active = true;
+        }
+    }
 
-                                    //WHISPER_PRINT_DEBUG("%s: beam candidate: %s (%f, %f)\n", __func__, ctx->vocab.id_to_token.at(token.id).c_str(), token.plog, beam_candidates.back().sequence.sum_logprobs_all);
-                                }
-                            } break;
-                    };
-                }
+    // these tokens determine the task that will be performed
+    std::vector<whisper_token> prompt_init = { whisper_token_sot(ctx), };
 
-                // for beam-search, choose the top candidates and update the KV caches
-                if (params.strategy == whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH) {
-                    std::sort(
-                            beam_candidates.begin(),
-                            beam_candidates.end(),
-                            [](const beam_candidate & a, const beam_candidate & b) {
-                        return a.sequence.sum_logprobs_all > b.sequence.sum_logprobs_all;
-                    });
+    if (whisper_is_multilingual(ctx)) {
+        const int lang_id = whisper_lang_id(params.language);
+        state->lang_id = lang_id;
+        prompt_init.push_back(whisper_token_lang(ctx, lang_id));
+        if (params.translate) {
+            prompt_init.push_back(whisper_token_translate(ctx));
+        } else {
+            prompt_init.push_back(whisper_token_transcribe(ctx));
+        }
+    }
 
-                    uint32_t cur_c = 0;
-                    std::vector<int> decoder_idx(n_decoders_cur, -1);
+    // distilled models require the "no_timestamps" token
+    {
+        const bool is_distil = ctx->model.hparams.n_text_layer == 2;
+        if (is_distil && !params.no_timestamps) {
+            WHISPER_LOG_WARN("%s: using distilled model - forcing no_timestamps\n", __func__);
+            params.no_timestamps = true;
+        }
+    }
 
-                    for (int j = 0; j < n_decoders_cur; ++j) {
-                        auto & decoder = state->decoders[j];
+    if (params.no_timestamps) {
+        prompt_init.push_back(whisper_token_not(ctx));
+    }
 
-                        if (decoder.completed || decoder.failed) {
-                            continue;
-                        }
+    int seek = seek_start;
 
-                        if (cur_c >= beam_candidates.size()) {
-                            cur_c = 0;
-                        }
+    std::vector<whisper_token> prompt;
+    prompt.reserve(whisper_n_text_ctx(ctx));
 
-                        auto & cur = beam_candidates[cur_c++];
+    // main loop
+    while (true) {
+        if (params.progress_callback) {
+            const int progress_cur = (100*(seek - seek_start))/(seek_end - seek_start);
 
-                        while (beam_candidates.size() > cur_c && beam_candidates[cur_c].sequence.sum_logprobs_all == cur.sequence.sum_logprobs_all && i > 0) {
-                            ++cur_c;
-                        }
+            params.progress_callback(
+                ctx, ctx->state, progress_cur, params.progress_callback_user_data);
+        }
 
-                        decoder.sequence   = cur.sequence;
-                        decoder.seek_delta = cur.seek_delta;
-                        decoder.has_ts     = cur.has_ts;
+        // of only 1 second left, then stop
+        if (seek + 100 >= seek_end) {
+            break;
+        }
 
-                        decoder_idx[j] = cur.decoder_idx;
-                        WHISPER_PRINT_DEBUG("%s: beam search: decoder %d: from decoder %d: token = %10s, plog = %8.5f, sum_logprobs = %8.5f\n",
-                                __func__, j, cur.decoder_idx, ctx->vocab.id_to_token.at(decoder.sequence.tokens.back().id).c_str(), decoder.sequence.tokens.back().plog, decoder.sequence.sum_logprobs_all);
-                    }
+        const int64_t t_window_start_us = ggml_time_us();
 
-                    // update KV caches
-                    whisper_kv_swap_fast(decoder_idx, state->decoders, state->kv_swap_bufs, n_decoders_cur);
-                }
+        if (params.encoder_begin_callback) {
+            if (params.encoder_begin_callback(ctx, state, params.encoder_begin_callback_user_data) == false) {
+                WHISPER_LOG_ERROR("%s: encoder_begin_callback returned false - aborting\n", __func__);
+                break;
+            }
+        }
 
-                // update the decoder state
-                // - check if the sequence is completed
-                // - check if the sequence is failed
-                // - update sliding window based on timestamp tokens
-                for (int j = 0; j < n_decoders_cur; ++j) {
-                    auto & decoder = state->decoders[j];
+        // pick up the window that was encoded while decoding the previous one
+        if (encode_next.joinable()) {
+            encode_next.join();
 
-                    if (decoder.completed || decoder.failed) {
-                        continue;
-                    }
+            if (state->enc_seek_next == seek) {
+                std::swap(state->kv_cross, state->kv_cross_next);
 
-                    auto & has_ts     = decoder.has_ts;
-                    auto & failed     = decoder.failed;
-                    auto & completed  = decoder.completed;
-                    auto & seek_delta = decoder.seek_delta;
-                    auto & result_len = decoder.sequence.result_len;
+                state->enc_seek = seek;
+            }
 
-                    {
-                        const auto & token = decoder.sequence.tokens.back();
+            state->enc_seek_next = -1;
+        }
 
-                        // timestamp token - update sliding window
-                        if (token.id > whisper_token_beg(ctx)) {
-                            const int seek_delta_new = 2*(token.id - whisper_token_beg(ctx));
+        // shrink the encoder window to the audio that is left
+        // the decoder cross-attention follows through exp_n_audio_ctx
+        if (params.audio_ctx_auto) {
+            state->exp_n_audio_ctx = whisper_audio_ctx_auto(*ctx, seek_end - seek);
 
-                            // do not allow to go back in time
-                            if (has_ts && seek_delta > seek_delta_new && result_len < i) {
-                                failed = true; // TODO: maybe this is not a failure ?
-                                continue;
-                            }
+            WHISPER_PRINT_DEBUG("%s: seek = %d, audio_ctx = %d\n", __func__, seek, state->exp_n_audio_ctx);
+        }
 
-                            seek_delta = seek_delta_new;
-                            result_len = i + 1;
-                            has_ts = true;
-                        }
+        const int n_audio_ctx_cur = state->exp_n_audio_ctx > 0 ? state->exp_n_audio_ctx : whisper_n_audio_ctx(ctx);
 
-                        whisper_grammar_accept_token(*ctx, decoder.grammar, token.id);
+        // encode audio features starting at offset seek
+        // the language detection or the pipelined encoder may have already encoded this window
+        if (state->enc_seek == seek && state->enc_n_ctx == n_audio_ctx_cur) {
+            WHISPER_PRINT_DEBUG("%s: reusing the encoded window at seek = %d\n", __func__, seek);
 
-#ifdef WHISPER_DEBUG
-                        {
-                            const auto tt = token.pt > 0.10 ? ctx->vocab.id_to_token.at(token.tid) : "[?]";
-                            WHISPER_PRINT_DEBUG("%s: id = %3d, decoder = %d, token = %6d, p = %6.3f, ts = %10s, %6.3f, result_len = %4d '%s'\n",
-                                    __func__, i, j, token.id, token.p, tt.c_str(), token.pt, result_len, ctx->vocab.id_to_token.at(token.id).c_str());
-                        }
-#endif
+            state->n_enc_hit++;
+        } else if (!whisper_encode_internal(*ctx, *state, seek, n_threads_encode, params.abort_callback, params.abort_callback_user_data)) {
+            WHISPER_LOG_ERROR("%s: failed to encode\n", __func__);
+            return -6;
+        }
 
-                        // end of segment
-                        if (token.id == whisper_token_eot(ctx) ||               // end of text token
-                           (params.max_tokens > 0 && i >= params.max_tokens) || // max tokens per segment reached
-                           (has_ts && seek + seek_delta + 100 >= seek_end)      // end of audio reached
-                           ) {
-                            if (result_len == 0) {
-                                if (seek + seek_delta + 100 >= seek_end) {
-                                    result_len = i + 1;
-                                } else {
-                                    failed = true;
-                                    continue;
-                                }
-                            }
+        if (draft_state != nullptr) {
+            draft_state->exp_n_audio_ctx = state->exp_n_audio_ctx;
 
-                            if (params.single_segment) {
-                                result_len = i + 1;
-                                seek_delta = 100*WHISPER_CHUNK_SIZE;
-                            }
+            if (!whisper_encode_internal(*params.draft_ctx, *draft_state, seek, n_threads_encode, params.abort_callback, params.abort_callback_user_data)) {
+                WHISPER_LOG_ERROR("%s: failed to encode with the draft model\n", __func__);
+                return -6;
+            }
+        }
 
-                            completed = true;
-                            continue;
-                        }
+        // most windows advance by a full chunk - start encoding the next one on the spare threads
+        // the audio context must stay the same, since it is taken from exp_n_audio_ctx
+        if (n_threads_encode_next > 0 && seek + 100*WHISPER_CHUNK_SIZE + 100 < seek_end &&
+            (!params.audio_ctx_auto || whisper_audio_ctx_auto(*ctx, seek_end - seek - 100*WHISPER_CHUNK_SIZE) == n_audio_ctx_cur)) {
+            const int seek_next = seek + 100*WHISPER_CHUNK_SIZE;
 
-                        // TESTS: if no tensors are loaded, it means we are running tests
-                        if (ctx->model.n_loaded == 0) {
-                            seek_delta = 100*WHISPER_CHUNK_SIZE;
-                            completed = true;
-                            continue;
-                        }
-                    }
+            state->enc_seek_next = -1;
 
-                    // sometimes, the decoding can get stuck in a repetition loop
-                    // this is an attempt to mitigate such cases - we flag the decoding as failed and use a fallback strategy
-                    if (i == n_max - 1 && (result_len == 0 || seek_delta < 100*WHISPER_CHUNK_SIZE/2)) {
-                        failed = true;
-                        continue;
-                    }
+            encode_next = std::thread([ctx, state, seek_next, n_threads_encode_next]() {
+                if (whisper_encode_window(*ctx, *state, state->kv_cross_next, seek_next, n_threads_encode_next, &state->work_encode_next, nullptr, nullptr)) {
+                    state->enc_seek_next = seek_next;
                 }
+            });
+        }
 
-                // check if all decoders have finished (i.e. completed or failed)
-                {
-                    bool completed_all = true;
-
-                    for (int j = 0; j < n_decoders_cur; ++j) {
-                        auto & decoder = state->decoders[j];
-
-                        if (decoder.completed || decoder.failed) {
-                            continue;
-                        }
-
-                        completed_all = false;
-                    }
+        // if there is a very short audio segment left to process, we remove any past prompt since it tends
+        // to confuse the decoder and often make it repeat or hallucinate stuff
+        if (seek > seek_start && seek + 500 >= seek_end) {
+            prompt_past.clear();
+        }
 
-                    if (completed_all) {
-                        break;
-                    }
-                }
+        int best_decoder_id = 0;
 
-                state->t_sample_us += ggml_time_us() - t_start_sample_us;
+        for (int it = 0; it < (int) temperatures.size(); ) {
+            // temperatures it + 1 .. it + n_group - 1 are decoded at the same time by the helper states
+            const int n_group = std::min(1 + n_fallback_parallel, (int) temperatures.size() - it);
 
-                // obtain logits for the next token
-                for (int j = 0; j < n_decoders_cur; ++j) {
-                    auto & decoder = state->decoders[j];
+            fallback_abort.stop = false;
 
-                    if (decoder.failed || decoder.completed) {
-                        continue;
-                    }
+            for (int k = 1; k < n_group; ++k) {
+                whisper_state * fstate = state->fallback_states[k - 1];
 
-                    decoder.tokens_tmp.resize(1);
-                    decoder.tokens_tmp[0] = decoder.sequence.tokens.back().id;
+                // the helper states read the cross-attention cache of the state, encoded with this audio context
+                fstate->exp_n_audio_ctx = state->exp_n_audio_ctx;
 
-                    //WHISPER_PRINT_DEBUG("%s: decoder %d: token %d, kv_self.n %d, seek_delta %d\n", __func__, j, decoder.tokens_tmp[0], decoder.kv_self.n, decoder.seek_delta);
+                fallback_workers[k - 1] = std::thread([&, k, fstate]() {
+                    fallback_ret[k] = whisper_full_decode_window(ctx, fstate, params, temperatures[it + k], seek, seek_end, prompt_past, prompt_init,
+                            fallback_prompt[k], fallback_spec[k], params.n_threads_fallback, whisper_fallback_abort_callback, &fallback_abort, fallback_best[k]);
+                });
+            }
 
-                    if (!whisper_decode_internal(*ctx, *state, decoder, decoder.tokens_tmp.data(), decoder.tokens_tmp.size(), decoder.kv_self.n, params.n_threads, params.abort_callback, params.abort_callback_user_data)) {
-                        WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
-                        return -8;
-                    }
+            fallback_ret[0] = whisper_full_decode_window(ctx, state, params, temperatures[it], seek, seek_end, prompt_past, prompt_init, prompt, spec,
+                    n_threads_decode, params.abort_callback, params.abort_callback_user_data, best_decoder_id);
+            fallback_best[0] = best_decoder_id;
 
-                    {
-                        const int64_t t_start_sample_us = ggml_time_us();
+            // take the first temperature that was successful
+            int ret    = 0;
+            int k_best = -1;
 
-                        whisper_process_logits(*ctx, *state, params, decoder, t_cur);
+            for (int k = 0; k < n_group; ++k) {
+                if (k > 0) {
+                    fallback_workers[k - 1].join();
+                }
 
-                        ++decoder.kv_self.n;
+                ret = fallback_ret[k];
+                if (ret != 0) {
+                    break;
+                }
 
-                        state->t_sample_us += ggml_time_us() - t_start_sample_us;
-                    }
+                // was the decoding successful for the current temperature?
+                // do fallback only if:
+                // - we are not at the last temperature
+                // - we are not at the end of the audio (3 sec)
+                if (it + k == (int) temperatures.size() - 1) {
+                    k_best = k;
+                    break;
                 }
-            }
 
-            // rank the resulting sequences and select the best one
-            {
-                double best_score = -INFINITY;
+                if (seek_end - seek > 10*WHISPER_CHUNK_SIZE) {
+                    const whisper_state * kstate = k == 0 ? state : state->fallback_states[k - 1];
 
-                for (int j = 0; j < n_decoders_cur; ++j) {
-                    auto & decoder = state->decoders[j];
+                    const auto & decoder = kstate->decoders[fallback_best[k]];
 
-                    if (decoder.failed) {
-                        continue;
+                    if (!(decoder.failed || decoder.sequence.avg_logprobs < params.logprob_thold)) {
+                        k_best = k;
+                        break;
                     }
 
-                    decoder.sequence.tokens.resize(decoder.sequence.result_len);
-                    whisper_sequence_score(params, decoder.sequence);
+                    state->n_fail_p++;
+                }
 
-                    WHISPER_PRINT_DEBUG("%s: decoder %2d: score = %8.5f, result_len = %3d, avg_logprobs = %8.5f, entropy = %8.5f\n",
-                            __func__, j, decoder.sequence.score, decoder.sequence.result_len, decoder.sequence.avg_logprobs, decoder.sequence.entropy);
+                WHISPER_PRINT_DEBUG("\n%s: failed to decode with temperature = %.2f\n", __func__, temperatures[it + k]);
+            }
 
-                    if (decoder.sequence.result_len > 32 && decoder.sequence.entropy < params.entropy_thold) {
-                        WHISPER_PRINT_DEBUG("%s: decoder %2d: failed due to entropy %8.5f < %8.5f\n",
-                                __func__, j, decoder.sequence.entropy, params.entropy_thold);
+            // the remaining decodes are not needed - they return WHISPER_FALLBACK_CANCELLED, which is not looked at since
+            // they come after the first accepted temperature
+            fallback_abort.stop = true;
 
-                        decoder.failed = true;
-                        state->n_fail_h++;
+            for (auto & worker : fallback_workers) {
+                if (worker.joinable()) {
+                    worker.join();
+                }
+            }
 
-                        continue;
-                    }
+            // the decodes of the helper states are reported by this state
+            for (int k = 1; k < n_group; ++k) {
+                whisper_state * fstate = state->fallback_states[k - 1];
 
-                    if (best_score < decoder.sequence.score) {
-                        best_score = decoder.sequence.score;
-                        best_decoder_id = j;
-                    }
-                }
+                whisper_accumulate_timings(*state, *fstate);
+                whisper_reset_timings_state(*fstate);
+            }
 
-                WHISPER_PRINT_DEBUG("%s: best decoder = %d\n", __func__, best_decoder_id);
+            if (ret != 0) {
+                return ret;
             }
 
-            // was the decoding successful for the current temperature?
-            // do fallback only if:
-            // - we are not at the last temperature
-            // - we are not at the end of the audio (3 sec)
-            if (it != (int) temperatures.size() - 1 &&
-                seek_end - seek > 10*WHISPER_CHUNK_SIZE) {
-                bool success = true;
+            if (k_best > 0) {
+                const auto & decoder = state->fallback_states[k_best - 1]->decoders[fallback_best[k_best]];
 
-                const auto & decoder = state->decoders[best_decoder_id];
+                best_decoder_id = 0;
 
-                if (decoder.failed || decoder.sequence.avg_logprobs < params.logprob_thold) {
-                    success = false;
-                    state->n_fail_p++;
-                }
+                state->decoders[0].sequence   = decoder.sequence;
+                state->decoders[0].seek_delta = decoder.seek_delta;
+                state->decoders[0].has_ts     = decoder.has_ts;
 
-                if (success) {
-                    //for (auto & token : ctx->decoders[best_decoder_id].sequence.tokens) {
-                    //    WHISPER_PRINT_DEBUG("%s: token = %d, p = %6.3f, pt = %6.3f, ts = %s, str = %s\n", __func__, token.id, token.p, token.pt, ctx->vocab.id_to_token.at(token.tid).c_str(), ctx->vocab.id_to_token.at(token.id).c_str());
-                    //}
+                prompt.swap(fallback_prompt[k_best]);
+            }
 
-                    break;
-                }
+            if (k_best >= 0) {
+                break;
             }
 
-            WHISPER_PRINT_DEBUG("\n%s: failed to decode with temperature = %.2f\n", __func__, t_cur);
+            it += n_group;
         }
 
         // output results through a user-provided callback
@@ -5659,6 +8074,11 @@ int whisper_full_with_state(
             seek += seek_delta;
 
             WHISPER_PRINT_DEBUG("seek = %d, seek_delta = %d\n", seek, seek_delta);
+
+            state->n_window++;
+            state->n_window_tokens += result_len;
+
+            whisper_hist_add(state->hist_window_us, ggml_time_us() - t_window_start_us);
         }
     }
 
@@ -5682,6 +8102,13 @@ int whisper_full_parallel(
     if (n_processors == 1) {
         return whisper_full(ctx, params, samples, n_samples);
     }
+
+    // the draft model has a single state that cannot be shared between the processors
+    if (params.draft_ctx != nullptr) {
+        WHISPER_LOG_WARN("%s: speculative decoding is not supported with multiple processors - disabling\n", __func__);
+        params.draft_ctx = nullptr;
+    }
+
     int ret = 0;
 
     // prepare separate states for each thread
@@ -5698,6 +8125,11 @@ int whisper_full_parallel(
         // create a new state for each thread
         states.push_back(whisper_init_state(ctx));
 
+        // [EXPERIMENTAL] with a copy of the weights on each NUMA node, the processors are spread over the nodes
+        if (ctx->params.numa == WHISPER_NUMA_STRATEGY_REPLICATE && whisper_numa_n_nodes() > 1 && ggml_backend_is_cpu(states[i]->backend)) {
+            whisper_state_set_affinity(ctx, states[i], (i + 1) % whisper_numa_n_nodes(), nullptr, 0, false);
+        }
+
         const int start_samples = offset_samples + (i + 1)*n_samples_per_processor;
         const int n_samples_cur = (i == n_processors - 2) ? n_samples - start_samples : n_samples_per_processor;
 
@@ -5754,26 +8186,19 @@ int whisper_full_parallel(
             }
         }
 
-        ctx->state->t_mel_us += states[i]->t_mel_us;
-
-        ctx->state->t_sample_us += states[i]->t_sample_us;
-        ctx->state->t_encode_us += states[i]->t_encode_us;
-        ctx->state->t_decode_us += states[i]->t_decode_us;
-        ctx->state->t_prompt_us += states[i]->t_prompt_us;
-
-        ctx->state->n_sample += states[i]->n_sample;
-        ctx->state->n_encode += states[i]->n_encode;
-        ctx->state->n_decode += states[i]->n_decode;
-        ctx->state->n_prompt += states[i]->n_prompt;
+        whisper_accumulate_timings(*ctx->state, *states[i]);
 
         whisper_free_state(states[i]);
     }
 
-    // average the timings
+    // average the timings - the processors run concurrently, so this approximates the wall time
+    // the counters and the histograms are summed
     ctx->state->t_mel_us    /= n_processors;
     ctx->state->t_sample_us /= n_processors;
     ctx->state->t_encode_us /= n_processors;
+    ctx->state->t_cross_us  /= n_processors;
     ctx->state->t_decode_us /= n_processors;
+    ctx->state->t_prompt_us /= n_processors;
 
     // print information about the audio boundaries
     WHISPER_LOG_WARN("\n");
@@ -5876,6 +8301,277 @@ float whisper_full_get_token_p(struct whisper_context * ctx, int i_segment, int
 
 // =================================================================================================
 
+//
+// [EXPERIMENTAL] thread count autotuning
+//
+
+// the thread counts to try: 1, 2, 3, 4, 6, 8, 12, 16, ... and n_threads_max
+static std::vector<int> whisper_autotune_candidates(int n_threads_max) {
+    std::vector<int> result;
+
+    for (int n = 1; n <= 3 && n < n_threads_max; ++n) {
+        result.push_back(n);
+    }
+
+    for (int n = 4; n < n_threads_max; n *= 2) {
+        result.push_back(n);
+
+        if (3*n/2 < n_threads_max) {
+            result.push_back(3*n/2);
+        }
+    }
+
+    result.push_back(n_threads_max);
+
+    return result;
+}
+
+// the cache entries are keyed by the model hyperparameters and weight type, the backend, the host (hardware threads
+// and a hash of the CPU features from whisper_print_system_info()) and n_threads_max
+static std::string whisper_autotune_key(const whisper_context & ctx, int n_threads_max) {
+    const auto & hparams = ctx.model.hparams;
+
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ull;
+    for (const char * p = whisper_print_system_info(); *p != '\0'; ++p) {
+        hash ^= (uint8_t) *p;
+        hash *= 1099511628211ull;
+    }
+
+    char key[256];
+    snprintf(key, sizeof(key), "%d-%d-%d-%d-%d-%d-%d-%s-%u-%016llx-%d",
+            hparams.n_vocab, hparams.n_audio_ctx, hparams.n_audio_state, hparams.n_audio_layer,
+            hparams.n_text_state, hparams.n_text_layer, hparams.ftype, ggml_backend_name(ctx.backend),
+            std::thread::hardware_concurrency(), (unsigned long long) hash, n_threads_max);
+
+    return key;
+}
+
+// cache file: one line per entry - key n_threads_encode n_threads_decode n_threads_mel
+static bool whisper_autotune_cache_read(const char * fname, const std::string & key, int & n_encode, int & n_decode, int & n_mel) {
+    std::ifstream fin(fname);
+
+    std::string line;
+    while (std::getline(fin, line)) {
+        char cur[256];
+        int  n[3];
+
+        if (sscanf(line.c_str(), "%255s %d %d %d", cur, &n[0], &n[1], &n[2]) == 4 && key == cur &&
+            n[0] > 0 && n[1] > 0 && n[2] > 0) {
+            n_encode = n[0];
+            n_decode = n[1];
+            n_mel    = n[2];
+
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// replaces the entry with the same key, the other entries are kept
+static bool whisper_autotune_cache_write(const char * fname, const std::string & key, int n_encode, int n_decode, int n_mel) {
+    std::vector<std::string> lines;
+
+    {
+        std::ifstream fin(fname);
+
+        std::string line;
+        while (std::getline(fin, line)) {
+            if (!line.empty() && line[0] != '#' && line.compare(0, key.size() + 1, key + " ") != 0) {
+                lines.push_back(line);
+            }
+        }
+    }
+
+    std::ofstream fout(fname);
+    if (!fout) {
+        return false;
+    }
+
+    fout << "# whisper.cpp thread counts: key n_threads_encode n_threads_decode n_threads_mel\n";
+
+    for (const auto & line : lines) {
+        fout << line << "\n";
+    }
+
+    fout << key << " " << n_encode << " " << n_decode << " " << n_mel << "\n";
+
+    return fout.good();
+}
+
+// the time of the fastest of n_rep runs in us, -1 on failure
+template <typename F>
+static int64_t whisper_autotune_time_us(int n_rep, F && run) {
+    int64_t result = -1;
+
+    for (int i = 0; i < n_rep; ++i) {
+        const int64_t t_start_us = ggml_time_us();
+
+        if (!run()) {
+            return -1;
+        }
+
+        const int64_t t_us = ggml_time_us() - t_start_us;
+
+        if (result < 0 || t_us < result) {
+            result = t_us;
+        }
+    }
+
+    return result;
+}
+
+// the smallest thread count within 5% of the fastest one, -1 on failure
+// the counts are tried from the largest one down. with stop_early, the search stops at the first count that is more
+// than 20% slower than the fastest one so far - a graph that scales with the threads is not faster with fewer of them
+template <typename F>
+static int whisper_autotune_pick(const char * stage, const std::vector<int> & candidates, bool stop_early, F && time_us) {
+    std::vector<std::pair<int, int64_t>> results;
+
+    int64_t t_best_us = -1;
+
+    for (int i = (int) candidates.size() - 1; i >= 0; --i) {
+        const int n_threads = candidates[i];
+
+        const int64_t t_us = time_us(n_threads);
+        if (t_us < 0) {
+            return -1;
+        }
+
+        WHISPER_LOG_INFO("%s: %-6s: %3d threads = %9.2f ms\n", __func__, stage, n_threads, t_us/1000.0);
+
+        results.emplace_back(n_threads, t_us);
+
+        if (t_best_us < 0 || t_us < t_best_us) {
+            t_best_us = t_us;
+        }
+
+        if (stop_early && 5*t_us > 6*t_best_us) {
+            break;
+        }
+    }
+
+    int result = -1;
+
+    for (const auto & r : results) {
+        if (100*r.second <= 105*t_best_us && (result < 0 || r.first < result)) {
+            result = r.first;
+        }
+    }
+
+    return result;
+}
+
+int whisper_autotune_threads(
+        struct whisper_context * ctx,
+                           int   n_threads_max,
+                    const char * fname_cache,
+    struct whisper_full_params * params) {
+    if (n_threads_max < 1) {
+        WHISPER_LOG_ERROR("%s: invalid n_threads_max = %d\n", __func__, n_threads_max);
+        return -1;
+    }
+
+    const std::string key = whisper_autotune_key(*ctx, n_threads_max);
+
+    if (fname_cache != nullptr) {
+        int n_encode = 0;
+        int n_decode = 0;
+        int n_mel    = 0;
+
+        if (whisper_autotune_cache_read(fname_cache, key, n_encode, n_decode, n_mel)) {
+            params->n_threads_encode = n_encode;
+            params->n_threads_decode = n_decode;
+            params->n_threads_mel    = n_mel;
+
+            WHISPER_LOG_INFO("%s: threads from '%s': encode = %d, decode = %d, mel = %d\n", __func__, fname_cache, n_encode, n_decode, n_mel);
+
+            return 1;
+        }
+    }
+
+    WHISPER_LOG_INFO("%s: benchmarking with up to %d threads\n", __func__, n_threads_max);
+
+    whisper_state * state = whisper_init_state(ctx);
+    if (state == nullptr) {
+        WHISPER_LOG_ERROR("%s: failed to create a state\n", __func__);
+        return -2;
+    }
+
+    struct whisper_state_free {
+        whisper_state * state;
+        ~whisper_state_free() {
+            whisper_free_state(state);
+        }
+    } state_free = { state };
+
+    // 30 s of noise - the timings do not depend on the content
+    std::vector<float> pcmf32(WHISPER_SAMPLE_RATE*WHISPER_CHUNK_SIZE);
+    {
+        std::mt19937 rng(0);
+        std::normal_distribution<float> dist(0.0f, 0.1f);
+
+        for (auto & x : pcmf32) {
+            x = dist(rng);
+        }
+    }
+
+    const std::vector<int> candidates = whisper_autotune_candidates(n_threads_max);
+
+    const int n_mel = whisper_autotune_pick("mel", candidates, false, [&](int n_threads) {
+        return whisper_autotune_time_us(3, [&]() {
+            return whisper_pcm_to_mel_with_state(ctx, state, pcmf32.data(), pcmf32.size(), n_threads) == 0;
+        });
+    });
+
+    // warm-up, also the cross-attention cache for the decoder
+    if (n_mel < 0 || !whisper_encode_internal(*ctx, *state, 0, n_threads_max, nullptr, nullptr)) {
+        WHISPER_LOG_ERROR("%s: failed to encode\n", __func__);
+        return -3;
+    }
+
+    const int n_encode = whisper_autotune_pick("encode", candidates, true, [&](int n_threads) {
+        return whisper_autotune_time_us(1, [&]() {
+            return whisper_encode_internal(*ctx, *state, 0, n_threads, nullptr, nullptr);
+        });
+    });
+
+    // the prompt followed by single-token passes, as in the decoding loop
+    const whisper_token token = whisper_token_sot(ctx);
+
+    const int n_decode = whisper_autotune_pick("decode", candidates, false, [&](int n_threads) {
+        return whisper_autotune_time_us(3, [&]() {
+            for (int i = 0; i < 8; ++i) {
+                if (!whisper_decode_internal(*ctx, *state, state->decoders[0], &token, 1, i, false, n_threads, nullptr, nullptr)) {
+                    return false;
+                }
+            }
+
+            return true;
+        });
+    });
+
+    if (n_encode < 0 || n_decode < 0) {
+        WHISPER_LOG_ERROR("%s: failed to benchmark the model\n", __func__);
+        return -4;
+    }
+
+    params->n_threads_encode = n_encode;
+    params->n_threads_decode = n_decode;
+    params->n_threads_mel    = n_mel;
+
+    WHISPER_LOG_INFO("%s: threads: encode = %d, decode = %d, mel = %d\n", __func__, n_encode, n_decode, n_mel);
+
+    if (fname_cache != nullptr && !whisper_autotune_cache_write(fname_cache, key, n_encode, n_decode, n_mel)) {
+        WHISPER_LOG_WARN("%s: failed to write '%s'\n", __func__, fname_cache);
+    }
+
+    return 0;
+}
+
+// =================================================================================================
+
 //
 // Temporary interface needed for exposing ggml interface
 // Will be removed in the future when ggml becomes a separate library
@@ -34,6 +34,8 @@
 #define WHISPER_HOP_LENGTH  160
 #define WHISPER_CHUNK_SIZE  30
 
+#define WHISPER_TIMINGS_HIST_SIZE 24
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -80,8 +82,19 @@ extern "C" {
 
     typedef int whisper_token;
 
+    // [EXPERIMENTAL] NUMA placement of the model weights (Linux, CPU backend only)
+    enum whisper_numa_strategy {
+        WHISPER_NUMA_STRATEGY_DISABLED   = 0, // the pages land on the node of the thread that touches them first
+        WHISPER_NUMA_STRATEGY_NODE       = 1, // all pages on numa_node
+        WHISPER_NUMA_STRATEGY_INTERLEAVE = 2, // pages interleaved across all nodes
+        WHISPER_NUMA_STRATEGY_REPLICATE  = 3, // a copy of the weights on each node, see whisper_state_set_affinity()
+    };
+
     struct whisper_context_params {
         bool  use_gpu;
+
+        enum whisper_numa_strategy numa;
+        int   numa_node; // node of the weights for WHISPER_NUMA_STRATEGY_NODE
     };
 
     typedef struct whisper_token_data {
@@ -178,8 +191,40 @@ extern "C" {
         "use whisper_init_with_params_no_state instead"
     );
 
+    // The first state of a context measures the compute buffers, the next ones reuse the measured sizes
     WHISPER_API struct whisper_state * whisper_init_state(struct whisper_context * ctx);
 
+    // Create a new state with a copy of the mel spectrogram, the results and the encoded window of 'state'
+    // e.g. to decode the same audio with different parameters without running the encoder again
+    WHISPER_API struct whisper_state * whisper_state_clone(struct whisper_context * ctx, struct whisper_state * state);
+
+    // Bring a state back to the way it was after whisper_init_state(), without freeing its buffers
+    // Use this to recycle states between requests instead of creating new ones
+    WHISPER_API void whisper_state_reset(struct whisper_state * state);
+
+    // [EXPERIMENTAL] Bind a state to a NUMA node and/or a set of CPUs (Linux only)
+    // numa_node >= 0: the buffers of the state are moved to the node and, with WHISPER_NUMA_STRATEGY_REPLICATE, the
+    //                 state reads the copy of the weights on the node. if cpus is NULL, the CPUs of the node are used
+    // cpus:           the compute threads of the state run on these CPUs. if pin is true, thread i runs on cpus[i % n_cpus]
+    //                 the threads of the concurrent fallback decoders and of the pipelined encoder are never pinned
+    // The binding is kept by whisper_state_reset() and copied by whisper_state_clone()
+    // Use numa_node = -1 and cpus = NULL to remove the binding
+    // Returns 0 on success
+    WHISPER_API int whisper_state_set_affinity(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+                           int   numa_node,
+                     const int * cpus,
+                           int   n_cpus,
+                          bool   pin);
+
+    // [EXPERIMENTAL] Number of NUMA nodes of the host (1 if unknown)
+    WHISPER_API int whisper_numa_n_nodes(void);
+
+    // Returns the default state of the context, or NULL if it was created with a _no_state function
+    // Allows reading the results of whisper_full() with the same _from_state functions as for other states
+    WHISPER_API struct whisper_state * whisper_get_state(struct whisper_context * ctx);
+
     // Given a context, enable use of OpenVINO for encode inference.
     // model_path: Optional path to OpenVINO encoder IR model. If set to nullptr,
     //                      the path will be generated from the ggml model path that was passed
@@ -330,6 +375,35 @@ extern "C" {
                                int   n_threads,
                              float * lang_probs);
 
+    // [EXPERIMENTAL] Score how well each phrase matches the mel data at offset_ms (e.g. a list of voice commands)
+    // Make sure to call whisper_pcm_to_mel() or whisper_set_mel() first
+    // scores[i] is the log probability of phrases[i], tokenized with a leading space and followed by the end of text token,
+    // after the optional prompt tokens and the transcription task tokens (language = nullptr means "en")
+    // The audio is encoded once and the phrases that start with the same tokens share the decoder KV cache
+    // Returns 0 on success
+    WHISPER_API int whisper_score_phrases(
+            struct whisper_context * ctx,
+                        const char * language,
+               const whisper_token * prompt_tokens,
+                               int   prompt_n_tokens,
+                       const char ** phrases,
+                               int   n_phrases,
+                               int   offset_ms,
+                               int   n_threads,
+                             float * scores);
+
+    WHISPER_API int whisper_score_phrases_with_state(
+            struct whisper_context * ctx,
+              struct whisper_state * state,
+                        const char * language,
+               const whisper_token * prompt_tokens,
+                               int   prompt_n_tokens,
+                       const char ** phrases,
+                               int   n_phrases,
+                               int   offset_ms,
+                               int   n_threads,
+                             float * scores);
+
     WHISPER_API int whisper_n_len           (struct whisper_context * ctx); // mel length
     WHISPER_API int whisper_n_len_from_state(struct whisper_state * state); // mel length
     WHISPER_API int whisper_n_vocab         (struct whisper_context * ctx);
@@ -380,6 +454,83 @@ extern "C" {
     WHISPER_API void whisper_print_timings(struct whisper_context * ctx);
     WHISPER_API void whisper_reset_timings(struct whisper_context * ctx);
 
+    // Performance information from a state, accumulated over all calls since the state was created
+    // (or since the last whisper_reset_timings() for the default state)
+    // Take the difference of two snapshots to measure a single call - this works for the histograms too
+    //
+    // Latency histograms: bucket i counts the calls that took [2^i, 2^(i+1)) us
+    // The first bucket starts at 0 and the last one is open-ended (>= ~8.4 s)
+    typedef struct whisper_timings {
+        int64_t t_mel_us;    // PCM -> log mel spectrogram
+        int64_t t_encode_us; // conv + encoder
+        int64_t t_cross_us;  // cross-attention K/V of the encoder output
+        int64_t t_prompt_us; // decoder calls with n_tokens > 1
+        int64_t t_decode_us; // decoder calls with n_tokens == 1 (text-generation)
+        int64_t t_sample_us; // sampling of the decoded logits
+
+        int32_t n_encode;
+        int32_t n_prompt;
+        int32_t n_decode;
+        int32_t n_sample;
+        int32_t n_fail_p;    // logprob threshold failures
+        int32_t n_fail_h;    // entropy threshold failures
+
+        int32_t n_enc_hit;       // windows that reused an encoder pass (language detection or pipelined encoding)
+        int32_t n_window;        // audio windows processed by whisper_full
+        int32_t n_window_tokens; // tokens of the best decoder over these windows, including timestamp tokens
+
+        int32_t hist_encode_us[WHISPER_TIMINGS_HIST_SIZE]; // encoder calls (conv + encoder + cross)
+        int32_t hist_prompt_us[WHISPER_TIMINGS_HIST_SIZE]; // decoder calls with n_tokens > 1
+        int32_t hist_decode_us[WHISPER_TIMINGS_HIST_SIZE]; // decoder calls with n_tokens == 1
+        int32_t hist_window_us[WHISPER_TIMINGS_HIST_SIZE]; // whole windows: encode + decode + sampling + fallbacks
+    } whisper_timings;
+
+    WHISPER_API struct whisper_timings whisper_get_timings              (struct whisper_context * ctx);
+    WHISPER_API struct whisper_timings whisper_get_timings_from_state(struct whisper_state * state);
+
+    // Memory used by a context (the model weights) or by a state (KV caches, compute buffers, host buffers)
+    typedef struct whisper_memory_entry {
+        const char * name;    // "weights", "kv_self", "kv_cross", "compute_decode", ...
+        const char * backend; // name of the backend that holds the buffer, "host" for the buffers in system memory
+        int32_t      id;      // ggml_type for the "weights" entries by type, NUMA node for "weights_replica",
+                              // decoder index for the per-decoder entries, -1 otherwise
+        size_t       size;    // allocated bytes
+        size_t       used;    // bytes in use, for the KV caches the tokens currently in the cache
+        size_t       peak;    // largest number of bytes in use so far
+        int32_t      helper;  // index of the helper state of whisper_full_params.n_fallback_parallel that holds the
+                              // buffer, -1 for the buffers of the state itself and of the model
+    } whisper_memory_entry;
+
+    // Fill up to n_entries entries and return the number of available entries
+    // Call with entries = NULL and n_entries = 0 to get the number of entries
+    // The first "weights" entry (id = -1) is the whole model buffer, the others break it down by tensor type
+    // The buffers that are created on demand (e.g. the KV caches of the additional decoders) are listed once they exist
+    // The entries of a state include the buffers of its fallback helper states
+    WHISPER_API int whisper_model_memory_usage(struct whisper_context * ctx,   struct whisper_memory_entry * entries, int n_entries);
+    WHISPER_API int whisper_state_memory_usage(struct whisper_state   * state, struct whisper_memory_entry * entries, int n_entries);
+
+    // Print the memory usage of the model and of the state, either can be NULL
+    WHISPER_API void whisper_print_memory_usage(struct whisper_context * ctx, struct whisper_state * state);
+
+    // [EXPERIMENTAL] Per-node profiler of the compute graphs (conv, encoder, cross, decoder)
+    // While enabled, the CPU compute threads record the duration of each node and of their share of it.
+    // The other backends only record the duration of the whole graphs.
+    WHISPER_API void whisper_profile_enable           (struct whisper_context * ctx, bool enable);
+    WHISPER_API void whisper_profile_enable_with_state(struct whisper_state   * state, bool enable);
+
+    // Discard the recorded events
+    WHISPER_API void whisper_profile_reset           (struct whisper_context * ctx);
+    WHISPER_API void whisper_profile_reset_with_state(struct whisper_state   * state);
+
+    // Print the total time spent in each op type, per graph
+    WHISPER_API void whisper_profile_print           (struct whisper_context * ctx);
+    WHISPER_API void whisper_profile_print_with_state(struct whisper_state   * state);
+
+    // Write the recorded events in the Chrome trace event format (chrome://tracing, https://ui.perfetto.dev)
+    // Returns 0 on success
+    WHISPER_API int whisper_profile_export_trace           (struct whisper_context * ctx,   const char * fname);
+    WHISPER_API int whisper_profile_export_trace_with_state(struct whisper_state   * state, const char * fname);
+
     // Print system information
     WHISPER_API const char * whisper_print_system_info(void);
 
@@ -427,6 +578,13 @@ extern "C" {
         enum whisper_sampling_strategy strategy;
 
         int n_threads;
+
+        // thread counts of the stages, 0 = n_threads (see whisper_autotune_threads())
+        // the encoder scales to many cores, while the single-token decoder passes stop scaling at a few threads
+        int n_threads_encode;   // conv, encoder and cross-attention graphs (and the language detection)
+        int n_threads_decode;   // decoder graphs
+        int n_threads_mel;      // log mel spectrogram
+
         int n_max_text_ctx;     // max tokens to use from past text as prompt for the decoder
         int offset_ms;          // start offset in ms
         int duration_ms;        // audio duration to process in ms
@@ -453,10 +611,28 @@ extern "C" {
         bool speed_up;          // speed-up the audio by 2x using Phase Vocoder
         bool debug_mode;        // enable debug_mode provides extra info (eg. Dump log_mel)
         int  audio_ctx;         // overwrite the audio context size (0 = use default)
+        bool audio_ctx_auto;    // size the audio context to the remaining audio of each window (overrides audio_ctx)
+
+        // [EXPERIMENTAL] pipelined encoding (CPU only)
+        // while a window is decoded, the window 30 s later is encoded on n_threads_encode_next of the n_threads
+        // it is used when the decoder advances by a full window, otherwise the window is encoded again
+        int  n_threads_encode_next; // 0 = disabled
 
         // [EXPERIMENTAL] [TDRZ] tinydiarize
         bool tdrz_enable;       // enable tinydiarize speaker turn detection
 
+        // [EXPERIMENTAL] speculative decoding
+        // a smaller model with the same vocabulary (e.g. tiny for large) drafts tokens that the main model
+        // verifies in a single decoder pass. only used for greedy sampling at temperature 0 - the result
+        // is the same as without a draft model. the draft context must have its own state (not _no_state)
+        struct whisper_context * draft_ctx; // draft model (nullptr = disabled)
+        int draft_n_tokens;                 // number of tokens to draft per verification pass
+
+        // [EXPERIMENTAL] prompt lookup - draft tokens without a draft model by matching the last tokens against
+        // the prompt and the text decoded so far, and verify them the same way (0 = disabled, 3 is a good start)
+        // if both are enabled, the draft model is used only when the lookup finds no match
+        int draft_ngram;                    // longest n-gram to look up
+
         // tokens to provide to the whisper decoder as initial prompt
         // these are prepended to any existing text context from a previous call
         const char * initial_prompt;
@@ -466,6 +642,7 @@ extern "C" {
         // for auto-detection, set to nullptr, "" or "auto"
         const char * language;
         bool detect_language;
+        int  detect_audio_ctx;  // audio context for the language detection (0 = same as the first window)
 
         // common decoding parameters:
         bool suppress_blank;    // ref: https://github.com/openai/whisper/blob/f82bc59f5ea234d4b97fb2860842ed38519f7e65/whisper/decoding.py#L89
@@ -482,6 +659,18 @@ extern "C" {
         float logprob_thold;
         float no_speech_thold;  // TODO: not implemented
 
+        // [EXPERIMENTAL] concurrent fallback (CPU only)
+        // decode the next n_fallback_parallel temperatures at the same time as the current one, each on a helper state
+        // with n_threads_fallback threads. the first temperature that passes the thresholds is used, as without it
+        // note: the helper states are created on first use and logits_filter_callback is also called from their threads
+        int   n_fallback_parallel; // 0 = disabled
+        int   n_threads_fallback;
+
+        // [EXPERIMENTAL] fail a decoder as soon as it is stuck in a repetition loop, instead of after the max number
+        // of tokens, so that the fallback starts right away. loops are detected from the last sampled tokens with the
+        // entropy threshold, n-gram repeats and a compression ratio estimate
+        bool  loop_detect;
+
         struct {
             int best_of;    // ref: https://github.com/openai/whisper/blob/f82bc59f5ea234d4b97fb2860842ed38519f7e65/whisper/transcribe.py#L264
         } greedy;
@@ -489,7 +678,7 @@ extern "C" {
         struct {
             int beam_size;  // ref: https://github.com/openai/whisper/blob/f82bc59f5ea234d4b97fb2860842ed38519f7e65/whisper/transcribe.py#L265
 
-            float patience; // TODO: not implemented, ref: https://arxiv.org/pdf/2204.05424.pdf
+            float patience; // stop after round(patience*beam_size) finished hypotheses (<= 0: run all beams to the end), ref: https://arxiv.org/pdf/2204.05424.pdf
         } beam_search;
 
         // called for every newly generated text segment
@@ -516,6 +705,14 @@ extern "C" {
         size_t                           n_grammar_rules;
         size_t                           i_start_rule;
         float                            grammar_penalty;
+
+        // [EXPERIMENTAL] restricted output projection
+        // the decoder computes the logits only for these tokens, the end of text token and, unless no_timestamps is set,
+        // the timestamp tokens. all other tokens get -INFINITY logits. useful when the output is limited to a small set
+        // of tokens (e.g. a list of commands), since the projection to the full vocabulary dominates the decoding time
+        // of the small models
+        const whisper_token * vocab_tokens;
+        int vocab_n_tokens;
     };
 
     // NOTE: this function allocates memory, and it is the responsibility of the caller to free the pointer - see whisper_free_context_params & whisper_free_params()
@@ -600,6 +797,21 @@ extern "C" {
 
     ////////////////////////////////////////////////////////////////////////////
 
+    // [EXPERIMENTAL] thread count autotuning
+    // benchmarks the log mel spectrogram, the encoder and the single-token decoder of the loaded model with up to
+    // n_threads_max threads on a temporary state, and sets n_threads_mel, n_threads_encode and n_threads_decode in
+    // params to the smallest thread count within 5% of the fastest one for each stage
+    // if fname_cache is not NULL, the counts are read from this file when it has an entry for the model, the host
+    // and n_threads_max, otherwise the new entry is added to it
+    // returns 0 after benchmarking, 1 if the counts were read from the cache, negative on failure
+    WHISPER_API int whisper_autotune_threads(
+            struct whisper_context * ctx,
+                               int   n_threads_max,
+                        const char * fname_cache,
+        struct whisper_full_params * params);
+
+    ////////////////////////////////////////////////////////////////////////////
+
     // Temporary helpers needed for exposing ggml interface
 
     WHISPER_API int          whisper_bench_memcpy          (int n_threads);